@@ -5,52 +5,165 @@ Connects to the ESP32's web API, polls for new CAN messages, and writes
 them to a timestamped CSV file locally. Runs until Ctrl+C.
 
 Usage:
-    python can_logger.py [ESP32_IP]
+    python can_logger.py [ESP32_IP] [FILTER]
 
     ESP32_IP defaults to 192.168.0.200 (static IP on local network).
     Override if needed:
         python can_logger.py 192.168.0.42
 
+    FILTER is passed to the sniffer's /log as a query string, so only
+    matching frames cross the WiFi link, e.g.
+        python can_logger.py 192.168.0.200 "id=0x100,0x200-0x2FF&data=01xx"
+
     Use helm action buttons on the web UI to annotate the log.
     Press Ctrl+C to stop -- CSV file is saved automatically.
 
-The script deduplicates using sequence numbers from the ESP32, so no
-messages are lost or doubled even with frequent polling.
+The script asks only for entries newer than the last sequence number it
+has seen, and deduplicates on them too, so no messages are lost or
+doubled even with frequent polling. Responses are requested
+gzip-compressed, which cuts the WiFi traffic several times over on a
+busy bus. Sniffers built with more than one CAN controller report their
+buses in /status, and the CSV then gets a bus column, as in the
+sniffer's own /csv download.
+
+Every row starts with its absolute UTC time. The script syncs to the
+sniffer's /time NTP-style: it brackets each reading of the device clock
+with the host clock, keeps the reading with the shortest round trip from
+each burst of SYNC_SAMPLES, and fits offset and drift over the bursts of
+the last DRIFT_WINDOW seconds. The fit is handed back to the sniffer as
+its UTC anchor, so the sniffer's own /csv carries the same times.
+Device timestamps restart at 0 on each /clear; the EPOCH event logged
+there gives the new zero, and the script carries UTC across it.
 """
 
 import csv
+import gzip
 import sys
+from urllib.parse import quote
 import time
-from datetime import datetime
+from datetime import datetime, timezone
 from pathlib import Path
 from urllib.error import URLError
-from urllib.request import urlopen
+from urllib.request import Request, urlopen
 import json
 
 ESP32_IP = sys.argv[1] if len(sys.argv) > 1 else "192.168.0.200"
+LOG_FILTER = sys.argv[2] if len(sys.argv) > 2 else ""
 POLL_INTERVAL = 0.2  # seconds between polls
+LOG_LIMIT = 500      # the sniffer's per-reply cap (LOG_REPLY_MAX)
 LOG_URL = f"http://{ESP32_IP}/log"
 STATUS_URL = f"http://{ESP32_IP}/status"
+TIME_URL = f"http://{ESP32_IP}/time"
+SYNC_SAMPLES = 8       # /time exchanges per sync burst
+SYNC_INTERVAL = 60.0   # seconds between sync bursts
+DRIFT_WINDOW = 1800.0  # seconds of bursts the drift is fitted over
 
 
 def fetch_json(url: str, timeout: float = 2.0) -> list | dict | None:
     """Fetch JSON from the ESP32 web API."""
     try:
-        with urlopen(url, timeout=timeout) as resp:
-            return json.loads(resp.read().decode())
-    except (URLError, OSError, json.JSONDecodeError) as e:
+        request = Request(url, headers={"Accept-Encoding": "gzip"})
+        with urlopen(request, timeout=timeout) as resp:
+            body = resp.read()
+            if resp.headers.get("Content-Encoding") == "gzip":
+                body = gzip.decompress(body)
+            return json.loads(body.decode())
+    except (URLError, OSError, EOFError, json.JSONDecodeError) as e:
         print(f"  Connection error: {e}")
         return None
 
 
+class ClockSync:
+    """Maps device time (us since boot) to UTC from /time exchanges."""
+
+    def __init__(self) -> None:
+        self.samples: list[tuple[int, float, int]] = []  # (device us, offset us, rtt us)
+        self.anchor_device = 0
+        self.anchor_utc = 0
+        self.ppm = 0.0
+        self.err = 0
+        self.epoch_start_ms = 0
+
+    def exchange(self) -> tuple[int, float, int, int] | None:
+        """One /time round trip: (device us, offset us, rtt us, epoch start ms)."""
+        sent = time.time_ns() // 1000
+        reply = fetch_json(TIME_URL)
+        received = time.time_ns() // 1000
+        if reply is None:
+            return None
+        offset = (sent + received) / 2 - reply["us"]
+        return reply["us"], offset, received - sent, reply["start"]
+
+    def sync(self) -> bool:
+        """Runs a burst of exchanges, refits and re-anchors the device."""
+        best = None
+        for _ in range(SYNC_SAMPLES):
+            sample = self.exchange()
+            if sample is not None and (best is None or sample[2] < best[2]):
+                best = sample
+        if best is None:
+            return False
+        device_us, offset, rtt, start_ms = best
+        if not self.samples:
+            self.epoch_start_ms = start_ms
+        self.samples.append((device_us, offset, rtt))
+        self.samples = [s for s in self.samples if device_us - s[0] <= DRIFT_WINDOW * 1e6]
+        self.fit(device_us)
+        query = (f"?utc={self.anchor_utc}&at={self.anchor_device}"
+                 f"&ppm={self.ppm:.3f}&err={self.err}")
+        fetch_json(TIME_URL + query)
+        return True
+
+    def fit(self, device_us: int) -> None:
+        """Least-squares offset and drift over the kept samples, weighting
+        each by its round trip, anchored at the newest one."""
+        weights = [1.0 / max(rtt, 1) ** 2 for _, _, rtt in self.samples]
+        total = sum(weights)
+        mean_d = sum(w * d for w, (d, _, _) in zip(weights, self.samples)) / total
+        mean_o = sum(w * o for w, (_, o, _) in zip(weights, self.samples)) / total
+        var = sum(w * (d - mean_d) ** 2 for w, (d, _, _) in zip(weights, self.samples))
+        slope = 0.0
+        if len(self.samples) > 1 and var > 0:
+            cov = sum(w * (d - mean_d) * (o - mean_o) for w, (d, o, _) in zip(weights, self.samples))
+            slope = max(-500e-6, min(500e-6, cov / var))
+        self.ppm = slope * 1e6
+        self.anchor_device = device_us
+        self.anchor_utc = round(device_us + mean_o + slope * (device_us - mean_d))
+        self.err = min(rtt for _, _, rtt in self.samples) // 2
+
+    def on_event(self, text: str) -> None:
+        """Follows EPOCH events, which move the zero of log timestamps."""
+        if text.startswith("EPOCH "):
+            for field in text.split():
+                if field.startswith("start="):
+                    self.epoch_start_ms = int(field[6:])
+
+    def utc(self, log_ms: int) -> str:
+        """ISO 8601 UTC time of a log timestamp in the current epoch."""
+        if not self.samples:
+            return ""
+        device_us = (self.epoch_start_ms + log_ms) * 1000
+        since = device_us - self.anchor_device
+        utc_us = self.anchor_utc + since + since * self.ppm / 1e6
+        stamp = datetime.fromtimestamp(utc_us / 1e6, timezone.utc)
+        return stamp.isoformat(timespec="milliseconds").replace("+00:00", "Z")
+
+
 def format_mark_line(entry: dict) -> str:
     """Format a mark entry for terminal display."""
     return f"\033[1;33m  {entry['t']:>10}ms  >>> {entry['mark']}\033[0m"
 
 
+def format_event_line(entry: dict) -> str:
+    """Format a firmware event entry for terminal display."""
+    return f"\033[1;31m  {entry['t']:>10}ms  !!! {entry['event']}\033[0m"
+
+
 def format_can_line(entry: dict) -> str:
     """Format a CAN message entry for terminal display."""
     can_id = f"0x{entry['id']:03X}"
+    if "bus" in entry:
+        can_id = f"can{entry['bus']} {can_id}"
     return f"  {entry['t']:>10}ms  {can_id}  DLC={entry['dlc']}  {entry['data']}"
 
 
@@ -63,6 +176,8 @@ def main() -> None:
     print("==================")
     print(f"ESP32 address: {ESP32_IP}")
     print(f"Output file:   {output_file}")
+    if LOG_FILTER:
+        print(f"Filter:        {LOG_FILTER}")
     print()
 
     # Wait for connection to the ESP32
@@ -75,6 +190,14 @@ def main() -> None:
         print(".", end="", flush=True)
         time.sleep(1)
 
+    multi_bus = "buses" in status
+
+    clock = ClockSync()
+    if clock.sync():
+        print(f"Clock synced: +-{clock.err / 1000:.1f} ms")
+    else:
+        print("Clock sync failed, utc column left empty until it succeeds")
+    last_sync = time.monotonic()
     print(f"Logging to {output_file} -- press Ctrl+C to stop\n")
 
     last_seq = 0
@@ -83,11 +206,15 @@ def main() -> None:
 
     with open(output_file, "w", newline="") as f:
         writer = csv.writer(f)
-        writer.writerow(["timestamp", "id", "extended", "rtr", "dlc", "data"])
+        header = ["utc", "timestamp", "id", "extended", "flags", "dlc", "data"]
+        writer.writerow(header + ["bus"] if multi_bus else header)
 
         try:
             while True:
-                entries = fetch_json(LOG_URL)
+                query = f"?since={last_seq}&limit={LOG_LIMIT}"
+                if LOG_FILTER:
+                    query += "&" + quote(LOG_FILTER, safe="=&,-?")
+                entries = fetch_json(LOG_URL + query)
                 if entries is None:
                     time.sleep(1)
                     continue
@@ -99,14 +226,20 @@ def main() -> None:
                     ts = entry["t"]
 
                     if "mark" in entry:
-                        writer.writerow([ts, "MARK", 0, 0, 0, entry["mark"]])
+                        writer.writerow([clock.utc(ts), ts, "MARK", 0, 0, 0, entry["mark"]])
                         print(format_mark_line(entry))
                         mark_count += 1
+                    elif "event" in entry:
+                        clock.on_event(entry["event"])
+                        writer.writerow([clock.utc(ts), ts, "EVENT", 0, 0, 0, entry["event"]])
+                        print(format_event_line(entry))
                     else:
                         can_id = f"0x{entry['id']:X}"
-                        writer.writerow([
-                            ts, can_id, 0, 0, entry["dlc"], entry["data"]
-                        ])
+                        row = [clock.utc(ts), ts, can_id, entry.get("ext", 0),
+                               entry.get("flags", 0), entry["dlc"], entry["data"]]
+                        if multi_bus:
+                            row.append(entry.get("bus", 0))
+                        writer.writerow(row)
                         msg_count += 1
 
                     last_seq = max(last_seq, seq)
@@ -122,6 +255,10 @@ def main() -> None:
                         f"logged (seq={last_seq})"
                     )
 
+                if time.monotonic() - last_sync >= SYNC_INTERVAL:
+                    clock.sync()
+                    last_sync = time.monotonic()
+
                 time.sleep(POLL_INTERVAL)
 
         except KeyboardInterrupt:
@@ -0,0 +1,618 @@
+"""
+Merge captures from several ETS sniffers into one time-ordered stream.
+
+With one sniffer at the helm and one in the engine bay each capture runs
+on its own crystal. This script puts them all on the clock of the first
+(reference) capture and merges them, tagging every row with the capture
+it came from.
+
+Usage:
+    python can_merge.py [-o OUT] [--format csv|bin|cdl] CAPTURE CAPTURE [...]
+
+    CAPTURE is any of:
+      - a can_logger.py CSV, or a /csv download from the WiFi sniffer
+      - the serial sniffer's output saved to a file (other lines, such as
+        help text, are skipped)
+      - a /csv?burst=1 download (timestamp_us column)
+      - a .bin burst dump, the record layout of burst_capture.h
+      - a .cdl delta-coded capture (delta_codec.h): a /csv?delta=1
+        download, or this script's cdl output
+    Any of these may be gzip-compressed, as saved from a gzip download.
+
+    OUT defaults to stdout. CSV output is the sniffer's frame layout with
+    a source column added, the capture's position on the command line:
+        timestamp,id,extended,flags,dlc,data,bus,source
+    timestamp is ms on the reference clock, to the us. Marks and events
+    keep the six-column typed layout, with an empty bus. Binary output is
+    burst_capture.h records, timestamps in us since the first merged
+    record (wrapping at 2^32, which a reader can undo since the stream
+    is ordered) and the bus byte set to source * 4 + bus. Typed rows
+    have no binary form and are left out. cdl output is delta coded as
+    delta_codec.h describes, usually several times smaller than bin,
+    timestamps in us, buses as for bin, typed rows included. Given a
+    single capture the script converts it, so
+        python can_merge.py --format cdl -o log.cdl log.csv
+        python can_merge.py log.cdl
+    round-trips a capture through the delta coding.
+
+Clock alignment uses frames both sniffers saw on a shared bus: the same
+ID and payload in both captures. A pass over each capture keeps the
+times of a hash-selected subset of (ID, payload) keys, sampling harder
+as needed to stay within SAMPLE_TIMES, so memory doesn't grow with the
+capture. A vote over the time differences of matching keys gives a
+coarse offset; times that then have exactly one match near it are
+fitted for offset and drift, first with a Theil-Sen median fit and then
+by least squares with outliers beyond OUTLIER_MADS median absolute
+deviations dropped. The coarse offset tolerates COARSE_SPAN_US of drift
+over the whole capture, about 14 hours at 20 ppm. Captures that share
+no frames with the reference are merged on their own clock, with a
+warning.
+
+Device timestamps restart at 0 on every clear. EPOCH records (time_base.h)
+give the new zero in ms since boot, so each capture is first put on one
+continuous device clock. Rows before a capture's first EPOCH are taken
+to count from boot.
+
+The merge itself is a streaming k-way merge. A capture is in time order
+except for marks, which are logged after the moment they are stamped
+with: a debounced button press, or a host mark back-dated by the clock
+sync. Each capture therefore passes through a heap that holds its rows
+for MARK_REORDER_US before they are merged. Rows later than that are
+passed on out of order and counted in a warning. Throughput is reported
+on stderr at the end.
+"""
+
+import argparse
+import bisect
+import csv
+import gzip
+import heapq
+import os
+import random
+import statistics
+import struct
+import sys
+import time
+import zlib
+from typing import Iterator, NamedTuple, TextIO
+
+SAMPLE_TIMES = 400_000     # Most frame times kept per capture for alignment
+MAX_KEY_REPEATS = 64       # Keys seen more often than this (constant payloads) aren't used
+COARSE_BIN_US = 100_000
+COARSE_SPAN_US = 1_000_000 # Drift over the capture the coarse offset tolerates
+COARSE_KEYS = 2_000        # Shared keys voting on the coarse offset
+THEIL_SEN_PAIRS = 20_000
+MATCH_WINDOW_US = 50_000   # Matches this far from the Theil-Sen line aren't refitted
+OUTLIER_MADS = 4.0
+MAX_PPM = 500.0          # Far past any crystal's tolerance
+MARK_REORDER_US = 5_000_000  # Marks are back-dated by up to CLOCK_MAX_RTT_US
+BURST_RECORD = struct.Struct("<IIBBB")
+CAN_EXTENDED_BIT = 0x80000000
+CDL_MAGIC = b"CDL1"
+CDL_BLOCK = struct.Struct("<IHHq")   # DeltaBlockHeader
+CDL_BLOCK_BYTES = 65_000   # Block size written, under the header's uint16
+CDL_MAX_IDS = 1024         # Dictionary size written; a block ends when it's full
+CDL_MARK, CDL_EVENT, CDL_TYPED = 1, 2, 3    # Text record types
+CDL_FRAME, CDL_RESHAPE, CDL_NEW_ID, CDL_TEXT = range(4)
+
+
+class Row(NamedTuple):
+    us: int           # Device time, us on one continuous clock
+    kind: str         # "" for frames, else MARK, EVENT, STATUS, ...
+    can_id: int
+    extended: int
+    flags: int
+    dlc: int
+    data: str         # Hex bytes separated by spaces, or the typed row's text
+    bus: int
+
+
+def dlc_to_len(dlc: int) -> int:
+    """Payload length for a DLC code, as canDlcToLen() on the device."""
+    return dlc if dlc <= 8 else (12, 16, 20, 24, 32, 48, 64)[dlc - 9]
+
+
+def len_to_dlc(length: int) -> int:
+    """Smallest DLC code that holds length bytes."""
+    if length <= 8:
+        return length
+    for dlc in range(9, 16):
+        if dlc_to_len(dlc) >= length:
+            return dlc
+    return 15
+
+
+def epoch_start_ms(kind: str, text: str) -> int | None:
+    """The new zero in ms since boot if this row starts an epoch: serial
+    EPOCH rows (epoch=..;reason=..;start=..) and WiFi EPOCH events
+    (EPOCH n reason start=..)."""
+    if kind == "EPOCH" or (kind == "EVENT" and text.startswith("EPOCH ")):
+        for field in text.replace(";", " ").split():
+            if field.startswith("start="):
+                return int(field[6:])
+    return None
+
+
+def open_capture(path: str, binary: bool):
+    """Opens a capture, gunzipping it if it starts with the gzip magic."""
+    with open(path, "rb") as f:
+        gzipped = f.read(2) == b"\x1f\x8b"
+    if binary:
+        return gzip.open(path, "rb") if gzipped else open(path, "rb")
+    return gzip.open(path, "rt", newline="") if gzipped else open(path, newline="")
+
+
+def read_csv(path: str) -> Iterator[Row]:
+    """Rows of a CSV capture on one continuous device clock."""
+    # Column positions; -1 for columns the capture doesn't have.
+    t, i, ext, fl, dlc, data, bus = 0, 1, 2, 3, 4, 5, 6
+    scale = 1000
+    base_us = 0
+    with open_capture(path, False) as f:
+        for fields in csv.reader(f):
+            if not fields:
+                continue
+            if "timestamp" in fields or "timestamp_us" in fields:
+                columns = {name: n for n, name in enumerate(fields)}
+                scale = 1 if "timestamp_us" in columns else 1000
+                t = columns.get("timestamp", columns.get("timestamp_us"))
+                i, ext, fl, dlc, data, bus = (columns.get(name, -1)
+                                              for name in ("id", "extended", "flags", "dlc", "data", "bus"))
+                continue
+            if len(fields) < t + 6 or not fields[t].isdigit():
+                continue
+            us = base_us + int(fields[t]) * scale
+            if not fields[t + 1].startswith("0x"):
+                # Typed rows keep the six-column layout after the timestamp.
+                kind = fields[t + 1]
+                text = ",".join(fields[t + 5:])
+                start = epoch_start_ms(kind, text)
+                if start is not None:
+                    base_us = start * 1000
+                    us = base_us + int(fields[t]) * scale
+                yield Row(us, kind, 0, 0, 0, 0, text, 0)
+                continue
+            yield Row(
+                us, "", int(fields[i], 16),
+                int(fields[ext]) if ext >= 0 else 0,
+                int(fields[fl]) if fl >= 0 else 0,
+                int(fields[dlc]) if dlc >= 0 else 0,
+                fields[data].upper() if data >= 0 else "",
+                int(fields[bus]) if 0 <= bus < len(fields) and fields[bus] else 0,
+            )
+
+
+def read_bin(path: str) -> Iterator[Row]:
+    """Frames of a burst dump, timestamps unwrapped past 2^32 us."""
+    with open_capture(path, True) as f:
+        wraps = 0
+        last = 0
+        while True:
+            header = f.read(BURST_RECORD.size)
+            if len(header) < BURST_RECORD.size:
+                return
+            ts, raw_id, flags, bus, length = BURST_RECORD.unpack(header)
+            payload = f.read(length)
+            if ts < last:
+                wraps += 1
+            last = ts
+            yield Row(
+                (wraps << 32) + ts, "", raw_id & ~CAN_EXTENDED_BIT, 1 if raw_id & CAN_EXTENDED_BIT else 0,
+                flags, len_to_dlc(length), " ".join(f"{b:02X}" for b in payload), bus,
+            )
+
+
+def get_varint(data: bytes, pos: int) -> tuple[int, int]:
+    value = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        if not b & 0x80:
+            return value, pos
+        shift += 7
+
+
+def put_varint(out: bytearray, value: int) -> None:
+    while value >= 0x80:
+        out.append(value & 0x7F | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def unzigzag(value: int) -> int:
+    return (value >> 1) ^ -(value & 1)
+
+
+def zigzag(value: int) -> int:
+    return value * 2 if value >= 0 else -value * 2 - 1
+
+
+def read_cdl(path: str) -> Iterator[Row]:
+    """Rows of a delta-coded capture. Marks and events from the WiFi log
+    are on its device clock, which EPOCH events carry across clears."""
+    with open_capture(path, True) as f:
+        if f.read(len(CDL_MAGIC)) != CDL_MAGIC:
+            raise ValueError(f"{path}: not a .cdl capture")
+        (us_per_tick,) = struct.unpack("<I", f.read(4))
+        base_us = 0
+        while len(header := f.read(CDL_BLOCK.size)) == CDL_BLOCK.size:
+            _, count, used, last = CDL_BLOCK.unpack(header)
+            data = f.read(used)
+            ids: list[list] = []    # [CAN ID, meta, flags, payload, last time, period]
+            pos = 0
+            for _ in range(count):
+                tag, pos = get_varint(data, pos)
+                n, kind = tag >> 2, tag & 3
+                if kind == CDL_TEXT:
+                    delta, pos = get_varint(data, pos)
+                    last += unzigzag(delta)
+                    text = data[pos + 1:pos + 1 + data[pos]].decode(errors="replace")
+                    pos += 1 + data[pos]
+                    if n == CDL_TYPED:
+                        row_kind, _, text = text.partition(",")
+                        yield Row(last * us_per_tick, row_kind, 0, 0, 0, 0, text, 0)
+                        continue
+                    row_kind = "MARK" if n == CDL_MARK else "EVENT"
+                    start = epoch_start_ms(row_kind, text)
+                    if start is not None:
+                        base_us = start * 1000
+                    yield Row(base_us + last * us_per_tick, row_kind, 0, 0, 0, 0, text, 0)
+                    continue
+                if kind == CDL_NEW_ID:
+                    can_id, pos = get_varint(data, pos)
+                    meta, flags, length = data[pos:pos + 3]
+                    delta, pos = get_varint(data, pos + 3)
+                    last += unzigzag(delta)
+                    entry = [can_id, meta, flags, bytearray(data[pos:pos + length]), last, 0]
+                    pos += length
+                    ids.append(entry)
+                else:
+                    entry = ids[n]
+                    payload = entry[3]
+                    if kind == CDL_RESHAPE:
+                        entry[2], length = data[pos:pos + 2]
+                        pos += 2
+                        payload.extend(bytes(max(0, length - len(payload))))
+                        del payload[length:]
+                    delta, pos = get_varint(data, pos)
+                    last = entry[4] + entry[5] + unzigzag(delta)
+                    bitmap = data[pos:pos + (len(payload) + 7) // 8]
+                    pos += len(bitmap)
+                    for j in range(len(payload)):
+                        if bitmap[j >> 3] >> (j & 7) & 1:
+                            payload[j] ^= data[pos]
+                            pos += 1
+                    entry[4], entry[5] = last, last - entry[4]
+                can_id, meta, flags, payload = entry[:4]
+                yield Row(base_us + last * us_per_tick, "", can_id, meta & 1, flags, len_to_dlc(len(payload)),
+                          " ".join(f"{b:02X}" for b in payload), meta >> 1)
+
+
+def read_capture(path: str) -> Iterator[Row]:
+    name = path.removesuffix(".gz")
+    if name.endswith(".cdl"):
+        return read_cdl(path)
+    return read_bin(path) if name.endswith(".bin") else read_csv(path)
+
+
+# ============== ALIGNMENT ==============
+
+class KeySample:
+    """Times of a consistent, hash-selected subset of (ID, payload) keys.
+    Every capture keeps the keys whose hash is below the same threshold,
+    so sampled keys line up between captures; the threshold halves
+    whenever more than SAMPLE_TIMES times are kept. Keys seen more than
+    MAX_KEY_REPEATS times keep no times at all."""
+
+    def __init__(self) -> None:
+        self.level = 0                      # Keep hashes with this many leading zero bits
+        self.times: dict[int, list[int] | None] = {}
+        self.kept = 0
+
+    def add(self, row: Row) -> None:
+        h = zlib.crc32(row.data.encode(), row.can_id | row.extended << 31)
+        if self.level and h >> (32 - self.level):
+            return
+        times = self.times.get(h, [])
+        if times is None:
+            return
+        if len(times) == MAX_KEY_REPEATS:
+            self.times[h] = None
+            self.kept -= len(times)
+            return
+        times.append(row.us)
+        self.times[h] = times
+        self.kept += 1
+        if self.kept > SAMPLE_TIMES:
+            self.raise_level(self.level + 1)
+
+    def raise_level(self, level: int) -> None:
+        self.level = level
+        self.times = {h: t for h, t in self.times.items() if not h >> (32 - level)}
+        self.kept = sum(len(t) for t in self.times.values() if t is not None)
+
+
+def sample_capture(path: str) -> KeySample:
+    sample = KeySample()
+    for row in read_capture(path):
+        if not row.kind:
+            sample.add(row)
+    return sample
+
+
+def theil_sen(points: list[tuple[int, int]]) -> tuple[float, float]:
+    """Median slope over random point pairs and the median intercept for
+    it: the fit holds with up to ~29% of points wrong."""
+    rng = random.Random(0)
+    slopes = []
+    for _ in range(THEIL_SEN_PAIRS):
+        (x0, y0), (x1, y1) = rng.sample(points, 2)
+        if abs(x1 - x0) >= 1_000_000:
+            slopes.append((y1 - y0) / (x1 - x0))
+    slope = statistics.median(slopes) if slopes else 0.0
+    slope = max(-MAX_PPM / 1e6, min(MAX_PPM / 1e6, slope))
+    return statistics.median(y - slope * x for x, y in points), slope
+
+
+def refine(points: list[tuple[int, int]], offset: float, slope: float) -> tuple[float, float, float, int]:
+    """Least-squares refits over the points near the line, dropping
+    outliers beyond OUTLIER_MADS each round. Returns offset, slope, the
+    residual MAD and the number of points kept."""
+    points = [(x, y) for x, y in points if abs(y - offset - slope * x) <= MATCH_WINDOW_US]
+    mad = 0.0
+    for _ in range(4):
+        if len(points) < 2:
+            break
+        n = len(points)
+        mean_x = sum(x for x, _ in points) / n
+        mean_y = sum(y for _, y in points) / n
+        var = sum((x - mean_x) ** 2 for x, _ in points)
+        if var > 0:
+            slope = sum((x - mean_x) * (y - mean_y) for x, y in points) / var
+            slope = max(-MAX_PPM / 1e6, min(MAX_PPM / 1e6, slope))
+        offset = mean_y - slope * mean_x
+        mad = statistics.median(abs(y - offset - slope * x) for x, y in points)
+        kept = [(x, y) for x, y in points if abs(y - offset - slope * x) <= OUTLIER_MADS * max(mad, 1.0)]
+        if len(kept) == n:
+            break
+        points = kept
+    return offset, slope, mad, len(points)
+
+
+def align(ref: KeySample, other: KeySample) -> tuple[float, float, int, float] | None:
+    """Offset and slope mapping other's clock onto ref's, the number of
+    pairs fitted and their residual MAD in us; None with too few shared
+    keys.
+
+    Counters in payloads wrap, so on a long capture most keys recur.
+    Every pairing of a key's times votes for its time difference; the
+    true offset is the one difference all keys agree on, and the votes
+    are summed over COARSE_SPAN_US so drift doesn't split them. Each
+    time of other is then matched to the one time of ref near that
+    offset, skipping times with more than one, and the matches fitted."""
+    level = max(ref.level, other.level)
+    for s in (ref, other):
+        if s.level < level:
+            s.raise_level(level)
+    shared = [(sorted(r), t) for h, t in other.times.items()
+              if t is not None and (r := ref.times.get(h)) is not None]
+    if not shared:
+        return None
+
+    bins: dict[int, int] = {}
+    for ref_times, times in shared[:COARSE_KEYS]:
+        for t in times:
+            for r in ref_times:
+                b = (r - t) // COARSE_BIN_US
+                bins[b] = bins.get(b, 0) + 1
+    span = COARSE_SPAN_US // COARSE_BIN_US
+    best = max(bins, key=lambda b: sum(bins.get(b + i, 0) for i in range(span)))
+    coarse = (best * COARSE_BIN_US) + COARSE_SPAN_US // 2
+
+    points = []
+    for ref_times, times in shared:
+        for t in times:
+            lo = bisect.bisect_left(ref_times, t + coarse - COARSE_SPAN_US)
+            hi = bisect.bisect_right(ref_times, t + coarse + COARSE_SPAN_US)
+            if hi - lo == 1:
+                points.append((t, ref_times[lo] - t))
+    if len(points) < 2:
+        return None
+    offset, slope = theil_sen(points)
+    offset, slope, mad, pairs = refine(points, offset, slope)
+    if pairs < 2:
+        return None
+    return offset, slope, pairs, mad
+
+
+# ============== MERGE ==============
+
+def aligned(path: str, source: int, offset: float, slope: float) -> Iterator[tuple[int, int, Row]]:
+    pending: list[tuple[int, int, Row]] = []   # (us, arrival, row)
+    last = None
+    late = 0
+
+    def release(until: float) -> Iterator[tuple[int, int, Row]]:
+        nonlocal last, late
+        while pending and pending[0][0] <= until:
+            us, _, row = heapq.heappop(pending)
+            if last is not None and us < last:
+                late += 1
+            last = us
+            yield us, source, row
+
+    for arrival, row in enumerate(read_capture(path)):
+        us = round(row.us + offset + slope * row.us)
+        heapq.heappush(pending, (us, arrival, row))
+        yield from release(us - MARK_REORDER_US)
+    yield from release(float("inf"))
+    if late:
+        print(f"{path}: {late} rows more than {MARK_REORDER_US / 1e6:g} s out of order, merged late",
+              file=sys.stderr)
+
+
+def write_csv(out: TextIO, merged: Iterator[tuple[int, int, Row]]) -> int:
+    out.write("timestamp,id,extended,flags,dlc,data,bus,source\n")
+    rows = 0
+    for us, source, row in merged:
+        ms = f"{us // 1000}.{us % 1000:03d}" if us >= 0 else f"{us / 1000:.3f}"
+        if row.kind:
+            out.write(f"{ms},{row.kind},0,0,0,{row.data},,{source}\n")
+        else:
+            can_id = f"0x{row.can_id:08X}" if row.extended else f"0x{row.can_id:03X}"
+            out.write(f"{ms},{can_id},{row.extended},{row.flags},{row.dlc},{row.data},{row.bus},{source}\n")
+        rows += 1
+    return rows
+
+
+def write_bin(out, merged: Iterator[tuple[int, int, Row]]) -> int:
+    rows = 0
+    first = None
+    for us, source, row in merged:
+        if row.kind:
+            continue
+        if first is None:
+            first = us
+        payload = bytes.fromhex(row.data)
+        raw_id = row.can_id | (CAN_EXTENDED_BIT if row.extended else 0)
+        out.write(BURST_RECORD.pack((us - first) & 0xFFFFFFFF, raw_id, row.flags,
+                                    (source * 4 + row.bus) & 0xFF, len(payload)))
+        out.write(payload)
+        rows += 1
+    return rows
+
+
+class CdlWriter:
+    """Delta codes rows into .cdl blocks, times in us."""
+
+    def __init__(self, out) -> None:
+        self.out = out
+        self.seq = 1
+        self.block = bytearray()
+        self.count = 0
+        self.ids: dict[tuple[int, int], list] = {}  # (CAN ID, meta) -> [index, flags, payload, last, period]
+        self.base = self.last = 0
+        out.write(CDL_MAGIC + struct.pack("<I", 1))
+
+    def flush(self) -> None:
+        if self.count:
+            self.out.write(CDL_BLOCK.pack(self.seq, self.count, len(self.block), self.base))
+            self.out.write(self.block)
+            self.seq += self.count
+        self.block.clear()
+        self.count = 0
+        self.ids = {}
+
+    def begin(self, us: int, new_id: bool) -> None:
+        """Starts a new block if this record might not fit the current one."""
+        if (self.count == 0 or len(self.block) > CDL_BLOCK_BYTES - 300
+                or (new_id and len(self.ids) >= CDL_MAX_IDS) or self.count == 0xFFFF):
+            self.flush()
+            self.base = self.last = us
+        self.count += 1
+
+    def text(self, us: int, kind: str, text: str) -> None:
+        self.begin(us, False)
+        encoded = f"{kind},{text}".encode()[:255]
+        put_varint(self.block, CDL_TYPED << 2 | CDL_TEXT)
+        put_varint(self.block, zigzag(us - self.last))
+        self.block.append(len(encoded))
+        self.block += encoded
+        self.last = us
+
+    def frame(self, us: int, can_id: int, meta: int, flags: int, payload: bytes) -> None:
+        key = (can_id, meta)
+        self.begin(us, key not in self.ids)
+        entry = self.ids.get(key)
+        if entry is None:
+            self.ids[key] = [len(self.ids), flags, bytearray(payload), us, 0]
+            put_varint(self.block, (len(self.ids) - 1) << 2 | CDL_NEW_ID)
+            put_varint(self.block, can_id)
+            self.block += bytes((meta, flags, len(payload)))
+            put_varint(self.block, zigzag(us - self.last))
+            self.block += payload
+            self.last = us
+            return
+        index, old_flags, old, last, period = entry
+        if old_flags == flags and len(old) == len(payload):
+            put_varint(self.block, index << 2 | CDL_FRAME)
+        else:
+            put_varint(self.block, index << 2 | CDL_RESHAPE)
+            self.block += bytes((flags, len(payload)))
+            old.extend(bytes(max(0, len(payload) - len(old))))
+            del old[len(payload):]
+        put_varint(self.block, zigzag(us - (last + period)))
+        bitmap = bytearray((len(payload) + 7) // 8)
+        changed = bytearray()
+        for j, b in enumerate(payload):
+            if b != old[j]:
+                bitmap[j >> 3] |= 1 << (j & 7)
+                changed.append(b ^ old[j])
+        self.block += bitmap
+        self.block += changed
+        entry[1:] = [flags, bytearray(payload), us, us - last]
+        self.last = us
+
+
+def write_cdl(out, merged: Iterator[tuple[int, int, Row]]) -> int:
+    writer = CdlWriter(out)
+    rows = 0
+    for us, source, row in merged:
+        if row.kind:
+            writer.text(us, row.kind, row.data)
+        else:
+            meta = row.extended | ((source * 4 + row.bus) & 0x7F) << 1
+            writer.frame(us, row.can_id, meta, row.flags, bytes.fromhex(row.data))
+        rows += 1
+    writer.flush()
+    return rows
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Merge ETS sniffer captures onto one clock.")
+    parser.add_argument("captures", nargs="+", help="capture files, the first is the reference clock")
+    parser.add_argument("-o", "--output", help="output file (default stdout)")
+    parser.add_argument("--format", choices=("csv", "bin", "cdl"), default="csv")
+    parser.add_argument("--no-align", action="store_true", help="merge on the captures' own clocks")
+    args = parser.parse_args()
+
+    started = time.monotonic()
+    fits = [(0.0, 0.0)]
+    if not args.no_align and len(args.captures) > 1:
+        ref = sample_capture(args.captures[0])
+        for source, path in enumerate(args.captures[1:], start=1):
+            result = align(ref, sample_capture(path))
+            if result is None:
+                print(f"{path}: no frames shared with {args.captures[0]}, left on its own clock",
+                      file=sys.stderr)
+                fits.append((0.0, 0.0))
+                continue
+            offset, slope, pairs, mad = result
+            print(f"{path}: offset {offset / 1000:+.3f} ms, drift {slope * 1e6:+.2f} ppm, "
+                  f"{pairs} matches, residual {mad:.0f} us", file=sys.stderr)
+            fits.append((offset, slope))
+    else:
+        fits = [(0.0, 0.0)] * len(args.captures)
+    aligned_at = time.monotonic()
+
+    streams = [aligned(path, source, *fits[source]) for source, path in enumerate(args.captures)]
+    merged = heapq.merge(*streams, key=lambda item: (item[0], item[1]))
+    if args.format != "csv":
+        write = write_bin if args.format == "bin" else write_cdl
+        with open(args.output, "wb") if args.output else os.fdopen(sys.stdout.fileno(), "wb", closefd=False) as out:
+            rows = write(out, merged)
+    else:
+        with open(args.output, "w", newline="") if args.output else sys.stdout as out:
+            rows = write_csv(out, merged)
+
+    done = time.monotonic()
+    size = sum(os.path.getsize(path) for path in args.captures)
+    merge_s = max(done - aligned_at, 1e-9)
+    print(f"Merged {rows} rows from {size / 1e6:.1f} MB: alignment {aligned_at - started:.1f} s, "
+          f"merge {merge_s:.1f} s ({rows / merge_s:,.0f} rows/s, {size / 1e6 / merge_s:.1f} MB/s)",
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
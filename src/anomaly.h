@@ -0,0 +1,274 @@
+/*
+ * On-device anomaly detector, shared by the serial and WiFi builds.
+ *
+ * Each tracked ID learns a baseline online from its first
+ * ANOMALY_LEARN_FRAMES frames: payload length, period and jitter
+ * (smoothed like idPeriodUs in the WiFi build), and whether the payload
+ * ever changes. After that every frame is checked against it in
+ * constant time:
+ *
+ *   new_id    An ID first seen after the ANOMALY_WARMUP_MS warm-up
+ *   dlc       Payload length differs from a fixed learned length
+ *   period    A periodic ID arrived well outside its jitter band
+ *   payload   An ID whose payload never changed while learning changed
+ *   missing   A periodic ID is ANOMALY_MISSING_PERIODS periods overdue
+ *
+ * Missing frames are found without scanning the ID table: every frame of
+ * a periodic ID re-arms its deadline, ANOMALY_MISSING_PERIODS learned
+ * periods ahead, in a timer wheel (timer_wheel.h), and anomalyService()
+ * only sees the IDs whose deadline has passed. Each expiry counts as one
+ * missing event for that ID, kept with its time whether or not the alert
+ * itself gets through the rate limit; the ID isn't re-armed until it is
+ * heard from again.
+ *
+ * Alerts are rate limited twice: an ID raises at most one alert per
+ * ALERT_ID_HOLDOFF_MS, and all IDs together share a token bucket of
+ * ALERT_BURST alerts refilled one per ALERT_REFILL_MS, so a wrong baud
+ * or a failing bus can't flood the output. Suppressed alerts are
+ * counted. Raised alerts wait in a small queue for anomalyNextAlert().
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+#include "timer_wheel.h"
+
+#define ANOMALY_LEARN_FRAMES     16       // Frames per ID before its checks start
+#define ANOMALY_WARMUP_MS        30000    // New IDs before this are the baseline
+#define ANOMALY_PERIODIC_JITTER  4        // Periodic if jitter <= period / this
+#define ANOMALY_MAX_PERIOD_US    10000000 // Slower IDs aren't treated as periodic
+#define ANOMALY_BAND_JITTERS     6        // Period band is this many jitters...
+#define ANOMALY_BAND_MIN_DIV     4        // ...but at least period / this
+#define ANOMALY_MISSING_PERIODS  3
+#define ALERT_ID_HOLDOFF_MS      60000
+#define ALERT_BURST              10
+#define ALERT_REFILL_MS          6000     // 10 alerts a minute sustained
+#define ALERT_QUEUE_LEN          16       // Power of two
+
+#define ANOMALY_LEN_VARIES       0xFF     // IdBaseline::len when not fixed
+
+typedef enum {
+    ALERT_NEW_ID,
+    ALERT_DLC,
+    ALERT_PERIOD,
+    ALERT_PAYLOAD,
+    ALERT_MISSING,
+    ALERT_TYPE_COUNT
+} alert_type_t;
+
+struct Alert {
+    uint8_t type;           // alert_type_t
+    uint8_t bus;
+    bool extended;
+    uint32_t id;
+    unsigned long ms;       // millis() when raised
+    uint32_t value;         // dlc: bytes; period, missing: us since the previous frame
+    uint32_t expected;      // dlc: bytes; period, missing: learned period in us
+};
+
+struct IdBaseline {
+    uint32_t id;
+    bool extended;
+    uint8_t bus;
+    uint8_t len;            // Learned payload length, or ANOMALY_LEN_VARIES
+    bool payloadFixed;      // Payload never changed while learning
+    uint16_t frames;        // Saturates at ANOMALY_LEARN_FRAMES
+    unsigned long lastUs;   // Timestamp of the latest frame
+    uint32_t periodUs;      // Smoothed interval, 0 = unknown
+    uint32_t jitterUs;      // Smoothed |interval - period|
+    unsigned long lastAlertMs;
+    bool alerted;           // lastAlertMs is valid
+    unsigned long missing;  // Times the ID went overdue
+    unsigned long lastMissingMs;
+    bool overdue;           // Missing since lastMissingMs
+};
+
+template <int Ids>
+struct AnomalyDetector {
+    IdBaseline ids[Ids];
+    TimerWheel<Ids> deadlines;           // Armed for periodic IDs only
+    unsigned long startMs;               // Warm-up runs from here
+
+    int tokensUsed;                      // From the ALERT_BURST bucket
+    unsigned long refillMs;
+
+    Alert queue[ALERT_QUEUE_LEN];
+    uint8_t queueHead;
+    uint8_t queueCount;
+
+    unsigned long raised[ALERT_TYPE_COUNT];
+    unsigned long suppressed;            // Rate limited or queue full
+};
+
+inline const char* alertTypeToString(uint8_t type) {
+    switch(type) {
+        case ALERT_NEW_ID:  return "new_id";
+        case ALERT_DLC:     return "dlc";
+        case ALERT_PERIOD:  return "period";
+        case ALERT_PAYLOAD: return "payload";
+        case ALERT_MISSING: return "missing";
+        default:            return "unknown";
+    }
+}
+
+// Forgets every baseline and restarts the warm-up. Call whenever the ID
+// table is cleared, since baselines are indexed by ID table slot. An
+// all-zero detector is already clear, warming up from boot.
+template <int Ids>
+inline void anomalyClear(AnomalyDetector<Ids>* d, unsigned long nowMs) {
+    memset(d, 0, sizeof(*d));
+    wheelReset(&d->deadlines, nowMs);
+    d->startMs = nowMs;
+}
+
+inline bool anomalyPeriodic(const IdBaseline* b) {
+    return b->frames >= ANOMALY_LEARN_FRAMES && b->periodUs > 0 && b->periodUs <= ANOMALY_MAX_PERIOD_US &&
+           b->jitterUs <= b->periodUs / ANOMALY_PERIODIC_JITTER;
+}
+
+// Picks up after frames bypassed the detector, as they do during a burst
+// capture. The time in between is neither reported as missing nor
+// learned as an interval: each ID's next frame is taken as coming back
+// from a gap, and periodic IDs are re-armed from nowMs.
+template <int Ids>
+inline void anomalyResume(AnomalyDetector<Ids>* d, unsigned long nowMs) {
+    wheelReset(&d->deadlines, nowMs);
+    for (int i = 0; i < Ids; i++) {
+        IdBaseline* b = &d->ids[i];
+        if (b->frames == 0) continue;
+        b->lastUs = micros();
+        b->overdue = true;
+        if (anomalyPeriodic(b)) {
+            wheelArm(&d->deadlines, i, nowMs + (ANOMALY_MISSING_PERIODS * b->periodUs) / 1000 + WHEEL_TICK_MS);
+        }
+    }
+}
+
+template <int Ids>
+inline unsigned long anomalyAlertTotal(const AnomalyDetector<Ids>* d) {
+    unsigned long total = 0;
+    for (int t = 0; t < ALERT_TYPE_COUNT; t++) total += d->raised[t];
+    return total;
+}
+
+template <int Ids>
+inline void anomalyRaise(AnomalyDetector<Ids>* d, IdBaseline* b, uint8_t type,
+                         uint32_t value, uint32_t expected, unsigned long nowMs) {
+    if (b->alerted && nowMs - b->lastAlertMs < ALERT_ID_HOLDOFF_MS) {
+        d->suppressed++;
+        return;
+    }
+    while (d->tokensUsed > 0 && nowMs - d->refillMs >= ALERT_REFILL_MS) {
+        d->tokensUsed--;
+        d->refillMs += ALERT_REFILL_MS;
+    }
+    if (d->tokensUsed == 0) d->refillMs = nowMs;
+    if (d->tokensUsed == ALERT_BURST || d->queueCount == ALERT_QUEUE_LEN) {
+        d->suppressed++;
+        return;
+    }
+    d->tokensUsed++;
+    b->alerted = true;
+    b->lastAlertMs = nowMs;
+    d->raised[type]++;
+
+    Alert* a = &d->queue[(d->queueHead + d->queueCount) & (ALERT_QUEUE_LEN - 1)];
+    d->queueCount++;
+    a->type = type;
+    a->bus = b->bus;
+    a->extended = b->extended;
+    a->id = b->id;
+    a->ms = nowMs;
+    a->value = value;
+    a->expected = expected;
+}
+
+// Pops the oldest raised alert. Returns false if there is none.
+template <int Ids>
+inline bool anomalyNextAlert(AnomalyDetector<Ids>* d, Alert* out) {
+    if (d->queueCount == 0) return false;
+    *out = d->queue[d->queueHead];
+    d->queueHead = (d->queueHead + 1) & (ALERT_QUEUE_LEN - 1);
+    d->queueCount--;
+    return true;
+}
+
+// Checks one frame against slot i's baseline and updates it. isNew is
+// true when the frame just took slot i in the ID table; changed is
+// whether its payload differs from the previous one.
+template <int Ids>
+inline void anomalyOnFrame(AnomalyDetector<Ids>* d, int i, const CanFrame* frame,
+                           bool isNew, bool changed, unsigned long nowMs) {
+    if (i < 0 || i >= Ids) return;
+    IdBaseline* b = &d->ids[i];
+
+    // A slot with no baseline yet (after anomalyClear() with the ID table
+    // kept) starts learning from this frame, without a new ID alert.
+    if (isNew || b->frames == 0) {
+        wheelCancel(&d->deadlines, i);
+        memset(b, 0, sizeof(*b));
+        b->id = frame->id;
+        b->extended = frame->extended;
+        b->bus = frame->bus;
+        b->len = frame->len;
+        b->payloadFixed = true;
+        b->frames = 1;
+        b->lastUs = frame->timestampUs;
+        if (isNew && nowMs - d->startMs >= ANOMALY_WARMUP_MS) anomalyRaise(d, b, ALERT_NEW_ID, 0, 0, nowMs);
+        return;
+    }
+
+    uint32_t interval = frame->timestampUs - b->lastUs;
+    b->lastUs = frame->timestampUs;
+
+    // The gap an overdue ID comes back from was already reported as
+    // missing, and would only skew its period.
+    bool gap = b->overdue;
+    b->overdue = false;
+
+    if (b->frames < ANOMALY_LEARN_FRAMES) {
+        b->frames++;
+        if (frame->len != b->len) b->len = ANOMALY_LEN_VARIES;
+        if (changed) b->payloadFixed = false;
+    } else {
+        if (b->len != ANOMALY_LEN_VARIES && frame->len != b->len) {
+            anomalyRaise(d, b, ALERT_DLC, frame->len, b->len, nowMs);
+        }
+        if (b->payloadFixed && changed) anomalyRaise(d, b, ALERT_PAYLOAD, 0, 0, nowMs);
+        if (!gap && anomalyPeriodic(b)) {
+            uint32_t band = max(ANOMALY_BAND_JITTERS * b->jitterUs, b->periodUs / ANOMALY_BAND_MIN_DIV);
+            uint32_t off = interval > b->periodUs ? interval - b->periodUs : b->periodUs - interval;
+            if (off > band) anomalyRaise(d, b, ALERT_PERIOD, interval, b->periodUs, nowMs);
+        }
+    }
+
+    if (gap) {
+        // Keep the learned period and jitter.
+    } else if (b->periodUs == 0) {
+        b->periodUs = interval;
+    } else {
+        uint32_t off = interval > b->periodUs ? interval - b->periodUs : b->periodUs - interval;
+        b->periodUs = b->periodUs - b->periodUs / 8 + interval / 8;
+        b->jitterUs = b->jitterUs - b->jitterUs / 8 + off / 8;
+    }
+
+    if (anomalyPeriodic(b)) {
+        wheelArm(&d->deadlines, i, nowMs + (ANOMALY_MISSING_PERIODS * b->periodUs) / 1000 + WHEEL_TICK_MS);
+    } else {
+        wheelCancel(&d->deadlines, i);
+    }
+}
+
+// Call from loop(): records a missing event, and raises an alert, for
+// every periodic ID whose deadline has passed.
+template <int Ids>
+inline void anomalyService(AnomalyDetector<Ids>* d, unsigned long nowMs) {
+    wheelAdvance(&d->deadlines, nowMs, [d, nowMs](int i) {
+        IdBaseline* b = &d->ids[i];
+        b->missing++;
+        b->lastMissingMs = nowMs;
+        b->overdue = true;
+        anomalyRaise(d, b, ALERT_MISSING, micros() - b->lastUs, b->periodUs, nowMs);
+    });
+}
@@ -0,0 +1,116 @@
+/*
+ * MCP2515 backend: external controller on VSPI with an 8 MHz crystal.
+ * See can_backend.h for the interface.
+ *
+ * Wiring (ESP32 to MCP2515 + SN65HVD230 module):
+ *   GPIO23 MOSI, GPIO19 MISO, GPIO18 SCK, GPIO5 CS, GPIO4 INT
+ * Further controllers use the CS and INT pins in can_backend.h.
+ *
+ * EFLG and CANSTAT are read with raw SPI because mcp_can doesn't expose
+ * register access. Both reads use the same bus settings as the library.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <mcp_can.h>
+
+// MCP2515 SPI instructions and registers used for health checks.
+#define MCP_SPI_READ        0x03
+#define MCP_SPI_BITMOD      0x05
+#define MCP_REG_CANSTAT     0x0E
+#define MCP_REG_EFLG        0x2D
+#define MCP_OPMOD_LISTEN    0x03
+#define MCP_EFLG_RXOVR      0xC0     // RX1OVR | RX0OVR
+#define MCP_EFLG_TXBO_BIT   0x20
+#define MCP_EFLG_RXEP_BIT   0x08
+
+class Mcp2515Backend {
+public:
+    explicit Mcp2515Backend(uint8_t bus)
+        : bus(bus), csPin(canCsPins[bus]), irqPin(canIntPins[bus]), mcp(csPin) {}
+
+    static const char* name() { return "MCP2515, 8 MHz crystal"; }
+
+    int intPin() const { return irqPin; }
+
+    bool begin(can_baud_t baud) {
+        pinMode(irqPin, INPUT);
+        if (mcp.begin(MCP_ANY, mcpBaud(baud), MCP_8MHZ) != CAN_OK) return false;
+        mcp.setMode(MCP_LISTENONLY);
+        return true;
+    }
+
+    bool pending() {
+        return digitalRead(irqPin) == LOW;
+    }
+
+    bool read(CanFrame* frame) {
+        unsigned long rxId;
+        if (mcp.readMsgBuf(&rxId, &frame->len, frame->data) != CAN_OK) return false;
+        frame->timestampUs = micros();
+        frame->extended = (rxId & 0x80000000) != 0;
+        frame->flags = (rxId & 0x40000000) ? CAN_FLAG_RTR : 0;
+        frame->id = rxId & 0x1FFFFFFF;
+        frame->bus = bus;
+        if (frame->len > 8) frame->len = 8;
+        return true;
+    }
+
+    uint8_t errorFlags() {
+        uint8_t eflg = readRegister(MCP_REG_EFLG);
+        uint8_t flags = 0;
+        if (eflg & MCP_EFLG_RXOVR) flags |= CAN_ERR_RX_OVERFLOW;
+        if (eflg & MCP_EFLG_RXEP_BIT) flags |= CAN_ERR_RX_PASSIVE;
+        if (eflg & MCP_EFLG_TXBO_BIT) flags |= CAN_ERR_BUS_OFF;
+        return flags;
+    }
+
+    void clearOverflow() {
+        bitModify(MCP_REG_EFLG, MCP_EFLG_RXOVR, 0);
+    }
+
+    // A reset or brown-out brings the MCP2515 back in configuration mode.
+    bool listening() {
+        return (readRegister(MCP_REG_CANSTAT) >> 5) == MCP_OPMOD_LISTEN;
+    }
+
+private:
+    uint8_t bus;
+    uint8_t csPin;
+    uint8_t irqPin;
+    MCP_CAN mcp;
+
+    static byte mcpBaud(can_baud_t baud) {
+        switch(baud) {
+            case BAUD_125K: return CAN_125KBPS;
+            case BAUD_250K: return CAN_250KBPS;
+            case BAUD_500K: return CAN_500KBPS;
+            case BAUD_1M:   return CAN_1000KBPS;
+            default:        return CAN_250KBPS;
+        }
+    }
+
+    uint8_t readRegister(uint8_t reg) {
+        SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+        digitalWrite(csPin, LOW);
+        SPI.transfer(MCP_SPI_READ);
+        SPI.transfer(reg);
+        uint8_t value = SPI.transfer(0x00);
+        digitalWrite(csPin, HIGH);
+        SPI.endTransaction();
+        return value;
+    }
+
+    void bitModify(uint8_t reg, uint8_t mask, uint8_t value) {
+        SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+        digitalWrite(csPin, LOW);
+        SPI.transfer(MCP_SPI_BITMOD);
+        SPI.transfer(reg);
+        SPI.transfer(mask);
+        SPI.transfer(value);
+        digitalWrite(csPin, HIGH);
+        SPI.endTransaction();
+    }
+};
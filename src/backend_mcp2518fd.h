@@ -0,0 +1,286 @@
+/*
+ * MCP2518FD backend: external CAN FD controller on VSPI with a 40 MHz
+ * crystal, in listen-only mode. See can_backend.h for the interface.
+ *
+ * Wiring is the same as the MCP2515 board:
+ *   GPIO23 MOSI, GPIO19 MISO, GPIO18 SCK, GPIO5 CS, GPIO4 INT
+ * Further controllers use the CS and INT pins in can_backend.h.
+ *
+ * All 2 KB of message RAM goes to one RX FIFO of 26 objects with 64-byte
+ * payloads (the TX queue and TX event FIFO are turned off), so a slow
+ * loop() pass costs latency rather than frames where the MCP2515 has
+ * only two RX buffers. INT is asserted while the FIFO is not empty.
+ *
+ * Each object carries the controller's time base counter at reception,
+ * run at 1 tick per µs. The offset to micros() is re-measured on every
+ * health poll, to within the SPI transaction time, so timestamps are
+ * exact relative to each other only between two polls and may step by
+ * a few µs across one.
+ *
+ * Only the nominal (arbitration) bit rate follows the baud setting; the
+ * data phase of FD frames with BRS is fixed at CAN_FD_DATA_BITRATE.
+ *
+ * There is no MCP2518FD library in lib_deps, so the chip is driven with
+ * raw SPI. Register and RAM access is little-endian 32-bit words.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#define MCP18_SPI_HZ        10000000
+#define MCP18_SYSCLK_MHZ    40          // Crystal; the bit timings below assume 40 MHz
+#define MCP18_FIFO_DEPTH    26          // 26 x (12 + 64) bytes fits the 2 KB RAM
+
+#if CAN_FD_DATA_BITRATE != 2000000
+#error "MCP18_DBTCFG is set up for a 2 Mbps data phase"
+#endif
+
+// SPI instructions (top 4 bits of the 16-bit command word).
+#define MCP18_CMD_RESET     0x0
+#define MCP18_CMD_WRITE     0x2
+#define MCP18_CMD_READ      0x3
+
+// Registers
+#define MCP18_REG_CON       0x000
+#define MCP18_REG_NBTCFG    0x004
+#define MCP18_REG_DBTCFG    0x008
+#define MCP18_REG_TBC       0x010
+#define MCP18_REG_TSCON     0x014
+#define MCP18_REG_INT       0x01C
+#define MCP18_REG_TREC      0x034
+#define MCP18_REG_FIFOCON1  0x05C     // FIFO n at 0x050 + 12 n; FIFO 0 is the TX queue
+#define MCP18_REG_FIFOSTA1  0x060
+#define MCP18_REG_FIFOUA1   0x064
+#define MCP18_REG_FLTCON0   0x1D0
+#define MCP18_REG_FLTOBJ0   0x1F0
+#define MCP18_REG_MASK0     0x1F4
+#define MCP18_REG_OSC       0xE00
+#define MCP18_RAM_START     0x400
+#define MCP18_RAM_SIZE      2048
+
+// Register bits
+#define MCP18_CON_RESET     0x04980760   // Power-on value of C1CON
+#define MCP18_CON_TXQEN     (1UL << 20)
+#define MCP18_CON_STEF      (1UL << 19)
+#define MCP18_OPMOD_LISTEN  3
+#define MCP18_OPMOD_CONFIG  4
+#define MCP18_OSC_OSCRDY    (1UL << 10)
+#define MCP18_TSCON_TBCEN   (1UL << 16)
+#define MCP18_INT_RXIE      (1UL << 17)
+#define MCP18_TREC_RXBP     (1UL << 19)
+#define MCP18_TREC_TXBO     (1UL << 21)
+#define MCP18_FIFO_TFNRFNIE (1UL << 0)
+#define MCP18_FIFO_RXTSEN   (1UL << 5)
+#define MCP18_FIFO_UINC     0x01         // Bit 8: byte 1 of C1FIFOCON
+#define MCP18_FIFO_PLSIZE64 (7UL << 29)
+#define MCP18_FIFOSTA_RXOVIF 0x08
+#define MCP18_FLT_EN        0x80
+
+// RX object header, word R1
+#define MCP18_R1_IDE        (1UL << 4)
+#define MCP18_R1_RTR        (1UL << 5)
+#define MCP18_R1_BRS        (1UL << 6)
+#define MCP18_R1_FDF        (1UL << 7)
+#define MCP18_R1_ESI        (1UL << 8)
+
+// Data phase: 2 Mbps, 20 TQ of 25 ns, sample point 80%.
+#define MCP18_DBTCFG ((0UL << 24) | (14UL << 16) | (3UL << 8) | 3UL)
+
+class Mcp2518fdBackend {
+public:
+    explicit Mcp2518fdBackend(uint8_t bus)
+        : bus(bus), csPin(canCsPins[bus]), irqPin(canIntPins[bus]) {}
+
+    static const char* name() { return "MCP2518FD, 40 MHz crystal"; }
+
+    int intPin() const { return irqPin; }
+
+    bool begin(can_baud_t baud) {
+        pinMode(irqPin, INPUT);
+        pinMode(csPin, OUTPUT);
+        digitalWrite(csPin, HIGH);
+        SPI.begin();
+
+        // Reset puts the chip in configuration mode with the oscillator
+        // restarting. A missing chip reads back as all 0s or all 1s and
+        // fails the mode check.
+        command(MCP18_CMD_RESET, 0);
+        unsigned long start = millis();
+        while (!(readWord(MCP18_REG_OSC) & MCP18_OSC_OSCRDY)) {
+            if (millis() - start > 10) return false;
+            delay(1);
+        }
+        if (opmode() != MCP18_OPMOD_CONFIG) return false;
+
+        writeWord(MCP18_REG_CON, MCP18_CON_RESET & ~(MCP18_CON_TXQEN | MCP18_CON_STEF));
+        writeWord(MCP18_REG_NBTCFG, nominalTiming(baud));
+        writeWord(MCP18_REG_DBTCFG, MCP18_DBTCFG);
+        writeWord(MCP18_REG_TSCON, MCP18_TSCON_TBCEN | (MCP18_SYSCLK_MHZ - 1));
+        writeWord(MCP18_REG_FIFOCON1, MCP18_FIFO_PLSIZE64 | ((uint32_t)(MCP18_FIFO_DEPTH - 1) << 24) |
+                                      MCP18_FIFO_RXTSEN | MCP18_FIFO_TFNRFNIE);
+
+        // Filter 0 with an all-zero mask accepts everything into FIFO 1.
+        writeWord(MCP18_REG_MASK0, 0);
+        writeWord(MCP18_REG_FLTOBJ0, 0);
+        writeByte(MCP18_REG_FLTCON0, MCP18_FLT_EN | 1);
+
+        // INT follows RXIF only. Overflow is polled by the health monitor,
+        // so INT low always means a frame is waiting.
+        writeWord(MCP18_REG_INT, MCP18_INT_RXIE);
+
+        writeByte(MCP18_REG_CON + 3, MCP18_OPMOD_LISTEN);
+        start = millis();
+        while (opmode() != MCP18_OPMOD_LISTEN) {
+            if (millis() - start > 10) return false;
+            delay(1);
+        }
+        syncTimestamp();
+        return true;
+    }
+
+    bool pending() {
+        return digitalRead(irqPin) == LOW;
+    }
+
+    // The header, timestamp and first 8 data bytes come in one SPI
+    // transaction, so a classic frame costs three: user address, object,
+    // and the FIFO increment.
+    bool read(CanFrame* frame) {
+        uint32_t ua = readWord(MCP18_REG_FIFOUA1);
+        if (ua >= MCP18_RAM_SIZE) return false;
+        uint16_t addr = MCP18_RAM_START + ua;
+
+        uint8_t obj[12 + 8];
+        readBytes(addr, obj, sizeof(obj));
+        uint32_t r0 = le32(obj);
+        uint32_t r1 = le32(obj + 4);
+        uint32_t ts = le32(obj + 8);
+
+        bool fd = r1 & MCP18_R1_FDF;
+        frame->len = canDlcToLen(r1 & 0x0F, fd);
+        memcpy(frame->data, obj + 12, frame->len < 8 ? frame->len : 8);
+        if (frame->len > 8) {
+            // FD lengths above 8 are all multiples of 4, as RAM reads must be.
+            readBytes(addr + sizeof(obj), frame->data + 8, frame->len - 8);
+        }
+        writeByte(MCP18_REG_FIFOCON1 + 1, MCP18_FIFO_UINC);
+
+        frame->extended = r1 & MCP18_R1_IDE;
+        uint32_t sid = r0 & 0x7FF;
+        uint32_t eid = (r0 >> 11) & 0x3FFFF;
+        frame->id = frame->extended ? (sid << 18) | eid : sid;
+        frame->flags = (r1 & MCP18_R1_RTR ? CAN_FLAG_RTR : 0) |
+                       (fd ? CAN_FLAG_FD : 0) |
+                       (r1 & MCP18_R1_BRS ? CAN_FLAG_BRS : 0) |
+                       (r1 & MCP18_R1_ESI ? CAN_FLAG_ESI : 0);
+        frame->bus = bus;
+        frame->timestampUs = ts + tsOffset;
+        return true;
+    }
+
+    uint8_t errorFlags() {
+        syncTimestamp();
+        uint32_t trec = readWord(MCP18_REG_TREC);
+        uint8_t flags = 0;
+        if (readByte(MCP18_REG_FIFOSTA1) & MCP18_FIFOSTA_RXOVIF) flags |= CAN_ERR_RX_OVERFLOW;
+        if (trec & MCP18_TREC_RXBP) flags |= CAN_ERR_RX_PASSIVE;
+        if (trec & MCP18_TREC_TXBO) flags |= CAN_ERR_BUS_OFF;
+        return flags;
+    }
+
+    // RXOVIF is cleared by writing 0; the other bits in that byte are
+    // read-only for an RX FIFO.
+    void clearOverflow() {
+        writeByte(MCP18_REG_FIFOSTA1, 0);
+    }
+
+    // Like the MCP2515, a reset brings it back in configuration mode.
+    bool listening() {
+        return opmode() == MCP18_OPMOD_LISTEN;
+    }
+
+private:
+    uint8_t bus;
+    uint8_t csPin;
+    uint8_t irqPin;
+    unsigned long tsOffset = 0;      // micros() minus time base counter
+
+    // Nominal phase: 1 sync + TSEG1 + TSEG2 TQ at 25 ns (50 ns at
+    // 125 kbps), sample point 80%.
+    static uint32_t nominalTiming(can_baud_t baud) {
+        switch(baud) {
+            case BAUD_125K: return (1UL << 24) | (126UL << 16) | (31UL << 8) | 31UL;
+            case BAUD_500K: return (0UL << 24) | (62UL << 16) | (15UL << 8) | 15UL;
+            case BAUD_1M:   return (0UL << 24) | (30UL << 16) | (7UL << 8) | 7UL;
+            case BAUD_250K:
+            default:        return (0UL << 24) | (126UL << 16) | (31UL << 8) | 31UL;
+        }
+    }
+
+    static uint32_t le32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    uint8_t opmode() {
+        return (readWord(MCP18_REG_CON) >> 21) & 0x07;
+    }
+
+    void syncTimestamp() {
+        unsigned long before = micros();
+        uint32_t tbc = readWord(MCP18_REG_TBC);
+        unsigned long after = micros();
+        tsOffset = before + (after - before) / 2 - tbc;
+    }
+
+    void select(uint8_t cmd, uint16_t addr) {
+        SPI.beginTransaction(SPISettings(MCP18_SPI_HZ, MSBFIRST, SPI_MODE0));
+        digitalWrite(csPin, LOW);
+        SPI.transfer((cmd << 4) | ((addr >> 8) & 0x0F));
+        SPI.transfer(addr & 0xFF);
+    }
+
+    void deselect() {
+        digitalWrite(csPin, HIGH);
+        SPI.endTransaction();
+    }
+
+    void command(uint8_t cmd, uint16_t addr) {
+        select(cmd, addr);
+        deselect();
+    }
+
+    void readBytes(uint16_t addr, uint8_t* buf, int len) {
+        select(MCP18_CMD_READ, addr);
+        SPI.transferBytes(NULL, buf, len);
+        deselect();
+    }
+
+    void writeBytes(uint16_t addr, const uint8_t* buf, int len) {
+        select(MCP18_CMD_WRITE, addr);
+        SPI.writeBytes(buf, len);
+        deselect();
+    }
+
+    uint8_t readByte(uint16_t addr) {
+        uint8_t value;
+        readBytes(addr, &value, 1);
+        return value;
+    }
+
+    void writeByte(uint16_t addr, uint8_t value) {
+        writeBytes(addr, &value, 1);
+    }
+
+    uint32_t readWord(uint16_t addr) {
+        uint8_t buf[4];
+        readBytes(addr, buf, 4);
+        return le32(buf);
+    }
+
+    void writeWord(uint16_t addr, uint32_t value) {
+        uint8_t buf[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+        writeBytes(addr, buf, 4);
+    }
+};
@@ -0,0 +1,125 @@
+/*
+ * Mock backend: generates ETS-like traffic with no controller attached,
+ * for exercising the firmware, web UI and host tools on a bare ESP32.
+ * See can_backend.h for the interface.
+ *
+ * At 250 kbps it produces a fixed schedule of periodic IDs whose
+ * payloads carry a rolling counter and a slowly sweeping throttle value.
+ * Two CAN FD streams (20 and 64 bytes) exercise the FD paths; the real
+ * ETS bus is classic CAN only.
+ * At any other baud it produces random IDs, like a real controller
+ * decoding noise at the wrong bit rate, so baud scanning can be tried
+ * out too.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+struct MockStream {
+    uint32_t id;
+    bool extended;
+    uint8_t flags;
+    uint8_t len;
+    unsigned long periodUs;
+};
+
+static const MockStream mockStreams[] = {
+    { 0x100,      false, 0, 8, 10000 },      // Lever position
+    { 0x101,      false, 0, 8, 20000 },      // Throttle command
+    { 0x200,      false, 0, 4, 100000 },     // Shift state
+    { 0x300,      false, 0, 2, 1000000 },    // Heartbeat
+    { 0x18FEF100, true,  0, 8, 100000 },     // J1939-style engine status
+    { 0x400,      false, CAN_FLAG_FD, 20, 50000 },                  // FD, no BRS
+    { 0x18DA00F1, true,  CAN_FLAG_FD | CAN_FLAG_BRS, 64, 200000 },  // FD, full length
+};
+#define MOCK_STREAM_COUNT (sizeof(mockStreams) / sizeof(mockStreams[0]))
+#define MOCK_NOISE_PERIOD_US 2000
+
+class MockBackend {
+public:
+    explicit MockBackend(uint8_t bus) : bus(bus) {}
+
+    static const char* name() { return "mock traffic generator"; }
+
+    int intPin() const { return -1; }
+
+    bool begin(can_baud_t baud) {
+        noise = baud != BAUD_250K;
+        unsigned long now = micros();
+        for (size_t i = 0; i < MOCK_STREAM_COUNT; i++) {
+            nextDueUs[i] = now + mockStreams[i].periodUs;
+            counters[i] = 0;
+        }
+        nextNoiseUs = now;
+        return true;
+    }
+
+    bool pending() {
+        return nextStream(micros()) >= 0;
+    }
+
+    bool read(CanFrame* frame) {
+        unsigned long now = micros();
+        int s = nextStream(now);
+        if (s < 0) return false;
+        frame->timestampUs = now;
+        frame->bus = bus;
+
+        if (noise) {
+            nextNoiseUs += MOCK_NOISE_PERIOD_US;
+            frame->extended = esp_random() & 1;
+            frame->id = esp_random() & (frame->extended ? 0x1FFFFFFF : 0x7FF);
+            frame->flags = 0;
+            frame->len = esp_random() % 9;
+            for (int i = 0; i < 8; i++) frame->data[i] = esp_random();
+            return true;
+        }
+
+        const MockStream* m = &mockStreams[s];
+        nextDueUs[s] += m->periodUs;
+        uint8_t count = counters[s]++;
+        // Throttle sweeps 0..255..0 over about 10 s.
+        uint8_t sweep = (now / 20000) & 0x1FF;
+        if (sweep & 0x100) sweep = ~sweep;
+
+        frame->id = m->id;
+        frame->extended = m->extended;
+        frame->flags = m->flags;
+        frame->len = m->len;
+        memset(frame->data, 0, m->len);
+        frame->data[0] = count;
+        if (m->len > 1) frame->data[1] = sweep;
+        if (m->len > 2) frame->data[2] = s;
+        // FD payloads get a byte ramp so truncation anywhere shows up.
+        for (int i = 8; i < m->len; i++) frame->data[i] = i + count;
+        return true;
+    }
+
+    uint8_t errorFlags() { return 0; }
+    void clearOverflow() {}
+    bool listening() { return true; }
+
+private:
+    uint8_t bus;
+    bool noise = false;
+    unsigned long nextDueUs[MOCK_STREAM_COUNT];
+    unsigned long nextNoiseUs = 0;
+    uint8_t counters[MOCK_STREAM_COUNT];
+
+    // Index of the most overdue stream, MOCK_STREAM_COUNT for noise, or
+    // -1 if nothing is due yet.
+    int nextStream(unsigned long now) {
+        if (noise) return (long)(now - nextNoiseUs) >= 0 ? (int)MOCK_STREAM_COUNT : -1;
+        int best = -1;
+        long bestLate = -1;
+        for (size_t i = 0; i < MOCK_STREAM_COUNT; i++) {
+            long late = (long)(now - nextDueUs[i]);
+            if (late >= 0 && late > bestLate) {
+                bestLate = late;
+                best = i;
+            }
+        }
+        return best;
+    }
+};
@@ -0,0 +1,116 @@
+/*
+ * ESP32 TWAI backend: the on-chip CAN controller, in listen-only mode.
+ * See can_backend.h for the interface.
+ *
+ * Wiring (ESP32 to SN65HVD230 or similar 3.3 V transceiver):
+ *   GPIO21 -> transceiver TXD   (held recessive in listen-only mode)
+ *   GPIO22 -> transceiver RXD
+ *
+ * No SPI: the TWAI interrupt drains the 64-byte hardware RX FIFO into the
+ * driver's queue, so frames are buffered in RAM between loop() passes
+ * rather than in the MCP2515's two RX buffers. The ESP32 TWAI peripheral
+ * has no receive timestamp, so frames are stamped when dequeued.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <driver/twai.h>
+
+#define TWAI_TX_PIN 21
+#define TWAI_RX_PIN 22
+#define TWAI_RX_QUEUE_LEN 64
+
+#if CAN_BUS_COUNT > 1
+#error "The ESP32 has one TWAI controller; use an SPI backend for more buses"
+#endif
+
+class TwaiBackend {
+public:
+    explicit TwaiBackend(uint8_t bus) {}
+
+    static const char* name() { return "ESP32 TWAI"; }
+
+    int intPin() const { return -1; }
+
+    bool begin(can_baud_t baud) {
+        if (installed) {
+            twai_stop();
+            twai_driver_uninstall();
+            installed = false;
+        }
+
+        twai_general_config_t general = TWAI_GENERAL_CONFIG_DEFAULT(
+            (gpio_num_t)TWAI_TX_PIN, (gpio_num_t)TWAI_RX_PIN, TWAI_MODE_LISTEN_ONLY);
+        general.rx_queue_len = TWAI_RX_QUEUE_LEN;
+        general.tx_queue_len = 0;
+        twai_timing_config_t timing = timingFor(baud);
+        twai_filter_config_t filter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+        if (twai_driver_install(&general, &timing, &filter) != ESP_OK) return false;
+        installed = true;
+        if (twai_start() != ESP_OK) return false;
+        lastMissed = 0;
+        lastOverrun = 0;
+        return true;
+    }
+
+    bool pending() {
+        twai_status_info_t status;
+        return installed && twai_get_status_info(&status) == ESP_OK && status.msgs_to_rx > 0;
+    }
+
+    bool read(CanFrame* frame) {
+        twai_message_t msg;
+        if (twai_receive(&msg, 0) != ESP_OK) return false;
+        frame->timestampUs = micros();
+        frame->id = msg.identifier & 0x1FFFFFFF;
+        frame->extended = msg.extd;
+        frame->flags = msg.rtr ? CAN_FLAG_RTR : 0;
+        frame->bus = 0;
+        frame->len = canDlcToLen(msg.data_length_code, false);
+        memcpy(frame->data, msg.data, frame->len);
+        return true;
+    }
+
+    // Overflow is reported when the driver's missed/overrun counters have
+    // moved since the last clearOverflow().
+    uint8_t errorFlags() {
+        twai_status_info_t status;
+        if (!installed || twai_get_status_info(&status) != ESP_OK) return 0;
+        uint8_t flags = 0;
+        if (status.rx_missed_count != lastMissed || status.rx_overrun_count != lastOverrun) {
+            flags |= CAN_ERR_RX_OVERFLOW;
+        }
+        if (status.rx_error_counter >= 128) flags |= CAN_ERR_RX_PASSIVE;
+        if (status.state == TWAI_STATE_BUS_OFF) flags |= CAN_ERR_BUS_OFF;
+        return flags;
+    }
+
+    void clearOverflow() {
+        twai_status_info_t status;
+        if (!installed || twai_get_status_info(&status) != ESP_OK) return;
+        lastMissed = status.rx_missed_count;
+        lastOverrun = status.rx_overrun_count;
+    }
+
+    bool listening() {
+        twai_status_info_t status;
+        return installed && twai_get_status_info(&status) == ESP_OK && status.state == TWAI_STATE_RUNNING;
+    }
+
+private:
+    bool installed = false;
+    uint32_t lastMissed = 0;
+    uint32_t lastOverrun = 0;
+
+    static twai_timing_config_t timingFor(can_baud_t baud) {
+        switch(baud) {
+            case BAUD_125K: { twai_timing_config_t t = TWAI_TIMING_CONFIG_125KBITS(); return t; }
+            case BAUD_500K: { twai_timing_config_t t = TWAI_TIMING_CONFIG_500KBITS(); return t; }
+            case BAUD_1M:   { twai_timing_config_t t = TWAI_TIMING_CONFIG_1MBITS(); return t; }
+            case BAUD_250K:
+            default:        { twai_timing_config_t t = TWAI_TIMING_CONFIG_250KBITS(); return t; }
+        }
+    }
+};
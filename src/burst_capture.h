@@ -0,0 +1,219 @@
+/*
+ * Burst capture, shared by the serial and WiFi builds.
+ *
+ * For short events at 1 Mbps the output paths, not the bus, are what
+ * loses frames. A burst stops every sink (serial rows, the web log, ID
+ * tracking, the flight recorder) and appends frames to one buffer taken
+ * from the largest free block of heap, or of PSRAM if the board has more
+ * there, leaving BURST_HEAP_RESERVE for the rest of the firmware. It
+ * runs until a frame count, a duration or a trigger ID (plus some
+ * frames after it), or until the buffer fills or the user stops it. The
+ * buffer is kept afterwards for dumping at leisure.
+ *
+ * Records are packed back to back, little-endian:
+ *   uint32  timestamp, us since the burst started
+ *   uint32  CAN ID, bit 31 set for extended IDs
+ *   uint8   flags (CAN_FLAG_*)
+ *   uint8   bus
+ *   uint8   payload length in bytes
+ *   ...     payload
+ * which is also the layout of the serial binary dump.
+ *
+ * A burst is lossless if no controller reported an RX overflow and no
+ * read failed while it ran; the caller checks the controllers every
+ * BURST_FLAG_POLL_US and counts what it finds in overflows and
+ * readErrors.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+#include "frame_format.h"
+
+#define BURST_RECORD_HEADER 11
+#ifndef BURST_HEAP_RESERVE
+#define BURST_HEAP_RESERVE  32768     // Heap left for everything else
+#endif
+#define BURST_FLAG_POLL_US  10000     // How often controllers are checked for overflow
+
+typedef enum {
+    BURST_IDLE,             // No buffer, or a burst already dumped and freed
+    BURST_RUNNING,
+    BURST_DONE              // Stopped, buffer holds the capture
+} burst_state_t;
+
+typedef enum {
+    BURST_STOP_NONE,
+    BURST_STOP_COUNT,
+    BURST_STOP_TIME,
+    BURST_STOP_TRIGGER,
+    BURST_STOP_FULL,
+    BURST_STOP_USER
+} burst_stop_t;
+
+struct BurstCapture {
+    uint8_t* buf;
+    size_t size;
+    size_t used;
+    bool psram;
+    burst_state_t state;
+    burst_stop_t reason;
+
+    // Stop conditions, 0 = none
+    unsigned long maxFrames;
+    unsigned long maxUs;
+    bool hasTrigger;
+    uint32_t triggerId;
+    unsigned long post;          // Frames kept after the trigger
+    bool triggered;
+    unsigned long postLeft;
+
+    unsigned long frames;
+    unsigned long startUs;
+    unsigned long elapsedUs;     // Set when stopped
+    unsigned long lastFlagPollUs;
+    unsigned long overflows;     // Controllers that reported an overflow while running
+    unsigned long readErrors;
+};
+
+inline const char* burstStopToString(burst_stop_t reason) {
+    switch(reason) {
+        case BURST_STOP_COUNT:   return "count";
+        case BURST_STOP_TIME:    return "time";
+        case BURST_STOP_TRIGGER: return "trigger";
+        case BURST_STOP_FULL:    return "full";
+        case BURST_STOP_USER:    return "stopped";
+        default:                 return "none";
+    }
+}
+
+inline void burstFree(BurstCapture* b) {
+    if (b->buf != NULL) free(b->buf);
+    b->buf = NULL;
+    b->size = 0;
+    b->used = 0;
+    b->state = BURST_IDLE;
+}
+
+// Takes the buffer for a new burst, freeing the last one's first.
+// Returns false if less than a few KB is free.
+inline bool burstAlloc(BurstCapture* b) {
+    burstFree(b);
+    size_t heap = ESP.getMaxAllocHeap();
+    heap = heap > BURST_HEAP_RESERVE ? heap - BURST_HEAP_RESERVE : 0;
+    size_t psram = psramFound() ? ESP.getMaxAllocPsram() : 0;
+
+    if (psram > heap) {
+        b->buf = (uint8_t*)ps_malloc(psram);
+        b->size = psram;
+        b->psram = true;
+    }
+    if (b->buf == NULL && heap >= 4096) {
+        b->buf = (uint8_t*)malloc(heap);
+        b->size = heap;
+        b->psram = false;
+    }
+    if (b->buf == NULL) {
+        b->size = 0;
+        return false;
+    }
+    return true;
+}
+
+inline void burstStart(BurstCapture* b, unsigned long maxFrames, unsigned long maxMs,
+                       bool hasTrigger, uint32_t triggerId, unsigned long post) {
+    b->used = 0;
+    b->state = BURST_RUNNING;
+    b->reason = BURST_STOP_NONE;
+    b->maxFrames = maxFrames;
+    b->maxUs = maxMs * 1000;
+    b->hasTrigger = hasTrigger;
+    b->triggerId = triggerId;
+    b->post = post;
+    b->triggered = false;
+    b->postLeft = 0;
+    b->frames = 0;
+    b->startUs = micros();
+    b->elapsedUs = 0;
+    b->lastFlagPollUs = b->startUs;
+    b->overflows = 0;
+    b->readErrors = 0;
+}
+
+inline void burstStop(BurstCapture* b, burst_stop_t reason) {
+    if (b->state != BURST_RUNNING) return;
+    b->state = BURST_DONE;
+    b->reason = reason;
+    b->elapsedUs = micros() - b->startUs;
+}
+
+// Appends one frame. Returns false once the burst has stopped.
+inline bool burstRecord(BurstCapture* b, const CanFrame* frame) {
+    if (b->state != BURST_RUNNING) return false;
+    if (b->used + BURST_RECORD_HEADER + frame->len > b->size) {
+        burstStop(b, BURST_STOP_FULL);
+        return false;
+    }
+    uint8_t* p = b->buf + b->used;
+    uint32_t t = frame->timestampUs - b->startUs;
+    uint32_t id = frame->id | (frame->extended ? 0x80000000 : 0);
+    memcpy(p, &t, 4);
+    memcpy(p + 4, &id, 4);
+    p[8] = frame->flags;
+    p[9] = frame->bus;
+    p[10] = frame->len;
+    memcpy(p + BURST_RECORD_HEADER, frame->data, frame->len);
+    b->used += BURST_RECORD_HEADER + frame->len;
+    b->frames++;
+
+    if (!b->triggered && b->hasTrigger && frame->id == b->triggerId) {
+        b->triggered = true;
+        b->postLeft = b->post;
+    } else if (b->triggered && b->postLeft > 0) {
+        b->postLeft--;
+    }
+    if (b->triggered && b->postLeft == 0) burstStop(b, BURST_STOP_TRIGGER);
+    if (b->maxFrames && b->frames >= b->maxFrames) burstStop(b, BURST_STOP_COUNT);
+    return b->state == BURST_RUNNING;
+}
+
+// Call on every pass while running: stops the burst at its duration.
+inline void burstCheckTime(BurstCapture* b) {
+    if (b->state == BURST_RUNNING && b->maxUs && micros() - b->startUs >= b->maxUs) {
+        burstStop(b, BURST_STOP_TIME);
+    }
+}
+
+inline bool burstLossless(const BurstCapture* b) {
+    return b->overflows == 0 && b->readErrors == 0;
+}
+
+inline unsigned long burstFramesPerSecond(const BurstCapture* b) {
+    return b->elapsedUs ? (unsigned long)((uint64_t)b->frames * 1000000 / b->elapsedUs) : 0;
+}
+
+// Reads the record at *offset back into frame (timestampUs relative to
+// the burst start) and advances *offset. Returns false past the end.
+inline bool burstNextRecord(const BurstCapture* b, size_t* offset, CanFrame* frame) {
+    if (*offset + BURST_RECORD_HEADER > b->used) return false;
+    const uint8_t* p = b->buf + *offset;
+    uint32_t t, id;
+    memcpy(&t, p, 4);
+    memcpy(&id, p + 4, 4);
+    frame->timestampUs = t;
+    frame->id = id & 0x1FFFFFFF;
+    frame->extended = (id & 0x80000000) != 0;
+    frame->flags = p[8];
+    frame->bus = p[9];
+    frame->len = p[10];
+    memcpy(frame->data, p + BURST_RECORD_HEADER, frame->len);
+    *offset += BURST_RECORD_HEADER + frame->len;
+    return true;
+}
+
+// Formats one record as a frame row with a microsecond timestamp, in
+// the CSV format of frame_format.h.
+inline int burstFormatRecord(const CanFrame* frame, char* line, int size) {
+    return formatFrameCsv(frame, frame->timestampUs, line, size);
+}
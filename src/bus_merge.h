@@ -0,0 +1,116 @@
+/*
+ * Multi-controller receive, shared by the serial and WiFi builds.
+ *
+ * mergeFill() drains the controllers in turn into small per-bus queues,
+ * taking at most a budget of frames from one before moving to the next
+ * (MERGE_READ_BUDGET, more while rx_adapt.h is polling), so with several
+ * controllers on one SPI bus a busy one can't starve the others.
+ * mergeNext() then hands out the queued frames in timestamp order across
+ * all buses.
+ *
+ * A frame is only handed out once no bus can still produce an older one.
+ * Each bus's safe point is when it was seen drained, or, if it still has
+ * frames waiting, the newest frame queued from it (a controller delivers
+ * its own frames in order). The watermark is the earliest safe point.
+ * Backends that stamp frames in hardware (MCP2518FD) can hold a frame
+ * older than one already read from another bus, which is what this
+ * ordering is for; frames stamped on read are already in order and only
+ * wait at most one loop() pass.
+ *
+ * With a single controller every queued frame is released in the same
+ * pass, so the cost is one copy per frame.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+#include "can_health.h"
+#include "trace.h"
+
+#define MERGE_QUEUE_LEN    64    // Frames per bus, power of two
+#define MERGE_READ_BUDGET  8     // Default frames from one controller per turn
+
+struct BusQueue {
+    CanFrame frames[MERGE_QUEUE_LEN];
+    uint8_t head;                // Oldest queued frame
+    uint8_t count;
+};
+
+struct BusMerge {
+    BusQueue queues[CAN_BUS_COUNT];
+    unsigned long watermark;     // Frames stamped at or before this are released
+    bool backlog;                // The last fill left frames behind: a budget or queue ran out
+};
+
+// Reads up to budget waiting frames from each controller into the
+// queues. Each frame and each failed read is reported to that bus's
+// health monitor, and failed reads are counted in readErrors[bus].
+// Returns how many failed.
+template <class Bus>
+inline int mergeFill(BusMerge* m, Bus* buses, CanHealth* health, unsigned long* readErrors, int budget) {
+    int errors = 0;
+    bool first = true;
+    unsigned long watermark = 0;
+    m->backlog = false;
+
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        BusQueue* q = &m->queues[b];
+        int left = budget;
+        while (left > 0 && q->count < MERGE_QUEUE_LEN && buses[b].pending()) {
+            CanFrame* f = &q->frames[(q->head + q->count) & (MERGE_QUEUE_LEN - 1)];
+            TRACE_BEGIN(TRACE_SPI_READ, b);
+            bool ok = buses[b].read(f);
+            TRACE_END(TRACE_SPI_READ, b);
+            left--;
+            if (ok) {
+                healthOnFrame(&health[b]);
+                q->count++;
+            } else {
+                healthOnReadError(&health[b], millis());
+                readErrors[b]++;
+                errors++;
+            }
+        }
+
+        unsigned long safe;
+        if (!buses[b].pending()) {
+            safe = micros();
+        } else {
+            if (left == 0 || q->count == MERGE_QUEUE_LEN) m->backlog = true;
+            if (q->count > 0) {
+                safe = q->frames[(q->head + q->count - 1) & (MERGE_QUEUE_LEN - 1)].timestampUs;
+            } else {
+                safe = m->watermark;     // Only failed reads this turn
+            }
+        }
+        if (first || (long)(safe - watermark) < 0) watermark = safe;
+        first = false;
+    }
+
+    m->watermark = watermark;
+    return errors;
+}
+
+// Returns the oldest queued frame across all buses, or NULL if there is
+// none that is safe to release yet. The frame stays valid until the next
+// mergeFill().
+inline CanFrame* mergeNext(BusMerge* m) {
+    int best = -1;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        BusQueue* q = &m->queues[b];
+        if (q->count == 0) continue;
+        if (best < 0 || (long)(q->frames[q->head].timestampUs -
+                               m->queues[best].frames[m->queues[best].head].timestampUs) < 0) {
+            best = b;
+        }
+    }
+    if (best < 0) return NULL;
+
+    BusQueue* q = &m->queues[best];
+    CanFrame* f = &q->frames[q->head];
+    if ((long)(f->timestampUs - m->watermark) > 0) return NULL;
+    q->head = (q->head + 1) & (MERGE_QUEUE_LEN - 1);
+    q->count--;
+    return f;
+}
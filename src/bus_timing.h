@@ -0,0 +1,286 @@
+/*
+ * Bus timing analysis, shared by the serial and WiFi builds.
+ *
+ * Every frame's time on the wire is computed from its length
+ * (canFrameBits()), which with its timestamp gives where it started and
+ * ended. From consecutive frames on a bus that yields, incrementally and
+ * in fixed memory:
+ *
+ *   gaps        Idle time before each frame, in bit times, as a histogram
+ *               (timingGapBoundsBits).
+ *   clusters    Busy periods: runs of frames each starting within
+ *               TIMING_B2B_BITS of the previous one's end. Counted, with
+ *               the longest and the last TIMING_CLUSTER_KEEP of at least
+ *               TIMING_CLUSTER_MIN frames kept.
+ *   load        Bus utilisation per TIMING_BUCKET_MS for the last
+ *               TIMING_SERIES_LEN buckets, in permille.
+ *
+ * and per tracked ID (indexed by ID table slot, like anomaly.h):
+ *
+ *   jitter      Worst-case response jitter, the spread between the
+ *               shortest and longest interval seen.
+ *   delay       Arbitration delay estimate. A frame that starts as the
+ *               previous one ends was queued while the bus was busy, so
+ *               it waited at most as long as the busy period before it;
+ *               the longest such wait is kept. Frames that came
+ *               back-to-back behind a higher-priority ID are counted as
+ *               lost arbitrations.
+ *
+ * Gaps are only as good as the timestamps. The MCP2518FD stamps frames
+ * in hardware at start of frame; the other backends stamp them with
+ * micros() when read, so frames read in one batch look back-to-back and
+ * the figures there are an upper bound on contention. Stuff bits aren't
+ * counted, so frames are slightly shorter than on the wire.
+ *
+ * All-zero is the empty state.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#define TIMING_B2B_BITS      10      // Idle up to this (past IFS) is back-to-back
+#define TIMING_BUCKET_MS     1000
+#define TIMING_SERIES_LEN    60      // Load buckets kept
+#define TIMING_CLUSTER_MIN   4       // Clusters this long are kept in recent[]
+#define TIMING_CLUSTER_KEEP  8
+
+#ifdef CAN_BACKEND_MCP2518FD
+#define TIMING_STAMP_AT_SOF  1       // Hardware timestamp at start of frame
+#else
+#define TIMING_STAMP_AT_SOF  0       // micros() after the frame was read
+#endif
+
+// Gap histogram bucket upper bounds in bit times; the last bucket is
+// everything longer.
+static const uint32_t timingGapBoundsBits[] = { TIMING_B2B_BITS, 32, 128, 1000, 10000 };
+#define TIMING_GAP_BUCKETS (sizeof(timingGapBoundsBits) / sizeof(timingGapBoundsBits[0]) + 1)
+
+struct IdTiming {
+    bool seen;
+    unsigned long lastUs;        // Start of the previous frame
+    uint32_t intervals;
+    uint32_t minIntervalUs;
+    uint32_t maxIntervalUs;
+    uint32_t backToBack;         // Frames that started as the previous one ended
+    uint32_t lostArb;            // ...behind a higher-priority ID
+    uint32_t maxDelayUs;         // Longest busy period before one of its frames
+};
+
+struct TimingCluster {
+    unsigned long ms;            // millis() when it ended
+    uint16_t frames;
+    uint32_t durationUs;
+};
+
+struct BusTiming {
+    bool haveLast;
+    unsigned long lastEndUs;
+    uint32_t lastKey;            // timingArbKey() of the previous frame
+    unsigned long clusterStartUs;
+    uint16_t clusterFrames;
+
+    unsigned long frames;
+    unsigned long backToBack;
+    unsigned long gaps[TIMING_GAP_BUCKETS];
+
+    unsigned long clusters;      // Busy periods of 2+ frames
+    uint16_t maxClusterFrames;
+    uint32_t maxClusterUs;
+    TimingCluster recent[TIMING_CLUSTER_KEEP];
+    uint8_t recentHead;
+    uint8_t recentCount;
+
+    unsigned long bucketStartMs;
+    uint32_t bucketBusyUs;
+    uint16_t series[TIMING_SERIES_LEN];   // Permille, oldest at seriesHead - seriesCount
+    uint8_t seriesHead;
+    uint8_t seriesCount;
+};
+
+template <int Ids>
+struct BusTimingStats {
+    IdTiming ids[Ids];
+    BusTiming buses[CAN_BUS_COUNT];
+};
+
+inline unsigned long baudToBitsPerSecond(can_baud_t baud) {
+    switch(baud) {
+        case BAUD_125K: return 125000;
+        case BAUD_250K: return 250000;
+        case BAUD_500K: return 500000;
+        case BAUD_1M:   return 1000000;
+        default:        return 250000;
+    }
+}
+
+// Nominal frame length on the wire including interframe space, without
+// stuff bits. The data phase of a CAN FD frame with BRS is counted in
+// nominal bit times at CAN_FD_DATA_BITRATE.
+inline int canFrameBits(const CanFrame* frame, unsigned long bitrate) {
+    if (!(frame->flags & CAN_FLAG_FD)) {
+        return (frame->extended ? 67 : 47) + 8 * min((int)frame->len, 8);
+    }
+    // Arbitration, CRC delimiter, ACK, EOF and IFS at the nominal rate;
+    // ESI, DLC, data, stuff count and CRC in the data phase.
+    unsigned long nominal = (frame->extended ? 36 : 17) + 13;
+    unsigned long data = 5 + 8 * frame->len + 4 + (frame->len > 16 ? 21 : 17);
+    if (frame->flags & CAN_FLAG_BRS) {
+        data = data * bitrate / CAN_FD_DATA_BITRATE;
+    }
+    return nominal + data;
+}
+
+// Orders frames as arbitration does, lowest wins: the 11-bit base ID
+// first, then a standard frame before an extended one with the same base
+// (IDE is recessive), then the extended ID's low 18 bits.
+inline uint32_t timingArbKey(const CanFrame* frame) {
+    if (!frame->extended) return frame->id << 19;
+    return ((frame->id >> 18) << 19) | (1UL << 18) | (frame->id & 0x3FFFF);
+}
+
+template <int Ids>
+inline void timingClear(BusTimingStats<Ids>* t) {
+    memset(t, 0, sizeof(*t));
+}
+
+// Closes the load buckets that ended by nowMs. After a long quiet spell
+// at most a full series of empty buckets is added.
+inline void timingRoll(BusTiming* b, unsigned long nowMs) {
+    if (b->bucketStartMs == 0) {
+        b->bucketStartMs = nowMs;
+        return;
+    }
+    int rolled = 0;
+    while (nowMs - b->bucketStartMs >= TIMING_BUCKET_MS) {
+        if (rolled++ < TIMING_SERIES_LEN) {
+            b->series[b->seriesHead] = min(b->bucketBusyUs / TIMING_BUCKET_MS, (uint32_t)1000);
+            b->seriesHead = (b->seriesHead + 1) % TIMING_SERIES_LEN;
+            if (b->seriesCount < TIMING_SERIES_LEN) b->seriesCount++;
+        }
+        b->bucketBusyUs = 0;
+        b->bucketStartMs += TIMING_BUCKET_MS;
+    }
+}
+
+// Bus load over the last complete bucket, 0..1.
+inline float timingLoad(const BusTiming* b) {
+    if (b->seriesCount == 0) return 0;
+    return b->series[(b->seriesHead + TIMING_SERIES_LEN - 1) % TIMING_SERIES_LEN] / 1000.0f;
+}
+
+inline void timingEndCluster(BusTiming* b, unsigned long nowMs) {
+    if (b->clusterFrames < 2) return;
+    uint32_t duration = b->lastEndUs - b->clusterStartUs;
+    b->clusters++;
+    if (b->clusterFrames > b->maxClusterFrames) b->maxClusterFrames = b->clusterFrames;
+    if (duration > b->maxClusterUs) b->maxClusterUs = duration;
+    if (b->clusterFrames >= TIMING_CLUSTER_MIN) {
+        TimingCluster* c = &b->recent[b->recentHead];
+        c->ms = nowMs;
+        c->frames = b->clusterFrames;
+        c->durationUs = duration;
+        b->recentHead = (b->recentHead + 1) % TIMING_CLUSTER_KEEP;
+        if (b->recentCount < TIMING_CLUSTER_KEEP) b->recentCount++;
+    }
+}
+
+// Picks up after frames bypassed the stats, as they do during a burst
+// capture: the next frame on each bus and of each ID starts afresh
+// rather than counting the time in between as one idle gap or interval,
+// and the load series skips it.
+template <int Ids>
+inline void timingResume(BusTimingStats<Ids>* t, unsigned long nowMs) {
+    for (int i = 0; i < Ids; i++) t->ids[i].seen = false;
+    for (int i = 0; i < CAN_BUS_COUNT; i++) {
+        BusTiming* b = &t->buses[i];
+        timingEndCluster(b, nowMs);
+        b->clusterFrames = 0;
+        b->haveLast = false;
+        b->bucketStartMs = nowMs;
+        b->bucketBusyUs = 0;
+    }
+}
+
+// Accounts one frame on its bus and to ID slot i (-1 if the ID isn't
+// tracked). isNew is true when the frame just took slot i; bitrate is
+// the bus's nominal rate.
+template <int Ids>
+inline void timingOnFrame(BusTimingStats<Ids>* t, int i, const CanFrame* frame, bool isNew,
+                          unsigned long bitrate, unsigned long nowMs) {
+    BusTiming* b = &t->buses[frame->bus];
+    uint32_t durationUs = (uint64_t)canFrameBits(frame, bitrate) * 1000000 / bitrate;
+#if TIMING_STAMP_AT_SOF
+    unsigned long startUs = frame->timestampUs;
+#else
+    unsigned long startUs = frame->timestampUs - durationUs;
+#endif
+    uint32_t key = timingArbKey(frame);
+
+    timingRoll(b, nowMs);
+    b->bucketBusyUs += durationUs;
+    b->frames++;
+
+    bool backToBack = false;
+    uint32_t delayUs = 0;
+    if (b->haveLast) {
+        long idle = (long)(startUs - b->lastEndUs);
+        uint32_t idleBits = idle > 0 ? (uint64_t)idle * bitrate / 1000000 : 0;
+        size_t g = 0;
+        while (g < TIMING_GAP_BUCKETS - 1 && idleBits > timingGapBoundsBits[g]) g++;
+        b->gaps[g]++;
+
+        if (idleBits <= TIMING_B2B_BITS) {
+            backToBack = true;
+            b->backToBack++;
+            if ((long)(startUs - b->clusterStartUs) > 0) delayUs = startUs - b->clusterStartUs;
+            if (b->clusterFrames < 0xFFFF) b->clusterFrames++;
+        } else {
+            timingEndCluster(b, nowMs);
+            b->clusterStartUs = startUs;
+            b->clusterFrames = 1;
+        }
+    } else {
+        b->clusterStartUs = startUs;
+        b->clusterFrames = 1;
+    }
+    b->haveLast = true;
+    b->lastEndUs = startUs + durationUs;
+
+    if (i >= 0 && i < Ids) {
+        IdTiming* d = &t->ids[i];
+        if (isNew) memset(d, 0, sizeof(*d));
+        if (d->seen) {
+            uint32_t interval = startUs - d->lastUs;
+            if (d->intervals == 0 || interval < d->minIntervalUs) d->minIntervalUs = interval;
+            if (interval > d->maxIntervalUs) d->maxIntervalUs = interval;
+            d->intervals++;
+        }
+        d->seen = true;
+        d->lastUs = startUs;
+        if (backToBack) {
+            d->backToBack++;
+            if (b->lastKey < key) d->lostArb++;
+            if (delayUs > d->maxDelayUs) d->maxDelayUs = delayUs;
+        }
+    }
+    b->lastKey = key;
+}
+
+// Call from loop(): closes load buckets on quiet buses.
+template <int Ids>
+inline void timingService(BusTimingStats<Ids>* t, unsigned long nowMs) {
+    for (int b = 0; b < CAN_BUS_COUNT; b++) timingRoll(&t->buses[b], nowMs);
+}
+
+inline uint32_t timingJitterUs(const IdTiming* d) {
+    return d->intervals > 0 ? d->maxIntervalUs - d->minIntervalUs : 0;
+}
+
+// Highest load in the series, 0..1.
+inline float timingPeakLoad(const BusTiming* b) {
+    uint16_t peak = 0;
+    for (int k = 0; k < b->seriesCount; k++) peak = max(peak, b->series[k]);
+    return peak / 1000.0f;
+}
@@ -0,0 +1,125 @@
+/*
+ * CAN controller backends.
+ *
+ * The capture code talks to the controller through one object,
+ * `canBus`, of type CanBackend. Which class that is gets decided at
+ * compile time by a build flag set per PlatformIO env:
+ *
+ *   CAN_BACKEND_MCP2515    External MCP2515 over SPI (default)
+ *   CAN_BACKEND_MCP2518FD  External MCP2518FD over SPI, receives CAN FD
+ *   CAN_BACKEND_TWAI       ESP32 built-in TWAI controller, needs only a
+ *                          transceiver
+ *   CAN_BACKEND_MOCK       Synthetic ETS-like traffic, no hardware
+ *
+ * Every backend has the same non-virtual interface, so calls are direct
+ * and inline into the receive path:
+ *
+ *   explicit Backend(uint8_t bus);     // Index into canBus[]
+ *   static const char* name();
+ *   int intPin() const;                // Active-low RX interrupt, or -1
+ *   bool begin(can_baud_t baud);       // (Re)initialise in listen-only mode
+ *   bool pending();                    // A frame is waiting to be read
+ *   bool read(CanFrame* frame);        // false = read failed
+ *   uint8_t errorFlags();              // CAN_ERR_* bits, for can_health.h
+ *   void clearOverflow();              // Acknowledge CAN_ERR_RX_OVERFLOW
+ *   bool listening();                  // Still in listen-only mode
+ *
+ * CAN_BUS_COUNT (default 1) sets how many controllers there are, one per
+ * bus, as canBus[0..CAN_BUS_COUNT-1]. The SPI controllers share VSPI and
+ * each has its own CS and INT pin from the tables below.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+typedef enum {
+    BAUD_125K,
+    BAUD_250K,
+    BAUD_500K,
+    BAUD_1M
+} can_baud_t;
+
+#ifndef CAN_BUS_COUNT
+#define CAN_BUS_COUNT 1
+#endif
+#define CAN_MAX_BUSES 4
+#if CAN_BUS_COUNT < 1 || CAN_BUS_COUNT > CAN_MAX_BUSES
+#error "CAN_BUS_COUNT must be 1 to 4"
+#endif
+
+// Initialiser for canBus[]: each backend is constructed with its index.
+#if CAN_BUS_COUNT == 1
+#define CAN_BUS_INDEXES { CanBackend(0) }
+#elif CAN_BUS_COUNT == 2
+#define CAN_BUS_INDEXES { CanBackend(0), CanBackend(1) }
+#elif CAN_BUS_COUNT == 3
+#define CAN_BUS_INDEXES { CanBackend(0), CanBackend(1), CanBackend(2) }
+#else
+#define CAN_BUS_INDEXES { CanBackend(0), CanBackend(1), CanBackend(2), CanBackend(3) }
+#endif
+
+// SPI controller wiring per bus. Bus 0 is the original single-controller
+// wiring; the rest share MOSI/MISO/SCK (GPIO23/19/18).
+static const uint8_t canCsPins[CAN_MAX_BUSES]  = { 5, 17, 26, 33 };
+static const uint8_t canIntPins[CAN_MAX_BUSES] = { 4, 16, 27, 32 };
+
+#define CAN_MAX_DLEN 64
+
+// Frame flags, also written as the FLAGS column of CSV output. Bit 0 is
+// RTR so classic captures read the same as they did before CAN FD.
+#define CAN_FLAG_RTR  0x01
+#define CAN_FLAG_FD   0x02   // CAN FD frame (FDF)
+#define CAN_FLAG_BRS  0x04   // FD data phase sent at the data bit rate
+#define CAN_FLAG_ESI  0x08   // FD transmitter was error-passive
+
+// Data phase bit rate assumed for CAN FD frames with BRS set, used for
+// bus load and by backends that receive FD.
+#define CAN_FD_DATA_BITRATE 2000000
+
+// One received frame, in the controller-independent form used by the
+// capture code. len is the payload length in bytes, not the DLC code.
+struct CanFrame {
+    uint32_t id;
+    bool extended;
+    uint8_t flags;               // CAN_FLAG_*
+    uint8_t len;                 // 0-8, or 0-64 for FD
+    uint8_t data[CAN_MAX_DLEN];
+    uint8_t bus;                 // Controller it came from, index into canBus[]
+    unsigned long timestampUs;   // micros() when the frame was received
+};
+
+// DLC codes 9-15 mean 12-64 bytes in CAN FD and 8 bytes in classic CAN.
+inline uint8_t canDlcToLen(uint8_t dlc, bool fd) {
+    static const uint8_t fdLen[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+    dlc &= 0x0F;
+    return fd ? fdLen[dlc] : (dlc > 8 ? 8 : dlc);
+}
+
+inline uint8_t canLenToDlc(uint8_t len) {
+    if (len <= 8) return len;
+    if (len <= 24) return 8 + (len - 5) / 4;     // 12, 16, 20, 24 -> 9..12
+    if (len <= 32) return 13;
+    if (len <= 48) return 14;
+    return 15;
+}
+
+// Controller error state, reported by errorFlags().
+#define CAN_ERR_RX_OVERFLOW  0x01   // A frame was lost because RX was full
+#define CAN_ERR_RX_PASSIVE   0x02   // Receive error counter >= 128
+#define CAN_ERR_BUS_OFF      0x04
+
+#if defined(CAN_BACKEND_TWAI)
+#include "backend_twai.h"
+typedef TwaiBackend CanBackend;
+#elif defined(CAN_BACKEND_MCP2518FD)
+#include "backend_mcp2518fd.h"
+typedef Mcp2518fdBackend CanBackend;
+#elif defined(CAN_BACKEND_MOCK)
+#include "backend_mock.h"
+typedef MockBackend CanBackend;
+#else
+#define CAN_BACKEND_MCP2515
+#include "backend_mcp2515.h"
+typedef Mcp2515Backend CanBackend;
+#endif
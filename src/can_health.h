@@ -0,0 +1,197 @@
+/*
+ * CAN controller health monitor, shared by the serial and WiFi builds.
+ *
+ * The firmware feeds it the outcome of every read attempt and calls
+ * healthPoll() once per loop(). It watches for the ways an unattended
+ * sniffer silently stops capturing:
+ *
+ *   - INT held low but every read fails (RX flags stuck, SPI glitch)
+ *   - A long run of consecutive read errors
+ *   - An overflow storm: RX overflow reported many times a second
+ *   - Bus-off, or receive error-passive that doesn't clear by itself
+ *   - The controller leaving listen-only mode, which is what a brown-out
+ *     or spurious reset of an MCP2515 looks like (it comes back in
+ *     configuration mode and never raises INT again)
+ *
+ * When healthPoll() returns a fault the caller re-runs initCAN() with its
+ * current configuration, then reports the result with healthRecovered()
+ * or healthRecoveryFailed(). Failed recoveries back off up to
+ * HEALTH_RETRY_MAX_MS so a missing board doesn't spin on SPI.
+ *
+ * Controller state comes from the backend's errorFlags() and listening()
+ * (see can_backend.h), so the same checks cover every backend.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#define HEALTH_CHECK_INTERVAL_MS  100     // errorFlags() poll
+#define HEALTH_MODE_INTERVAL_MS   1000    // listening() poll
+#define HEALTH_STUCK_INT_MS       500     // INT low with no good read
+#define HEALTH_MAX_READ_ERRORS    100     // Consecutive failed reads
+#define HEALTH_STORM_OVERFLOWS    20      // Overflow polls per storm window
+#define HEALTH_STORM_WINDOW_MS    1000
+#define HEALTH_PASSIVE_MS         5000    // Error-passive this long = stuck
+#define HEALTH_RETRY_MIN_MS       1000
+#define HEALTH_RETRY_MAX_MS       30000
+
+typedef enum {
+    FAULT_NONE,
+    FAULT_STUCK_INT,
+    FAULT_READ_ERRORS,
+    FAULT_OVERFLOW_STORM,
+    FAULT_BUS_OFF,
+    FAULT_ERROR_PASSIVE,
+    FAULT_CONTROLLER_RESET
+} can_fault_t;
+
+struct CanHealth {
+    unsigned long lastCheck;
+    unsigned long lastModeCheck;
+    unsigned long intStuckSince;       // First failed read while INT low, 0 = none
+    unsigned long consecutiveErrors;
+    unsigned long stormWindowStart;
+    unsigned long stormOverflows;
+    unsigned long passiveSince;        // 0 = not error-passive
+    unsigned long faultSince;          // When capture was last known good, 0 = healthy
+    unsigned long nextRetry;           // Backoff after a failed recovery
+    unsigned long retryInterval;
+
+    // Lifetime counters, reported in status
+    unsigned long overflows;
+    unsigned long recoveries;
+    unsigned long failedRecoveries;
+    unsigned long downtimeMs;
+    can_fault_t lastFault;
+};
+
+inline const char* faultToString(can_fault_t fault) {
+    switch(fault) {
+        case FAULT_NONE:             return "none";
+        case FAULT_STUCK_INT:        return "stuck-int";
+        case FAULT_READ_ERRORS:      return "read-errors";
+        case FAULT_OVERFLOW_STORM:   return "overflow-storm";
+        case FAULT_BUS_OFF:          return "bus-off";
+        case FAULT_ERROR_PASSIVE:    return "error-passive";
+        case FAULT_CONTROLLER_RESET: return "controller-reset";
+        default:                     return "unknown";
+    }
+}
+
+inline void healthInit(CanHealth* h) {
+    memset(h, 0, sizeof(*h));
+    h->retryInterval = HEALTH_RETRY_MIN_MS;
+}
+
+// Clears the per-episode detectors after the controller has been
+// (re)initialised. Lifetime counters are kept.
+inline void healthReset(CanHealth* h, unsigned long now) {
+    h->lastCheck = now;
+    h->lastModeCheck = now;
+    h->intStuckSince = 0;
+    h->consecutiveErrors = 0;
+    h->stormWindowStart = now;
+    h->stormOverflows = 0;
+    h->passiveSince = 0;
+}
+
+inline void healthOnFrame(CanHealth* h) {
+    h->intStuckSince = 0;
+    h->consecutiveErrors = 0;
+}
+
+// A read was attempted because INT was low, and it failed.
+inline void healthOnReadError(CanHealth* h, unsigned long now) {
+    if (h->intStuckSince == 0) h->intStuckSince = now;
+    h->consecutiveErrors++;
+}
+
+// Returns the fault that needs recovery now, or FAULT_NONE. Cheap when
+// nothing is due: only compares timestamps between register polls.
+template <class Bus>
+inline can_fault_t healthPoll(CanHealth* h, Bus& bus, unsigned long now) {
+    if (h->faultSince != 0) {
+        // Waiting to retry a failed recovery.
+        return (long)(now - h->nextRetry) >= 0 ? h->lastFault : FAULT_NONE;
+    }
+
+    can_fault_t fault = FAULT_NONE;
+    unsigned long goodUntil = now;
+
+    if (h->intStuckSince != 0 && now - h->intStuckSince > HEALTH_STUCK_INT_MS) {
+        fault = FAULT_STUCK_INT;
+        goodUntil = h->intStuckSince;
+    } else if (h->consecutiveErrors >= HEALTH_MAX_READ_ERRORS) {
+        fault = FAULT_READ_ERRORS;
+    }
+
+    if (fault == FAULT_NONE && now - h->lastCheck >= HEALTH_CHECK_INTERVAL_MS) {
+        h->lastCheck = now;
+        uint8_t flags = bus.errorFlags();
+
+        if (flags & CAN_ERR_RX_OVERFLOW) {
+            h->overflows++;
+            h->stormOverflows++;
+            bus.clearOverflow();
+        }
+        if (now - h->stormWindowStart >= HEALTH_STORM_WINDOW_MS) {
+            h->stormWindowStart = now;
+            h->stormOverflows = 0;
+        }
+
+        if (flags & CAN_ERR_RX_PASSIVE) {
+            if (h->passiveSince == 0) h->passiveSince = now;
+        } else {
+            h->passiveSince = 0;
+        }
+
+        if (flags & CAN_ERR_BUS_OFF) {
+            fault = FAULT_BUS_OFF;
+        } else if (h->stormOverflows >= HEALTH_STORM_OVERFLOWS) {
+            fault = FAULT_OVERFLOW_STORM;
+            goodUntil = h->stormWindowStart;
+        } else if (h->passiveSince != 0 && now - h->passiveSince > HEALTH_PASSIVE_MS) {
+            fault = FAULT_ERROR_PASSIVE;
+            goodUntil = h->passiveSince;
+        }
+    }
+
+    if (fault == FAULT_NONE && now - h->lastModeCheck >= HEALTH_MODE_INTERVAL_MS) {
+        h->lastModeCheck = now;
+        if (!bus.listening()) {
+            fault = FAULT_CONTROLLER_RESET;
+            goodUntil = now - HEALTH_MODE_INTERVAL_MS;
+        }
+    }
+
+    if (fault != FAULT_NONE) {
+        h->faultSince = goodUntil;
+        h->lastFault = fault;
+    }
+    return fault;
+}
+
+// initCAN() succeeded. Returns how long capture was down.
+inline unsigned long healthRecovered(CanHealth* h, unsigned long now) {
+    unsigned long down = now - h->faultSince;
+    h->downtimeMs += down;
+    h->recoveries++;
+    h->faultSince = 0;
+    h->retryInterval = HEALTH_RETRY_MIN_MS;
+    healthReset(h, now);
+    return down;
+}
+
+// initCAN() failed; try again after an increasing delay.
+inline void healthRecoveryFailed(CanHealth* h, unsigned long now) {
+    h->failedRecoveries++;
+    h->nextRetry = now + h->retryInterval;
+    h->retryInterval = min(h->retryInterval * 2, (unsigned long)HEALTH_RETRY_MAX_MS);
+}
+
+// Downtime including an outage still in progress.
+inline unsigned long healthDowntime(const CanHealth* h, unsigned long now) {
+    return h->downtimeMs + (h->faultSince != 0 ? now - h->faultSince : 0);
+}
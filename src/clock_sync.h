@@ -0,0 +1,128 @@
+/*
+ * Per-client clock offset estimation, for web UI marks.
+ *
+ * A mark stamped when /mark is handled lands after the WiFi round trip
+ * and any loop() backlog. Instead the browser stamps it with its own
+ * performance.now(), and each client's clock is mapped onto the device's
+ * by NTP-style ping exchanges:
+ *
+ *   /ping?c=ID&t=T0[&p=T0'&r=T3']
+ *
+ * The device answers with its time D, taken when the ping is handled.
+ * The client's next ping reports the previous one's send time T0' and
+ * reply arrival T3', which pair with the D' kept for it to give one
+ * sample:
+ *
+ *   rtt     T3' - T0'
+ *   offset  D' - (T0' + T3') / 2    (device minus client time)
+ *
+ * The offset is exact if the request and reply legs took equally long,
+ * and off by at most rtt / 2 otherwise. Of the last CLOCK_SAMPLES
+ * samples the one with the shortest round trip is used: it had the
+ * least queueing, so the tightest bound. A client mark at time T is then
+ * placed at T + offset with an uncertainty of that rtt / 2. Keeping only
+ * recent samples also follows the drift between the two clocks.
+ *
+ * All times here are microseconds. Device time is esp_timer_get_time(),
+ * the clock millis() and micros() are read from. Up to CLOCK_MAX_CLIENTS
+ * clients are tracked; a new one takes the slot least recently heard
+ * from.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#define CLOCK_MAX_CLIENTS   4
+#define CLOCK_SAMPLES       8
+#define CLOCK_MAX_RTT_US    5000000   // Slower exchanges are discarded
+
+struct ClockSample {
+    int64_t offsetUs;
+    uint32_t rttUs;
+};
+
+struct ClockClient {
+    uint32_t id;                 // Chosen by the client, 0 = free slot
+    unsigned long lastSeenMs;
+    bool pending;                // A ping is awaiting its reported reply time
+    int64_t pendingT0Us;
+    int64_t pendingDeviceUs;
+    ClockSample samples[CLOCK_SAMPLES];
+    uint8_t sampleHead;
+    uint8_t sampleCount;
+    int best;                    // Index of the shortest round trip, -1 = none
+    uint32_t pings;
+};
+
+struct ClockSync {
+    ClockClient clients[CLOCK_MAX_CLIENTS];
+};
+
+// Returns client id's slot, taking the least recently seen one for a new
+// client.
+inline ClockClient* clockClient(ClockSync* s, uint32_t id, unsigned long nowMs) {
+    ClockClient* oldest = &s->clients[0];
+    for (int i = 0; i < CLOCK_MAX_CLIENTS; i++) {
+        ClockClient* c = &s->clients[i];
+        if (c->id == id) {
+            c->lastSeenMs = nowMs;
+            return c;
+        }
+        if (c->id == 0 || (oldest->id != 0 && nowMs - c->lastSeenMs > nowMs - oldest->lastSeenMs)) oldest = c;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->id = id;
+    oldest->lastSeenMs = nowMs;
+    oldest->best = -1;
+    return oldest;
+}
+
+inline void clockAddSample(ClockClient* c, int64_t offsetUs, uint32_t rttUs) {
+    c->samples[c->sampleHead].offsetUs = offsetUs;
+    c->samples[c->sampleHead].rttUs = rttUs;
+    c->sampleHead = (c->sampleHead + 1) % CLOCK_SAMPLES;
+    if (c->sampleCount < CLOCK_SAMPLES) c->sampleCount++;
+
+    c->best = 0;
+    for (int k = 1; k < c->sampleCount; k++) {
+        if (c->samples[k].rttUs < c->samples[c->best].rttUs) c->best = k;
+    }
+}
+
+// Handles one ping sent at client time t0Us, seen at deviceUs. hasPrev
+// is set when the ping reports the previous exchange (prevT0Us, prevT3Us);
+// a report that doesn't match the ping on record is ignored.
+inline void clockPing(ClockClient* c, int64_t t0Us, bool hasPrev, int64_t prevT0Us,
+                      int64_t prevT3Us, int64_t deviceUs) {
+    if (hasPrev && c->pending && prevT0Us == c->pendingT0Us) {
+        int64_t rtt = prevT3Us - prevT0Us;
+        if (rtt >= 0 && rtt <= CLOCK_MAX_RTT_US) {
+            clockAddSample(c, c->pendingDeviceUs - (prevT0Us + prevT3Us) / 2, (uint32_t)rtt);
+        }
+    }
+    c->pending = true;
+    c->pendingT0Us = t0Us;
+    c->pendingDeviceUs = deviceUs;
+    c->pings++;
+}
+
+inline bool clockSynced(const ClockClient* c) {
+    return c->best >= 0;
+}
+
+// Maps client time clientUs to device time, with an uncertainty of half
+// the best sample's round trip. Returns false before the first sample.
+inline bool clockToDevice(const ClockClient* c, int64_t clientUs, int64_t* deviceUs, uint32_t* errUs) {
+    if (!clockSynced(c)) return false;
+    *deviceUs = clientUs + c->samples[c->best].offsetUs;
+    *errUs = c->samples[c->best].rttUs / 2;
+    return true;
+}
+
+// Parses a client timestamp in milliseconds with a fraction, as sent
+// from performance.now(), to microseconds.
+inline int64_t clockParseMs(const char* text) {
+    return (int64_t)(strtod(text, NULL) * 1000.0);
+}
@@ -0,0 +1,336 @@
+/*
+ * Streaming deflate compressor, shared by the serial and WiFi builds.
+ *
+ * CAN logs are the same few IDs over and over, so even a small LZ77
+ * window finds most of each record in the ones before it. This is an
+ * LZ77 matcher of the heatshrink class -- a DEFLATE_WINDOW byte history
+ * searched DEFLATE_CHAIN candidates deep -- whose output is coded as
+ * deflate fixed-Huffman blocks (RFC 1951). On two minutes of the mock's
+ * traffic as /csv (test/test_deflate) that gives about 3.5:1 where zlib
+ * -6 with its 32 KB window and dynamic tables gets 6.8:1, but it needs
+ * no second pass and no tables in RAM, and the result is standard
+ * deflate: browsers take it as Content-Encoding: gzip and Python's zlib
+ * and gzip modules read it.
+ *
+ * Output goes to a sink callback DEFLATE_OUT_SIZE bytes at a time, so a
+ * stream can feed an HTTP chunked response or a flash sector. The whole
+ * state is one struct of about 8.5 KB and nothing is allocated.
+ *
+ * inflateFixed() is the matching decoder, for reading back what this
+ * encoder wrote (flight recorder sectors). It only takes stored and
+ * fixed-Huffman blocks.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_rom_crc.h>
+
+#define DEFLATE_WINDOW     1024        // History searched for matches, power of two
+#define DEFLATE_HASH_BITS  10
+#define DEFLATE_CHAIN      8           // Candidates tried per position
+#define DEFLATE_MIN_MATCH  3
+#define DEFLATE_MAX_MATCH  258
+#define DEFLATE_OUT_SIZE   512
+
+// Worst case bytes out for n bytes in: 9 bits per literal plus block
+// framing, not counting the gzip header and trailer.
+#define DEFLATE_BOUND(n)   ((n) + (n) / 8 + 8)
+#define DEFLATE_GZIP_OVERHEAD 18
+
+typedef void (*deflate_sink_t)(void* ctx, const uint8_t* data, size_t len);
+
+struct DeflateStream {
+    uint8_t buf[2 * DEFLATE_WINDOW];      // History, then input not yet coded
+    uint16_t head[1 << DEFLATE_HASH_BITS]; // Last position + 1 per hash, 0 = none
+    uint16_t prev[2 * DEFLATE_WINDOW];    // Position + 1 before this one with its hash
+    uint16_t fill;
+    uint16_t pos;                         // Next byte of buf to code
+
+    uint32_t bits;
+    int bitCount;
+    uint8_t out[DEFLATE_OUT_SIZE];
+    uint16_t outUsed;
+    deflate_sink_t sink;
+    void* ctx;
+
+    bool gzip;
+    uint32_t crc;
+    uint32_t inBytes;
+    uint32_t outBytes;
+};
+
+static const uint16_t DEFLATE_LEN_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t DEFLATE_LEN_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DEFLATE_DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DEFLATE_DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// ============== ENCODER ==============
+
+inline void deflateSinkOut(DeflateStream* d) {
+    if (d->outUsed == 0) return;
+    d->sink(d->ctx, d->out, d->outUsed);
+    d->outBytes += d->outUsed;
+    d->outUsed = 0;
+}
+
+inline void deflateByte(DeflateStream* d, uint8_t b) {
+    if (d->outUsed == DEFLATE_OUT_SIZE) deflateSinkOut(d);
+    d->out[d->outUsed++] = b;
+}
+
+// Appends n bits of value, least significant first.
+inline void deflateBits(DeflateStream* d, uint32_t value, int n) {
+    d->bits |= value << d->bitCount;
+    d->bitCount += n;
+    while (d->bitCount >= 8) {
+        deflateByte(d, d->bits & 0xFF);
+        d->bits >>= 8;
+        d->bitCount -= 8;
+    }
+}
+
+// Huffman codes go most significant bit first.
+inline void deflateCode(DeflateStream* d, uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    deflateBits(d, reversed, n);
+}
+
+// Literal/length symbol in the fixed code (RFC 1951 3.2.6).
+inline void deflateSymbol(DeflateStream* d, int sym) {
+    if (sym < 144) deflateCode(d, 0x30 + sym, 8);
+    else if (sym < 256) deflateCode(d, 0x190 + sym - 144, 9);
+    else if (sym < 280) deflateCode(d, sym - 256, 7);
+    else deflateCode(d, 0xC0 + sym - 280, 8);
+}
+
+inline void deflateMatch(DeflateStream* d, int len, int dist) {
+    int l = 28;
+    while (DEFLATE_LEN_BASE[l] > len) l--;
+    deflateSymbol(d, 257 + l);
+    deflateBits(d, len - DEFLATE_LEN_BASE[l], DEFLATE_LEN_EXTRA[l]);
+    int c = 29;
+    while (DEFLATE_DIST_BASE[c] > dist) c--;
+    deflateCode(d, c, 5);
+    deflateBits(d, dist - DEFLATE_DIST_BASE[c], DEFLATE_DIST_EXTRA[c]);
+}
+
+inline uint32_t deflateHash(const uint8_t* p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Codes buffered input, all of it at the end of the stream, otherwise
+// only while a longest match still fits in what's buffered.
+inline void deflateCompress(DeflateStream* d, bool all) {
+    int limit = all ? d->fill : d->fill - DEFLATE_MAX_MATCH;
+    while (d->pos < limit) {
+        int avail = d->fill - d->pos;
+        int len = 0, dist = 0;
+        if (avail >= DEFLATE_MIN_MATCH) {
+            uint32_t h = deflateHash(d->buf + d->pos);
+            int cand = d->head[h] - 1;
+            d->prev[d->pos] = d->head[h];
+            d->head[h] = d->pos + 1;
+            int max = avail < DEFLATE_MAX_MATCH ? avail : DEFLATE_MAX_MATCH;
+            for (int depth = 0; cand >= 0 && depth < DEFLATE_CHAIN; depth++) {
+                int l = 0;
+                while (l < max && d->buf[cand + l] == d->buf[d->pos + l]) l++;
+                if (l > len) {
+                    len = l;
+                    dist = d->pos - cand;
+                    if (l == max) break;
+                }
+                cand = d->prev[cand] - 1;
+            }
+        }
+        if (len >= DEFLATE_MIN_MATCH) {
+            deflateMatch(d, len, dist);
+            for (int i = 1; i < len && d->pos + i + DEFLATE_MIN_MATCH <= d->fill; i++) {
+                uint32_t hi = deflateHash(d->buf + d->pos + i);
+                d->prev[d->pos + i] = d->head[hi];
+                d->head[hi] = d->pos + i + 1;
+            }
+            d->pos += len;
+        } else {
+            deflateSymbol(d, d->buf[d->pos]);
+            d->pos++;
+        }
+    }
+}
+
+// Starts a stream, raw deflate or with the gzip header and trailer.
+inline void deflateBegin(DeflateStream* d, bool gzip, deflate_sink_t sink, void* ctx) {
+    memset(d->head, 0, sizeof(d->head));
+    d->fill = 0;
+    d->pos = 0;
+    d->bits = 0;
+    d->bitCount = 0;
+    d->outUsed = 0;
+    d->sink = sink;
+    d->ctx = ctx;
+    d->gzip = gzip;
+    d->crc = 0;
+    d->inBytes = 0;
+    d->outBytes = 0;
+    if (gzip) {
+        static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+        for (int i = 0; i < 10; i++) deflateByte(d, header[i]);
+    }
+    deflateBits(d, 0, 1);      // Not the final block
+    deflateBits(d, 1, 2);      // Fixed Huffman
+}
+
+inline void deflateWrite(DeflateStream* d, const uint8_t* data, size_t len) {
+    if (d->gzip) d->crc = esp_rom_crc32_le(d->crc, data, len);
+    d->inBytes += len;
+    while (len > 0) {
+        if (d->fill == sizeof(d->buf)) {
+            deflateCompress(d, false);
+            // pos is past DEFLATE_WINDOW now, so the first half is only
+            // history older than any match can reach.
+            memmove(d->buf, d->buf + DEFLATE_WINDOW, DEFLATE_WINDOW);
+            d->fill -= DEFLATE_WINDOW;
+            d->pos -= DEFLATE_WINDOW;
+            for (int h = 0; h < (1 << DEFLATE_HASH_BITS); h++) {
+                d->head[h] = d->head[h] > DEFLATE_WINDOW ? d->head[h] - DEFLATE_WINDOW : 0;
+            }
+            for (int i = 0; i < DEFLATE_WINDOW; i++) {
+                uint16_t p = d->prev[i + DEFLATE_WINDOW];
+                d->prev[i] = p > DEFLATE_WINDOW ? p - DEFLATE_WINDOW : 0;
+            }
+        }
+        size_t n = sizeof(d->buf) - d->fill;
+        if (n > len) n = len;
+        memcpy(d->buf + d->fill, data, n);
+        d->fill += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Codes what's left, ends the stream and hands everything to the sink.
+// Returns the stream's compressed size.
+inline uint32_t deflateEnd(DeflateStream* d) {
+    deflateCompress(d, true);
+    deflateSymbol(d, 256);     // End of block
+    deflateBits(d, 1, 1);      // An empty final block
+    deflateBits(d, 1, 2);
+    deflateSymbol(d, 256);
+    if (d->bitCount > 0) deflateBits(d, 0, 8 - d->bitCount);
+    if (d->gzip) {
+        for (int i = 0; i < 4; i++) deflateByte(d, d->crc >> (8 * i));
+        for (int i = 0; i < 4; i++) deflateByte(d, d->inBytes >> (8 * i));
+    }
+    deflateSinkOut(d);
+    return d->outBytes;
+}
+
+// ============== DECODER ==============
+
+struct InflateBits {
+    const uint8_t* in;
+    size_t len;
+    size_t pos;
+    uint32_t bits;
+    int bitCount;
+};
+
+// Next n bits, least significant first; -1 past the end of the input.
+inline int inflateGetBits(InflateBits* b, int n) {
+    while (b->bitCount < n) {
+        if (b->pos >= b->len) return -1;
+        b->bits |= (uint32_t)b->in[b->pos++] << b->bitCount;
+        b->bitCount += 8;
+    }
+    int v = b->bits & ((1u << n) - 1);
+    b->bits >>= n;
+    b->bitCount -= n;
+    return v;
+}
+
+// Huffman code bits, most significant first, appended to code.
+inline int inflateGetCode(InflateBits* b, int code, int n) {
+    for (int i = 0; i < n; i++) {
+        int bit = inflateGetBits(b, 1);
+        if (bit < 0) return -1;
+        code = (code << 1) | bit;
+    }
+    return code;
+}
+
+// Next literal/length symbol of the fixed code.
+inline int inflateSymbol(InflateBits* b) {
+    int code = inflateGetCode(b, 0, 7);
+    if (code < 0) return -1;
+    if (code <= 0x17) return 256 + code;
+    code = inflateGetCode(b, code, 1);
+    if (code < 0) return -1;
+    if (code >= 0x30 && code <= 0xBF) return code - 0x30;
+    if (code >= 0xC0 && code <= 0xC7) return 280 + code - 0xC0;
+    code = inflateGetCode(b, code, 1);
+    if (code < 0) return -1;
+    return code >= 0x190 ? 144 + code - 0x190 : -1;
+}
+
+// Decodes a raw deflate stream of stored and fixed-Huffman blocks into
+// out. Returns the decoded length, or -1 if the stream is corrupt, uses
+// dynamic Huffman blocks or doesn't fit in outSize.
+inline int inflateFixed(const uint8_t* in, size_t inLen, uint8_t* out, size_t outSize) {
+    InflateBits b = { in, inLen, 0, 0, 0 };
+    size_t used = 0;
+    int final;
+    do {
+        final = inflateGetBits(&b, 1);
+        int type = inflateGetBits(&b, 2);
+        if (final < 0 || type < 0) return -1;
+        if (type == 0) {
+            b.bits = 0;        // Stored: skip to the byte boundary
+            b.bitCount = 0;
+            if (b.pos + 4 > b.len) return -1;
+            size_t n = b.in[b.pos] | (b.in[b.pos + 1] << 8);
+            b.pos += 4;
+            if (b.pos + n > b.len || used + n > outSize) return -1;
+            memcpy(out + used, b.in + b.pos, n);
+            b.pos += n;
+            used += n;
+            continue;
+        }
+        if (type != 1) return -1;
+        for (;;) {
+            int sym = inflateSymbol(&b);
+            if (sym < 0 || sym > 285) return -1;
+            if (sym < 256) {
+                if (used == outSize) return -1;
+                out[used++] = sym;
+                continue;
+            }
+            if (sym == 256) break;
+            int l = sym - 257;
+            int extra = inflateGetBits(&b, DEFLATE_LEN_EXTRA[l]);
+            int c = inflateGetCode(&b, 0, 5);
+            if (extra < 0 || c < 0 || c > 29) return -1;
+            size_t len = DEFLATE_LEN_BASE[l] + extra;
+            extra = inflateGetBits(&b, DEFLATE_DIST_EXTRA[c]);
+            if (extra < 0) return -1;
+            size_t dist = DEFLATE_DIST_BASE[c] + extra;
+            if (dist > used || used + len > outSize) return -1;
+            for (size_t i = 0; i < len; i++, used++) out[used] = out[used - dist];
+        }
+    } while (!final);
+    return used;
+}
@@ -0,0 +1,292 @@
+/*
+ * CAN-aware delta coding of captures, for the WiFi build's log ring and
+ * for .cdl capture files (can_merge.py reads and writes them).
+ *
+ * A CAN log is the same few IDs over and over, each at its own period
+ * and mostly repeating its previous payload. Each record is coded
+ * against the last one of its ID instead of as a whole frame:
+ *   - the ID as an index into a dictionary the block builds as it goes
+ *   - the time as the difference from when the ID was expected, its
+ *     last time plus its last interval
+ *   - a bitmap of the payload bytes that changed, one bit per byte,
+ *     followed by only those bytes XORed with their previous values
+ * A periodic frame with one changing byte takes about 4 bytes, against
+ * 19 for a classic frame in a burst_capture.h record.
+ *
+ * Records are grouped into blocks, each with a DeltaBlockHeader, and a
+ * block's dictionary starts empty, so every block decodes on its own and
+ * a ring of blocks can drop its oldest whole.
+ *
+ * Numbers are LEB128 varints, signed ones zigzag coded. Each record
+ * starts with a tag, (n << 2) | kind:
+ *   DELTA_FRAME    ID n, same flags and length as its last frame:
+ *                    time, bitmap, changed bytes
+ *   DELTA_RESHAPE  ID n, new flags or length:
+ *                    flags byte, length byte, time, bitmap, changed bytes
+ *   DELTA_NEW_ID   ID n is added to the dictionary, n being its size:
+ *                    CAN ID, meta byte (bit 0 extended, bits 1-7 bus),
+ *                    flags byte, length byte, time, payload
+ *   DELTA_TEXT     a mark or event of caller-defined type n:
+ *                    time, length byte, text
+ * Times of new IDs and text are from the block's previous record. Bytes
+ * past an ID's payload length count as zero, so a longer payload codes
+ * its new bytes as changed.
+ *
+ * Time units are the caller's; the log ring codes ms since startTime.
+ * The arithmetic here is 32-bit, so times wrap as unsigned long does.
+ *
+ * A .cdl file is the magic "CDL1", a uint32 of microseconds per time
+ * unit, then blocks, each its DeltaBlockHeader (little-endian, as laid
+ * out below) followed by its used bytes of records. /csv?delta=1 writes
+ * the log ring's blocks as they are. Files from can_merge.py are in us,
+ * with 64-bit times and bigger dictionaries than DELTA_MAX_IDS, and
+ * their typed rows are text of type 3, "KIND,text".
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#define DELTA_MAX_IDS     64      // Dictionary size; a block ends when it's full
+#define DELTA_MAX_TEXT    80
+#define DELTA_MAX_RECORD  96      // Most bytes one record codes to
+#define DELTA_FILE_MAGIC  "CDL1"
+
+typedef enum {
+    DELTA_FRAME,
+    DELTA_RESHAPE,
+    DELTA_NEW_ID,
+    DELTA_TEXT
+} delta_kind_t;
+
+struct DeltaBlockHeader {
+    uint32_t firstSeq;          // Sequence number of the first record
+    uint16_t count;             // Records in the block
+    uint16_t used;              // Bytes of records after the header
+    int64_t baseTime;           // What the first record's time is coded from
+};
+
+struct DeltaId {
+    uint32_t id;
+    uint8_t meta;               // Bit 0 extended, bits 1-7 bus
+    uint8_t flags;              // CAN_FLAG_*
+    uint8_t len;
+    uint32_t lastTime;
+    uint32_t period;            // Last interval, 0 after the first frame
+    uint8_t data[CAN_MAX_DLEN]; // Zero past len
+};
+
+// Dictionary and times of the block being coded, the same on both sides.
+struct DeltaState {
+    DeltaId ids[DELTA_MAX_IDS];
+    int idCount;
+    uint32_t lastTime;          // Of the block's previous record
+};
+
+// One decoded record. type is 0 for frames, else the text record's type.
+struct DeltaRecord {
+    uint8_t type;
+    uint32_t time;
+    uint32_t id;
+    bool extended;
+    uint8_t bus;
+    uint8_t flags;
+    uint8_t len;
+    uint8_t data[CAN_MAX_DLEN];
+    const char* text;           // Into the block, not terminated
+    uint8_t textLen;
+};
+
+inline int deltaPutVarint(uint8_t* out, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+inline bool deltaGetVarint(const uint8_t* in, int len, int* pos, uint32_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 35 && *pos < len; shift += 7) {
+        uint8_t b = in[(*pos)++];
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+inline uint32_t deltaZigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t deltaUnzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Starts a block: an empty dictionary, times coded from time.
+inline void deltaBlockBegin(DeltaState* s, DeltaBlockHeader* h, uint32_t firstSeq, uint32_t time) {
+    s->idCount = 0;
+    s->lastTime = time;
+    h->firstSeq = firstSeq;
+    h->count = 0;
+    h->used = 0;
+    h->baseTime = time;
+}
+
+// Starts decoding a block.
+inline void deltaDecodeBegin(DeltaState* s, const DeltaBlockHeader* h) {
+    s->idCount = 0;
+    s->lastTime = h->baseTime;
+}
+
+// Codes a frame into out, which must have DELTA_MAX_RECORD bytes free.
+// Returns the bytes written, or -1 if the frame's ID is new and the
+// dictionary is full; the caller then starts a new block.
+inline int deltaEncodeFrame(DeltaState* s, uint32_t time, const CanFrame* frame, uint8_t* out) {
+    uint8_t meta = (frame->extended ? 1 : 0) | (frame->bus << 1);
+    int i = 0;
+    while (i < s->idCount && (s->ids[i].id != frame->id || s->ids[i].meta != meta)) i++;
+
+    int n;
+    if (i == s->idCount) {
+        if (i >= DELTA_MAX_IDS) return -1;
+        DeltaId* d = &s->ids[s->idCount++];
+        d->id = frame->id;
+        d->meta = meta;
+        d->flags = frame->flags;
+        d->len = frame->len;
+        d->lastTime = time;
+        d->period = 0;
+        memset(d->data, 0, sizeof(d->data));
+        memcpy(d->data, frame->data, frame->len);
+
+        n = deltaPutVarint(out, (uint32_t)i << 2 | DELTA_NEW_ID);
+        n += deltaPutVarint(out + n, frame->id);
+        out[n++] = meta;
+        out[n++] = frame->flags;
+        out[n++] = frame->len;
+        n += deltaPutVarint(out + n, deltaZigzag((int32_t)(time - s->lastTime)));
+        memcpy(out + n, frame->data, frame->len);
+        s->lastTime = time;
+        return n + frame->len;
+    }
+
+    DeltaId* d = &s->ids[i];
+    if (d->flags == frame->flags && d->len == frame->len) {
+        n = deltaPutVarint(out, (uint32_t)i << 2 | DELTA_FRAME);
+    } else {
+        n = deltaPutVarint(out, (uint32_t)i << 2 | DELTA_RESHAPE);
+        out[n++] = frame->flags;
+        out[n++] = frame->len;
+        if (frame->len < d->len) memset(d->data + frame->len, 0, d->len - frame->len);
+        d->flags = frame->flags;
+        d->len = frame->len;
+    }
+    n += deltaPutVarint(out + n, deltaZigzag((int32_t)(time - (d->lastTime + d->period))));
+
+    uint8_t* bitmap = out + n;
+    int bitmapLen = (frame->len + 7) / 8;
+    memset(bitmap, 0, bitmapLen);
+    n += bitmapLen;
+    for (int j = 0; j < frame->len; j++) {
+        uint8_t x = frame->data[j] ^ d->data[j];
+        if (x == 0) continue;
+        bitmap[j >> 3] |= 1 << (j & 7);
+        out[n++] = x;
+        d->data[j] = frame->data[j];
+    }
+    d->period = time - d->lastTime;
+    d->lastTime = time;
+    s->lastTime = time;
+    return n;
+}
+
+// Codes a mark or event of the caller's type (1-63) into out, its len
+// bytes of text cut to DELTA_MAX_TEXT. Returns the bytes written, at most
+// DELTA_MAX_RECORD.
+inline int deltaEncodeText(DeltaState* s, uint32_t time, uint8_t type, const char* text, int len, uint8_t* out) {
+    len = min(len, DELTA_MAX_TEXT);
+    int n = deltaPutVarint(out, (uint32_t)type << 2 | DELTA_TEXT);
+    n += deltaPutVarint(out + n, deltaZigzag((int32_t)(time - s->lastTime)));
+    out[n++] = len;
+    memcpy(out + n, text, len);
+    s->lastTime = time;
+    return n + len;
+}
+
+// Decodes the record at *pos of a block's len bytes and advances *pos.
+// Returns false at the end of the block or on a malformed record.
+inline bool deltaDecode(DeltaState* s, const uint8_t* in, int len, int* pos, DeltaRecord* r) {
+    uint32_t tag, v;
+    if (*pos >= len || !deltaGetVarint(in, len, pos, &tag)) return false;
+    uint32_t n = tag >> 2;
+    uint8_t kind = tag & 3;
+
+    if (kind == DELTA_TEXT) {
+        if (!deltaGetVarint(in, len, pos, &v) || *pos >= len) return false;
+        r->type = n;
+        r->time = s->lastTime + deltaUnzigzag(v);
+        r->textLen = in[(*pos)++];
+        if (*pos + r->textLen > len) return false;
+        r->text = (const char*)in + *pos;
+        *pos += r->textLen;
+        s->lastTime = r->time;
+        return true;
+    }
+
+    DeltaId* d;
+    if (kind == DELTA_NEW_ID) {
+        if (n != (uint32_t)s->idCount || n >= DELTA_MAX_IDS) return false;
+        d = &s->ids[s->idCount];
+        if (!deltaGetVarint(in, len, pos, &d->id) || *pos + 3 > len) return false;
+        d->meta = in[(*pos)++];
+        d->flags = in[(*pos)++];
+        d->len = in[(*pos)++];
+        if (d->len > CAN_MAX_DLEN || !deltaGetVarint(in, len, pos, &v) || *pos + d->len > len) return false;
+        d->lastTime = s->lastTime + deltaUnzigzag(v);
+        d->period = 0;
+        memset(d->data, 0, sizeof(d->data));
+        memcpy(d->data, in + *pos, d->len);
+        *pos += d->len;
+        s->idCount++;
+    } else {
+        if (n >= (uint32_t)s->idCount) return false;
+        d = &s->ids[n];
+        if (kind == DELTA_RESHAPE) {
+            if (*pos + 2 > len || in[*pos + 1] > CAN_MAX_DLEN) return false;
+            uint8_t newLen = in[*pos + 1];
+            d->flags = in[*pos];
+            *pos += 2;
+            if (newLen < d->len) memset(d->data + newLen, 0, d->len - newLen);
+            d->len = newLen;
+        }
+        if (!deltaGetVarint(in, len, pos, &v)) return false;
+        uint32_t time = d->lastTime + d->period + deltaUnzigzag(v);
+
+        const uint8_t* bitmap = in + *pos;
+        int bitmapLen = (d->len + 7) / 8;
+        if (*pos + bitmapLen > len) return false;
+        *pos += bitmapLen;
+        for (int j = 0; j < d->len; j++) {
+            if (!(bitmap[j >> 3] & (1 << (j & 7)))) continue;
+            if (*pos >= len) return false;
+            d->data[j] ^= in[(*pos)++];
+        }
+        d->period = time - d->lastTime;
+        d->lastTime = time;
+    }
+
+    r->type = 0;
+    r->time = d->lastTime;
+    r->id = d->id;
+    r->extended = d->meta & 1;
+    r->bus = d->meta >> 1;
+    r->flags = d->flags;
+    r->len = d->len;
+    memcpy(r->data, d->data, d->len);
+    s->lastTime = r->time;
+    return true;
+}
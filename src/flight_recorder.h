@@ -0,0 +1,544 @@
+/*
+ * Flight recorder: circular binary capture log in a flash partition,
+ * shared by the serial and WiFi builds.
+ *
+ * Frames and marks are appended to one of two 4 KB RAM blocks in the
+ * capture path (a memcpy, no flash access). When a block fills, or has
+ * been open for FLIGHT_FLUSH_MS, it is handed to a low-priority writer
+ * task. The writer deflates the block (deflate_stream.h) into a chunk
+ * and programs it after the chunks already in the open sector of the
+ * "flightrec" partition; when it doesn't fit, the next sector is erased
+ * and opened. A block that doesn't shrink is stored as is. Sectors are
+ * used strictly in rotation, so every sector sees the same number of
+ * erases (wear levelling by construction) and the partition always
+ * holds the most recent data.
+ *
+ * Each sector starts with a magic, a sequence number that keeps
+ * counting across reboots, the boot number it was opened in, and a
+ * CRC32; each chunk has its own CRC32. On boot the sector headers are
+ * scanned to find the newest sector and writing resumes in the one
+ * after it. A dump walks the sectors oldest-first and inflates each
+ * chunk, skipping any with a bad CRC, so a chunk torn by a reset or
+ * power loss mid-write costs only that chunk.
+ *
+ * Timestamps are millis() since that boot, not since the last clear, so
+ * frames from different boots are told apart by their boot number.
+ * The newest partly-filled block is in RAM until it is flushed, so up
+ * to FLIGHT_FLUSH_MS of traffic is lost on an unexpected reset.
+ *
+ * Flash budget (default partition: 0x170000 bytes = 368 sectors):
+ *   - A record is 9 bytes + payload, so 17 bytes for a full 8-byte frame
+ *     (73 for a 64-byte CAN FD frame, one more for frames from bus 1-3);
+ *     about 240 frames fit in a block.
+ *   - Records deflate about 2.4:1 on the mock's ETS-like traffic
+ *     (two minutes of it, in test/test_deflate; ratio and CPU time on
+ *     the device are in the "flight" status), so a sector holds about
+ *     two full blocks.
+ *   - Retention is 368 sectors: about 15 minutes at 200 frames/s of
+ *     8-byte frames, about 50 s at 3500 frames/s (500 kbps, saturated).
+ *   - Endurance: ESP32 module flash is rated for 100k erase cycles per
+ *     sector. Each full rotation erases every sector once, so lifetime
+ *     is 100k x retention: ~2.6 years continuous at 200 frames/s, ~2
+ *     months at 3500 frames/s. Below ~10 frames/s the timed flush
+ *     writes small chunks, many to a sector, so an idle bus erases far
+ *     less than one sector per FLIGHT_FLUSH_MS.
+ *
+ * Cost: ESP32 flash erase/program suspends the instruction cache on
+ * both cores, so while a sector is erased (~45 ms worst case) loop()
+ * stalls unless it is running from IRAM, and the MCP2515's two RX
+ * buffers can overflow at high frame rates. The recorder is therefore
+ * off until enabled, and the choice is kept in NVS so an unattended
+ * install comes back up recording. Deflating a block takes the writer
+ * task a few ms on core 0, off the capture path, and its state and the
+ * chunk buffer add about 12 KB of RAM.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include "can_backend.h"
+#include "deflate_stream.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+#define FLIGHT_PARTITION_LABEL "flightrec"
+#define FLIGHT_BLOCK_SIZE      4096        // One flash sector
+#define FLIGHT_MAGIC_Z         0x5A455246  // "FREZ", deflated chunks
+#define FLIGHT_FLUSH_MS        10000
+#define FLIGHT_MAX_TEXT        39          // Mark text, matches LogEntry::markText
+
+// Record flags, stored in the top bits of the ID word.
+#define FLIGHT_FLAG_EXT   0x80000000
+#define FLIGHT_FLAG_RTR   0x40000000
+#define FLIGHT_FLAG_MARK  0x20000000
+#define FLIGHT_ID_MASK    0x1FFFFFFF
+
+// The length byte of a frame record holds the DLC code plus these FD
+// flags; classic records from before CAN FD (0-8, no flags) read the same.
+// FLIGHT_LEN_BUS means a bus number byte precedes the data; bus 0 frames
+// leave it out. For marks it is the text length.
+#define FLIGHT_LEN_DLC    0x0F
+#define FLIGHT_LEN_FD     0x10
+#define FLIGHT_LEN_BRS    0x20
+#define FLIGHT_LEN_ESI    0x40
+#define FLIGHT_LEN_BUS    0x80
+
+// A block of records: a RAM block being filled, or a chunk as a dump
+// hands it out, inflated.
+struct FlightBlockHeader {
+    uint32_t seq;       // Of the sector it was read from
+    uint32_t bootId;    // Boot number this block was written in
+    uint16_t used;      // Bytes of records after the header
+    uint16_t records;
+    uint32_t firstMs;   // Timestamp of the first record
+    uint32_t crc;       // Of the chunk it was read from
+};
+
+#define FLIGHT_PAYLOAD_SIZE (FLIGHT_BLOCK_SIZE - (int)sizeof(FlightBlockHeader))
+
+struct FlightBlock {
+    FlightBlockHeader header;
+    uint8_t payload[FLIGHT_PAYLOAD_SIZE];
+};
+
+// Header of a sector.
+struct FlightSectorHeader {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t bootId;
+    uint32_t crc;       // CRC32 of the words above
+};
+
+#define FLIGHT_CHUNK_STORED 0x01       // Records as is, not deflated
+#define FLIGHT_CHUNK_END    0xFFFF     // size of the erased space after the last chunk
+
+// One block in a FLIGHT_MAGIC_Z sector.
+struct FlightChunkHeader {
+    uint16_t size;      // Bytes of data after this header
+    uint16_t used;      // Bytes of records once inflated
+    uint16_t records;
+    uint16_t flags;     // FLIGHT_CHUNK_*
+    uint32_t firstMs;
+    uint32_t crc;       // CRC32 of the header (with crc = 0) and the data
+};
+
+// Most record bytes a RAM block takes, so that a block that doesn't
+// compress still fits in a sector as a stored chunk.
+#define FLIGHT_RAW_LIMIT (FLIGHT_BLOCK_SIZE - (int)sizeof(FlightSectorHeader) - (int)sizeof(FlightChunkHeader))
+
+// One decoded record. For marks, data holds the text (not terminated).
+struct FlightRecord {
+    uint32_t ms;
+    uint32_t id;
+    bool extended;
+    uint8_t flags;          // CAN_FLAG_*
+    uint8_t bus;
+    bool isMark;
+    uint8_t len;
+    uint8_t data[CAN_MAX_DLEN];      // >= FLIGHT_MAX_TEXT
+};
+
+struct FlightRecorder {
+    const esp_partition_t* partition;
+    uint32_t sectorCount;
+    bool enabled;
+
+    FlightBlock blocks[2];
+    volatile bool blockBusy[2];     // Queued for or being written by the task
+    int active;                     // Block being filled by the capture path
+    unsigned long activeSince;
+    uint32_t nextSeq;
+    uint32_t bootId;
+
+    QueueHandle_t queue;
+    uint32_t nextSector;            // Owned by the writer task, as is the rest of this group
+    uint32_t sectorOffset;          // Partition offset of the open sector
+    uint32_t sectorUsed;            // Bytes programmed in it, 0 = none open
+    DeflateStream deflate;
+    uint8_t chunk[sizeof(FlightChunkHeader) + FLIGHT_RAW_LIMIT];
+    uint16_t chunkSize;
+    bool chunkOverflow;
+
+    // Counters for status
+    volatile uint32_t blocksWritten;
+    volatile uint32_t writeErrors;
+    uint32_t droppedRecords;        // Both RAM blocks were waiting on flash
+    volatile uint32_t rawBytes;     // Record bytes written, before and
+    volatile uint32_t storedBytes;  // after deflate (chunk headers included)
+    volatile uint32_t compressUs;   // Writer time spent deflating
+};
+
+// Reads the sector headers to find the newest and oldest blocks.
+// Returns false if the partition holds no valid blocks.
+inline bool flightScan(FlightRecorder* f, uint32_t* oldestSector, uint32_t* newestSector,
+                       uint32_t* newestSeq, uint32_t* maxBootId) {
+    bool found = false;
+    uint32_t oldestSeq = 0;
+    *maxBootId = 0;
+    for (uint32_t s = 0; s < f->sectorCount; s++) {
+        FlightSectorHeader h;
+        if (esp_partition_read(f->partition, s * FLIGHT_BLOCK_SIZE, &h, sizeof(h)) != ESP_OK) continue;
+        if (h.magic != FLIGHT_MAGIC_Z ||
+            esp_rom_crc32_le(0, (const uint8_t*)&h, offsetof(FlightSectorHeader, crc)) != h.crc) {
+            continue;
+        }
+        if (!found || h.seq > *newestSeq) {
+            *newestSeq = h.seq;
+            *newestSector = s;
+        }
+        if (!found || h.seq < oldestSeq) {
+            oldestSeq = h.seq;
+            *oldestSector = s;
+        }
+        if (h.bootId > *maxBootId) *maxBootId = h.bootId;
+        found = true;
+    }
+    return found;
+}
+
+inline void flightChunkSink(void* ctx, const uint8_t* data, size_t len) {
+    FlightRecorder* f = (FlightRecorder*)ctx;
+    if (f->chunkOverflow || f->chunkSize + len > FLIGHT_RAW_LIMIT) {
+        f->chunkOverflow = true;
+        return;
+    }
+    memcpy(f->chunk + sizeof(FlightChunkHeader) + f->chunkSize, data, len);
+    f->chunkSize += len;
+}
+
+// Erases the next sector and writes its header.
+inline bool flightOpenSector(FlightRecorder* f) {
+    f->sectorUsed = 0;
+    f->sectorOffset = f->nextSector * FLIGHT_BLOCK_SIZE;
+    f->nextSector = (f->nextSector + 1) % f->sectorCount;
+    FlightSectorHeader h = { FLIGHT_MAGIC_Z, f->nextSeq++, f->bootId, 0 };
+    h.crc = esp_rom_crc32_le(0, (const uint8_t*)&h, offsetof(FlightSectorHeader, crc));
+    if (esp_partition_erase_range(f->partition, f->sectorOffset, FLIGHT_BLOCK_SIZE) != ESP_OK ||
+        esp_partition_write(f->partition, f->sectorOffset, &h, sizeof(h)) != ESP_OK) {
+        return false;
+    }
+    f->sectorUsed = sizeof(h);
+    return true;
+}
+
+// Deflates a block into a chunk and programs it into the open sector,
+// opening the next one if it doesn't fit.
+inline bool flightWriteChunk(FlightRecorder* f, const FlightBlock* b) {
+    int64_t start = esp_timer_get_time();
+    f->chunkSize = 0;
+    f->chunkOverflow = false;
+    deflateBegin(&f->deflate, false, flightChunkSink, f);
+    deflateWrite(&f->deflate, b->payload, b->header.used);
+    deflateEnd(&f->deflate);
+
+    FlightChunkHeader* c = (FlightChunkHeader*)f->chunk;
+    c->flags = 0;
+    if (f->chunkOverflow || f->chunkSize >= b->header.used) {
+        memcpy(f->chunk + sizeof(FlightChunkHeader), b->payload, b->header.used);
+        f->chunkSize = b->header.used;
+        c->flags = FLIGHT_CHUNK_STORED;
+    }
+    c->size = f->chunkSize;
+    c->used = b->header.used;
+    c->records = b->header.records;
+    c->firstMs = b->header.firstMs;
+    c->crc = 0;
+    size_t len = sizeof(FlightChunkHeader) + c->size;
+    c->crc = esp_rom_crc32_le(0, f->chunk, len);
+    f->compressUs += esp_timer_get_time() - start;
+
+    if (f->sectorUsed == 0 || f->sectorUsed + len > FLIGHT_BLOCK_SIZE) {
+        if (!flightOpenSector(f)) return false;
+    }
+    if (esp_partition_write(f->partition, f->sectorOffset + f->sectorUsed, f->chunk, len) != ESP_OK) {
+        f->sectorUsed = 0;
+        return false;
+    }
+    f->sectorUsed += len;
+    f->rawBytes += b->header.used;
+    f->storedBytes += len;
+    return true;
+}
+
+inline void flightWriterTask(void* arg) {
+    FlightRecorder* f = (FlightRecorder*)arg;
+    uint8_t index;
+    for (;;) {
+        if (xQueueReceive(f->queue, &index, portMAX_DELAY) != pdTRUE) continue;
+        if (flightWriteChunk(f, &f->blocks[index])) {
+            f->blocksWritten++;
+        } else {
+            f->writeErrors++;
+        }
+        f->blockBusy[index] = false;
+    }
+}
+
+inline void flightOpenBlock(FlightRecorder* f, int index) {
+    f->active = index;
+    f->blocks[index].header.used = 0;
+    f->blocks[index].header.records = 0;
+    f->activeSince = 0;
+}
+
+// Finds the partition, resumes after the newest block and starts the
+// writer task. Returns false if the partition table has no flightrec
+// partition, in which case every other call is a no-op.
+inline bool flightInit(FlightRecorder* f) {
+    memset(f, 0, sizeof(*f));
+    f->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                            (esp_partition_subtype_t)ESP_PARTITION_SUBTYPE_ANY,
+                                            FLIGHT_PARTITION_LABEL);
+    if (f->partition == NULL) return false;
+    f->sectorCount = f->partition->size / FLIGHT_BLOCK_SIZE;
+
+    uint32_t oldest, newest, newestSeq, maxBootId;
+    if (flightScan(f, &oldest, &newest, &newestSeq, &maxBootId)) {
+        f->nextSector = (newest + 1) % f->sectorCount;
+        f->nextSeq = newestSeq + 1;
+        f->bootId = maxBootId + 1;
+    } else {
+        f->nextSeq = 1;
+        f->bootId = 1;
+    }
+
+    Preferences prefs;
+    prefs.begin("flightrec", true);
+    f->enabled = prefs.getBool("enabled", false);
+    prefs.end();
+
+    flightOpenBlock(f, 0);
+    f->queue = xQueueCreate(2, sizeof(uint8_t));
+    xTaskCreatePinnedToCore(flightWriterTask, "flightrec", 3072, f, 1, NULL, 0);
+    return true;
+}
+
+inline bool flightAvailable(const FlightRecorder* f) {
+    return f->partition != NULL;
+}
+
+inline void flightSetEnabled(FlightRecorder* f, bool enabled) {
+    if (!flightAvailable(f)) return;
+    f->enabled = enabled;
+    Preferences prefs;
+    prefs.begin("flightrec", false);
+    prefs.putBool("enabled", enabled);
+    prefs.end();
+}
+
+// Seals the active block and queues it for writing. If the other block
+// is still being written the records stay where they are and the next
+// append decides whether to drop.
+inline void flightFlush(FlightRecorder* f) {
+    FlightBlock* b = &f->blocks[f->active];
+    if (b->header.records == 0) return;
+    int other = 1 - f->active;
+    if (f->blockBusy[other]) return;
+
+    uint8_t index = f->active;
+    f->blockBusy[index] = true;
+    xQueueSend(f->queue, &index, 0);
+    flightOpenBlock(f, other);
+}
+
+inline void flightAppend(FlightRecorder* f, uint32_t idFlags, uint8_t lenByte, const uint8_t* data, uint8_t len) {
+    if (!f->enabled || f->partition == NULL) return;
+
+    uint32_t ms = millis();
+    FlightBlock* b = &f->blocks[f->active];
+    if (b->header.used + 9 + len > FLIGHT_RAW_LIMIT) {
+        flightFlush(f);
+        b = &f->blocks[f->active];
+        if (b->header.used + 9 + len > FLIGHT_RAW_LIMIT) {
+            f->droppedRecords++;
+            return;
+        }
+    }
+
+    uint8_t* p = b->payload + b->header.used;
+    memcpy(p, &ms, 4);
+    memcpy(p + 4, &idFlags, 4);
+    p[8] = lenByte;
+    memcpy(p + 9, data, len);
+    if (b->header.records == 0) {
+        b->header.firstMs = ms;
+        f->activeSince = millis();
+    }
+    b->header.used += 9 + len;
+    b->header.records++;
+}
+
+inline void flightRecordFrame(FlightRecorder* f, const CanFrame* frame) {
+    uint32_t idFlags = (frame->id & FLIGHT_ID_MASK) | (frame->extended ? FLIGHT_FLAG_EXT : 0) |
+                       (frame->flags & CAN_FLAG_RTR ? FLIGHT_FLAG_RTR : 0);
+    uint8_t lenByte = canLenToDlc(frame->len) |
+                      (frame->flags & CAN_FLAG_FD ? FLIGHT_LEN_FD : 0) |
+                      (frame->flags & CAN_FLAG_BRS ? FLIGHT_LEN_BRS : 0) |
+                      (frame->flags & CAN_FLAG_ESI ? FLIGHT_LEN_ESI : 0);
+    if (frame->bus == 0) {
+        flightAppend(f, idFlags, lenByte, frame->data, frame->len);
+        return;
+    }
+    uint8_t buf[1 + CAN_MAX_DLEN];
+    buf[0] = frame->bus;
+    memcpy(buf + 1, frame->data, frame->len);
+    flightAppend(f, idFlags, lenByte | FLIGHT_LEN_BUS, buf, frame->len + 1);
+}
+
+inline void flightRecordMark(FlightRecorder* f, const char* text) {
+    size_t len = strlen(text);
+    if (len > FLIGHT_MAX_TEXT) len = FLIGHT_MAX_TEXT;
+    flightAppend(f, FLIGHT_FLAG_MARK, len, (const uint8_t*)text, len);
+}
+
+// Call from loop(): flushes a block that has been open too long, so a
+// quiet bus still reaches flash within FLIGHT_FLUSH_MS.
+inline void flightService(FlightRecorder* f, unsigned long now) {
+    if (!f->enabled || f->partition == NULL) return;
+    if (f->blocks[f->active].header.records > 0 && now - f->activeSince > FLIGHT_FLUSH_MS) {
+        flightFlush(f);
+    }
+}
+
+// ============== READBACK ==============
+
+// Position of a dump in progress. Sectors opened after flightBeginDump()
+// are skipped so a dump never wraps around into data newer than it
+// started with. Holds a whole sector, so keep it off the stack.
+struct FlightDump {
+    uint32_t firstSector;
+    uint32_t newestSeq;
+    uint32_t sector;       // Sectors visited so far
+    bool valid;
+    uint16_t chunkOffset;  // Next chunk in buf, 0 = read the next sector
+    uint8_t buf[FLIGHT_BLOCK_SIZE];
+};
+
+inline bool flightBeginDump(FlightRecorder* f, FlightDump* d) {
+    memset(d, 0, sizeof(*d));
+    if (!flightAvailable(f)) return false;
+    uint32_t newestSector, maxBootId;
+    d->valid = flightScan(f, &d->firstSector, &newestSector, &d->newestSeq, &maxBootId);
+    return d->valid;
+}
+
+// Inflates the next valid chunk of the sector in d->buf into *out.
+// Returns false at the end of the sector.
+inline bool flightNextChunk(FlightDump* d, FlightBlock* out) {
+    const FlightSectorHeader* sector = (const FlightSectorHeader*)d->buf;
+    while (d->chunkOffset + sizeof(FlightChunkHeader) <= FLIGHT_BLOCK_SIZE) {
+        FlightChunkHeader c;
+        memcpy(&c, d->buf + d->chunkOffset, sizeof(c));
+        size_t dataOffset = d->chunkOffset + sizeof(c);
+        if (c.size == FLIGHT_CHUNK_END || c.size > FLIGHT_BLOCK_SIZE - dataOffset) return false;
+        d->chunkOffset = dataOffset + c.size;
+
+        uint32_t crc = c.crc;
+        c.crc = 0;
+        uint32_t check = esp_rom_crc32_le(0, (const uint8_t*)&c, sizeof(c));
+        if (esp_rom_crc32_le(check, d->buf + dataOffset, c.size) != crc || c.used > FLIGHT_PAYLOAD_SIZE) continue;
+        if (c.flags & FLIGHT_CHUNK_STORED) {
+            if (c.size != c.used) continue;
+            memcpy(out->payload, d->buf + dataOffset, c.size);
+        } else if (inflateFixed(d->buf + dataOffset, c.size, out->payload, FLIGHT_PAYLOAD_SIZE) != c.used) {
+            continue;
+        }
+        out->header.seq = sector->seq;
+        out->header.bootId = sector->bootId;
+        out->header.used = c.used;
+        out->header.records = c.records;
+        out->header.firstMs = c.firstMs;
+        out->header.crc = crc;
+        return true;
+    }
+    return false;
+}
+
+// Loads the next valid block into *out, inflated. Returns false when the
+// dump is done.
+inline bool flightNextBlock(FlightRecorder* f, FlightDump* d, FlightBlock* out) {
+    for (;;) {
+        if (d->chunkOffset != 0) {
+            if (flightNextChunk(d, out)) return true;
+            d->chunkOffset = 0;
+        }
+        if (!d->valid || d->sector >= f->sectorCount) return false;
+        uint32_t s = (d->firstSector + d->sector++) % f->sectorCount;
+        if (esp_partition_read(f->partition, s * FLIGHT_BLOCK_SIZE, d->buf, FLIGHT_BLOCK_SIZE) != ESP_OK) continue;
+
+        const FlightSectorHeader* h = (const FlightSectorHeader*)d->buf;
+        if (h->magic != FLIGHT_MAGIC_Z || h->seq > d->newestSeq ||
+            esp_rom_crc32_le(0, d->buf, offsetof(FlightSectorHeader, crc)) != h->crc) {
+            continue;
+        }
+        d->chunkOffset = sizeof(FlightSectorHeader);
+    }
+}
+
+// Decodes the record at *offset and advances it. Returns false at the
+// end of the block.
+inline bool flightNextRecord(const FlightBlock* b, uint16_t* offset, FlightRecord* r) {
+    if (*offset + 9 > b->header.used) return false;
+    const uint8_t* p = b->payload + *offset;
+    uint32_t idFlags;
+    memcpy(&r->ms, p, 4);
+    memcpy(&idFlags, p + 4, 4);
+    r->id = idFlags & FLIGHT_ID_MASK;
+    r->extended = idFlags & FLIGHT_FLAG_EXT;
+    r->isMark = idFlags & FLIGHT_FLAG_MARK;
+    r->bus = 0;
+    int header = 9;
+    if (r->isMark) {
+        r->flags = 0;
+        r->len = p[8];
+        if (r->len > FLIGHT_MAX_TEXT) return false;
+    } else {
+        if (p[8] & FLIGHT_LEN_BUS) {
+            if (*offset + 10 > b->header.used) return false;
+            r->bus = p[9];
+            header = 10;
+        }
+        r->flags = (idFlags & FLIGHT_FLAG_RTR ? CAN_FLAG_RTR : 0) |
+                   (p[8] & FLIGHT_LEN_FD ? CAN_FLAG_FD : 0) |
+                   (p[8] & FLIGHT_LEN_BRS ? CAN_FLAG_BRS : 0) |
+                   (p[8] & FLIGHT_LEN_ESI ? CAN_FLAG_ESI : 0);
+        r->len = canDlcToLen(p[8] & FLIGHT_LEN_DLC, r->flags & CAN_FLAG_FD);
+    }
+    if (*offset + header + r->len > b->header.used) return false;
+    memcpy(r->data, p + header, r->len);
+    *offset += header + r->len;
+    return true;
+}
+
+// Formats one record as a CSV line in the same layout as the live
+// output, prefixed by a BOOT row whenever the boot number changes.
+// Returns the line length.
+inline int flightFormatRecord(const FlightBlock* b, const FlightRecord* r, uint32_t* lastBoot,
+                              char* line, int size) {
+    int len = 0;
+    if (b->header.bootId != *lastBoot) {
+        *lastBoot = b->header.bootId;
+        len += snprintf(line, size, "%lu,BOOT,0,0,0,boot=%lu;seq=%lu\n",
+                        (unsigned long)r->ms, (unsigned long)b->header.bootId, (unsigned long)b->header.seq);
+    }
+    if (r->isMark) {
+        len += snprintf(line + len, size - len, "%lu,MARK,0,0,0,%.*s\n",
+                        (unsigned long)r->ms, r->len, (const char*)r->data);
+        return len;
+    }
+    len += snprintf(line + len, size - len, r->extended ? "%lu,0x%08X,%d,%d,%d," : "%lu,0x%03X,%d,%d,%d,",
+                    (unsigned long)r->ms, (unsigned)r->id, r->extended ? 1 : 0, r->flags, canLenToDlc(r->len));
+    for (int i = 0; i < r->len; i++) {
+        len += snprintf(line + len, size - len, i < r->len - 1 ? "%02X " : "%02X", r->data[i]);
+    }
+#if CAN_BUS_COUNT > 1
+    len += snprintf(line + len, size - len, ",%d", r->bus);
+#endif
+    line[len++] = '\n';
+    return len;
+}
@@ -0,0 +1,53 @@
+/*
+ * Text forms of a frame, shared by the serial build's live output and
+ * the burst dumps of both builds.
+ *
+ *   CSV      TIMESTAMP,ID,EXTENDED,FLAGS,DLC,DATA[,BUS]
+ *            DLC is the code (9-15 for FD lengths over 8); DATA is the
+ *            payload as space-separated hex bytes; BUS only with more
+ *            than one controller.
+ *   candump  (SECONDS.MILLIS) canN ID#DATA, as written by candump -L
+ *            and read by can-utils canplayer. CAN FD frames use
+ *            ID##<flags>DATA, where the flags nibble is 1 BRS, 2 ESI.
+ *
+ * Both write a whole line, newline included and not terminated, into
+ * line and return its length. A 64-byte frame takes about 230 bytes.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+// timestamp is written as is, in whatever unit the caller uses.
+inline int formatFrameCsv(const CanFrame* frame, unsigned long timestamp, char* line, int size) {
+    int len = snprintf(line, size, frame->extended ? "%lu,0x%08X,%d,%d,%d," : "%lu,0x%03X,%d,%d,%d,",
+                       timestamp, (unsigned)frame->id, frame->extended ? 1 : 0,
+                       frame->flags, canLenToDlc(frame->len));
+    for (int i = 0; i < frame->len; i++) {
+        len += snprintf(line + len, size - len, i < frame->len - 1 ? "%02X " : "%02X", frame->data[i]);
+    }
+#if CAN_BUS_COUNT > 1
+    len += snprintf(line + len, size - len, ",%d", frame->bus);
+#endif
+    line[len++] = '\n';
+    return len;
+}
+
+inline int formatFrameCandump(const CanFrame* frame, unsigned long timestampMs, char* line, int size) {
+    int len = snprintf(line, size, frame->extended ? "(%lu.%03lu) can%d %08X#" : "(%lu.%03lu) can%d %03X#",
+                       timestampMs / 1000, timestampMs % 1000, frame->bus, (unsigned)frame->id);
+    if (frame->flags & CAN_FLAG_FD) {
+        line[len++] = '#';
+        line[len++] = '0' + ((frame->flags & CAN_FLAG_BRS ? 1 : 0) | (frame->flags & CAN_FLAG_ESI ? 2 : 0));
+    }
+    if (frame->flags & CAN_FLAG_RTR) {
+        line[len++] = 'R';
+    } else {
+        for (int i = 0; i < frame->len; i++) {
+            len += snprintf(line + len, size - len, "%02X", frame->data[i]);
+        }
+    }
+    line[len++] = '\n';
+    return len;
+}
@@ -0,0 +1,97 @@
+/*
+ * Heap and stack telemetry for long unattended sessions.
+ *
+ * heapSample() is called about once a second from loop() and tracks the
+ * worst values seen since boot: lowest free heap, smallest largest-free-
+ * block, and fragmentation (how much of the free heap can't be handed
+ * out as one block). Stack high-water marks are read for the tasks that
+ * matter to capture: the Arduino loop, lwIP, the WiFi driver, the
+ * Arduino event task and the flight recorder writer.
+ *
+ * With HEAP_ALLOC_TRACKING defined (and the matching --wrap linker flags
+ * in platformio.ini) malloc/calloc/realloc are wrapped to count
+ * allocations made by the loop task, which is where the web handlers
+ * run. The wrappers are a compare and an increment on top of the real
+ * allocator. Allocations from other tasks (WiFi, lwIP) are not counted,
+ * so per-handler counts aren't polluted by background traffic.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define HEAP_SAMPLE_INTERVAL_MS 1000
+
+struct HeapStats {
+    uint32_t freeHeap;
+    uint32_t minFreeHeap;        // Lowest ever, from the allocator
+    uint32_t maxBlock;           // Largest free block now
+    uint32_t minMaxBlock;        // Smallest largest-free-block seen
+    uint8_t fragmentation;       // % of free heap not in the largest block
+    uint8_t maxFragmentation;
+    unsigned long lastSample;
+};
+
+// Tasks whose stack headroom is reported. Names are FreeRTOS task names.
+static const char* const heapWatchedTasks[] = {
+    "loopTask", "tiT", "wifi", "arduino_events", "flightrec"
+};
+#define HEAP_WATCHED_TASK_COUNT (sizeof(heapWatchedTasks) / sizeof(heapWatchedTasks[0]))
+
+// Loop-task allocation counter, advanced by the malloc wrappers.
+volatile uint32_t heapAllocCount = 0;
+TaskHandle_t heapTrackedTask = NULL;
+
+#ifdef HEAP_ALLOC_TRACKING
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    if (xTaskGetCurrentTaskHandle() == heapTrackedTask) heapAllocCount++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    if (xTaskGetCurrentTaskHandle() == heapTrackedTask) heapAllocCount++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    if (xTaskGetCurrentTaskHandle() == heapTrackedTask) heapAllocCount++;
+    return __real_realloc(ptr, size);
+}
+}
+#endif
+
+// Call from setup(), i.e. on the loop task, before the web server starts.
+inline void heapInit(HeapStats* h) {
+    memset(h, 0, sizeof(*h));
+    heapTrackedTask = xTaskGetCurrentTaskHandle();
+    h->minMaxBlock = UINT32_MAX;
+}
+
+inline void heapSample(HeapStats* h, unsigned long now) {
+    h->lastSample = now;
+    h->freeHeap = ESP.getFreeHeap();
+    h->minFreeHeap = ESP.getMinFreeHeap();
+    h->maxBlock = ESP.getMaxAllocHeap();
+    if (h->maxBlock < h->minMaxBlock) h->minMaxBlock = h->maxBlock;
+    h->fragmentation = h->freeHeap > 0 ? 100 - (uint64_t)h->maxBlock * 100 / h->freeHeap : 0;
+    if (h->fragmentation > h->maxFragmentation) h->maxFragmentation = h->fragmentation;
+}
+
+inline void heapService(HeapStats* h, unsigned long now) {
+    if (now - h->lastSample >= HEAP_SAMPLE_INTERVAL_MS) heapSample(h, now);
+}
+
+// Minimum free stack ever seen for a task, in bytes, or -1 if no task
+// by that name is running.
+inline int heapTaskStackFree(const char* name) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if (task == NULL) return -1;
+    return uxTaskGetStackHighWaterMark(task);
+}
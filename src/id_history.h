@@ -0,0 +1,132 @@
+/*
+ * Recent frames per tracked ID, for the WiFi build's /ids/history.
+ *
+ * The log ring is flushed by the busiest IDs within seconds, so a
+ * slow status frame's last few values can't be read back from it. Each
+ * ID gets its own history instead: up to HISTORY_DEPTH frames, kept in
+ * blocks of HISTORY_BLOCK_LEN taken from a slab shared by all IDs as
+ * the ID fills them. An ID seen once holds one block; one at its depth
+ * reuses its own oldest block. When the slab runs out, the ID holding
+ * the most blocks gives up its oldest, so fast IDs shrink to make room
+ * and every ID keeps at least its latest block. There are more blocks
+ * than ID table slots, so every tracked ID gets one.
+ *
+ * Payloads past 8 bytes (CAN FD) aren't kept; entries record the full
+ * length so a reader can tell.
+ *
+ * All-zero is the empty state, so a global history needs no init.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#ifndef HISTORY_DEPTH
+#define HISTORY_DEPTH      32      // Frames kept per ID, at most
+#endif
+#define HISTORY_BLOCK_LEN  4
+#define HISTORY_BLOCKS     320     // Shared by all IDs; more than the ID table has slots
+#define HISTORY_MAX_BLOCKS ((HISTORY_DEPTH + HISTORY_BLOCK_LEN - 1) / HISTORY_BLOCK_LEN)
+
+struct HistoryEntry {
+    unsigned long ms;
+    uint8_t len;             // Full payload length; data holds up to 8
+    uint8_t flags;           // CAN_FLAG_*
+    uint8_t data[8];
+};
+
+struct HistoryBlock {
+    HistoryEntry entries[HISTORY_BLOCK_LEN];
+    uint16_t next;           // Next newer block of the same ID plus one, 0 = none
+};
+
+template <int Ids>
+struct IdHistory {
+    HistoryBlock blocks[HISTORY_BLOCKS];
+    int blocksUsed;          // Never-used blocks start here
+    uint16_t first[Ids];     // Oldest block plus one, 0 = none
+    uint16_t last[Ids];      // Newest block plus one
+    uint8_t blockCount[Ids];
+    uint8_t fill[Ids];       // Entries used in the newest block
+};
+
+template <int Ids>
+inline void historyClear(IdHistory<Ids>* h) {
+    h->blocksUsed = 0;
+    memset(h->first, 0, sizeof(h->first));
+    memset(h->last, 0, sizeof(h->last));
+    memset(h->blockCount, 0, sizeof(h->blockCount));
+    memset(h->fill, 0, sizeof(h->fill));
+}
+
+// Unlinks and returns the oldest block of ID slot i.
+template <int Ids>
+inline int historyTakeOldest(IdHistory<Ids>* h, int i) {
+    int b = h->first[i] - 1;
+    h->first[i] = h->blocks[b].next;
+    if (h->first[i] == 0) h->last[i] = 0;
+    h->blockCount[i]--;
+    return b;
+}
+
+// Finds a block for ID slot i to write into next: a fresh one while the
+// slab lasts and the ID is under its depth, else its own oldest, else
+// the oldest of the ID with the most blocks. Returns -1 if there is none
+// to spare.
+template <int Ids>
+inline int historyFindBlock(IdHistory<Ids>* h, int i) {
+    if (h->blockCount[i] >= HISTORY_MAX_BLOCKS) return historyTakeOldest(h, i);
+    if (h->blocksUsed < HISTORY_BLOCKS) return h->blocksUsed++;
+
+    int victim = -1;
+    for (int v = 0; v < Ids; v++) {
+        if (v != i && h->blockCount[v] > 1 &&
+            (victim < 0 || h->blockCount[v] > h->blockCount[victim])) {
+            victim = v;
+        }
+    }
+    if (victim >= 0 && h->blockCount[victim] > h->blockCount[i] + 1) return historyTakeOldest(h, victim);
+    if (h->blockCount[i] > 0) return historyTakeOldest(h, i);
+    return -1;
+}
+
+// Appends a frame to ID slot i's history, stamped ms.
+template <int Ids>
+inline void historyAdd(IdHistory<Ids>* h, int i, const CanFrame* frame, unsigned long ms) {
+    if (i < 0 || i >= Ids) return;
+    if (h->last[i] == 0 || h->fill[i] == HISTORY_BLOCK_LEN) {
+        int b = historyFindBlock(h, i);
+        if (b < 0) return;
+        h->blocks[b].next = 0;
+        if (h->last[i]) {
+            h->blocks[h->last[i] - 1].next = b + 1;
+        } else {
+            h->first[i] = b + 1;
+        }
+        h->last[i] = b + 1;
+        h->blockCount[i]++;
+        h->fill[i] = 0;
+    }
+
+    HistoryEntry* e = &h->blocks[h->last[i] - 1].entries[h->fill[i]++];
+    e->ms = ms;
+    e->len = frame->len;
+    e->flags = frame->flags;
+    memcpy(e->data, frame->data, frame->len < 8 ? frame->len : 8);
+}
+
+template <int Ids>
+inline int historyCount(const IdHistory<Ids>* h, int i) {
+    if (h->blockCount[i] == 0) return 0;
+    return (h->blockCount[i] - 1) * HISTORY_BLOCK_LEN + h->fill[i];
+}
+
+// Calls f(entry) for each frame in ID slot i's history, oldest first.
+template <int Ids, class F>
+inline void historyForEach(const IdHistory<Ids>* h, int i, F f) {
+    for (uint16_t b = h->first[i]; b != 0; b = h->blocks[b - 1].next) {
+        int n = b == h->last[i] ? h->fill[i] : HISTORY_BLOCK_LEN;
+        for (int k = 0; k < n; k++) f(&h->blocks[b - 1].entries[k]);
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ * Bounded-memory ID statistics for buses with more IDs than the exact ID
+ * table holds (a wrong baud, or a busy J1939 backbone), shared by the
+ * serial and WiFi builds.
+ *
+ * HyperLogLog estimates how many distinct IDs have been seen, in
+ * HLL_REGISTERS bytes, with a standard error of about 3% (1.04 /
+ * sqrt(1024)). Every frame is fed to it.
+ *
+ * Space-Saving keeps the TOPK_SIZE heaviest of the IDs that didn't fit in
+ * the exact table. An entry's true count lies between count - err and
+ * count, and any ID making up more than 1/TOPK_SIZE of the frames fed in
+ * is guaranteed to be in the table. Lookups are a
+ * linear scan, paid only by frames the exact table turned away.
+ *
+ * IDs are keyed with their bus and the extended flag, so 0x100 standard
+ * and 0x100 extended count as two IDs. All-zero is the empty state.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <math.h>
+#include "can_backend.h"
+
+#define HLL_PRECISION  10
+#define HLL_REGISTERS  (1 << HLL_PRECISION)
+#define TOPK_SIZE      32
+
+#define SKETCH_KEY_EXT      0x80000000
+#define SKETCH_KEY_BUS_SHIFT 29          // Bus in bits 29-30, above a 29-bit ID
+
+struct HyperLogLog {
+    uint8_t registers[HLL_REGISTERS];
+};
+
+struct TopKEntry {
+    uint32_t key;
+    unsigned long count;
+    unsigned long err;      // Most the count can overstate by
+};
+
+struct TopK {
+    TopKEntry entries[TOPK_SIZE];
+    int used;
+    unsigned long total;    // Frames fed in
+};
+
+inline uint32_t sketchKey(const CanFrame* frame) {
+    return (frame->id & 0x1FFFFFFF) | ((uint32_t)frame->bus << SKETCH_KEY_BUS_SHIFT) |
+           (frame->extended ? SKETCH_KEY_EXT : 0);
+}
+
+inline uint32_t sketchKeyId(uint32_t key) { return key & 0x1FFFFFFF; }
+inline uint8_t sketchKeyBus(uint32_t key) { return (key >> SKETCH_KEY_BUS_SHIFT) & 0x03; }
+
+// MurmurHash3 finaliser: CAN IDs are dense and sequential, and HLL needs
+// every hash bit to look random.
+inline uint32_t sketchHash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+inline void hllClear(HyperLogLog* h) {
+    memset(h->registers, 0, sizeof(h->registers));
+}
+
+inline void hllAdd(HyperLogLog* h, uint32_t key) {
+    uint32_t hash = sketchHash(key);
+    uint32_t index = hash >> (32 - HLL_PRECISION);
+    uint32_t rest = hash << HLL_PRECISION;
+    uint8_t rank = rest == 0 ? 32 - HLL_PRECISION + 1 : __builtin_clz(rest) + 1;
+    if (rank > h->registers[index]) h->registers[index] = rank;
+}
+
+// Estimated number of distinct keys added, with the small-range
+// (linear counting) correction. Loops over every register, so call it
+// for reports, not per frame.
+inline unsigned long hllEstimate(const HyperLogLog* h) {
+    const float m = HLL_REGISTERS;
+    float sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexpf(1.0f, -h->registers[i]);
+        if (h->registers[i] == 0) zeros++;
+    }
+    float estimate = 0.7213f / (1.0f + 1.079f / m) * m * m / sum;
+    if (estimate <= 2.5f * m && zeros > 0) estimate = m * logf(m / zeros);
+    return (unsigned long)(estimate + 0.5f);
+}
+
+inline void topkClear(TopK* t) {
+    t->used = 0;
+    t->total = 0;
+}
+
+// Counts one occurrence of key. A key not in a full table replaces the
+// entry with the lowest count and inherits that count as its error.
+inline void topkAdd(TopK* t, uint32_t key) {
+    t->total++;
+    int lowest = 0;
+    for (int i = 0; i < t->used; i++) {
+        TopKEntry* e = &t->entries[i];
+        if (e->key == key) {
+            e->count++;
+            return;
+        }
+        if (e->count < t->entries[lowest].count) lowest = i;
+    }
+
+    if (t->used < TOPK_SIZE) {
+        TopKEntry* e = &t->entries[t->used++];
+        e->key = key;
+        e->count = 1;
+        e->err = 0;
+        return;
+    }
+    TopKEntry* e = &t->entries[lowest];
+    e->key = key;
+    e->err = e->count;
+    e->count++;
+}
@@ -0,0 +1,208 @@
+/*
+ * Server-side filters for the WiFi build's /log, /csv and /flight.
+ *
+ * A query is compiled once from the request's arguments so each log
+ * entry is checked with a few table lookups:
+ *
+ *   id=0x100,0x200-0x2FF,...  IDs and inclusive ranges. IDs up to 0x7FF
+ *                             go in a bitmap; ranges above that are
+ *                             checked in turn (QUERY_MAX_RANGES).
+ *   bus=N                     One bus only.
+ *   data=01x?FF               Payload pattern from byte 0, two hex digits
+ *                             per byte, x or ? for any nibble. Compiled
+ *                             to a 64-bit mask and value; a frame must be
+ *                             at least as long as the pattern. Repeat for
+ *                             alternatives (QUERY_MAX_DATA), any of which
+ *                             may match. Only the first 8 bytes can be
+ *                             matched.
+ *   from=MS, to=MS            Inclusive time window on the log timestamp.
+ *   text=0                    Leave out marks and events. They pass the
+ *                             time window but no frame filters.
+ *   fields=t,id,data          Projection: which of s, t, id, ext, flags,
+ *                             dlc, data and bus each frame carries, plus
+ *                             utc, absolute time once the host has set
+ *                             it (time_base.h), which isn't in the
+ *                             default set.
+ *
+ * Arguments that aren't given don't filter. The parse functions return
+ * false on a malformed value and leave naming the argument to the
+ * handler's reply.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#define QUERY_STD_IDS     2048
+#define QUERY_MAX_RANGES  8
+#define QUERY_MAX_DATA    4
+
+#define FIELD_SEQ    0x01
+#define FIELD_TIME   0x02
+#define FIELD_ID     0x04
+#define FIELD_EXT    0x08
+#define FIELD_FLAGS  0x10
+#define FIELD_DLC    0x20
+#define FIELD_DATA   0x40
+#define FIELD_BUS    0x80
+#define FIELD_ALL    0xFF        // Default: everything but FIELD_UTC
+#define FIELD_UTC    0x100
+
+struct QueryRange {
+    uint32_t lo;
+    uint32_t hi;
+};
+
+struct QueryData {
+    uint64_t mask;           // Byte k of the payload is bits 8k..8k+7
+    uint64_t value;
+    uint8_t minLen;
+};
+
+struct LogQuery {
+    bool filtered;           // Any argument narrowed or projected the result
+    bool anyId;
+    uint8_t stdIds[QUERY_STD_IDS / 8];
+    QueryRange ranges[QUERY_MAX_RANGES];
+    int rangeCount;
+    int bus;                 // -1 = any
+    QueryData data[QUERY_MAX_DATA];
+    int dataCount;
+    unsigned long fromMs;
+    unsigned long toMs;
+    bool text;
+    uint16_t fields;
+};
+
+inline void queryInit(LogQuery* q) {
+    memset(q, 0, sizeof(*q));
+    q->anyId = true;
+    q->bus = -1;
+    q->toMs = ~0UL;
+    q->text = true;
+    q->fields = FIELD_ALL;
+}
+
+// Adds a comma-separated list of IDs and lo-hi ranges.
+inline bool queryAddIds(LogQuery* q, const char* list) {
+    const char* p = list;
+    while (*p) {
+        char* end;
+        uint32_t lo = strtoul(p, &end, 0);
+        if (end == p) return false;
+        uint32_t hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtoul(p, &end, 0);
+            if (end == p || hi < lo) return false;
+            p = end;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return false;
+        }
+
+        if (hi >= QUERY_STD_IDS) {
+            if (q->rangeCount >= QUERY_MAX_RANGES) return false;
+            q->ranges[q->rangeCount].lo = max(lo, (uint32_t)QUERY_STD_IDS);
+            q->ranges[q->rangeCount].hi = hi;
+            q->rangeCount++;
+        }
+        for (uint32_t id = lo; id <= hi && id < QUERY_STD_IDS; id++) {
+            q->stdIds[id >> 3] |= 1 << (id & 7);
+        }
+    }
+    q->anyId = false;
+    q->filtered = true;
+    return true;
+}
+
+inline int queryHexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Adds one data= pattern.
+inline bool queryAddData(LogQuery* q, const char* pattern) {
+    size_t n = strlen(pattern);
+    if (q->dataCount >= QUERY_MAX_DATA || n == 0 || n % 2 != 0 || n > 16) return false;
+    QueryData* d = &q->data[q->dataCount];
+    d->mask = 0;
+    d->value = 0;
+    for (size_t k = 0; k < n; k++) {
+        int shift = (k / 2) * 8 + (k % 2 == 0 ? 4 : 0);
+        char c = pattern[k];
+        if (c == 'x' || c == 'X' || c == '?') continue;
+        int v = queryHexNibble(c);
+        if (v < 0) return false;
+        d->mask |= (uint64_t)0xF << shift;
+        d->value |= (uint64_t)v << shift;
+    }
+    d->minLen = n / 2;
+    q->dataCount++;
+    q->filtered = true;
+    return true;
+}
+
+inline bool queryParseFields(LogQuery* q, const char* list) {
+    static const struct { const char* name; uint16_t bit; } names[] = {
+        { "s", FIELD_SEQ }, { "t", FIELD_TIME }, { "id", FIELD_ID }, { "ext", FIELD_EXT },
+        { "flags", FIELD_FLAGS }, { "dlc", FIELD_DLC }, { "data", FIELD_DATA }, { "bus", FIELD_BUS },
+        { "utc", FIELD_UTC },
+    };
+    uint16_t fields = 0;
+    const char* p = list;
+    while (*p) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        size_t k = 0;
+        while (k < sizeof(names) / sizeof(names[0]) &&
+               !(strlen(names[k].name) == len && strncmp(names[k].name, p, len) == 0)) k++;
+        if (k == sizeof(names) / sizeof(names[0])) return false;
+        fields |= names[k].bit;
+        p += len;
+        if (*p == ',') p++;
+    }
+    if (fields == 0) return false;
+    q->fields = fields;
+    q->filtered = true;
+    return true;
+}
+
+inline bool queryMatchTime(const LogQuery* q, unsigned long ms) {
+    return ms >= q->fromMs && ms <= q->toMs;
+}
+
+inline bool queryMatchId(const LogQuery* q, uint32_t id) {
+    if (q->anyId) return true;
+    if (id < QUERY_STD_IDS) return q->stdIds[id >> 3] & (1 << (id & 7));
+    for (int r = 0; r < q->rangeCount; r++) {
+        if (id >= q->ranges[r].lo && id <= q->ranges[r].hi) return true;
+    }
+    return false;
+}
+
+inline bool queryMatchFrame(const LogQuery* q, uint32_t id, uint8_t bus,
+                            const uint8_t* data, uint8_t len, unsigned long ms) {
+    if (!queryMatchTime(q, ms)) return false;
+    if (q->bus >= 0 && bus != q->bus) return false;
+    if (!queryMatchId(q, id)) return false;
+    if (q->dataCount == 0) return true;
+
+    uint64_t payload = 0;
+    for (int k = 0; k < len && k < 8; k++) payload |= (uint64_t)data[k] << (8 * k);
+    for (int p = 0; p < q->dataCount; p++) {
+        const QueryData* d = &q->data[p];
+        if (len >= d->minLen && (payload & d->mask) == d->value) return true;
+    }
+    return false;
+}
+
+inline bool queryMatchText(const LogQuery* q, unsigned long ms) {
+    return q->text && queryMatchTime(q, ms);
+}
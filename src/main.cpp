@@ -9,6 +9,75 @@
  * Output is CSV over serial, suitable for logging to a file and later
  * analysis in a spreadsheet or Python script.
  *
+ * Commands are typed as a line and sent with Enter. Input is assembled a
+ * byte at a time between CAN reads, so typing never stalls capture. Type
+ * "help" for the full list.
+ *
+ * Frames are written as TIMESTAMP_MS,ID,EXTENDED,FLAGS,DLC,DATA. FLAGS
+ * is a bit field (1 RTR, 2 CAN FD, 4 BRS, 8 ESI), so classic frames read
+ * the same as the RTR column did. DLC is the DLC code; CAN FD frames
+ * with codes 9-15 carry 12-64 data bytes. Builds with more than one
+ * controller (CAN_BUS_COUNT > 1) add a BUS column after DATA, and frames
+ * from all buses are interleaved in timestamp order.
+ *
+ * Frames, marks and status are queued as whole lines and drained to the
+ * UART only as fast as it can take them, so a slow serial link never
+ * blocks the CAN read. Non-frame rows are typed by their second column
+ * and keep the same six-column layout as frames:
+ *   TIMESTAMP_MS,MARK,0,0,0,text
+ *   TIMESTAMP_MS,STATUS,0,0,0,uptime=..;baud=..;msgs=..;errors=..;ids=..;dropped=..;
+ *                             overflows=..;recoveries=..;downtime=..;rxmode=irq|poll;
+ *                             rxswitches=..;rxsleep=..;distinct=..;untracked=..;
+ *                             alerts=..;suppressed=..
+ *                             (rx_adapt.h, rxsleep in ms; distinct is the estimated
+ *                             number of IDs seen, untracked the frames whose ID
+ *                             didn't fit in the ID table)
+ *   TIMESTAMP_MS,BUSSTAT,0,0,0,bus=..;baud=..;msgs=..;errors=..;overflows=..;
+ *                              recoveries=..;downtime=..   (multi-bus builds)
+ *   TIMESTAMP_MS,TIMING,0,0,0,bus=..;load=..;peak=..;b2b=..;clusters=..;
+ *                             maxcluster=..;maxclusterus=..;gaps=../../..
+ *                             (bus_timing.h, one per bus; load over the last
+ *                             second and peak over the last minute in permille;
+ *                             gaps is the idle gap histogram by bit times)
+ *   TIMESTAMP_MS,IDSTAT,0,0,0,id=0x123;count=..;missing=..;jitter=..;lost=..;delay=..
+ *                             (one per tracked ID; missing counts the times a
+ *                             periodic ID went overdue; jitter is its interval
+ *                             spread and delay its longest estimated
+ *                             arbitration delay, both in us; lost counts frames
+ *                             that came back-to-back behind a higher-priority
+ *                             ID; ;bus=.. on multi-bus builds)
+ *   TIMESTAMP_MS,IDTOP,0,0,0,id=0x123;count=..;err=..  (heaviest IDs that didn't
+ *                                                  fit in the ID table, see
+ *                                                  id_sketch.h; ;bus=.. as IDSTAT)
+ *   TIMESTAMP_MS,STATEND,0,0,0,ids=..;top=..      (end of one status report)
+ *   0,EPOCH,0,0,0,epoch=..;reason=clear|baud;start=..
+ *                           (timestamps restart at 0 from here; start is the
+ *                           new zero in ms since boot, see time_base.h)
+ *   TIMESTAMP_MS,TIME,0,0,0,us=..;start=..;epoch=..;boot=..[;utc=..;err=..;
+ *                           ppm=..;stale=0|1]   (reply to "time": the device
+ *                           clock in us and, once a host has anchored it,
+ *                           the Unix time in us)
+ *   TIMESTAMP_MS,ERROR,0,0,0,total=..
+ *   TIMESTAMP_MS,RECOVER,0,0,0,reason=..;ok=0|1;down=..;recoveries=..;bus=..
+ *   TIMESTAMP_MS,ALERT,0,0,0,type=..;id=0x123;value=..;expected=..
+ *                           (anomaly.h; new_id, dlc, period, payload or missing,
+ *                           value/expected in bytes for dlc and us for period
+ *                           and missing; ;bus=.. as IDSTAT)
+ *
+ * STATUS counts are totals over all buses, with bus 0's baud.
+ *
+ * "burst start" captures at full rate into free RAM with every output
+ * stopped, until a frame count, duration or trigger ID (burst_capture.h),
+ * then reports
+ *   TIMESTAMP_MS,BURST,0,0,0,frames=..;bytes=..;us=..;fps=..;overflows=..;
+ *                            errors=..;lossless=0|1;reason=..;psram=0|1
+ * "burst dump" replays it between BURST begin and end records, in the
+ * frame layout with timestamps in us since the burst started.
+ *
+ * "flight dump" replays the flash flight recorder between FLIGHT begin
+ * and end records. Its rows use the frame layout with timestamps in ms
+ * since that boot, and a BOOT row (boot=..;seq=..) starts each boot.
+ *
  * Wiring (ESP32 to MCP2515 + SN65HVD230 module, 8 MHz crystal):
  *   ESP32 GPIO23  -> MCP2515 MOSI  (SPI data out)
  *   ESP32 GPIO19  -> MCP2515 MISO  (SPI data in)
@@ -22,45 +91,160 @@
  *
  * Make sure the 120 ohm termination jumper on the module is
  * REMOVED when tapping into an already-terminated bus.
+ *
+ * Optional mark buttons from GPIO13, GPIO14 and GPIO25 to GND log marks
+ * stamped at the moment they're pressed (mark_buttons.h).
+ *
+ * A second MCP2515 (CAN_BUS_COUNT=2, the serial-dual env) shares
+ * MOSI/MISO/SCK and uses GPIO17 for CS and GPIO16 for INT; see the pin
+ * tables in can_backend.h.
+ *
+ * The MCP2515 is the default; see can_backend.h for the TWAI and mock
+ * backends and their build flags.
  */
 
 #include <Arduino.h>
-#include <SPI.h>
-#include <mcp_can.h>
+#include <stdarg.h>
+#include "can_backend.h"
+#include "anomaly.h"
+#include "burst_capture.h"
+#include "bus_merge.h"
+#include "bus_timing.h"
+#include "can_health.h"
+#include "flight_recorder.h"
+#include "frame_format.h"
+#include "id_sketch.h"
+#include "mark_buttons.h"
+#include "payload_store.h"
+#include "rx_adapt.h"
+#include "time_base.h"
+#include "trace.h"
 
 // ============== CONFIGURATION ==============
 
-#define CAN_CS_PIN 5
-#define CAN_INT_PIN 4
-
-MCP_CAN CAN(CAN_CS_PIN);
-
-typedef enum {
-    BAUD_125K,
-    BAUD_250K,
-    BAUD_500K,
-    BAUD_1M
-} can_baud_t;
+CanBackend canBus[CAN_BUS_COUNT] = CAN_BUS_INDEXES;
 
-can_baud_t currentBaud = BAUD_250K;
+can_baud_t currentBaud[CAN_BUS_COUNT];     // BAUD_250K until changed
 
 // ============== GLOBALS ==============
 
-unsigned long messageCount = 0;
+unsigned long messageCount = 0;            // Totals over all buses
 unsigned long errorCount = 0;
 unsigned long startTime = 0;
+unsigned long busMessageCount[CAN_BUS_COUNT];
+unsigned long busErrorCount[CAN_BUS_COUNT];
+
+CanHealth canHealth[CAN_BUS_COUNT];
+BusMerge busMerge;
+RxAdapt rxAdapt;
+FlightRecorder flightRec;
+TimeBase timeBase;                         // Epochs and the host-set UTC anchor
+
+// Flight recorder dump in progress, emitted a slice per loop() pass like
+// status reports.
+#define FLIGHT_DUMP_BYTES_PER_LOOP 512
+bool flightDumpActive = false;
+bool flightDumpHaveBlock = false;
+FlightDump flightDump;
+FlightBlock flightDumpBlock;
+uint16_t flightDumpOffset = 0;
+uint32_t flightDumpBoot = 0;
+uint32_t flightDumpBlocks = 0;
+
+// Burst capture (burst_capture.h). While it runs loop() does nothing but
+// read; a dump afterwards goes out a slice per pass, as CSV rows through
+// the output queue, or as raw records straight to the UART. A raw dump
+// stops frame rows and waits for the queue to drain, then holds the
+// queue until the last record is out.
+BurstCapture burst;
+bool burstDumpActive = false;
+bool burstDumpBinary = false;
+bool burstDumpRaw = false;           // Raw records going out, queue held
+size_t burstDumpOffset = 0;
+unsigned long burstStartMs = 0;      // Since startTime, for the dump's begin row
+
+#ifdef TRACE_ENABLED
+// Trace dump in progress, emitted a slice per loop() pass.
+bool traceDumpActive = false;
+TraceExport traceDump;
+#endif
 
 #define MAX_UNIQUE_IDS 256
 uint32_t seenIds[MAX_UNIQUE_IDS];
+uint8_t idBus[MAX_UNIQUE_IDS];       // The same ID on two buses is two entries
 unsigned long idCounts[MAX_UNIQUE_IDS];
+PayloadStore<MAX_UNIQUE_IDS> lastData;
 int uniqueIdCount = 0;
+HyperLogLog idDistinct;              // Every ID seen, estimated
+TopK idOverflow;                     // Heaviest IDs that didn't fit above
+AnomalyDetector<MAX_UNIQUE_IDS> anomaly;   // Baselines per seenIds slot
+BusTimingStats<MAX_UNIQUE_IDS> busTiming;  // Gaps, load and jitter, per seenIds slot
+
+// Serial command line, assembled one byte per loop() pass.
+#define CMD_LINE_MAX 64
+char cmdLine[CMD_LINE_MAX];
+int cmdLen = 0;
+unsigned long cmdLineTime = 0;   // Timestamp of the first byte of the line
 
-// Flag set when 'm' is pressed -- the next line of serial input
-// will be captured as an annotation rather than treated as commands.
+// Set by a bare "m" -- the next line of serial input is captured as an
+// annotation, stamped with the time the 'm' was typed.
 bool awaitingMark = false;
+unsigned long pendingMarkTime = 0;
+
+// GPIO mark buttons (mark_buttons.h), stamped when pressed.
+MarkButtons markButtons;
+
+// Software ID filter. Empty means every ID is printed.
+#define MAX_FILTERS 8
+struct IdRange {
+    uint32_t lo;
+    uint32_t hi;
+    int8_t bus;       // -1 = any bus
+};
+IdRange filters[MAX_FILTERS];
+int filterCount = 0;
+
+typedef enum {
+    OUTPUT_ALL,       // Print every frame
+    OUTPUT_CHANGED,   // Print a frame only when its ID's payload changes
+    OUTPUT_QUIET      // Track and count, but print nothing
+} output_mode_t;
+
+typedef enum {
+    FORMAT_CSV,       // TIMESTAMP_MS,ID,EXTENDED,FLAGS,DLC,DATA[,BUS]
+    FORMAT_CANDUMP    // (seconds) canN ID#DATA, as written by candump -L
+} output_format_t;
+
+output_mode_t outputMode = OUTPUT_ALL;
+output_format_t outputFormat = FORMAT_CSV;
+
+// Output queue. Whole lines go in; flushOutput() hands the UART only as
+// much as fits in its TX buffer, and only up to a line boundary so
+// interactive replies printed directly never land mid-record. If the
+// queue is full the new line is dropped and counted rather than waiting.
+// The last OUT_MARK_RESERVE bytes take only MARK rows, so a frame flood
+// or a dump can't crowd out an operator's mark.
+#define OUT_BUFFER_SIZE 8192
+#define OUT_LINE_MAX 320         // A 64-byte FD frame, or a BOOT row and a frame
+#define OUT_MARK_RESERVE 1024    // A few maximum-length MARK rows
+char outBuffer[OUT_BUFFER_SIZE];
+int outHead = 0;          // Next byte to write into
+int outTail = 0;          // Next byte to send
+int outUsed = 0;
+unsigned long outDropped = 0;
+
+// Status reports are emitted a few records per loop() pass so a full ID
+// table never hogs the queue. statusCursor walks seenIds[], then
+// idOverflow, between passes.
+#define STATUS_BYTES_PER_LOOP 256
+#define STATUS_INTERVAL_DEFAULT_MS 30000
+#define STATUS_INTERVAL_MAX_S 86400
+bool statusActive = false;
+int statusCursor = 0;
+unsigned long statusIntervalMs = STATUS_INTERVAL_DEFAULT_MS;   // 0 = no periodic status
 
 // Forward declarations
-void clearCounts();
+void clearCounts(const char* reason);
 
 // ============== CAN SETUP ==============
 
@@ -74,109 +258,327 @@ const char* baudToString(can_baud_t baud) {
     }
 }
 
-byte getMcpBaud(can_baud_t baud) {
+bool initCAN(int bus, can_baud_t baud) {
+    if (!canBus[bus].begin(baud)) {
+        Serial.printf("Failed to initialise %s on bus %d\n", CanBackend::name(), bus);
+        return false;
+    }
+
+    healthReset(&canHealth[bus], millis());
+    rxAdaptApplyMask(&rxAdapt);
+    Serial.printf("CAN%d initialised at %s (%s)\n", bus, baudToString(baud), CanBackend::name());
+    return true;
+}
+
+int baudToKbps(can_baud_t baud) {
     switch(baud) {
-        case BAUD_125K: return CAN_125KBPS;
-        case BAUD_250K: return CAN_250KBPS;
-        case BAUD_500K: return CAN_500KBPS;
-        case BAUD_1M:   return CAN_1000KBPS;
-        default:        return CAN_250KBPS;
+        case BAUD_125K: return 125;
+        case BAUD_250K: return 250;
+        case BAUD_500K: return 500;
+        case BAUD_1M:   return 1000;
+        default:        return 0;
     }
 }
 
-bool initCAN(can_baud_t baud) {
-    byte result = CAN.begin(MCP_ANY, getMcpBaud(baud), MCP_8MHZ);
-    if (result != CAN_OK) {
-        Serial.printf("Failed to initialise MCP2515: %d\n", result);
+// ============== OUTPUT QUEUE ==============
+
+// Room for ordinary lines, not counting the MARK reserve.
+int outFree() {
+    return max(OUT_BUFFER_SIZE - OUT_MARK_RESERVE - outUsed, 0);
+}
+
+// Queues one complete line, into the MARK reserve too if mark is set.
+// Returns false (and counts a drop) if it doesn't fit; a partial line is
+// never queued.
+bool outWrite(const char* line, int len, bool mark = false) {
+    int room = mark ? OUT_BUFFER_SIZE - outUsed : outFree();
+    if (len > room) {
+        outDropped++;
         return false;
     }
-
-    CAN.setMode(MCP_LISTENONLY);
-    Serial.printf("CAN initialised at %s (MCP2515, 8 MHz crystal)\n", baudToString(baud));
+    int first = min(len, OUT_BUFFER_SIZE - outHead);
+    memcpy(outBuffer + outHead, line, first);
+    memcpy(outBuffer, line + first, len - first);
+    outHead = (outHead + len) % OUT_BUFFER_SIZE;
+    outUsed += len;
     return true;
 }
 
+int outVprintf(bool mark, const char* fmt, va_list args) {
+    char line[OUT_LINE_MAX];
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    if (len < 0) return 0;
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    return outWrite(line, len, mark) ? len : 0;
+}
+
+// printf into the queue. Returns the number of bytes queued, 0 if dropped.
+int outPrintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = outVprintf(false, fmt, args);
+    va_end(args);
+    return len;
+}
+
+// outPrintf() for MARK rows, which may use the MARK reserve.
+int outPrintfMark(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = outVprintf(true, fmt, args);
+    va_end(args);
+    return len;
+}
+
+// Sends as much queued output as the UART will accept without blocking,
+// stopping at the last complete line that fits.
+void writeOutputChunk() {
+    int room = Serial.availableForWrite();
+    int chunk = min(min(room, outUsed), OUT_BUFFER_SIZE - outTail);
+    while (chunk > 0 && outBuffer[outTail + chunk - 1] != '\n') chunk--;
+
+    if (chunk == 0) {
+        // The next line wraps the end of the buffer: send its first part
+        // if the UART can take the whole line, since nothing else can be
+        // interleaved between the two writes.
+        int wrapped = OUT_BUFFER_SIZE - outTail;
+        if (wrapped >= outUsed || wrapped > room) return;
+        int rest = 0;
+        while (rest < outUsed - wrapped && outBuffer[rest] != '\n') rest++;
+        if (rest == outUsed - wrapped || wrapped + rest + 1 > room) return;
+        Serial.write((const uint8_t*)outBuffer + outTail, wrapped);
+        Serial.write((const uint8_t*)outBuffer, rest + 1);
+        outTail = rest + 1;
+        outUsed -= wrapped + rest + 1;
+        return;
+    }
+
+    Serial.write((const uint8_t*)outBuffer + outTail, chunk);
+    outTail = (outTail + chunk) % OUT_BUFFER_SIZE;
+    outUsed -= chunk;
+}
+
+void flushOutput() {
+    if (outUsed == 0) return;
+    TRACE_BEGIN(TRACE_SERIAL_FLUSH, 0);
+    writeOutputChunk();
+    TRACE_END(TRACE_SERIAL_FLUSH, 0);
+}
+
+// Called when a bus's health monitor reports a fault: re-initialise that
+// controller with its current baud (filters, mode and format are
+// software-side and survive) and log the outcome as a RECOVER record.
+void recoverCAN(int bus, can_fault_t fault) {
+    unsigned long now = millis();
+    CanHealth* h = &canHealth[bus];
+    bool ok = initCAN(bus, currentBaud[bus]);
+    unsigned long down;
+    if (ok) {
+        down = healthRecovered(h, now);
+    } else {
+        healthRecoveryFailed(h, now);
+        down = now - h->faultSince;
+    }
+    outPrintf("%lu,RECOVER,0,0,0,reason=%s;ok=%d;down=%lu;recoveries=%lu;bus=%d\n",
+              now - startTime, faultToString(fault), ok ? 1 : 0, down, h->recoveries, bus);
+}
+
 // ============== MESSAGE TRACKING ==============
 
-int findOrAddId(uint32_t id) {
+// Counts the frame against its bus and ID and records the payload. Sets
+// *changed if the payload differs from the previous frame with the same
+// ID on that bus (or the ID is new, or the table is full and we can't tell).
+int findOrAddId(const CanFrame* frame, bool* changed) {
+    hllAdd(&idDistinct, sketchKey(frame));
     for (int i = 0; i < uniqueIdCount; i++) {
-        if (seenIds[i] == id) {
+        if (seenIds[i] == frame->id && idBus[i] == frame->bus) {
             idCounts[i]++;
+            *changed = payloadStore(&lastData, i, frame);
             return i;
         }
     }
 
+    *changed = true;
     if (uniqueIdCount < MAX_UNIQUE_IDS) {
-        seenIds[uniqueIdCount] = id;
+        seenIds[uniqueIdCount] = frame->id;
+        idBus[uniqueIdCount] = frame->bus;
         idCounts[uniqueIdCount] = 1;
+        payloadStore(&lastData, uniqueIdCount, frame);
         uniqueIdCount++;
         return uniqueIdCount - 1;
     }
 
+    topkAdd(&idOverflow, sketchKey(frame));
     return -1;
 }
 
-// Format: TIMESTAMP_MS,CAN_ID,EXTENDED,RTR,DLC,DATA_BYTES
-void printMessageHex(uint32_t id, bool extended, bool rtr, uint8_t dlc, uint8_t* data) {
-    unsigned long timestamp = millis() - startTime;
-
-    Serial.printf("%lu,", timestamp);
-
-    if (extended) {
-        Serial.printf("0x%08X,", id);
-    } else {
-        Serial.printf("0x%03X,", id);
+bool passesFilter(const CanFrame* frame) {
+    if (filterCount == 0) return true;
+    for (int i = 0; i < filterCount; i++) {
+        if (filters[i].bus >= 0 && filters[i].bus != frame->bus) continue;
+        if (frame->id >= filters[i].lo && frame->id <= filters[i].hi) return true;
     }
+    return false;
+}
 
-    Serial.printf("%d,%d,%d,",
-        extended ? 1 : 0,
-        rtr ? 1 : 0,
-        dlc);
+// One line in the candump -L format of frame_format.h.
+void printMessageCandump(const CanFrame* frame) {
+    char line[OUT_LINE_MAX];
+    outWrite(line, formatFrameCandump(frame, millis() - startTime, line, sizeof(line)));
+}
 
-    for (int i = 0; i < dlc; i++) {
-        Serial.printf("%02X", data[i]);
-        if (i < dlc - 1) Serial.print(" ");
+// One line in the CSV format of frame_format.h, ms since startTime.
+void printMessageHex(const CanFrame* frame) {
+    if (outputFormat == FORMAT_CANDUMP) {
+        printMessageCandump(frame);
+        return;
     }
-
-    Serial.println();
+    char line[OUT_LINE_MAX];
+    outWrite(line, formatFrameCsv(frame, millis() - startTime, line, sizeof(line)));
 }
 
+// Starts a status report: the STATUS record is queued now and the
+// per-ID records follow from serviceStatus() over the next few passes.
+// A report already in progress is restarted.
 void printStatus() {
-    Serial.println("\n========== STATUS ==========");
-    Serial.printf("Uptime: %lu ms\n", millis() - startTime);
-    Serial.printf("Baud rate: %s\n", baudToString(currentBaud));
-    Serial.printf("Messages received: %lu\n", messageCount);
-    Serial.printf("Errors: %lu\n", errorCount);
-    Serial.printf("Unique CAN IDs seen: %d\n", uniqueIdCount);
+    unsigned long now = millis();
+    unsigned long overflows = 0, recoveries = 0, downtime = 0;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        overflows += canHealth[b].overflows;
+        recoveries += canHealth[b].recoveries;
+        downtime += healthDowntime(&canHealth[b], now);
+    }
+    outPrintf("%lu,STATUS,0,0,0,uptime=%lu;baud=%d;msgs=%lu;errors=%lu;ids=%d;dropped=%lu;"
+              "overflows=%lu;recoveries=%lu;downtime=%lu;rxmode=%s;rxswitches=%lu;rxsleep=%lu;"
+              "distinct=%lu;untracked=%lu;alerts=%lu;suppressed=%lu\n",
+              now - startTime, now - startTime, baudToKbps(currentBaud[0]),
+              messageCount, errorCount, uniqueIdCount, outDropped,
+              overflows, recoveries, downtime, rxModeToString(rxAdapt.mode),
+              rxAdapt.toPoll + rxAdapt.toIrq, (unsigned long)(rxAdapt.sleepUs / 1000),
+              hllEstimate(&idDistinct), idOverflow.total, anomalyAlertTotal(&anomaly), anomaly.suppressed);
+#if CAN_BUS_COUNT > 1
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        outPrintf("%lu,BUSSTAT,0,0,0,bus=%d;baud=%d;msgs=%lu;errors=%lu;overflows=%lu;"
+                  "recoveries=%lu;downtime=%lu\n",
+                  now - startTime, b, baudToKbps(currentBaud[b]), busMessageCount[b], busErrorCount[b],
+                  canHealth[b].overflows, canHealth[b].recoveries, healthDowntime(&canHealth[b], now));
+    }
+#endif
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        const BusTiming* t = &busTiming.buses[b];
+        char gaps[TIMING_GAP_BUCKETS * 11];
+        int len = 0;
+        for (size_t g = 0; g < TIMING_GAP_BUCKETS; g++) {
+            len += snprintf(gaps + len, sizeof(gaps) - len, g ? "/%lu" : "%lu", t->gaps[g]);
+        }
+        outPrintf("%lu,TIMING,0,0,0,bus=%d;load=%d;peak=%d;b2b=%lu;clusters=%lu;maxcluster=%u;"
+                  "maxclusterus=%lu;gaps=%s\n",
+                  now - startTime, b, (int)(timingLoad(t) * 1000), (int)(timingPeakLoad(t) * 1000),
+                  t->backToBack, t->clusters, t->maxClusterFrames, (unsigned long)t->maxClusterUs, gaps);
+    }
+    statusActive = true;
+    statusCursor = 0;
+}
+
+// Queues the next slice of the ID table, up to STATUS_BYTES_PER_LOOP
+// bytes. If the queue is too full the slice waits for the next pass
+// instead of dropping records.
+void serviceStatus() {
+    if (!statusActive) return;
+    int budget = STATUS_BYTES_PER_LOOP;
+    unsigned long timestamp = millis() - startTime;
 
-    if (uniqueIdCount > 0) {
-        Serial.println("\nID Summary:");
-        for (int i = 0; i < uniqueIdCount; i++) {
-            Serial.printf("  0x%03X: %lu messages\n", seenIds[i], idCounts[i]);
+    while (budget > 0) {
+        if (outFree() < OUT_LINE_MAX) return;
+
+        if (statusCursor >= uniqueIdCount + idOverflow.used) {
+            outPrintf("%lu,STATEND,0,0,0,ids=%d;top=%d\n", timestamp, uniqueIdCount, idOverflow.used);
+            statusActive = false;
+            return;
+        }
+        if (statusCursor >= uniqueIdCount) {
+            const TopKEntry* e = &idOverflow.entries[statusCursor - uniqueIdCount];
+#if CAN_BUS_COUNT > 1
+            budget -= outPrintf("%lu,IDTOP,0,0,0,id=0x%03X;count=%lu;err=%lu;bus=%d\n",
+                                timestamp, sketchKeyId(e->key), e->count, e->err, sketchKeyBus(e->key));
+#else
+            budget -= outPrintf("%lu,IDTOP,0,0,0,id=0x%03X;count=%lu;err=%lu\n",
+                                timestamp, sketchKeyId(e->key), e->count, e->err);
+#endif
+            statusCursor++;
+            continue;
         }
+        const IdTiming* timing = &busTiming.ids[statusCursor];
+#if CAN_BUS_COUNT > 1
+        budget -= outPrintf("%lu,IDSTAT,0,0,0,id=0x%03X;count=%lu;missing=%lu;jitter=%lu;lost=%lu;"
+                            "delay=%lu;bus=%d\n",
+                            timestamp, seenIds[statusCursor], idCounts[statusCursor],
+                            anomaly.ids[statusCursor].missing, (unsigned long)timingJitterUs(timing),
+                            (unsigned long)timing->lostArb, (unsigned long)timing->maxDelayUs,
+                            idBus[statusCursor]);
+#else
+        budget -= outPrintf("%lu,IDSTAT,0,0,0,id=0x%03X;count=%lu;missing=%lu;jitter=%lu;lost=%lu;"
+                            "delay=%lu\n",
+                            timestamp, seenIds[statusCursor], idCounts[statusCursor],
+                            anomaly.ids[statusCursor].missing, (unsigned long)timingJitterUs(timing),
+                            (unsigned long)timing->lostArb, (unsigned long)timing->maxDelayUs);
+#endif
+        statusCursor++;
     }
-    Serial.println("============================\n");
 }
 
 void printHelp() {
     Serial.println("\n========== COMMANDS ==========");
+    Serial.println("Type a command and press Enter.");
+#if CAN_BUS_COUNT > 1
+    Serial.println("1 [BUS] - Set baud to 125 kbps (every bus, or just BUS)");
+    Serial.println("2 [BUS] - Set baud to 250 kbps (default, most common)");
+    Serial.println("3 [BUS] - Set baud to 500 kbps");
+    Serial.println("4 [BUS] - Set baud to 1 Mbps");
+    Serial.println("a [BUS] - Auto-scan all baud rates on every bus, or just BUS");
+#else
     Serial.println("1 - Set baud to 125 kbps");
     Serial.println("2 - Set baud to 250 kbps (default, most common)");
     Serial.println("3 - Set baud to 500 kbps");
     Serial.println("4 - Set baud to 1 Mbps");
     Serial.println("a - Auto-scan all baud rates");
+#endif
     Serial.println("s - Print status summary");
+    Serial.println("status auto off|on|SECS - Periodic status (default every 30 s)");
     Serial.println("c - Clear message counts");
-    Serial.println("m - Add annotation mark (type text, press enter)");
+    Serial.println("m [text]          - Add annotation mark (bare m: text on next line)");
+    Serial.println("button [N LABEL]  - List the GPIO mark buttons, or relabel button N");
+    Serial.println("filter ID|LO-HI.. - Only print these IDs (up to 8, e.g. filter 0x100-0x1FF 0x7E8)");
+#if CAN_BUS_COUNT > 1
+    Serial.println("                    BUS:ID|BUS:LO-HI limits a range to one bus (e.g. 1:0x7E8)");
+#endif
+    Serial.println("filter off        - Print all IDs");
+    Serial.println("mode all|changed|quiet - Print every frame, payload changes only, or nothing");
+    Serial.println("format csv|candump     - Output line format");
+    Serial.println("time [UTC AT [PPM [ERR]]] - Device clock for host sync, or set its UTC anchor (us)");
+    Serial.println("flight [on|off|dump]   - Flash flight recorder state, enable, or replay");
+    Serial.println("burst start [frames=N] [ms=N] [trigger=ID [post=N]]");
+    Serial.println("                       - Capture at full rate into free RAM, no output until it stops");
+    Serial.println("                         (any input stops it)");
+    Serial.println("burst [dump [bin]|free] - Last burst's result, replay as rows or raw records, release RAM");
+#ifdef TRACE_ENABLED
+    Serial.println("trace on|off|clear|dump - Internal event trace (Chrome/Perfetto JSON)");
+#endif
     Serial.println("h - Print this help");
     Serial.println("==============================\n");
 }
 
-// Tries each baud rate for a few seconds and reports which one looks
-// like real CAN traffic vs decoded noise. Real traffic has a small
+// Tries each baud rate on one bus for a few seconds and reports which one
+// looks like real CAN traffic vs decoded noise. Real traffic has a small
 // number of IDs that repeat consistently. Noise produces many random IDs.
-void autoScan() {
-    Serial.println("\n========== AUTO-SCAN ==========");
+// The other buses are not read meanwhile. Only 64 IDs are kept per rate,
+// so the distinct count comes from a HyperLogLog once there are more.
+void autoScan(int bus) {
+    static HyperLogLog scanDistinct;
+    Serial.printf("\n========== AUTO-SCAN CAN%d ==========\n", bus);
     Serial.println("Testing each baud rate for 5 seconds...\n");
 
     can_baud_t rates[] = { BAUD_125K, BAUD_250K, BAUD_500K, BAUD_1M };
@@ -184,7 +586,7 @@ void autoScan() {
     float bestScore = 0;
 
     for (int r = 0; r < 4; r++) {
-        if (!initCAN(rates[r])) {
+        if (!initCAN(bus, rates[r])) {
             Serial.printf("  %s: FAILED to init\n", baudToString(rates[r]));
             continue;
         }
@@ -197,17 +599,17 @@ void autoScan() {
         unsigned long scanIdCounts[64];
         memset(scanIds, 0, sizeof(scanIds));
         memset(scanIdCounts, 0, sizeof(scanIdCounts));
+        hllClear(&scanDistinct);
 
         unsigned long scanStart = millis();
         while (millis() - scanStart < 5000) {
-            if (digitalRead(CAN_INT_PIN) == LOW) {
-                unsigned long rxId;
-                uint8_t dlc;
-                uint8_t data[8];
+            if (canBus[bus].pending()) {
+                CanFrame frame;
 
-                if (CAN.readMsgBuf(&rxId, &dlc, data) == CAN_OK) {
-                    uint32_t canId = rxId & 0x1FFFFFFF;
+                if (canBus[bus].read(&frame)) {
+                    uint32_t canId = frame.id;
                     scanMsgCount++;
+                    hllAdd(&scanDistinct, sketchKey(&frame));
 
                     // Track unique IDs (up to 64 for the scan)
                     bool found = false;
@@ -234,9 +636,10 @@ void autoScan() {
         //   - High repeat rate (each ID seen many times)
         //   - Low error count relative to message count
         // Noise has many unique IDs with low repeat counts.
+        unsigned long scanDistinctIds = scanUniqueIds < 64 ? scanUniqueIds : hllEstimate(&scanDistinct);
         float repeatRate = 0;
-        if (scanUniqueIds > 0 && scanMsgCount > 0) {
-            repeatRate = (float)scanMsgCount / (float)scanUniqueIds;
+        if (scanDistinctIds > 0 && scanMsgCount > 0) {
+            repeatRate = (float)scanMsgCount / (float)scanDistinctIds;
         }
         float errRate = 0;
         if (scanMsgCount + scanErrCount > 0) {
@@ -245,22 +648,22 @@ void autoScan() {
 
         // Higher repeat rate + fewer unique IDs = more likely real traffic
         float score = repeatRate;
-        if (scanUniqueIds > 30) score *= 0.1f;  // Penalise many random IDs
+        if (scanDistinctIds > 30) score *= 0.1f;  // Penalise many random IDs
 
         const char* verdict;
         if (scanMsgCount == 0) {
             verdict = "NO DATA";
-        } else if (scanUniqueIds <= 20 && repeatRate > 10) {
+        } else if (scanDistinctIds <= 20 && repeatRate > 10) {
             verdict = "<-- LIKELY CORRECT";
-        } else if (scanUniqueIds > 30) {
+        } else if (scanDistinctIds > 30) {
             verdict = "noise (random IDs)";
         } else {
             verdict = "uncertain";
         }
 
-        Serial.printf("  %s: %lu msgs, %d unique IDs, %.1f repeat rate, "
+        Serial.printf("  %s: %lu msgs, %s%lu unique IDs, %.1f repeat rate, "
                        "%.0f%% errors  %s\n",
-            baudToString(rates[r]), scanMsgCount, scanUniqueIds,
+            baudToString(rates[r]), scanMsgCount, scanUniqueIds < 64 ? "" : "~", scanDistinctIds,
             repeatRate, errRate, verdict);
 
         // Print the IDs seen if it looks like real traffic
@@ -282,148 +685,759 @@ void autoScan() {
     if (bestRate >= 0) {
         Serial.printf("Best match: %s\n", baudToString(rates[bestRate]));
         // Switch to the best rate
-        currentBaud = rates[bestRate];
-        initCAN(currentBaud);
-        clearCounts();
+        currentBaud[bus] = rates[bestRate];
+        initCAN(bus, currentBaud[bus]);
+        clearCounts("baud");
     } else {
         Serial.println("No valid traffic detected at any rate.");
-        initCAN(currentBaud);
+        initCAN(bus, currentBaud[bus]);
     }
     Serial.println("===============================\n");
 }
 
-void clearCounts() {
+// Resets the counts and starts a new epoch, so timestamps restart at 0;
+// the EPOCH row gives the new startTime in ms since boot (time_base.h).
+void clearCounts(const char* reason) {
     messageCount = 0;
     errorCount = 0;
     uniqueIdCount = 0;
+    memset(busMessageCount, 0, sizeof(busMessageCount));
+    memset(busErrorCount, 0, sizeof(busErrorCount));
     memset(seenIds, 0, sizeof(seenIds));
+    memset(idBus, 0, sizeof(idBus));
     memset(idCounts, 0, sizeof(idCounts));
+    payloadClear(&lastData);
+    hllClear(&idDistinct);
+    topkClear(&idOverflow);
+    anomalyClear(&anomaly, millis());
+    timingClear(&busTiming);
+    statusActive = false;
     startTime = millis();
+    uint32_t epoch = timeNewEpoch(&timeBase, startTime);
+    outPrintf("0,EPOCH,0,0,0,epoch=%lu;reason=%s;start=%lu\n", (unsigned long)epoch, reason, startTime);
     Serial.println("Counts cleared.");
 }
 
+// ============== SERIAL COMMANDS ==============
+
+void printMark(unsigned long timestamp, const char* text) {
+    outPrintfMark("%lu,MARK,0,0,0,%s\n", timestamp, text);
+    flightRecordMark(&flightRec, text);
+}
+
+// Logs each debounced mark button press, stamped when it was pressed.
+void serviceMarkButtons() {
+    MarkPress p;
+    while (markButtonsNext(&markButtons, &p)) {
+        printMark(markPressSince(&p, startTime), markButtons.buttons[p.button].label);
+    }
+}
+
+// button          -- list the mark buttons and their labels
+// button N LABEL  -- relabel button N with one of the standard labels
+void handleButtonCommand(char* args) {
+    if (*args == '\0') {
+        for (size_t i = 0; i < MARK_BUTTON_COUNT; i++) {
+            Serial.printf("Button %d: GPIO%d \"%s\"\n", (int)i, markButtons.buttons[i].pin,
+                          markButtons.buttons[i].label);
+        }
+        Serial.printf("%lu presses, %lu glitches ignored, %lu dropped\n",
+                      markButtons.presses, markButtons.glitches, markButtons.dropped);
+        return;
+    }
+    char* label;
+    unsigned long n = strtoul(args, &label, 10);
+    while (*label == ' ') label++;
+    if (label == args || !markButtonsSetLabel(&markButtons, n, label)) {
+        Serial.print("Usage: button N LABEL, LABEL one of:");
+        for (size_t k = 0; k < MARK_LABEL_COUNT; k++) Serial.printf(" \"%s\"", markLabels[k]);
+        Serial.println();
+        return;
+    }
+    Serial.printf("Button %lu: \"%s\"\n", n, markButtons.buttons[n].label);
+}
+
+#ifdef TRACE_ENABLED
+// Queues the next slice of a trace dump: Chrome trace_event JSON lines
+// between TRACE begin and end records. Recording stays paused until the
+// dump finishes.
+void serviceTraceDump() {
+    if (!traceDumpActive) return;
+    int budget = FLIGHT_DUMP_BYTES_PER_LOOP;
+
+    while (budget > 0) {
+        if (outFree() < OUT_LINE_MAX) return;
+        char line[OUT_LINE_MAX];
+        int len = traceExportNext(&traceDump, line, sizeof(line));
+        if (len == 0) {
+            outWrite(TRACE_JSON_FOOTER, strlen(TRACE_JSON_FOOTER));
+            outPrintf("%lu,TRACE,0,0,0,end;events=%lu\n", millis() - startTime, (unsigned long)traceDump.count);
+            traceExportEnd(&traceDump);
+            traceDumpActive = false;
+            return;
+        }
+        outWrite(line, len);
+        budget -= len;
+    }
+}
+
+// trace on|off|clear  -- control recording
+// trace dump          -- emit the ring as Chrome trace JSON (save the
+//                        lines between the TRACE records as a .json file)
+void handleTraceCommand(char* args) {
+    if (strcmp(args, "on") == 0) {
+        traceSetEnabled(true);
+    } else if (strcmp(args, "off") == 0) {
+        traceSetEnabled(false);
+    } else if (strcmp(args, "clear") == 0) {
+        traceClear();
+    } else if (strcmp(args, "dump") == 0) {
+        if (traceDumpActive || outFree() < (int)sizeof(TRACE_JSON_HEADER) + OUT_LINE_MAX) return;
+        traceExportBegin(&traceDump);
+        outPrintf("%lu,TRACE,0,0,0,begin\n", millis() - startTime);
+        outWrite(TRACE_JSON_HEADER, strlen(TRACE_JSON_HEADER));
+        traceDumpActive = true;
+        return;
+    } else {
+        Serial.println("Usage: trace on|off|clear|dump");
+        return;
+    }
+    Serial.printf("Trace %s, %lu events recorded.\n", traceRing.enabled ? "on" : "off",
+                  (unsigned long)traceRing.head);
+}
+#endif
+
+// Wakes loop() when it is asleep in interrupt mode; reads still happen in
+// loop(). arg is the bus number.
+void IRAM_ATTR canIntIsr(void* arg) {
+    (void)arg;                   // Only read when tracing
+    TRACE_INSTANT(TRACE_ISR, TRACE_TID_ISR, (uint32_t)(uintptr_t)arg);
+    rxAdaptWake(&rxAdapt);
+}
+
+// Queues the next slice of a flight recorder dump. Like serviceStatus(),
+// it waits rather than drops when the output queue is full.
+void serviceFlightDump() {
+    if (!flightDumpActive) return;
+    int budget = FLIGHT_DUMP_BYTES_PER_LOOP;
+
+    while (budget > 0) {
+        if (outFree() < OUT_LINE_MAX) return;
+
+        if (!flightDumpHaveBlock) {
+            if (!flightNextBlock(&flightRec, &flightDump, &flightDumpBlock)) {
+                outPrintf("%lu,FLIGHT,0,0,0,end;blocks=%lu\n", millis() - startTime, flightDumpBlocks);
+                flightDumpActive = false;
+                return;
+            }
+            flightDumpHaveBlock = true;
+            flightDumpOffset = 0;
+            flightDumpBlocks++;
+        }
+
+        FlightRecord rec;
+        if (!flightNextRecord(&flightDumpBlock, &flightDumpOffset, &rec)) {
+            flightDumpHaveBlock = false;
+            continue;
+        }
+        char line[OUT_LINE_MAX];
+        int len = flightFormatRecord(&flightDumpBlock, &rec, &flightDumpBoot, line, sizeof(line));
+        outWrite(line, len);
+        budget -= len;
+    }
+}
+
+// flight               -- recorder state
+// flight on|off        -- enable or disable (kept across reboots)
+// flight dump          -- replay the recorded log, oldest first
+void handleFlightCommand(char* args) {
+    if (!flightAvailable(&flightRec)) {
+        Serial.println("Flight recorder: no flightrec partition");
+        return;
+    }
+    if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+        flightSetEnabled(&flightRec, args[1] == 'n');
+    } else if (strcmp(args, "dump") == 0) {
+        if (flightDumpActive) return;
+        if (!flightBeginDump(&flightRec, &flightDump)) {
+            Serial.println("Flight recorder is empty.");
+            return;
+        }
+        outPrintf("%lu,FLIGHT,0,0,0,begin;boot=%lu\n", millis() - startTime, (unsigned long)flightRec.bootId);
+        flightDumpActive = true;
+        flightDumpHaveBlock = false;
+        flightDumpBoot = 0;
+        flightDumpBlocks = 0;
+        return;
+    } else if (*args != '\0') {
+        Serial.println("Usage: flight [on|off|dump]");
+        return;
+    }
+    Serial.printf("Flight recorder: %s, boot %lu, %lu KB, %lu blocks written, "
+                  "%lu write errors, %lu records dropped\n",
+                  flightRec.enabled ? "on" : "off", (unsigned long)flightRec.bootId,
+                  (unsigned long)(flightRec.sectorCount * FLIGHT_BLOCK_SIZE / 1024),
+                  (unsigned long)flightRec.blocksWritten, (unsigned long)flightRec.writeErrors,
+                  (unsigned long)flightRec.droppedRecords);
+    if (flightRec.blocksWritten > 0) {
+        Serial.printf("Compression: %lu KB to %lu KB (%.2fx), %lu us per block\n",
+                      (unsigned long)(flightRec.rawBytes / 1024), (unsigned long)(flightRec.storedBytes / 1024),
+                      (float)flightRec.rawBytes / flightRec.storedBytes,
+                      (unsigned long)(flightRec.compressUs / flightRec.blocksWritten));
+    }
+}
+
+// time                          -- the device clock for host time sync
+// time UTC_US AT_US [PPM [ERR]] -- set the UTC anchor (time_base.h)
+// Both answer with a TIME row. us is esp_timer_get_time() when the line
+// was run; utc, err, ppm and stale follow once an anchor is set.
+void handleTimeCommand(char* args) {
+    int64_t nowUs = esp_timer_get_time();
+    if (*args != '\0') {
+        char* end;
+        int64_t utcUs = strtoll(args, &end, 10);
+        int64_t atUs = strtoll(end, &end, 10);
+        float ppm = strtof(end, &end);
+        uint32_t errUs = strtoul(end, &end, 10);
+        if (atUs <= 0 || atUs > nowUs || !timeSetAnchor(&timeBase, utcUs, atUs, ppm, errUs)) {
+            Serial.println("Usage: time [UTC_US AT_US [PPM [ERR_US]]]");
+            return;
+        }
+        char text[FLIGHT_MAX_TEXT + 1];
+        snprintf(text, sizeof(text), "UTC %lld @%lld", (long long)(utcUs / 1000), (long long)(atUs / 1000));
+        flightRecordMark(&flightRec, text);
+    }
+    int64_t utc;
+    if (timeToUtc(&timeBase, nowUs, &utc)) {
+        outPrintf("%lu,TIME,0,0,0,us=%lld;start=%lu;epoch=%lu;boot=%lu;utc=%lld;err=%lu;ppm=%.3f;stale=%d\n",
+                  millis() - startTime, (long long)nowUs, timeBase.epochStartMs, (unsigned long)timeBase.epoch,
+                  (unsigned long)flightRec.bootId, (long long)utc, (unsigned long)timeBase.errUs, timeBase.ppm,
+                  timeAnchorStale(&timeBase, nowUs) ? 1 : 0);
+    } else {
+        outPrintf("%lu,TIME,0,0,0,us=%lld;start=%lu;epoch=%lu;boot=%lu\n",
+                  millis() - startTime, (long long)nowUs, timeBase.epochStartMs, (unsigned long)timeBase.epoch,
+                  (unsigned long)flightRec.bootId);
+    }
+}
+
+// Reports a finished burst: what stopped it, its rate and whether any
+// frame was lost.
+void printBurstResult() {
+    outPrintf("%lu,BURST,0,0,0,frames=%lu;bytes=%lu;us=%lu;fps=%lu;overflows=%lu;errors=%lu;"
+              "lossless=%d;reason=%s;psram=%d\n",
+              millis() - startTime, burst.frames, (unsigned long)burst.used, burst.elapsedUs,
+              burstFramesPerSecond(&burst), burst.overflows, burst.readErrors,
+              burstLossless(&burst) ? 1 : 0, burstStopToString(burst.reason), burst.psram ? 1 : 0);
+}
+
+// One pass of a running burst: read every bus into the buffer and nothing
+// else. Controllers are checked for overflow every BURST_FLAG_POLL_US, and
+// any serial input stops the burst. Frames read after it stopped stay in
+// the merge queue for the normal path, which the anomaly detector and
+// timing stats pick up again without counting the burst as a gap.
+void serviceBurst() {
+    burst.readErrors += mergeFill(&busMerge, canBus, canHealth, busErrorCount, RX_POLL_BUDGET);
+    CanFrame* frame;
+    while (burst.state == BURST_RUNNING && (frame = mergeNext(&busMerge)) != NULL) {
+        burstRecord(&burst, frame);
+    }
+    burstCheckTime(&burst);
+
+    if (micros() - burst.lastFlagPollUs >= BURST_FLAG_POLL_US) {
+        burst.lastFlagPollUs = micros();
+        for (int b = 0; b < CAN_BUS_COUNT; b++) {
+            if (canBus[b].errorFlags() & CAN_ERR_RX_OVERFLOW) {
+                burst.overflows++;
+                canBus[b].clearOverflow();
+            }
+        }
+    }
+    if (Serial.available()) {
+        while (Serial.available()) Serial.read();
+        burstStop(&burst, BURST_STOP_USER);
+    }
+    if (burst.state != BURST_RUNNING) {
+        anomalyResume(&anomaly, millis());
+        timingResume(&busTiming, millis());
+        printBurstResult();
+    }
+}
+
+// Emits the next slice of a burst dump. CSV rows wait for room in the
+// output queue; raw records wait for it to drain, then go straight to
+// the UART as fast as it takes them.
+void serviceBurstDump() {
+    if (!burstDumpActive) return;
+
+    if (burstDumpBinary) {
+        if (!burstDumpRaw && outUsed > 0) return;
+        burstDumpRaw = true;
+        size_t chunk = min((size_t)Serial.availableForWrite(), burst.used - burstDumpOffset);
+        Serial.write(burst.buf + burstDumpOffset, chunk);
+        burstDumpOffset += chunk;
+        if (burstDumpOffset == burst.used) {
+            burstDumpActive = false;
+            burstDumpRaw = false;
+        }
+        return;
+    }
+
+    int budget = FLIGHT_DUMP_BYTES_PER_LOOP;
+    while (budget > 0) {
+        if (outFree() < OUT_LINE_MAX) return;
+        CanFrame frame;
+        if (!burstNextRecord(&burst, &burstDumpOffset, &frame)) {
+            outPrintf("%lu,BURST,0,0,0,end;frames=%lu\n", millis() - startTime, burst.frames);
+            burstDumpActive = false;
+            return;
+        }
+        char line[OUT_LINE_MAX];
+        int len = burstFormatRecord(&frame, line, sizeof(line));
+        outWrite(line, len);
+        budget -= len;
+    }
+}
+
+// burst                     -- last burst's result
+// burst start [frames=N] [ms=N] [trigger=ID [post=N]]
+//                           -- capture until N frames, N ms, or N frames
+//                              after ID, whichever comes first (or until
+//                              RAM runs out or input arrives)
+// burst dump                -- replay as frame rows between BURST begin
+//                              and end records, timestamps in us since the
+//                              burst started
+// burst dump bin            -- a BURSTBIN row giving the byte count, then
+//                              the raw records (see burst_capture.h)
+// burst free                -- release the buffer
+void handleBurstCommand(char* args) {
+    char* tok = strtok(args, " ");
+    if (tok == NULL) {
+        if (burst.state == BURST_IDLE) {
+            Serial.println("No burst captured.");
+        } else {
+            printBurstResult();
+        }
+        return;
+    }
+    if (burstDumpActive) {
+        Serial.println("Burst dump in progress.");
+        return;
+    }
+
+    if (strcmp(tok, "start") == 0) {
+        unsigned long maxFrames = 0, maxMs = 0, post = 0;
+        bool hasTrigger = false;
+        uint32_t triggerId = 0;
+        while ((tok = strtok(NULL, " ")) != NULL) {
+            char* value = strchr(tok, '=');
+            char* end = NULL;
+            if (value != NULL) {
+                *value++ = '\0';
+                unsigned long v = strtoul(value, &end, 0);
+                if (strcmp(tok, "frames") == 0) maxFrames = v;
+                else if (strcmp(tok, "ms") == 0) maxMs = v;
+                else if (strcmp(tok, "post") == 0) post = v;
+                else if (strcmp(tok, "trigger") == 0) { hasTrigger = true; triggerId = v; }
+                else end = value;
+            }
+            if (end == NULL || end == value || *end != '\0') {
+                Serial.println("Usage: burst start [frames=N] [ms=N] [trigger=ID [post=N]]");
+                return;
+            }
+        }
+        if (!burstAlloc(&burst)) {
+            Serial.println("Not enough free RAM for a burst.");
+            return;
+        }
+        Serial.printf("Burst: %lu KB of %s, output stops until it ends (any input stops it).\n",
+                      (unsigned long)(burst.size / 1024), burst.psram ? "PSRAM" : "heap");
+        Serial.flush();
+        burstStartMs = millis() - startTime;
+        burstStart(&burst, maxFrames, maxMs, hasTrigger, triggerId, post);
+    } else if (strcmp(tok, "dump") == 0) {
+        if (burst.state != BURST_DONE) {
+            Serial.println("No burst captured.");
+            return;
+        }
+        burstDumpOffset = 0;
+        burstDumpBinary = false;
+        tok = strtok(NULL, " ");
+        if (tok != NULL && strcmp(tok, "bin") == 0) {
+            burstDumpBinary = true;
+            outPrintf("%lu,BURSTBIN,0,0,0,bytes=%lu\n", millis() - startTime, (unsigned long)burst.used);
+        } else {
+            outPrintf("%lu,BURST,0,0,0,begin;start=%lu;frames=%lu\n",
+                      millis() - startTime, burstStartMs, burst.frames);
+        }
+        burstDumpActive = true;
+    } else if (strcmp(tok, "free") == 0) {
+        burstFree(&burst);
+        Serial.println("Burst buffer freed.");
+    } else {
+        Serial.println("Usage: burst [start ...|dump [bin]|free]");
+    }
+}
+
+// status                 -- report now
+// status auto off|on|N   -- periodic reports off, back to 30 s, or every N s
+//                           (0 is off, at most a day)
+void handleStatusCommand(char* args) {
+    if (*args == '\0') {
+        printStatus();
+        return;
+    }
+    char* mode = strtok(args, " ");
+    char* value = strtok(NULL, " ");
+    if (strcmp(mode, "auto") != 0 || value == NULL) {
+        Serial.println("Usage: status [auto off|on|SECONDS]");
+        return;
+    }
+    if (strcmp(value, "off") == 0) {
+        statusIntervalMs = 0;
+    } else if (strcmp(value, "on") == 0) {
+        statusIntervalMs = STATUS_INTERVAL_DEFAULT_MS;
+    } else {
+        char* end;
+        unsigned long secs = strtoul(value, &end, 10);
+        if (end == value || *end != '\0' || secs > STATUS_INTERVAL_MAX_S) {
+            Serial.println("Usage: status [auto off|on|SECONDS]");
+            return;
+        }
+        statusIntervalMs = secs * 1000;
+    }
+    if (statusIntervalMs == 0) {
+        Serial.println("Periodic status off.");
+    } else {
+        Serial.printf("Periodic status every %lu s.\n", statusIntervalMs / 1000);
+    }
+}
+
+// Parses an optional bus number argument. Returns -1 if there is none
+// (meaning every bus), or -2 after printing why if it isn't a bus.
+int parseBusArg(const char* args) {
+    if (*args == '\0') return -1;
+    char* end;
+    long bus = strtol(args, &end, 10);
+    if (*end != '\0' || bus < 0 || bus >= CAN_BUS_COUNT) {
+        Serial.printf("Bad bus \"%s\" (0-%d)\n", args, CAN_BUS_COUNT - 1);
+        return -2;
+    }
+    return bus;
+}
+
+// Sets the baud on one bus, or on every bus if bus is -1.
+void setBaud(int bus, can_baud_t baud) {
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (bus >= 0 && b != bus) continue;
+        currentBaud[b] = baud;
+        initCAN(b, baud);
+    }
+    clearCounts("baud");
+}
+
+// filter ID|LO-HI ...  or  filter off. With no arguments, lists the filter.
+// A BUS: prefix limits a range to that bus.
+void handleFilterCommand(char* args) {
+    char* tok = strtok(args, " ");
+    if (tok == NULL) {
+        if (filterCount == 0) {
+            Serial.println("Filter: off (all IDs)");
+        }
+        for (int i = 0; i < filterCount; i++) {
+            if (filters[i].bus >= 0) {
+                Serial.printf("Filter: %d:0x%03X-0x%03X\n", filters[i].bus, filters[i].lo, filters[i].hi);
+            } else {
+                Serial.printf("Filter: 0x%03X-0x%03X\n", filters[i].lo, filters[i].hi);
+            }
+        }
+        return;
+    }
+    if (strcmp(tok, "off") == 0 || strcmp(tok, "clear") == 0) {
+        filterCount = 0;
+        Serial.println("Filter off.");
+        return;
+    }
+
+    int count = 0;
+    IdRange parsed[MAX_FILTERS];
+    for (; tok != NULL; tok = strtok(NULL, " ")) {
+        char* end;
+        const char* range = tok;
+        long bus = -1;
+        bool badBus = false;
+        char* colon = strchr(tok, ':');
+        if (colon != NULL) {
+            bus = strtol(tok, &end, 10);
+            badBus = end != colon || bus < 0 || bus >= CAN_BUS_COUNT;
+            range = colon + 1;
+        }
+        uint32_t lo = strtoul(range, &end, 0);
+        uint32_t hi = lo;
+        if (*end == '-') hi = strtoul(end + 1, &end, 0);
+        if (*end != '\0' || hi < lo || hi > 0x1FFFFFFF || badBus || count == MAX_FILTERS) {
+            Serial.printf("Bad filter \"%s\" (use ID or LO-HI, max %d)\n", tok, MAX_FILTERS);
+            return;
+        }
+        parsed[count].lo = lo;
+        parsed[count].hi = hi;
+        parsed[count].bus = bus;
+        count++;
+    }
+    memcpy(filters, parsed, sizeof(parsed[0]) * count);
+    filterCount = count;
+    Serial.printf("Filter set (%d range%s).\n", count, count == 1 ? "" : "s");
+}
+
+// Runs one complete command line. lineTime is when its first byte arrived,
+// so a mark is stamped when 'm' was typed rather than when Enter was.
+void processCommand(char* line, unsigned long lineTime) {
+    if (awaitingMark) {
+        awaitingMark = false;
+        if (line[0] != '\0') printMark(pendingMarkTime, line);
+        return;
+    }
+
+    char* args = strchr(line, ' ');
+    if (args != NULL) {
+        *args++ = '\0';
+        while (*args == ' ') args++;
+    } else {
+        args = line + strlen(line);
+    }
+
+    for (char* c = line; *c; c++) *c = tolower(*c);
+
+    if (line[0] >= '1' && line[0] <= '4' && line[1] == '\0') {
+        static const can_baud_t bauds[] = { BAUD_125K, BAUD_250K, BAUD_500K, BAUD_1M };
+        int bus = parseBusArg(args);
+        if (bus >= -1) setBaud(bus, bauds[line[0] - '1']);
+    } else if (strcmp(line, "a") == 0 || strcmp(line, "scan") == 0) {
+        int bus = parseBusArg(args);
+        for (int b = 0; b < CAN_BUS_COUNT; b++) {
+            if (bus == -1 || b == bus) autoScan(b);
+        }
+    } else if (strcmp(line, "s") == 0 || strcmp(line, "status") == 0) {
+        handleStatusCommand(args);
+    } else if (strcmp(line, "c") == 0 || strcmp(line, "clear") == 0) {
+        clearCounts("clear");
+    } else if (strcmp(line, "m") == 0 || strcmp(line, "mark") == 0) {
+        if (*args != '\0') {
+            printMark(lineTime, args);
+        } else {
+            Serial.print("MARK> ");
+            pendingMarkTime = lineTime;
+            awaitingMark = true;
+        }
+#ifdef TRACE_ENABLED
+    } else if (strcmp(line, "trace") == 0) {
+        handleTraceCommand(args);
+#endif
+    } else if (strcmp(line, "time") == 0) {
+        handleTimeCommand(args);
+    } else if (strcmp(line, "flight") == 0) {
+        handleFlightCommand(args);
+    } else if (strcmp(line, "button") == 0) {
+        handleButtonCommand(args);
+    } else if (strcmp(line, "burst") == 0) {
+        handleBurstCommand(args);
+    } else if (strcmp(line, "filter") == 0) {
+        handleFilterCommand(args);
+    } else if (strcmp(line, "mode") == 0) {
+        if (strcmp(args, "all") == 0) outputMode = OUTPUT_ALL;
+        else if (strcmp(args, "changed") == 0) outputMode = OUTPUT_CHANGED;
+        else if (strcmp(args, "quiet") == 0) outputMode = OUTPUT_QUIET;
+        else Serial.println("Usage: mode all|changed|quiet");
+    } else if (strcmp(line, "format") == 0) {
+        if (strcmp(args, "csv") == 0) outputFormat = FORMAT_CSV;
+        else if (strcmp(args, "candump") == 0) outputFormat = FORMAT_CANDUMP;
+        else Serial.println("Usage: format csv|candump");
+    } else if (strcmp(line, "h") == 0 || strcmp(line, "help") == 0 || strcmp(line, "?") == 0) {
+        printHelp();
+    } else {
+        Serial.printf("Unknown command \"%s\" (h for help)\n", line);
+    }
+}
+
+// Consumes whatever serial input is already buffered without waiting for
+// more. A line is run once CR or LF arrives; CRLF pairs are harmless since
+// empty lines are ignored.
+void pollSerialInput() {
+    while (Serial.available()) {
+        char c = Serial.read();
+
+        if (c == '\r' || c == '\n') {
+            while (cmdLen > 0 && cmdLine[cmdLen - 1] == ' ') cmdLen--;
+            if (cmdLen == 0) continue;
+            cmdLine[cmdLen] = '\0';
+            cmdLen = 0;
+            processCommand(cmdLine, cmdLineTime);
+            continue;
+        }
+        if (c == '\b' || c == 0x7F) {
+            if (cmdLen > 0) cmdLen--;
+            continue;
+        }
+        if (cmdLen == 0) {
+            if (c == ' ') continue;
+            cmdLineTime = millis() - startTime;
+        }
+        if (cmdLen < CMD_LINE_MAX - 1) cmdLine[cmdLen++] = c;
+    }
+}
+
 // ============== MAIN ==============
 
 void setup() {
+    Serial.setTxBufferSize(1024);
     Serial.begin(115200);
     delay(2000);
 
-    pinMode(CAN_INT_PIN, INPUT);
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        healthInit(&canHealth[b]);
+        currentBaud[b] = BAUD_250K;
+    }
 
     Serial.println("\n\n");
     Serial.println("================================================");
-    Serial.println("   ETS CAN Bus Sniffer - ESP32 + MCP2515");
+    Serial.println("   ETS CAN Bus Sniffer - ESP32");
     Serial.println("   For Cummins MerCruiser Diesel ETS System");
     Serial.println("================================================");
-    Serial.printf("SPI CS Pin:  GPIO%d\n", CAN_CS_PIN);
-    Serial.printf("INT Pin:     GPIO%d\n", CAN_INT_PIN);
+    Serial.printf("Controller:  %s\n", CanBackend::name());
+#if defined(CAN_BACKEND_MCP2515) || defined(CAN_BACKEND_MCP2518FD)
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        Serial.printf("CAN%d pins:   CS GPIO%d, INT GPIO%d\n", b, canCsPins[b], canIntPins[b]);
+    }
     Serial.println("SPI Bus:     VSPI (MOSI=23, MISO=19, SCK=18)");
-    Serial.println("Crystal:     8 MHz");
+#endif
     Serial.println();
 
     printHelp();
 
-    if (!initCAN(currentBaud)) {
-        Serial.println("FATAL: Could not initialise MCP2515!");
-        while(1) { delay(1000); }
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (!initCAN(b, currentBaud[b])) {
+            Serial.println("FATAL: Could not initialise CAN controller!");
+            while(1) { delay(1000); }
+        }
     }
 
     startTime = millis();
+    timeBase.epochStartMs = startTime;
+
+    if (flightInit(&flightRec)) {
+        Serial.printf("Flight recorder: %s (boot %lu, 'flight on' to enable)\n",
+                      flightRec.enabled ? "on" : "off", (unsigned long)flightRec.bootId);
+    }
+
+    rxAdaptInit(&rxAdapt, canBus, canIntIsr);
+    if (markButtonsInit(&markButtons)) {
+        Serial.print("Mark buttons:");
+        for (size_t i = 0; i < MARK_BUTTON_COUNT; i++) {
+            Serial.printf(" GPIO%d \"%s\"", markButtons.buttons[i].pin, markButtons.buttons[i].label);
+        }
+        Serial.println();
+    }
 
     Serial.println("\nListening for CAN messages...");
-    Serial.println("Format: TIMESTAMP_MS,ID,EXTENDED,RTR,DLC,DATA\n");
+#if CAN_BUS_COUNT > 1
+    Serial.println("Format: TIMESTAMP_MS,ID,EXTENDED,FLAGS,DLC,DATA,BUS\n");
+#else
+    Serial.println("Format: TIMESTAMP_MS,ID,EXTENDED,FLAGS,DLC,DATA\n");
+#endif
+}
+
+// Tracks, records and prints one received frame.
+void handleFrame(const CanFrame* frame) {
+    flightRecordFrame(&flightRec, frame);
+    messageCount++;
+    busMessageCount[frame->bus]++;
+    bool changed;
+    TRACE_BEGIN(TRACE_TRACK, 0);
+    int i = findOrAddId(frame, &changed);
+    bool isNew = i >= 0 && idCounts[i] == 1;
+    anomalyOnFrame(&anomaly, i, frame, isNew, changed, millis());
+    timingOnFrame(&busTiming, i, frame, isNew, baudToBitsPerSecond(currentBaud[frame->bus]), millis());
+    TRACE_END(TRACE_TRACK, 0);
+    if (outputMode != OUTPUT_QUIET && !(burstDumpActive && burstDumpBinary) && passesFilter(frame) &&
+        (outputMode == OUTPUT_ALL || changed)) {
+        TRACE_BEGIN(TRACE_LOG_APPEND, 0);
+        printMessageHex(frame);
+        TRACE_END(TRACE_LOG_APPEND, 0);
+    }
+}
+
+// Queues an ALERT row for each alert raised since the last pass and
+// records it in the flight recorder as a mark.
+void printAlerts() {
+    Alert a;
+    while (anomalyNextAlert(&anomaly, &a)) {
+        char text[FLIGHT_MAX_TEXT + 1];
+        snprintf(text, sizeof(text), "ALERT %s 0x%03X", alertTypeToString(a.type), (unsigned)a.id);
+        flightRecordMark(&flightRec, text);
+#if CAN_BUS_COUNT > 1
+        outPrintf("%lu,ALERT,0,0,0,type=%s;id=0x%03X;value=%lu;expected=%lu;bus=%d\n",
+                  a.ms - startTime, alertTypeToString(a.type), (unsigned)a.id,
+                  (unsigned long)a.value, (unsigned long)a.expected, a.bus);
+#else
+        outPrintf("%lu,ALERT,0,0,0,type=%s;id=0x%03X;value=%lu;expected=%lu\n",
+                  a.ms - startTime, alertTypeToString(a.type), (unsigned)a.id,
+                  (unsigned long)a.value, (unsigned long)a.expected);
+#endif
+    }
 }
 
 void loop() {
-    // --- 1. Try to receive a CAN frame ---
-    if (digitalRead(CAN_INT_PIN) == LOW) {
-        unsigned long rxId;
-        uint8_t dlc;
-        uint8_t data[8];
-
-        byte result = CAN.readMsgBuf(&rxId, &dlc, data);
-
-        if (result == CAN_OK) {
-            bool extended = (rxId & 0x80000000) != 0;
-            bool rtr = (rxId & 0x40000000) != 0;
-            uint32_t canId = rxId & 0x1FFFFFFF;
-
-            messageCount++;
-            findOrAddId(canId);
-            printMessageHex(canId, extended, rtr, dlc, data);
-        } else {
-            errorCount++;
-            if (errorCount % 100 == 1) {
-                Serial.printf("CAN read error: %d (total errors: %lu)\n", result, errorCount);
-            }
-        }
+    // --- 0. A running burst has the loop to itself ---
+    if (burst.state == BURST_RUNNING) {
+        serviceBurst();
+        return;
     }
 
-    // --- 2. Check for serial commands ---
-    if (Serial.available()) {
-        if (awaitingMark) {
-            // Read the full line as an annotation
-            String markText = Serial.readStringUntil('\n');
-            markText.trim();
-            if (markText.length() > 0) {
-                unsigned long timestamp = millis() - startTime;
-                Serial.printf("%lu,MARK,0,0,0,%s\n", timestamp, markText.c_str());
-            }
-            awaitingMark = false;
-        } else {
-            char cmd = Serial.read();
-
-            switch(cmd) {
-                case '1':
-                    currentBaud = BAUD_125K;
-                    initCAN(currentBaud);
-                    clearCounts();
-                    break;
-                case '2':
-                    currentBaud = BAUD_250K;
-                    initCAN(currentBaud);
-                    clearCounts();
-                    break;
-                case '3':
-                    currentBaud = BAUD_500K;
-                    initCAN(currentBaud);
-                    clearCounts();
-                    break;
-                case '4':
-                    currentBaud = BAUD_1M;
-                    initCAN(currentBaud);
-                    clearCounts();
-                    break;
-                case 'a':
-                case 'A':
-                    autoScan();
-                    break;
-                case 's':
-                case 'S':
-                    printStatus();
-                    break;
-                case 'c':
-                case 'C':
-                    clearCounts();
-                    break;
-                case 'm':
-                case 'M':
-                    Serial.print("MARK> ");
-                    awaitingMark = true;
-                    break;
-                case 'h':
-                case 'H':
-                case '?':
-                    printHelp();
-                    break;
-            }
+    // --- 1. Read waiting frames from every bus, then handle them oldest first ---
+    int failed = mergeFill(&busMerge, canBus, canHealth, busErrorCount, rxAdaptBudget(&rxAdapt));
+    for (int i = 0; i < failed; i++) {
+        errorCount++;
+        if (errorCount % 100 == 1) {
+            outPrintf("%lu,ERROR,0,0,0,total=%lu\n", millis() - startTime, errorCount);
         }
     }
+    CanFrame* frame;
+    int frames = 0;
+    while ((frame = mergeNext(&busMerge)) != NULL) {
+        handleFrame(frame);
+        frames++;
+    }
+    rxAdaptUpdate(&rxAdapt, &busMerge, frames);
+    anomalyService(&anomaly, millis());
+    timingService(&busTiming, millis());
+    printAlerts();
+
+    // --- 2. Recover any controller that has stopped capturing ---
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        can_fault_t fault = healthPoll(&canHealth[b], canBus[b], millis());
+        if (fault != FAULT_NONE) recoverCAN(b, fault);
+    }
 
-    // --- 3. Auto-print status every 30 seconds ---
+    // --- 3. Check for serial commands (never blocks) and mark buttons ---
+    pollSerialInput();
+    serviceMarkButtons();
+
+    // --- 4. Periodic status, then emit any report in progress ---
     static unsigned long lastStatus = 0;
-    if (messageCount > 0 && millis() - lastStatus > 30000) {
+    if (statusIntervalMs > 0 && messageCount > 0 && millis() - lastStatus > statusIntervalMs) {
         printStatus();
         lastStatus = millis();
     }
+    serviceStatus();
+    serviceFlightDump();
+#ifdef TRACE_ENABLED
+    serviceTraceDump();
+#endif
+    flightService(&flightRec, millis());
+
+    // --- 5. Drain queued output to the UART without blocking ---
+    if (!burstDumpRaw) flushOutput();
+    serviceBurstDump();
+
+    // --- 6. Sleep until the next frame if the bus is quiet ---
+    rxAdaptWait(&rxAdapt, canBus);
 }
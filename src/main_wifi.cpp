@@ -1,17 +1,22 @@
 /*
  * ETS CAN Bus Sniffer - WiFi Version
  *
- * Same passive CAN sniffer as main.cpp but adds a WiFi access point and
- * web interface so you can view live traffic from a phone or tablet
- * without needing a serial cable. Useful when the ESP32 is mounted in
- * the engine bay and the laptop is at the helm.
+ * Same passive CAN sniffer as main.cpp but adds WiFi and a web interface
+ * so you can view live traffic from a phone or tablet without needing a
+ * serial cable. Useful when the ESP32 is mounted in the engine bay and
+ * the laptop is at the helm.
  *
- * The ESP32 creates its own WiFi network (access point mode, no router
- * needed). Connect to it and browse to the web UI to see messages,
- * change baud rate, and download CSV logs.
+ * The CAN controller is brought up first so capture starts immediately at
+ * key-on. WiFi then joins the network from wifi_config.h in the
+ * background. If it can't connect within WIFI_CONNECT_TIMEOUT_MS the
+ * ESP32 also creates its own network (access point mode, no router
+ * needed) while it keeps retrying the router. Frames are buffered the
+ * whole time, and dropped connections are retried without stalling
+ * capture.
  *
- * WiFi AP: "ETS_Sniffer" / password: "canbuslog"
- * Web UI:  http://192.168.4.1
+ * Station:  http://192.168.0.200 (static IP from wifi_config.h)
+ * Fallback: WiFi AP "ETS_Sniffer" / password "canbuslog",
+ *           web UI at http://192.168.4.1
  *
  * CAN bus operation is identical to the serial version: listen-only mode,
  * no transmissions, no ACKs, invisible on the bus.
@@ -26,21 +31,75 @@
  *   ESP32 GND     -> MCP2515 GND
  *   MCP2515 CANH  -> ETS CAN Bus High (parallel tap)
  *   MCP2515 CANL  -> ETS CAN Bus Low  (parallel tap)
+ *
+ * The MCP2515 is the default; see can_backend.h for the TWAI and mock
+ * backends and their build flags. With CAN_BUS_COUNT=2 (the wifi-dual
+ * env) a second MCP2515 on GPIO17 CS / GPIO16 INT captures another bus;
+ * frames from both are logged in timestamp order and tagged with their
+ * bus, and /baud and /scan take a bus= argument.
+ *
+ * The anomaly detector (anomaly.h) raises alerts for new IDs, length and
+ * timing changes and missing periodic frames. Each one is logged as an
+ * event, mirrored to serial as an ALERT row, and kept for /alerts, which
+ * the web UI polls to show a banner.
+ *
+ * /burst runs a burst capture (burst_capture.h): every frame goes into
+ * free RAM with logging, ID tracking and the flight recorder stopped,
+ * and the web server is only served every BURST_WEB_POLL_MS. The result
+ * is kept for /csv?burst=1.
+ *
+ * Marks from the web UI carry the browser's own timestamp and are placed
+ * at that time using a clock offset learned per browser from /ping
+ * (clock_sync.h).
+ *
+ * Optional mark buttons from GPIO13, GPIO14 and GPIO25 to GND log marks
+ * stamped at the moment they're pressed, free of WiFi latency
+ * (mark_buttons.h); /buttons lists and relabels them.
+ *
+ * /timing reports inter-frame gaps, busy clusters, bus load over the
+ * last minute and per-ID jitter and arbitration delay (bus_timing.h).
+ *
+ * Log timestamps restart at each /clear; every restart is logged as an
+ * EPOCH event and a baud change as a BAUD event. A host syncs to /time
+ * and sets a UTC anchor there, after which /csv gains a utc column
+ * (time_base.h, can_logger.py).
+ *
+ * The log is held delta coded (delta_codec.h), several thousand entries
+ * deep, and /csv?delta=1 downloads it in that form for can_merge.py.
+ *
+ * /log, /csv, /flight, /metrics and /trace are gzip-compressed for
+ * clients that send Accept-Encoding: gzip (deflate_stream.h); /perf
+ * reports the bytes saved and the CPU time it cost.
  */
 
 #include <Arduino.h>
-#include <SPI.h>
-#include <mcp_can.h>
 #include <WiFi.h>
 #include <WebServer.h>
 #include <ArduinoOTA.h>
+#include <stdarg.h>
+#include "anomaly.h"
+#include "burst_capture.h"
+#include "bus_merge.h"
+#include "bus_timing.h"
+#include "can_backend.h"
+#include "can_health.h"
+#include "clock_sync.h"
+#include "deflate_stream.h"
+#include "delta_codec.h"
+#include "flight_recorder.h"
+#include "heap_stats.h"
+#include "id_history.h"
+#include "id_sketch.h"
+#include "log_query.h"
+#include "mark_buttons.h"
+#include "payload_store.h"
+#include "rx_adapt.h"
+#include "time_base.h"
+#include "trace.h"
 
 // ============== CONFIGURATION ==============
 
-#define CAN_CS_PIN 5
-#define CAN_INT_PIN 4
-
-MCP_CAN CAN(CAN_CS_PIN);
+CanBackend canBus[CAN_BUS_COUNT] = CAN_BUS_INDEXES;
 
 // WiFi and network config loaded from gitignored header.
 // Copy wifi_config.example.h to wifi_config.h and fill in your values.
@@ -51,42 +110,197 @@ IPAddress gateway(GATEWAY_IP);
 IPAddress subnet(SUBNET_MASK);
 IPAddress dns(DNS_IP);
 
-typedef enum { BAUD_125K, BAUD_250K, BAUD_500K, BAUD_1M } can_baud_t;
-can_baud_t currentBaud = BAUD_250K;
+// Fallback access point, started if the router can't be joined in time.
+#define AP_SSID "ETS_Sniffer"
+#define AP_PASS "canbuslog"
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define WIFI_RETRY_MIN_MS 2000
+#define WIFI_RETRY_MAX_MS 60000
+
+can_baud_t currentBaud[CAN_BUS_COUNT];     // BAUD_250K until changed
 
 // ============== GLOBALS ==============
 
 WebServer server(80);
 
-unsigned long messageCount = 0;
+unsigned long messageCount = 0;            // Totals over all buses
 unsigned long errorCount = 0;
 unsigned long startTime = 0;
-
-// Ring buffer for CAN messages and inline annotations.
-// Annotations use isMark=true and store text in markText.
-#define LOG_BUFFER_SIZE 500
+unsigned long busMessageCount[CAN_BUS_COUNT];
+unsigned long busErrorCount[CAN_BUS_COUNT];
+
+CanHealth canHealth[CAN_BUS_COUNT];
+BusMerge busMerge;
+RxAdapt rxAdapt;
+FlightRecorder flightRec;
+FlightBlock flightDumpBlock;    // Scratch for /flight, too big for the stack
+FlightDump flightDump;          // Likewise
+HeapStats heapStats;
+
+// Per-route request statistics for /perf. Routes registered with
+// addRoute() are timed and have their loop-task allocations counted.
+#define MAX_ROUTES 24
+struct RouteStats {
+    const char* path;
+    uint32_t calls;
+    uint32_t allocs;          // Total across all calls
+    uint32_t maxAllocs;       // Most in a single call
+    uint32_t maxMicros;
+    int32_t lastHeapDelta;    // Free heap after minus before, last call
+};
+RouteStats routeStats[MAX_ROUTES];
+int routeCount = 0;
+
+// Log of CAN messages, inline annotations and firmware events, delta
+// coded (delta_codec.h) into a ring of LOG_BLOCKS blocks that drops its
+// oldest block when it needs room. Entries are numbered by seq, one
+// after another. At about 6 bytes a frame on ETS traffic it holds over
+// 5000 entries, in the RAM a ring of 500 LogEntry structs took.
+#define LOG_BLOCK_SIZE 2048
+#define LOG_BLOCKS     16
+#define LOG_REPLY_MAX  500      // Most entries one /log reply takes
+typedef enum {
+    LOG_FRAME,
+    LOG_MARK,       // User annotation from the web UI
+    LOG_EVENT       // Firmware event, e.g. a controller recovery
+} log_type_t;
+
+// One log entry as read back. Marks and events have no frame fields and
+// store their text in markText.
 struct LogEntry {
     unsigned long timestamp;
     uint32_t seq;           // Monotonic sequence number for dedup by polling clients
     uint32_t id;
     bool extended;
-    bool rtr;
-    uint8_t dlc;
-    uint8_t data[8];
-    bool isMark;
+    uint8_t flags;          // CAN_FLAG_*
+    uint8_t bus;
+    uint8_t len;            // Payload bytes
+    uint8_t data[CAN_MAX_DLEN];
+    uint8_t type;           // log_type_t
     char markText[40];
 };
-LogEntry logBuffer[LOG_BUFFER_SIZE];
-int logHead = 0;
-int logCount = 0;
+
+struct LogBlock {
+    DeltaBlockHeader header;
+    uint8_t data[LOG_BLOCK_SIZE - sizeof(DeltaBlockHeader)];
+};
+LogBlock logBlocks[LOG_BLOCKS];
+int logOldest = 0;         // Oldest block in use
+int logBlocksUsed = 0;     // The newest is being appended to
+int logCount = 0;          // Entries in those blocks
 uint32_t nextSeq = 1;      // Global sequence counter, never resets to 0
+DeltaState logEncoder;
+LogEntry logLastText;      // The last mark or event added, as stored
+
+// Reads entries oldest first, decoding a copy of each block so the log
+// can grow, or drop the block, while a download polls CAN.
+struct LogReader {
+    uint32_t seq;           // Next entry wanted
+    uint32_t end;           // Stop before this one
+    LogBlock block;
+    int pos;                // In block.data; -1 = no block loaded
+    uint32_t blockSeq;      // seq of the record at pos
+    DeltaState state;
+};
+LogReader logReader;        // Global: too big for the stack
 
 // Unique ID tracking with last-seen data for the web UI.
 #define MAX_UNIQUE_IDS 256
 uint32_t seenIds[MAX_UNIQUE_IDS];
+uint8_t idBus[MAX_UNIQUE_IDS];              // The same ID on two buses is two entries
 unsigned long idCounts[MAX_UNIQUE_IDS];
-uint8_t lastData[MAX_UNIQUE_IDS][8];
+PayloadStore<MAX_UNIQUE_IDS> lastData;
+unsigned long idLastUs[MAX_UNIQUE_IDS];     // micros() of the latest frame
+unsigned long idPeriodUs[MAX_UNIQUE_IDS];   // Smoothed interval between frames, 0 = unknown
 int uniqueIdCount = 0;
+HyperLogLog idDistinct;                     // Every ID seen, estimated
+TopK idOverflow;                            // Heaviest IDs that didn't fit above
+AnomalyDetector<MAX_UNIQUE_IDS> anomaly;    // Baselines per seenIds slot
+IdHistory<MAX_UNIQUE_IDS> idHistory;        // Recent frames per seenIds slot
+
+// Recent alerts for /alerts, numbered so polling clients can ask for
+// only the ones they haven't seen.
+#define ALERT_HISTORY_LEN 32
+struct AlertRecord {
+    uint32_t seq;
+    Alert alert;
+};
+AlertRecord alertHistory[ALERT_HISTORY_LEN];
+int alertHistoryHead = 0;
+int alertHistoryCount = 0;
+uint32_t nextAlertSeq = 1;
+
+// GPIO mark buttons (mark_buttons.h), stamped when pressed rather than
+// when the mark reaches the log.
+MarkButtons markButtons;
+
+// Browser clock offsets from /ping, for placing web UI marks at the time
+// they were tapped (clock_sync.h).
+ClockSync clockSync;
+
+// Epochs of startTime and the host-set UTC anchor (time_base.h).
+TimeBase timeBase;
+
+// Burst capture. While it runs loop() reads and records, and serves the
+// web server only every BURST_WEB_POLL_MS so /burst?stop=1 still works.
+#define BURST_WEB_POLL_MS 200
+BurstCapture burst;
+unsigned long burstStartMs = 0;      // Since startTime
+unsigned long burstLastWebMs = 0;
+
+// Gaps, busy periods, load and per-ID jitter (bus_timing.h), indexed by
+// ID table slot. Bus load for /metrics is its last one-second bucket.
+BusTimingStats<MAX_UNIQUE_IDS> busTiming;
+
+// Histogram of time between loop() passes, for spotting stalls.
+// Bucket upper bounds in microseconds; the last bucket is +Inf.
+const unsigned long loopGapBoundsUs[] = { 100, 1000, 10000, 100000, 1000000 };
+#define LOOP_GAP_BUCKETS (sizeof(loopGapBoundsUs) / sizeof(loopGapBoundsUs[0]) + 1)
+unsigned long loopGapCounts[LOOP_GAP_BUCKETS];
+uint64_t loopGapSumUs = 0;
+unsigned long lastLoopUs = 0;
+
+// Fixed buffer for streamed responses (/metrics, /trace), sent as HTTP
+// chunks with CAN polled in between.
+#define STREAM_CHUNK_SIZE 1024
+char streamChunk[STREAM_CHUNK_SIZE];
+int streamUsed = 0;
+
+// Response compression (deflate_stream.h). Downloads and /log are sent
+// gzip-encoded to clients that accept it, which browsers and
+// can_logger.py do; bodies under GZIP_MIN_BYTES aren't worth it.
+#define GZIP_MIN_BYTES 512
+DeflateStream httpDeflate;
+bool httpGzip = false;
+uint32_t gzipResponses = 0;
+uint32_t gzipInBytes = 0;
+uint32_t gzipOutBytes = 0;
+uint32_t gzipUs = 0;             // Spent compressing, not sending
+uint32_t gzipSinkUs = 0;
+
+// /metrics reports per-ID series for only the busiest IDs so the
+// number of time series stays bounded however many IDs the bus has.
+#define METRICS_TOP_IDS 32
+unsigned long lastScrapeUs = 0;
+
+// WiFi connection state. The event callback runs on the WiFi task, so it
+// only records what happened; serviceWiFi() acts on it from loop().
+volatile bool wifiConnected = false;
+volatile bool wifiLost = false;             // Set on disconnect, cleared by serviceWiFi()
+volatile bool wifiAttemptFailed = false;    // A disconnect since the last begin()/reconnect()
+volatile unsigned long wifiDownSince = 0;   // millis() when the link dropped
+bool apActive = false;
+volatile int apStations = 0;                // Phones on the fallback AP
+bool otaStarted = false;
+unsigned long nextWifiRetry = 0;
+unsigned long wifiRetryInterval = WIFI_RETRY_MIN_MS;
+
+// Startup and connectivity metrics (all in ms, 0 = not yet happened).
+unsigned long firstFrameMs = 0;        // Boot to first CAN frame
+unsigned long wifiConnectMs = 0;       // Boot to first IP address
+unsigned long wifiReconnects = 0;
+unsigned long lastReconnectGapMs = 0;  // Duration of the most recent outage
+unsigned long maxReconnectGapMs = 0;
 
 // ============== CAN FUNCTIONS ==============
 
@@ -100,81 +314,355 @@ const char* baudToString(can_baud_t baud) {
     }
 }
 
-byte getMcpBaud(can_baud_t baud) {
-    switch(baud) {
-        case BAUD_125K: return CAN_125KBPS;
-        case BAUD_250K: return CAN_250KBPS;
-        case BAUD_500K: return CAN_500KBPS;
-        case BAUD_1M:   return CAN_1000KBPS;
-        default:        return CAN_250KBPS;
-    }
-}
+bool initCAN(int bus, can_baud_t baud) {
+    if (!canBus[bus].begin(baud)) return false;
 
-bool initCAN(can_baud_t baud) {
-    byte result = CAN.begin(MCP_ANY, getMcpBaud(baud), MCP_8MHZ);
-    if (result != CAN_OK) return false;
-
-    CAN.setMode(MCP_LISTENONLY);
+    healthReset(&canHealth[bus], millis());
+    rxAdaptApplyMask(&rxAdapt);
     return true;
 }
 
-int findOrAddId(uint32_t id, uint8_t* data, uint8_t dlc) {
+// Sets *changed if the payload differs from the previous frame with the
+// same ID on that bus (or the ID is new, or the table is full).
+int findOrAddId(const CanFrame* frame, bool* changed) {
+    unsigned long now = micros();
+    hllAdd(&idDistinct, sketchKey(frame));
     for (int i = 0; i < uniqueIdCount; i++) {
-        if (seenIds[i] == id) {
+        if (seenIds[i] == frame->id && idBus[i] == frame->bus) {
             idCounts[i]++;
-            memcpy(lastData[i], data, dlc);
+            *changed = payloadStore(&lastData, i, frame);
+            unsigned long interval = now - idLastUs[i];
+            idPeriodUs[i] = idPeriodUs[i] == 0 ? interval : idPeriodUs[i] - idPeriodUs[i] / 8 + interval / 8;
+            idLastUs[i] = now;
             return i;
         }
     }
 
+    *changed = true;
     if (uniqueIdCount < MAX_UNIQUE_IDS) {
-        seenIds[uniqueIdCount] = id;
+        seenIds[uniqueIdCount] = frame->id;
+        idBus[uniqueIdCount] = frame->bus;
         idCounts[uniqueIdCount] = 1;
-        memcpy(lastData[uniqueIdCount], data, dlc);
+        payloadStore(&lastData, uniqueIdCount, frame);
+        idLastUs[uniqueIdCount] = now;
+        idPeriodUs[uniqueIdCount] = 0;
         uniqueIdCount++;
         return uniqueIdCount - 1;
     }
+    topkAdd(&idOverflow, sketchKey(frame));
     return -1;
 }
 
-// Adds a CAN frame to the ring buffer.
-void addToLog(uint32_t id, bool extended, bool rtr, uint8_t dlc, uint8_t* data) {
-    LogEntry* entry = &logBuffer[logHead];
-    entry->timestamp = millis() - startTime;
-    entry->seq = nextSeq++;
-    entry->id = id;
-    entry->extended = extended;
-    entry->rtr = rtr;
-    entry->dlc = dlc;
-    memcpy(entry->data, data, 8);
-    entry->isMark = false;
-    entry->markText[0] = '\0';
+// Returns the block to code the next entry into: the newest, or a new
+// one if that's nearly full or fresh is set. A new block takes the
+// oldest one's place once they're all in use.
+LogBlock* logBlockFor(unsigned long timestamp, bool fresh) {
+    LogBlock* b = &logBlocks[(logOldest + logBlocksUsed - 1 + LOG_BLOCKS) % LOG_BLOCKS];
+    if (logBlocksUsed > 0 && !fresh && b->header.used + DELTA_MAX_RECORD <= (int)sizeof(b->data)) return b;
+    if (logBlocksUsed == LOG_BLOCKS) {
+        logCount -= logBlocks[logOldest].header.count;
+        logOldest = (logOldest + 1) % LOG_BLOCKS;
+        logBlocksUsed--;
+    }
+    b = &logBlocks[(logOldest + logBlocksUsed) % LOG_BLOCKS];
+    logBlocksUsed++;
+    deltaBlockBegin(&logEncoder, &b->header, nextSeq, timestamp);
+    return b;
+}
+
+void logCommit(LogBlock* b, int bytes) {
+    b->header.used += bytes;
+    b->header.count++;
+    logCount++;
+    nextSeq++;
+}
 
-    logHead = (logHead + 1) % LOG_BUFFER_SIZE;
-    if (logCount < LOG_BUFFER_SIZE) logCount++;
+void logClear() {
+    logOldest = 0;
+    logBlocksUsed = 0;
+    logCount = 0;
 }
 
-// Adds an annotation mark to the ring buffer, inline with CAN data.
-void addMarkToLog(const char* text) {
-    LogEntry* entry = &logBuffer[logHead];
-    entry->timestamp = millis() - startTime;
-    entry->seq = nextSeq++;
-    entry->id = 0;
-    entry->extended = false;
-    entry->rtr = false;
-    entry->dlc = 0;
-    memset(entry->data, 0, 8);
-    entry->isMark = true;
+// Coded bytes the log holds, for /status.
+unsigned long logBytes() {
+    unsigned long bytes = 0;
+    for (int k = 0; k < logBlocksUsed; k++) bytes += logBlocks[(logOldest + k) % LOG_BLOCKS].header.used;
+    return bytes;
+}
+
+// Adds a CAN frame to the log.
+void addToLog(const CanFrame* frame) {
+    unsigned long timestamp = millis() - startTime;
+    LogBlock* b = logBlockFor(timestamp, false);
+    int bytes = deltaEncodeFrame(&logEncoder, timestamp, frame, b->data + b->header.used);
+    if (bytes < 0) {                 // The block's ID dictionary is full
+        b = logBlockFor(timestamp, true);
+        bytes = deltaEncodeFrame(&logEncoder, timestamp, frame, b->data + b->header.used);
+    }
+    logCommit(b, bytes);
+}
+
+// Adds a mark or event to the log, inline with CAN data. timestamp is
+// ms since startTime. Returns the entry as stored, text cut to fit.
+LogEntry* addTextToLogAt(log_type_t type, const char* text, unsigned long timestamp) {
+    LogEntry* entry = &logLastText;
+    memset(entry, 0, sizeof(*entry));
+    entry->timestamp = timestamp;
+    entry->seq = nextSeq;
+    entry->type = type;
     strncpy(entry->markText, text, sizeof(entry->markText) - 1);
-    entry->markText[sizeof(entry->markText) - 1] = '\0';
 
-    logHead = (logHead + 1) % LOG_BUFFER_SIZE;
-    if (logCount < LOG_BUFFER_SIZE) logCount++;
+    LogBlock* b = logBlockFor(timestamp, false);
+    logCommit(b, deltaEncodeText(&logEncoder, timestamp, type, entry->markText,
+                                  strlen(entry->markText), b->data + b->header.used));
+    return entry;
+}
+
+LogEntry* addTextToLog(log_type_t type, const char* text) {
+    return addTextToLogAt(type, text, millis() - startTime);
+}
+
+// Starts reading entries from seq from, or the oldest still held, up to
+// but not including end.
+void logReadBegin(LogReader* r, uint32_t from, uint32_t end) {
+    uint32_t oldest = nextSeq - logCount;
+    r->seq = (int32_t)(from - oldest) > 0 ? from : oldest;
+    r->end = end;
+    r->pos = -1;
+}
+
+// Copies the block holding entry r->seq, moving r->seq on to the oldest
+// entry if it has been dropped. False if there's no such entry.
+bool logLoadBlock(LogReader* r) {
+    uint32_t oldest = nextSeq - logCount;
+    if ((int32_t)(r->seq - oldest) < 0) r->seq = oldest;
+    for (int k = 0; k < logBlocksUsed; k++) {
+        const LogBlock* b = &logBlocks[(logOldest + k) % LOG_BLOCKS];
+        if (r->seq - b->header.firstSeq >= b->header.count) continue;
+        r->block.header = b->header;
+        memcpy(r->block.data, b->data, b->header.used);
+        deltaDecodeBegin(&r->state, &r->block.header);
+        r->pos = 0;
+        r->blockSeq = b->header.firstSeq;
+        return true;
+    }
+    return false;
+}
+
+// Reads the next entry into e. Returns false when there are no more.
+bool logReadNext(LogReader* r, LogEntry* e) {
+    while ((int32_t)(r->seq - r->end) < 0) {
+        if (r->pos < 0 || r->blockSeq - r->block.header.firstSeq >= r->block.header.count) {
+            if (!logLoadBlock(r)) return false;
+        }
+        DeltaRecord rec;
+        if (!deltaDecode(&r->state, r->block.data, r->block.header.used, &r->pos, &rec)) {
+            r->seq = r->block.header.firstSeq + r->block.header.count;   // Corrupt: skip the block
+            r->pos = -1;
+            continue;
+        }
+        uint32_t seq = r->blockSeq++;
+        if ((int32_t)(seq - r->seq) < 0) continue;
+        r->seq = seq + 1;
+
+        e->timestamp = rec.time;
+        e->seq = seq;
+        e->type = rec.type;
+        if (rec.type != LOG_FRAME) {
+            int len = min((int)rec.textLen, (int)sizeof(e->markText) - 1);
+            memcpy(e->markText, rec.text, len);
+            e->markText[len] = '\0';
+            e->id = 0;
+            e->extended = false;
+            e->flags = 0;
+            e->bus = 0;
+            e->len = 0;
+            return true;
+        }
+        e->id = rec.id;
+        e->extended = rec.extended;
+        e->flags = rec.flags;
+        e->bus = rec.bus;
+        e->len = rec.len;
+        memcpy(e->data, rec.data, rec.len);
+        e->markText[0] = '\0';
+        return true;
+    }
+    return false;
+}
+
+// Adds an annotation mark to the ring buffer, inline with CAN data.
+// timestamp is ms since startTime.
+void addMarkToLog(const char* text, unsigned long timestamp) {
+    LogEntry* entry = addTextToLogAt(LOG_MARK, text, timestamp);
+    flightRecordMark(&flightRec, entry->markText);
 
     // Mirror to serial
     Serial.printf("%lu,MARK,0,0,0,%s\n", entry->timestamp, entry->markText);
 }
 
+// Called when a bus's health monitor reports a fault: re-initialise that
+// controller at its current baud and log the outcome as an event, so it
+// shows up inline in the web UI and in downloaded logs.
+void recoverCAN(int bus, can_fault_t fault) {
+    unsigned long now = millis();
+    CanHealth* h = &canHealth[bus];
+    bool ok = initCAN(bus, currentBaud[bus]);
+    unsigned long down;
+    if (ok) {
+        down = healthRecovered(h, now);
+    } else {
+        healthRecoveryFailed(h, now);
+        down = now - h->faultSince;
+    }
+
+    char text[40];
+#if CAN_BUS_COUNT > 1
+    snprintf(text, sizeof(text), "RECOVER can%d %s %s %lums",
+             bus, faultToString(fault), ok ? "ok" : "FAILED", down);
+#else
+    snprintf(text, sizeof(text), "RECOVER %s %s %lums",
+             faultToString(fault), ok ? "ok" : "FAILED", down);
+#endif
+    LogEntry* entry = addTextToLog(LOG_EVENT, text);
+    Serial.printf("%lu,EVENT,0,0,0,%s\n", entry->timestamp, entry->markText);
+}
+
+// Starts a new epoch after startTime moved, logging it as an event so
+// hosts can carry their clock across it (time_base.h).
+void logNewEpoch(const char* reason) {
+    uint32_t epoch = timeNewEpoch(&timeBase, startTime);
+    char text[40];
+    snprintf(text, sizeof(text), "EPOCH %lu %s start=%lu", (unsigned long)epoch, reason, startTime);
+    LogEntry* entry = addTextToLog(LOG_EVENT, text);
+    Serial.printf("%lu,EVENT,0,0,0,%s\n", entry->timestamp, entry->markText);
+}
+
+// Logs a bus's new baud as an event. Timestamps carry on, but intervals
+// and gaps across it aren't comparable.
+void logBaudChange(int bus) {
+    char text[40];
+#if CAN_BUS_COUNT > 1
+    snprintf(text, sizeof(text), "BAUD can%d %s", bus, baudToString(currentBaud[bus]));
+#else
+    snprintf(text, sizeof(text), "BAUD %s", baudToString(currentBaud[bus]));
+#endif
+    LogEntry* entry = addTextToLog(LOG_EVENT, text);
+    Serial.printf("%lu,EVENT,0,0,0,%s\n", entry->timestamp, entry->markText);
+}
+
+// Reads waiting frames from every controller and logs them oldest first.
+// Called from loop() and between chunks of long downloads so capture
+// keeps up while they run.
+void pollCAN() {
+    errorCount += mergeFill(&busMerge, canBus, canHealth, busErrorCount, rxAdaptBudget(&rxAdapt));
+
+    CanFrame* frame;
+    int frames = 0;
+    while ((frame = mergeNext(&busMerge)) != NULL) {
+        frames++;
+        if (firstFrameMs == 0) firstFrameMs = millis();
+        flightRecordFrame(&flightRec, frame);
+        messageCount++;
+        busMessageCount[frame->bus]++;
+        TRACE_BEGIN(TRACE_TRACK, 0);
+        bool changed;
+        int i = findOrAddId(frame, &changed);
+        bool isNew = i >= 0 && idCounts[i] == 1;
+        anomalyOnFrame(&anomaly, i, frame, isNew, changed, millis());
+        timingOnFrame(&busTiming, i, frame, isNew, baudToBitsPerSecond(currentBaud[frame->bus]), millis());
+        historyAdd(&idHistory, i, frame, millis() - startTime);
+        TRACE_END(TRACE_TRACK, 0);
+        TRACE_BEGIN(TRACE_LOG_APPEND, 0);
+        addToLog(frame);
+        TRACE_END(TRACE_LOG_APPEND, 0);
+    }
+    rxAdaptUpdate(&rxAdapt, &busMerge, frames);
+}
+
+// Checks for overdue periodic IDs, then logs every alert raised since
+// the last pass as an event, mirrors it to serial and keeps it for
+// /alerts.
+void serviceAlerts() {
+    anomalyService(&anomaly, millis());
+    Alert a;
+    while (anomalyNextAlert(&anomaly, &a)) {
+        AlertRecord* r = &alertHistory[alertHistoryHead];
+        r->seq = nextAlertSeq++;
+        r->alert = a;
+        alertHistoryHead = (alertHistoryHead + 1) % ALERT_HISTORY_LEN;
+        if (alertHistoryCount < ALERT_HISTORY_LEN) alertHistoryCount++;
+
+        char text[40];
+#if CAN_BUS_COUNT > 1
+        snprintf(text, sizeof(text), "ALERT can%d %s 0x%03X", a.bus, alertTypeToString(a.type), (unsigned)a.id);
+#else
+        snprintf(text, sizeof(text), "ALERT %s 0x%03X", alertTypeToString(a.type), (unsigned)a.id);
+#endif
+        addTextToLog(LOG_EVENT, text);
+        flightRecordMark(&flightRec, text);
+        Serial.printf("%lu,ALERT,0,0,0,type=%s;id=0x%03X;value=%lu;expected=%lu;bus=%d\n",
+                      a.ms - startTime, alertTypeToString(a.type), (unsigned)a.id,
+                      (unsigned long)a.value, (unsigned long)a.expected, a.bus);
+    }
+}
+
+// Logs a finished burst's result as an event and a serial BURST row.
+void reportBurst() {
+    char text[40];
+    snprintf(text, sizeof(text), "BURST %lu frames %s%s", burst.frames,
+             burstStopToString(burst.reason), burstLossless(&burst) ? "" : " LOSSY");
+    addTextToLog(LOG_EVENT, text);
+    Serial.printf("%lu,BURST,0,0,0,frames=%lu;bytes=%lu;us=%lu;fps=%lu;overflows=%lu;errors=%lu;"
+                  "lossless=%d;reason=%s;psram=%d\n",
+                  millis() - startTime, burst.frames, (unsigned long)burst.used, burst.elapsedUs,
+                  burstFramesPerSecond(&burst), burst.overflows, burst.readErrors,
+                  burstLossless(&burst) ? 1 : 0, burstStopToString(burst.reason), burst.psram ? 1 : 0);
+}
+
+// One pass of a running burst: read every bus into the buffer, check the
+// controllers for overflow every BURST_FLAG_POLL_US, and serve the web
+// server every BURST_WEB_POLL_MS. Frames read after it stopped stay in
+// the merge queue for pollCAN(), and the anomaly detector, timing stats
+// and loop gap histogram pick up again without counting the burst as a
+// gap.
+void serviceBurst() {
+    burst.readErrors += mergeFill(&busMerge, canBus, canHealth, busErrorCount, RX_POLL_BUDGET);
+    CanFrame* frame;
+    while (burst.state == BURST_RUNNING && (frame = mergeNext(&busMerge)) != NULL) {
+        burstRecord(&burst, frame);
+    }
+    burstCheckTime(&burst);
+
+    if (micros() - burst.lastFlagPollUs >= BURST_FLAG_POLL_US) {
+        burst.lastFlagPollUs = micros();
+        for (int b = 0; b < CAN_BUS_COUNT; b++) {
+            if (canBus[b].errorFlags() & CAN_ERR_RX_OVERFLOW) {
+                burst.overflows++;
+                canBus[b].clearOverflow();
+            }
+        }
+    }
+    if (burst.state == BURST_RUNNING && millis() - burstLastWebMs >= BURST_WEB_POLL_MS) {
+        burstLastWebMs = millis();
+        server.handleClient();
+    }
+    if (burst.state != BURST_RUNNING) {
+        anomalyResume(&anomaly, millis());
+        timingResume(&busTiming, millis());
+        lastLoopUs = 0;
+        reportBurst();
+    }
+}
+
+// Logs each debounced mark button press, stamped when it was pressed.
+void serviceMarkButtons() {
+    MarkPress p;
+    while (markButtonsNext(&markButtons, &p)) {
+        addMarkToLog(markButtons.buttons[p.button].label, markPressSince(&p, startTime));
+    }
+}
+
 // ============== WEB HANDLERS ==============
 
 void handleRoot() {
@@ -199,7 +687,9 @@ void handleRoot() {
         .data { font-family: monospace; color: #00ff88; }
         #log { max-height: 400px; overflow-y: auto; }
         .id-summary { display: grid; grid-template-columns: repeat(auto-fill, minmax(200px, 1fr)); gap: 8px; }
-        .id-card { background: #0f3460; padding: 10px; border-radius: 4px; }
+        .id-card { background: #0f3460; padding: 10px; border-radius: 4px; cursor: pointer; }
+        #history { display: none; background: #16213e; padding: 12px; border-radius: 8px; margin-top: 8px; }
+        #history table { margin-top: 8px; }
         .mark-section { background: #1e2a3a; padding: 12px; border-radius: 8px; margin-bottom: 12px; border: 1px solid #00d4ff44; }
         .mark-buttons { display: flex; flex-wrap: wrap; gap: 4px; margin-bottom: 8px; }
         .mark-buttons button { background: #e67e22; font-weight: bold; }
@@ -209,6 +699,10 @@ void handleRoot() {
         .mark-custom input { flex: 1; padding: 10px; border-radius: 4px; border: 1px solid #555; background: #0f1a2e; color: #eee; font-size: 14px; font-family: monospace; }
         .mark-row { background: #3d1f00 !important; }
         .mark-row td { color: #e67e22; font-weight: bold; border-color: #e67e2244; }
+        .event-row { background: #3d0010 !important; }
+        .event-row td { color: #ff5577; font-weight: bold; border-color: #ff557744; }
+        #alerts { display: none; background: #3d0010; border: 1px solid #ff5577; color: #ff5577; padding: 10px 12px; border-radius: 8px; margin-bottom: 12px; }
+        #alerts div { margin: 2px 0; }
         .flash { animation: flashbg 0.3s; }
         @keyframes flashbg { 0% { background: #e67e22; } 100% { background: transparent; } }
     </style>
@@ -221,9 +715,14 @@ void handleRoot() {
         <strong>Baud:</strong> <span id="baud">--</span> |
         <strong>Msgs:</strong> <span id="msgcount">0</span> |
         <strong>Err:</strong> <span id="errcount">0</span> |
-        <strong>IDs:</strong> <span id="idcount">0</span>
+        <strong>Recoveries:</strong> <span id="recoveries">0</span> |
+        <strong>IDs:</strong> <span id="idcount">0</span> |
+        <strong>Alerts:</strong> <span id="alertcount">0</span> |
+        <strong>Mark sync:</strong> <span id="markerr">?</span>
     </div>
 
+    <div id="alerts" onclick="this.style.display='none'"></div>
+
     <div class="mark-section">
         <strong>Helm Action Markers</strong>
         <div class="mark-buttons">
@@ -253,6 +752,8 @@ void handleRoot() {
         <button onclick="setBaud(4)">1M</button>
         <button onclick="clearLog()">Clear</button>
         <button onclick="downloadCSV()">Download CSV</button>
+        <button onclick="window.location.href='/flight'">Flight Log</button>
+        <button onclick="runBurst()" id="burstbtn">Burst 10s</button>
         <button onclick="runScan()" id="scanbtn" style="background:#e67e22;font-weight:bold">Scan Baud Rates</button>
     </div>
 
@@ -260,8 +761,12 @@ void handleRoot() {
 
     <h2>Unique IDs (Live Values)</h2>
     <div id="ids" class="id-summary"></div>
+    <div id="history"></div>
 
     <h2>Recent Messages</h2>
+    <div class="mark-custom" style="margin-bottom:8px">
+        <input type="text" id="logfilter" placeholder="Filter, e.g. id=0x100,0x200-0x2FF&amp;data=01xx" onkeydown="if(event.key==='Enter')updateLog()">
+    </div>
     <div id="log">
         <table>
             <thead><tr><th>Time (ms)</th><th>ID</th><th>DLC</th><th>Data</th></tr></thead>
@@ -270,8 +775,31 @@ void handleRoot() {
     </div>
 
     <script>
+        // Marks carry the browser's own time, which the device maps onto
+        // its clock with the offset it learns from ping().
+        let clientId = sessionStorage.getItem('etsClient');
+        if (!clientId) {
+            clientId = String(1 + Math.floor(Math.random() * 4294967294));
+            sessionStorage.setItem('etsClient', clientId);
+        }
+        let lastPing = null;
+
+        function ping() {
+            let t0 = performance.now().toFixed(3);
+            let url = '/ping?c=' + clientId + '&t=' + t0;
+            if (lastPing) url += '&p=' + lastPing.t0 + '&r=' + lastPing.t3;
+            fetch(url).then(r => r.json()).then(data => {
+                lastPing = {t0: t0, t3: performance.now().toFixed(3)};
+                document.getElementById('markerr').textContent = data.err < 0 ? '?' : '\u00b1' + data.err + ' ms';
+            }).catch(() => { lastPing = null; });
+        }
+
+        function markUrl(msg, t) {
+            return '/mark?msg=' + encodeURIComponent(msg) + '&c=' + clientId + '&t=' + t.toFixed(3);
+        }
+
         function mark(msg) {
-            fetch('/mark?msg=' + encodeURIComponent(msg));
+            fetch(markUrl(msg, performance.now()));
             // Flash the button for feedback
             event.target.classList.add('flash');
             setTimeout(() => event.target.classList.remove('flash'), 300);
@@ -281,7 +809,7 @@ void handleRoot() {
             let input = document.getElementById('custommark');
             let msg = input.value.trim();
             if (msg) {
-                fetch('/mark?msg=' + encodeURIComponent(msg));
+                fetch(markUrl(msg, performance.now()));
                 input.value = '';
             }
             input.focus();
@@ -293,7 +821,10 @@ void handleRoot() {
                 document.getElementById('baud').textContent = data.baud;
                 document.getElementById('msgcount').textContent = data.messages;
                 document.getElementById('errcount').textContent = data.errors;
-                document.getElementById('idcount').textContent = data.uniqueIds;
+                document.getElementById('recoveries').textContent = data.recoveries;
+                document.getElementById('alertcount').textContent = data.alerts;
+                document.getElementById('idcount').textContent = data.uniqueIds +
+                    (data.distinctIds > data.uniqueIds ? ' (~' + data.distinctIds + ' seen)' : '');
             });
         }
 
@@ -301,9 +832,10 @@ void handleRoot() {
             fetch('/ids').then(r => r.json()).then(data => {
                 let html = '';
                 data.forEach(id => {
-                    html += `<div class="id-card">
+                    html += `<div class="id-card" onclick="showHistory(${id.approx ? -1 : id.id}, ${id.bus || 0})">
                         <strong>0x${id.id.toString(16).toUpperCase().padStart(3,'0')}</strong>
-                        (${id.count})<br>
+                        (${id.approx ? '~' : ''}${id.count})
+                        ${id.missing ? `<span style="color:${id.overdue ? '#ff5577' : '#e67e22'}">missing ${id.missing}x</span>` : ''}<br>
                         <span class="data">${id.data}</span>
                     </div>`;
                 });
@@ -311,8 +843,48 @@ void handleRoot() {
             });
         }
 
+        // Tapping an ID card shows its recent frames, refreshed while open.
+        let historyId = -1, historyBus = 0;
+        function showHistory(id, bus) {
+            if (id < 0) return;
+            if (id == historyId && bus == historyBus) {
+                closeHistory();
+                return;
+            }
+            historyId = id;
+            historyBus = bus;
+            updateHistory();
+        }
+
+        function closeHistory() {
+            historyId = -1;
+            document.getElementById('history').style.display = 'none';
+        }
+
+        function updateHistory() {
+            if (historyId < 0) return;
+            fetch('/ids/history?id=' + historyId + '&bus=' + historyBus).then(r => r.json()).then(data => {
+                let name = (data.bus ? 'can' + data.bus + ' ' : '') + '0x' + data.id.toString(16).toUpperCase().padStart(3,'0');
+                let html = `<strong>History ${name}</strong> (${data.frames.length} of ${data.count})
+                    <button onclick="closeHistory()">Close</button>
+                    <table><thead><tr><th>Time (ms)</th><th>Gap (ms)</th><th>DLC</th><th>Data</th></tr></thead><tbody>`;
+                let prev = null;
+                let rows = data.frames.map(f => {
+                    let gap = prev === null ? '' : f.t - prev;
+                    prev = f.t;
+                    return `<tr><td>${f.t}</td><td>${gap}</td><td>${f.dlc}${f.flags & 2 ? ' FD' : ''}</td><td class="data">${f.data}</td></tr>`;
+                });
+                html += rows.reverse().join('') + '</tbody></table>';
+                let div = document.getElementById('history');
+                div.innerHTML = html;
+                div.style.display = 'block';
+            }).catch(() => closeHistory());
+        }
+
         function updateLog() {
-            fetch('/log').then(r => r.json()).then(data => {
+            // The filter is applied on the sniffer, which only sends matches.
+            let filter = document.getElementById('logfilter').value.trim();
+            fetch('/log' + (filter ? '?' + filter : '')).then(r => r.ok ? r.json() : []).then(data => {
                 let html = '';
                 data.reverse().forEach(msg => {
                     if (msg.mark) {
@@ -320,11 +892,16 @@ void handleRoot() {
                             <td>${msg.t}</td>
                             <td colspan="3">>>> ${msg.mark}</td>
                         </tr>`;
+                    } else if (msg.event) {
+                        html += `<tr class="event-row">
+                            <td>${msg.t}</td>
+                            <td colspan="3">!!! ${msg.event}</td>
+                        </tr>`;
                     } else {
                         html += `<tr>
                             <td>${msg.t}</td>
-                            <td>0x${msg.id.toString(16).toUpperCase().padStart(3,'0')}</td>
-                            <td>${msg.dlc}</td>
+                            <td>${msg.bus ? 'can' + msg.bus + ' ' : ''}0x${msg.id.toString(16).toUpperCase().padStart(3,'0')}</td>
+                            <td>${msg.dlc}${msg.flags & 2 ? ' FD' : ''}</td>
                             <td class="data">${msg.data}</td>
                         </tr>`;
                     }
@@ -333,16 +910,62 @@ void handleRoot() {
             });
         }
 
+        // Newest alerts first; the banner hides when tapped and comes back
+        // with the next alert.
+        let alertSeq = 0;
+        let alertLines = [];
+        function updateAlerts() {
+            fetch('/alerts?since=' + alertSeq).then(r => r.json()).then(data => {
+                if (data.length == 0) return;
+                data.forEach(a => {
+                    alertSeq = a.s;
+                    let id = '0x' + a.id.toString(16).toUpperCase().padStart(3,'0');
+                    let detail = a.type == 'dlc' ? ` ${a.value} bytes, expected ${a.expected}` :
+                        (a.type == 'period' || a.type == 'missing') ?
+                        ` ${(a.value/1000).toFixed(1)} ms, period ${(a.expected/1000).toFixed(1)} ms` : '';
+                    alertLines.unshift(`${a.t} ms: ${a.type} ${a.bus ? 'can' + a.bus + ' ' : ''}${id}${detail}`);
+                });
+                alertLines = alertLines.slice(0, 5);
+                let div = document.getElementById('alerts');
+                div.innerHTML = alertLines.map(l => `<div>!!! ${l}</div>`).join('');
+                div.style.display = 'block';
+            });
+        }
+
         function setBaud(b) {
             fetch('/baud?v=' + b).then(() => updateStatus());
         }
 
         function clearLog() {
-            fetch('/clear').then(() => { updateStatus(); updateIds(); updateLog(); });
+            fetch('/clear').then(() => { closeHistory(); updateStatus(); updateIds(); updateLog(); });
         }
 
         function downloadCSV() {
-            window.location.href = '/csv';
+            let filter = document.getElementById('logfilter').value.trim();
+            window.location.href = '/csv' + (filter ? '?' + filter : '');
+        }
+
+        function runBurst() {
+            let btn = document.getElementById('burstbtn');
+            btn.textContent = 'Capturing...';
+            btn.disabled = true;
+            fetch('/burst?start=1&ms=10000').then(r => r.ok ? r.json() : Promise.reject()).then(() => {
+                let poll = setInterval(() => {
+                    fetch('/burst').then(r => r.json()).then(b => {
+                        if (b.state === 'running') return;
+                        clearInterval(poll);
+                        btn.textContent = 'Burst 10s';
+                        btn.disabled = false;
+                        if (confirm(b.frames + ' frames at ' + b.fps + '/s, ' +
+                                    (b.lossless ? 'no frames lost' : 'FRAMES LOST') + '. Download?')) {
+                            window.location.href = '/csv?burst=1';
+                        }
+                    });
+                }, 1000);
+            }).catch(() => {
+                btn.textContent = 'Burst 10s';
+                btn.disabled = false;
+            });
         }
 
         function runScan() {
@@ -378,10 +1001,14 @@ void handleRoot() {
         setInterval(updateStatus, 2000);
         setInterval(updateIds, 1000);
         setInterval(updateLog, 500);
+        setInterval(updateAlerts, 1000);
+        setInterval(updateHistory, 1000);
+        setInterval(ping, 2000);
 
         updateStatus();
         updateIds();
         updateLog();
+        ping();
     </script>
 </body>
 </html>
@@ -389,96 +1016,650 @@ void handleRoot() {
     server.send(200, "text/html", html);
 }
 
+// Controller counts are totals over all buses, with bus 0's baud and
+// fault; multi-bus builds add a "buses" array with each one's figures.
 void handleStatus() {
+    unsigned long now = millis();
+    unsigned long overflows = 0, recoveries = 0, downtime = 0;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        overflows += canHealth[b].overflows;
+        recoveries += canHealth[b].recoveries;
+        downtime += healthDowntime(&canHealth[b], now);
+    }
+
     String json = "{";
     json += "\"running\":true,";
-    json += "\"baud\":\"" + String(baudToString(currentBaud)) + "\",";
+    json += "\"baud\":\"" + String(baudToString(currentBaud[0])) + "\",";
     json += "\"messages\":" + String(messageCount) + ",";
     json += "\"errors\":" + String(errorCount) + ",";
-    json += "\"uniqueIds\":" + String(uniqueIdCount);
+    json += "\"overflows\":" + String(overflows) + ",";
+    json += "\"recoveries\":" + String(recoveries) + ",";
+    json += "\"downtimeMs\":" + String(downtime) + ",";
+    json += "\"lastFault\":\"" + String(faultToString(canHealth[0].lastFault)) + "\",";
+    json += "\"rxMode\":\"" + String(rxModeToString(rxAdapt.mode)) + "\",";
+    json += "\"rxToPoll\":" + String(rxAdapt.toPoll) + ",";
+    json += "\"rxToIrq\":" + String(rxAdapt.toIrq) + ",";
+    json += "\"rxRate\":" + String(rxAdapt.rate) + ",";
+    json += "\"rxSleepMs\":" + String((unsigned long)(rxAdapt.sleepUs / 1000)) + ",";
+#if CAN_BUS_COUNT > 1
+    json += "\"buses\":[";
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (b > 0) json += ",";
+        json += "{\"baud\":\"" + String(baudToString(currentBaud[b])) + "\"";
+        json += ",\"messages\":" + String(busMessageCount[b]);
+        json += ",\"errors\":" + String(busErrorCount[b]);
+        json += ",\"overflows\":" + String(canHealth[b].overflows);
+        json += ",\"recoveries\":" + String(canHealth[b].recoveries);
+        json += ",\"downtimeMs\":" + String(healthDowntime(&canHealth[b], now));
+        json += ",\"lastFault\":\"" + String(faultToString(canHealth[b].lastFault)) + "\"}";
+    }
+    json += "],";
+#endif
+    json += "\"flight\":\"" + String(!flightAvailable(&flightRec) ? "none" : (flightRec.enabled ? "on" : "off")) + "\",";
+    json += "\"flightBlocks\":" + String(flightRec.blocksWritten) + ",";
+    json += "\"flightRawBytes\":" + String(flightRec.rawBytes) + ",";
+    json += "\"flightStoredBytes\":" + String(flightRec.storedBytes) + ",";
+    json += "\"flightCompressUs\":" + String(flightRec.compressUs) + ",";
+    json += "\"heapFree\":" + String(heapStats.freeHeap) + ",";
+    json += "\"heapMinFree\":" + String(heapStats.minFreeHeap) + ",";
+    json += "\"heapMaxBlock\":" + String(heapStats.maxBlock) + ",";
+    json += "\"logEntries\":" + String(logCount) + ",";
+    json += "\"logBytes\":" + String(logBytes()) + ",";
+    json += "\"uniqueIds\":" + String(uniqueIdCount) + ",";
+    json += "\"distinctIds\":" + String(hllEstimate(&idDistinct)) + ",";
+    json += "\"untrackedFrames\":" + String(idOverflow.total) + ",";
+    json += "\"alerts\":" + String(anomalyAlertTotal(&anomaly)) + ",";
+    json += "\"alertsSuppressed\":" + String(anomaly.suppressed) + ",";
+    json += "\"wifi\":\"" + String(wifiConnected ? "sta" : (apActive ? "ap" : "connecting")) + "\",";
+    json += "\"firstFrameMs\":" + String(firstFrameMs) + ",";
+    json += "\"wifiConnectMs\":" + String(wifiConnectMs) + ",";
+    json += "\"reconnects\":" + String(wifiReconnects) + ",";
+    json += "\"lastGapMs\":" + String(lastReconnectGapMs) + ",";
+    json += "\"maxGapMs\":" + String(maxReconnectGapMs);
     json += "}";
     server.send(200, "application/json", json);
 }
 
+// Tracked IDs with their latest payload, then the heaviest IDs that
+// didn't fit in the table (id_sketch.h): those have "approx":true, no
+// payload, and a count that overstates the true one by at most "err".
+// Periodic IDs that have gone overdue (anomaly.h) carry "missing", the
+// number of times, "lastMissing", when the latest began, and
+// "overdue":true while it lasts.
 void handleIds() {
     String json = "[";
     for (int i = 0; i < uniqueIdCount; i++) {
         if (i > 0) json += ",";
         json += "{\"id\":" + String(seenIds[i]);
+        if (idBus[i]) json += ",\"bus\":" + String(idBus[i]);
         json += ",\"count\":" + String(idCounts[i]);
+        const IdBaseline* b = &anomaly.ids[i];
+        if (b->missing) {
+            json += ",\"missing\":" + String(b->missing);
+            json += ",\"lastMissing\":" + String(b->lastMissingMs - startTime);
+            if (b->overdue) json += ",\"overdue\":true";
+        }
         json += ",\"data\":\"";
-        for (int j = 0; j < 8; j++) {
+        uint8_t data[CAN_MAX_DLEN];
+        uint8_t len = payloadGet(&lastData, i, data);
+        for (int j = 0; j < len; j++) {
             if (j > 0) json += " ";
-            if (lastData[i][j] < 16) json += "0";
-            json += String(lastData[i][j], HEX);
+            if (data[j] < 16) json += "0";
+            json += String(data[j], HEX);
         }
         json += "\"}";
     }
+    for (int i = 0; i < idOverflow.used; i++) {
+        const TopKEntry* e = &idOverflow.entries[i];
+        if (uniqueIdCount > 0 || i > 0) json += ",";
+        json += "{\"id\":" + String(sketchKeyId(e->key));
+        if (sketchKeyBus(e->key)) json += ",\"bus\":" + String(sketchKeyBus(e->key));
+        json += ",\"count\":" + String(e->count);
+        json += ",\"err\":" + String(e->err);
+        json += ",\"approx\":true,\"data\":\"\"}";
+    }
     json += "]";
     server.send(200, "application/json", json);
 }
 
+// Compiles the filter arguments of /log, /csv and /flight (log_query.h).
+// On a bad argument replies 400 naming it and returns false.
+bool parseLogQuery(LogQuery* q) {
+    queryInit(q);
+    for (int a = 0; a < server.args(); a++) {
+        String name = server.argName(a);
+        String value = server.arg(a);
+        bool ok = true;
+        if (name == "id") {
+            ok = queryAddIds(q, value.c_str());
+        } else if (name == "data") {
+            ok = queryAddData(q, value.c_str());
+        } else if (name == "fields") {
+            ok = queryParseFields(q, value.c_str());
+        } else if (name == "bus") {
+            q->bus = value.toInt();
+            ok = q->bus >= 0 && q->bus < CAN_BUS_COUNT;
+            q->filtered = true;
+        } else if (name == "from") {
+            q->fromMs = strtoul(value.c_str(), NULL, 10);
+            q->filtered = true;
+        } else if (name == "to") {
+            q->toMs = strtoul(value.c_str(), NULL, 10);
+            q->filtered = true;
+        } else if (name == "text") {
+            q->text = value.toInt() != 0;
+            if (!q->text) q->filtered = true;
+        }
+        if (!ok) {
+            server.send(400, "text/plain", "Bad " + name);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool logEntryMatches(const LogQuery* q, const LogEntry* e) {
+    if (e->type != LOG_FRAME) return queryMatchText(q, e->timestamp);
+    return queryMatchFrame(q, e->id, e->bus, e->data, e->len, e->timestamp);
+}
+
+int decimalDigits(unsigned long v) {
+    int n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+// Length of an entry in an unfiltered /log reply, without the comma.
+int logJsonLen(const LogEntry* e) {
+    int len = 5 + decimalDigits(e->seq) + 5 + decimalDigits(e->timestamp);   // {"s":..,"t":..
+    if (e->type != LOG_FRAME) {
+        return len + (e->type == LOG_MARK ? 9 : 10) + strlen(e->markText) + 2;
+    }
+    len += 6 + decimalDigits(e->id) + 7 + decimalDigits(canLenToDlc(e->len));
+    if (e->extended) len += 8;
+    if (e->flags) len += 9 + decimalDigits(e->flags);
+    if (e->bus) len += 7 + decimalDigits(e->bus);
+    return len + 9 + (e->len > 0 ? 3 * e->len - 1 : 0) + 2;
+}
+
+// Length of an entry's row in an unfiltered /csv download.
+int logCsvLen(const LogEntry* e) {
+    int len = decimalDigits(e->timestamp);
+    if (e->type != LOG_FRAME) {
+        return len + (e->type == LOG_MARK ? 12 : 13) + strlen(e->markText) + 1;
+    }
+    int idDigits = 1;
+    for (uint32_t v = e->id >> 4; v; v >>= 4) idDigits++;
+    len += 3 + idDigits + 2 + 1 + decimalDigits(e->flags) + 1 + decimalDigits(canLenToDlc(e->len)) + 1;
+    len += e->len > 0 ? 3 * e->len - 1 : 0;
+#if CAN_BUS_COUNT > 1
+    len += 1 + decimalDigits(e->bus);
+#endif
+    return len + 1;
+}
+
+void httpDeflateSink(void*, const uint8_t* data, size_t len) {
+    unsigned long start = micros();
+    server.sendContent((const char*)data, len);
+    gzipSinkUs += micros() - start;
+}
+
+bool clientAcceptsGzip() {
+    return server.header("Accept-Encoding").indexOf("gzip") >= 0;
+}
+
+// Starts a chunked response whose body is written with bodyWrite(),
+// gzip-compressed if the client accepts it. Headers of its own go
+// before this.
+void bodyBegin(const char* contentType) {
+    httpGzip = clientAcceptsGzip();
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    if (httpGzip) server.sendHeader("Content-Encoding", "gzip");
+    server.send(200, contentType, "");
+    if (httpGzip) deflateBegin(&httpDeflate, true, httpDeflateSink, NULL);
+}
+
+void bodyWrite(const char* data, size_t len) {
+    if (len == 0) return;        // An empty chunk would end the response
+    if (!httpGzip) {
+        server.sendContent(data, len);
+        return;
+    }
+    unsigned long start = micros();
+    gzipSinkUs = 0;
+    deflateWrite(&httpDeflate, (const uint8_t*)data, len);
+    gzipUs += micros() - start - gzipSinkUs;
+}
+
+void bodyEnd() {
+    if (httpGzip) {
+        unsigned long start = micros();
+        gzipSinkUs = 0;
+        deflateEnd(&httpDeflate);
+        gzipUs += micros() - start - gzipSinkUs;
+        gzipResponses++;
+        gzipInBytes += httpDeflate.inBytes;
+        gzipOutBytes += httpDeflate.outBytes;
+        httpGzip = false;
+    }
+    server.sendContent("");
+}
+
+// Sends a response built in a String, compressed as bodyBegin().
+void sendBody(const char* contentType, const String& body) {
+    if (body.length() < GZIP_MIN_BYTES || !clientAcceptsGzip()) {
+        server.send(200, contentType, body);
+        return;
+    }
+    bodyBegin(contentType);
+    bodyWrite(body.c_str(), body.length());
+    bodyEnd();
+}
+
+void sendQueryHeaders(int matched, unsigned long fullBytes, unsigned long sentBytes) {
+    server.sendHeader("X-Log-Matched", String(matched));
+    server.sendHeader("X-Bytes-Saved", String(fullBytes > sentBytes ? fullBytes - sentBytes : 0UL));
+}
+
+// Appends an entry's time as ISO 8601 UTC, or nothing before the host
+// has set the clock.
+void appendLogUtc(String& out, const LogEntry* e) {
+    int64_t utc;
+    if (!timeToUtc(&timeBase, timeLogToDevice(&timeBase, e->timestamp), &utc)) return;
+    char text[TIME_ISO_SIZE];
+    timeFormatIso(utc, text, sizeof(text));
+    out += text;
+}
+
+// Appends one entry as a JSON object with the given FIELD_* set. ext,
+// flags and bus are left out when zero.
+void appendLogJson(String& json, const LogEntry* e, uint16_t fields) {
+    const char* sep = "{";
+    if (fields & FIELD_SEQ) {
+        json += String(sep) + "\"s\":" + String(e->seq);
+        sep = ",";
+    }
+    if (fields & FIELD_TIME) {
+        json += String(sep) + "\"t\":" + String(e->timestamp);
+        sep = ",";
+    }
+    if ((fields & FIELD_UTC) && timeBase.synced) {
+        json += String(sep) + "\"utc\":\"";
+        appendLogUtc(json, e);
+        json += "\"";
+        sep = ",";
+    }
+    if (e->type != LOG_FRAME) {
+        json += sep;
+        json += e->type == LOG_MARK ? "\"mark\":\"" : "\"event\":\"";
+        json += String(e->markText) + "\"}";
+        return;
+    }
+    if (fields & FIELD_ID) {
+        json += String(sep) + "\"id\":" + String(e->id);
+        sep = ",";
+    }
+    if ((fields & FIELD_EXT) && e->extended) {
+        json += String(sep) + "\"ext\":1";
+        sep = ",";
+    }
+    if (fields & FIELD_DLC) {
+        json += String(sep) + "\"dlc\":" + String(canLenToDlc(e->len));
+        sep = ",";
+    }
+    if ((fields & FIELD_FLAGS) && e->flags) {
+        json += String(sep) + "\"flags\":" + String(e->flags);
+        sep = ",";
+    }
+    if ((fields & FIELD_BUS) && e->bus) {
+        json += String(sep) + "\"bus\":" + String(e->bus);
+        sep = ",";
+    }
+    if (fields & FIELD_DATA) {
+        json += String(sep) + "\"data\":\"";
+        for (int j = 0; j < e->len; j++) {
+            if (j > 0) json += " ";
+            if (e->data[j] < 16) json += "0";
+            json += String(e->data[j], HEX);
+        }
+        json += "\"";
+        sep = ",";
+    }
+    json += sep[0] == '{' ? "{}" : "}";
+}
+
+// GET /log -- recent log entries as JSON, oldest first: the last 100, or
+// the last limit=N (up to LOG_REPLY_MAX) that pass the filters in
+// log_query.h and, with since=SEQ, are newer than SEQ. X-Log-Matched
+// counts the entries sent and X-Bytes-Saved how much smaller the reply
+// is than the unfiltered one.
 void handleLog() {
+    LogQuery q;
+    if (!parseLogQuery(&q)) return;
+    uint32_t since = server.hasArg("since") ? strtoul(server.arg("since").c_str(), NULL, 10) : 0;
+    int limit = server.hasArg("limit") ? constrain((int)server.arg("limit").toInt(), 1, LOG_REPLY_MAX) : 100;
+
+    // Count the matches newer than since, then send the last limit.
+    LogEntry e;
+    uint32_t end = nextSeq;
+    int matched = 0;
+    int total = 0;
+    logReadBegin(&logReader, since + 1, end);
+    while (logReadNext(&logReader, &e)) {
+        total++;
+        if (logEntryMatches(&q, &e)) matched++;
+    }
+    int skip = matched - limit;
+    if (skip > 0) matched = limit;
+
     String json = "[";
-    int count = min(100, logCount);
-    int idx = (logHead - count + LOG_BUFFER_SIZE) % LOG_BUFFER_SIZE;
+    bool any = false;
+    logReadBegin(&logReader, since + 1, end);
+    while (logReadNext(&logReader, &e)) {
+        if (!logEntryMatches(&q, &e) || skip-- > 0) continue;
+        if (any) json += ",";
+        any = true;
+        appendLogJson(json, &e, q.fields);
+    }
+    json += "]";
 
-    for (int i = 0; i < count; i++) {
-        if (i > 0) json += ",";
-        LogEntry* e = &logBuffer[idx];
+    // The unfiltered reply is the last limit entries of the same window.
+    unsigned long full = 2;
+    bool firstFull = true;
+    logReadBegin(&logReader, end - min(total, limit), end);
+    while (logReadNext(&logReader, &e)) {
+        full += logJsonLen(&e) + (firstFull ? 0 : 1);
+        firstFull = false;
+    }
+    sendQueryHeaders(matched, full, json.length());
+    sendBody("application/json", json);
+}
 
-        if (e->isMark) {
-            json += "{\"s\":" + String(e->seq);
-            json += ",\"t\":" + String(e->timestamp);
-            json += ",\"mark\":\"" + String(e->markText) + "\"}";
-        } else {
-            json += "{\"s\":" + String(e->seq);
-            json += ",\"t\":" + String(e->timestamp);
-            json += ",\"id\":" + String(e->id);
-            json += ",\"dlc\":" + String(e->dlc);
-            json += ",\"data\":\"";
-            for (int j = 0; j < e->dlc; j++) {
-                if (j > 0) json += " ";
-                if (e->data[j] < 16) json += "0";
-                json += String(e->data[j], HEX);
-            }
-            json += "\"}";
-        }
-        idx = (idx + 1) % LOG_BUFFER_SIZE;
+// GET /alerts[?since=N] -- recent anomaly alerts, oldest first, with
+// sequence numbers above N. value and expected are bytes for dlc and
+// microseconds for period and missing.
+void handleAlerts() {
+    uint32_t since = server.hasArg("since") ? strtoul(server.arg("since").c_str(), NULL, 10) : 0;
+    String json = "[";
+    bool first = true;
+    int idx = (alertHistoryHead - alertHistoryCount + ALERT_HISTORY_LEN) % ALERT_HISTORY_LEN;
+    for (int i = 0; i < alertHistoryCount; i++) {
+        const AlertRecord* r = &alertHistory[(idx + i) % ALERT_HISTORY_LEN];
+        if (r->seq <= since) continue;
+        if (!first) json += ",";
+        first = false;
+        json += "{\"s\":" + String(r->seq);
+        json += ",\"t\":" + String(r->alert.ms - startTime);
+        json += ",\"type\":\"" + String(alertTypeToString(r->alert.type)) + "\"";
+        json += ",\"id\":" + String(r->alert.id);
+        if (r->alert.bus) json += ",\"bus\":" + String(r->alert.bus);
+        json += ",\"value\":" + String(r->alert.value);
+        json += ",\"expected\":" + String(r->alert.expected) + "}";
     }
     json += "]";
     server.send(200, "application/json", json);
 }
 
+// Returns the bus= argument, or -1 if there is none. Out-of-range values
+// also give -1, so the caller's default applies.
+int busArg() {
+    if (!server.hasArg("bus")) return -1;
+    int bus = server.arg("bus").toInt();
+    return bus >= 0 && bus < CAN_BUS_COUNT ? bus : -1;
+}
+
+// GET /ids/history?id=0x123[&bus=N] -- the ID's recent frames from
+// id_history.h, oldest first. dlc is the full frame's; data stops at 8
+// bytes.
+void handleIdHistory() {
+    uint32_t id = strtoul(server.arg("id").c_str(), NULL, 0);
+    int bus = max(busArg(), 0);
+    int i = 0;
+    while (i < uniqueIdCount && !(seenIds[i] == id && idBus[i] == bus)) i++;
+    if (!server.hasArg("id") || i == uniqueIdCount) {
+        server.send(404, "text/plain", "Unknown ID");
+        return;
+    }
+
+    String json = "{\"id\":" + String(id);
+    if (bus) json += ",\"bus\":" + String(bus);
+    json += ",\"count\":" + String(idCounts[i]);
+    json += ",\"frames\":[";
+    bool first = true;
+    historyForEach(&idHistory, i, [&](const HistoryEntry* e) {
+        if (!first) json += ",";
+        first = false;
+        json += "{\"t\":" + String(e->ms);
+        json += ",\"dlc\":" + String(canLenToDlc(e->len));
+        if (e->flags) json += ",\"flags\":" + String(e->flags);
+        json += ",\"data\":\"";
+        for (int j = 0; j < e->len && j < 8; j++) {
+            if (j > 0) json += " ";
+            if (e->data[j] < 16) json += "0";
+            json += String(e->data[j], HEX);
+        }
+        json += "\"}";
+    });
+    json += "]}";
+    server.send(200, "application/json", json);
+}
+
+// GET /baud?v=1..4[&bus=N] -- sets the baud on one bus, or on all of them.
 void handleBaud() {
     if (server.hasArg("v")) {
+        int bus = busArg();
         int v = server.arg("v").toInt();
-        switch(v) {
-            case 1: currentBaud = BAUD_125K; break;
-            case 2: currentBaud = BAUD_250K; break;
-            case 3: currentBaud = BAUD_500K; break;
-            case 4: currentBaud = BAUD_1M; break;
+        for (int b = 0; b < CAN_BUS_COUNT; b++) {
+            if (bus >= 0 && b != bus) continue;
+            switch(v) {
+                case 1: currentBaud[b] = BAUD_125K; break;
+                case 2: currentBaud[b] = BAUD_250K; break;
+                case 3: currentBaud[b] = BAUD_500K; break;
+                case 4: currentBaud[b] = BAUD_1M; break;
+            }
+            initCAN(b, currentBaud[b]);
+            logBaudChange(b);
         }
-        initCAN(currentBaud);
+        anomalyClear(&anomaly, millis());
+        timingClear(&busTiming);
     }
     server.send(200, "text/plain", "OK");
 }
 
-// GET /mark?msg=... -- adds an annotation to the log at the current timestamp.
+// GET /buttons -- the GPIO mark buttons, their labels, the labels they
+// can take, and press counts.
+// GET /buttons?n=N&label=... -- relabels button N; 400 if either is bad.
+void handleButtons() {
+    if (server.hasArg("n") &&
+        !markButtonsSetLabel(&markButtons, server.arg("n").toInt(), server.arg("label").c_str())) {
+        server.send(400, "text/plain", "Bad button or label");
+        return;
+    }
+    String json = "{\"buttons\":[";
+    for (size_t i = 0; i < MARK_BUTTON_COUNT; i++) {
+        if (i > 0) json += ",";
+        json += "{\"n\":" + String((int)i);
+        json += ",\"pin\":" + String(markButtons.buttons[i].pin);
+        json += ",\"label\":\"" + String(markButtons.buttons[i].label) + "\"}";
+    }
+    json += "],\"labels\":[";
+    for (size_t k = 0; k < MARK_LABEL_COUNT; k++) {
+        if (k > 0) json += ",";
+        json += "\"" + String(markLabels[k]) + "\"";
+    }
+    json += "],\"presses\":" + String(markButtons.presses);
+    json += ",\"glitches\":" + String(markButtons.glitches);
+    json += ",\"dropped\":" + String(markButtons.dropped) + "}";
+    server.send(200, "application/json", json);
+}
+
+// GET /burst -- the current or last burst as JSON.
+// GET /burst?start=1[&frames=N][&ms=N][&trigger=ID[&post=N]] -- starts
+// one, stopping at N frames, N ms or N frames after the trigger ID,
+// whichever comes first, or when RAM runs out.
+// GET /burst?stop=1 -- stops it. GET /burst?free=1 -- releases the RAM.
+// Download the capture from /csv?burst=1.
+void handleBurst() {
+    if (server.hasArg("start")) {
+        if (burst.state == BURST_RUNNING) {
+            server.send(409, "text/plain", "Burst running");
+            return;
+        }
+        if (!burstAlloc(&burst)) {
+            server.send(503, "text/plain", "Not enough free RAM");
+            return;
+        }
+        burstStartMs = millis() - startTime;
+        burstLastWebMs = millis();
+        burstStart(&burst, strtoul(server.arg("frames").c_str(), NULL, 10),
+                   strtoul(server.arg("ms").c_str(), NULL, 10), server.hasArg("trigger"),
+                   strtoul(server.arg("trigger").c_str(), NULL, 0),
+                   strtoul(server.arg("post").c_str(), NULL, 10));
+    } else if (server.hasArg("stop")) {
+        burstStop(&burst, BURST_STOP_USER);
+    } else if (server.hasArg("free")) {
+        if (burst.state != BURST_RUNNING) burstFree(&burst);
+    }
+
+    static const char* states[] = { "idle", "running", "done" };
+    unsigned long us = burst.state == BURST_RUNNING ? micros() - burst.startUs : burst.elapsedUs;
+    String json = "{\"state\":\"" + String(states[burst.state]) + "\"";
+    json += ",\"start\":" + String(burstStartMs);
+    json += ",\"frames\":" + String(burst.frames);
+    json += ",\"bytes\":" + String((unsigned long)burst.used);
+    json += ",\"size\":" + String((unsigned long)burst.size);
+    json += ",\"psram\":" + String(burst.psram ? "true" : "false");
+    json += ",\"us\":" + String(us);
+    json += ",\"fps\":" + String(burstFramesPerSecond(&burst));
+    json += ",\"overflows\":" + String(burst.overflows);
+    json += ",\"errors\":" + String(burst.readErrors);
+    json += ",\"lossless\":" + String(burstLossless(&burst) ? "true" : "false");
+    json += ",\"reason\":\"" + String(burstStopToString(burst.reason)) + "\"";
+    int64_t utc;
+    if (burst.state != BURST_IDLE && timeToUtc(&timeBase, timeLogToDevice(&timeBase, burstStartMs), &utc)) {
+        char text[TIME_ISO_SIZE];
+        timeFormatIso(utc, text, sizeof(text));
+        json += ",\"utc\":\"" + String(text) + "\"";
+    }
+    json += "}";
+    server.send(200, "application/json", json);
+}
+
+// GET /mark?msg=...[&c=ID&t=MS] -- adds an annotation to the log. With
+// the client's ID and its performance.now() when the mark was made, and
+// a clock offset from /ping, the mark is placed at that time; otherwise
+// at the current time. Replies with the log time used and its
+// uncertainty in ms: {"t":..,"err":..,"synced":true|false}.
 void handleMark() {
+    unsigned long timestamp = millis() - startTime;
+    uint32_t errUs = 0;
+    bool synced = false;
+    if (server.hasArg("c") && server.hasArg("t")) {
+        ClockClient* c = clockClient(&clockSync, strtoul(server.arg("c").c_str(), NULL, 10), millis());
+        int64_t deviceUs;
+        if (clockToDevice(c, clockParseMs(server.arg("t").c_str()), &deviceUs, &errUs)) {
+            // Never after now, and not so far back that the estimate is suspect.
+            long ageMs = (long)((esp_timer_get_time() - deviceUs) / 1000);
+            if (ageMs >= 0 && ageMs < CLOCK_MAX_RTT_US / 1000 && ageMs <= (long)timestamp) {
+                timestamp -= ageMs;
+                synced = true;
+            } else if (ageMs < 0 && -ageMs <= (long)(errUs / 1000)) {
+                synced = true;
+            }
+        }
+    }
     if (server.hasArg("msg")) {
         String msg = server.arg("msg");
         msg.trim();
         if (msg.length() > 0) {
-            addMarkToLog(msg.c_str());
+            addMarkToLog(msg.c_str(), timestamp);
         }
     }
-    server.send(200, "text/plain", "OK");
+    String json = "{\"t\":" + String(timestamp);
+    json += ",\"err\":" + String(synced ? (errUs + 999) / 1000 : 0);
+    json += ",\"synced\":" + String(synced ? "true" : "false") + "}";
+    server.send(200, "application/json", json);
+}
+
+// GET /ping?c=ID&t=T0[&p=T0'&r=T3'] -- one clock sync exchange for
+// client ID (clock_sync.h). T0 is the client's performance.now() when
+// sending, in ms; p and r report the previous ping's T0 and when its
+// reply arrived. Replies with the device time in ms since startTime and
+// the client's current round trip and mark uncertainty in ms, -1 until
+// the first exchange completes.
+void handlePing() {
+    int64_t deviceUs = esp_timer_get_time();
+    if (!server.hasArg("c") || !server.hasArg("t")) {
+        server.send(400, "text/plain", "Bad ping");
+        return;
+    }
+    ClockClient* c = clockClient(&clockSync, strtoul(server.arg("c").c_str(), NULL, 10), millis());
+    bool hasPrev = server.hasArg("p") && server.hasArg("r");
+    clockPing(c, clockParseMs(server.arg("t").c_str()), hasPrev, clockParseMs(server.arg("p").c_str()),
+              clockParseMs(server.arg("r").c_str()), deviceUs);
+
+    long rtt = clockSynced(c) ? (long)(c->samples[c->best].rttUs / 1000) : -1;
+    String json = "{\"d\":" + String((unsigned long)(deviceUs / 1000) - startTime);
+    json += ",\"rtt\":" + String(rtt);
+    json += ",\"err\":" + String(rtt < 0 ? -1 : (long)(c->samples[c->best].rttUs / 2 + 999) / 1000) + "}";
+    server.send(200, "application/json", json);
 }
 
-// GET /scan -- tries each baud rate for 3 seconds and returns JSON results.
-// Blocks for ~12 seconds total. The web UI shows a results table.
+// GET /time -- the device clock for host time sync (time_base.h): us is
+// esp_timer_get_time() when the request was handled, start the current
+// epoch's startTime in ms since boot, plus the epoch and boot numbers and
+// the UTC anchor if set. utc is the Unix time in us now and stale is set
+// once the anchor is older than TIME_ANCHOR_STALE_S.
+// GET /time?utc=US&at=US[&ppm=X][&err=US] -- sets the anchor: Unix time
+// utc at device time at, with the drift and uncertainty the host
+// estimated. 400 if implausible. Each anchor is written to the flight
+// recorder as a mark, so its blocks can be put on UTC too.
+void handleTime() {
+    int64_t nowUs = esp_timer_get_time();
+    if (server.hasArg("utc")) {
+        int64_t utcUs = strtoll(server.arg("utc").c_str(), NULL, 10);
+        int64_t atUs = server.hasArg("at") ? strtoll(server.arg("at").c_str(), NULL, 10) : nowUs;
+        float ppm = server.hasArg("ppm") ? server.arg("ppm").toFloat() : 0;
+        uint32_t errUs = server.hasArg("err") ? strtoul(server.arg("err").c_str(), NULL, 10) : 0;
+        bool first = !timeBase.synced;
+        if (atUs > nowUs || !timeSetAnchor(&timeBase, utcUs, atUs, ppm, errUs)) {
+            server.send(400, "text/plain", "Bad time");
+            return;
+        }
+        char text[48];
+        snprintf(text, sizeof(text), "UTC %lld @%lld", (long long)(utcUs / 1000), (long long)(atUs / 1000));
+        flightRecordMark(&flightRec, text);
+        if (first) {
+            snprintf(text, sizeof(text), "UTC set err=%lums", (unsigned long)((errUs + 999) / 1000));
+            LogEntry* entry = addTextToLog(LOG_EVENT, text);
+            Serial.printf("%lu,EVENT,0,0,0,%s\n", entry->timestamp, entry->markText);
+        }
+    }
+
+    char json[224];
+    int len = snprintf(json, sizeof(json), "{\"us\":%lld,\"start\":%lu,\"epoch\":%lu,\"boot\":%lu",
+                       (long long)nowUs, timeBase.epochStartMs, (unsigned long)timeBase.epoch,
+                       (unsigned long)flightRec.bootId);
+    int64_t utc;
+    if (timeToUtc(&timeBase, nowUs, &utc)) {
+        len += snprintf(json + len, sizeof(json) - len, ",\"utc\":%lld,\"err\":%lu,\"ppm\":%.3f,\"stale\":%s",
+                        (long long)utc, (unsigned long)timeBase.errUs, timeBase.ppm,
+                        timeAnchorStale(&timeBase, nowUs) ? "true" : "false");
+    }
+    snprintf(json + len, sizeof(json) - len, "}");
+    server.send(200, "application/json", json);
+}
+
+// GET /scan[?bus=N] -- tries each baud rate on one bus (default 0) for 3
+// seconds and returns JSON results. Blocks for ~12 seconds total, without
+// reading the other buses. The web UI shows a results table. Past 64 IDs
+// per rate the ID count is a HyperLogLog estimate.
 void handleScan() {
+    static HyperLogLog scanDistinct;
+    int bus = max(busArg(), 0);
     can_baud_t rates[] = { BAUD_125K, BAUD_250K, BAUD_500K, BAUD_1M };
     int bestRate = -1;
     float bestScore = 0;
@@ -488,7 +1669,7 @@ void handleScan() {
     for (int r = 0; r < 4; r++) {
         if (r > 0) json += ",";
 
-        if (!initCAN(rates[r])) {
+        if (!initCAN(bus, rates[r])) {
             json += "{\"baud\":\"" + String(baudToString(rates[r])) + "\",\"msgs\":0,\"ids\":0,\"repeat\":0,\"verdict\":\"INIT FAIL\"}";
             continue;
         }
@@ -499,17 +1680,17 @@ void handleScan() {
         unsigned long scanIdCounts[64];
         memset(scanIds, 0, sizeof(scanIds));
         memset(scanIdCounts, 0, sizeof(scanIdCounts));
+        hllClear(&scanDistinct);
 
         unsigned long scanStart = millis();
         while (millis() - scanStart < 3000) {
-            if (digitalRead(CAN_INT_PIN) == LOW) {
-                unsigned long rxId;
-                uint8_t dlc;
-                uint8_t data[8];
+            if (canBus[bus].pending()) {
+                CanFrame frame;
 
-                if (CAN.readMsgBuf(&rxId, &dlc, data) == CAN_OK) {
-                    uint32_t canId = rxId & 0x1FFFFFFF;
+                if (canBus[bus].read(&frame)) {
+                    uint32_t canId = frame.id;
                     scanMsgCount++;
+                    hllAdd(&scanDistinct, sketchKey(&frame));
 
                     bool found = false;
                     for (int i = 0; i < scanUniqueIds; i++) {
@@ -528,20 +1709,21 @@ void handleScan() {
             }
         }
 
+        unsigned long scanDistinctIds = scanUniqueIds < 64 ? scanUniqueIds : hllEstimate(&scanDistinct);
         float repeatRate = 0;
-        if (scanUniqueIds > 0 && scanMsgCount > 0) {
-            repeatRate = (float)scanMsgCount / (float)scanUniqueIds;
+        if (scanDistinctIds > 0 && scanMsgCount > 0) {
+            repeatRate = (float)scanMsgCount / (float)scanDistinctIds;
         }
 
         float score = repeatRate;
-        if (scanUniqueIds > 30) score *= 0.1f;
+        if (scanDistinctIds > 30) score *= 0.1f;
 
         const char* verdict;
         if (scanMsgCount == 0) {
             verdict = "NO DATA";
-        } else if (scanUniqueIds <= 20 && repeatRate > 10) {
+        } else if (scanDistinctIds <= 20 && repeatRate > 10) {
             verdict = "LIKELY CORRECT";
-        } else if (scanUniqueIds > 30) {
+        } else if (scanDistinctIds > 30) {
             verdict = "Noise";
         } else {
             verdict = "Uncertain";
@@ -549,7 +1731,7 @@ void handleScan() {
 
         json += "{\"baud\":\"" + String(baudToString(rates[r])) + "\"";
         json += ",\"msgs\":" + String(scanMsgCount);
-        json += ",\"ids\":" + String(scanUniqueIds);
+        json += ",\"ids\":" + String(scanDistinctIds);
         json += ",\"repeat\":" + String(repeatRate, 1);
         json += ",\"verdict\":\"" + String(verdict) + "\"";
 
@@ -574,9 +1756,13 @@ void handleScan() {
 
     // Switch to the best rate found
     if (bestRate >= 0) {
-        currentBaud = rates[bestRate];
+        currentBaud[bus] = rates[bestRate];
     }
-    initCAN(currentBaud);
+    initCAN(bus, currentBaud[bus]);
+    logBaudChange(bus);
+    // Every ID went quiet while the scan ran; relearn rather than alert.
+    anomalyClear(&anomaly, millis());
+    timingClear(&busTiming);
 
     server.send(200, "application/json", json);
 }
@@ -584,79 +1770,571 @@ void handleScan() {
 void handleClear() {
     messageCount = 0;
     errorCount = 0;
+    memset(busMessageCount, 0, sizeof(busMessageCount));
+    memset(busErrorCount, 0, sizeof(busErrorCount));
     uniqueIdCount = 0;
-    logHead = 0;
-    logCount = 0;
+    payloadClear(&lastData);
+    hllClear(&idDistinct);
+    topkClear(&idOverflow);
+    anomalyClear(&anomaly, millis());
+    timingClear(&busTiming);
+    historyClear(&idHistory);
+    logClear();
     startTime = millis();
+    logNewEpoch("clear");
     server.send(200, "text/plain", "OK");
 }
 
+// Frame rows of multi-bus builds end with a bus column.
+#if CAN_BUS_COUNT > 1
+#define CSV_HEADER "timestamp,id,extended,flags,dlc,data,bus\n"
+#else
+#define CSV_HEADER "timestamp,id,extended,flags,dlc,data\n"
+#endif
+
+// Columns in /csv order, the extra ones last; typed rows (marks,
+// events) keep the six-column layout whatever the projection. Once the
+// host has set the clock the default adds a utc column, first so it
+// lines up on typed rows too.
+#if CAN_BUS_COUNT > 1
+#define CSV_DEFAULT_FIELDS (FIELD_ALL & ~FIELD_SEQ)
+#else
+#define CSV_DEFAULT_FIELDS (FIELD_ALL & ~FIELD_SEQ & ~FIELD_BUS)
+#endif
+
+String csvHeader(uint16_t fields) {
+    static const struct { uint16_t bit; const char* name; } columns[] = {
+        { FIELD_UTC, "utc" }, { FIELD_TIME, "timestamp" }, { FIELD_ID, "id" }, { FIELD_EXT, "extended" },
+        { FIELD_FLAGS, "flags" }, { FIELD_DLC, "dlc" }, { FIELD_DATA, "data" }, { FIELD_BUS, "bus" },
+        { FIELD_SEQ, "seq" },
+    };
+    String header;
+    for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); c++) {
+        if (!(fields & columns[c].bit)) continue;
+        if (header.length() > 0) header += ",";
+        header += columns[c].name;
+    }
+    return header + "\n";
+}
+
+void appendLogCsv(String& csv, const LogEntry* e, uint16_t fields) {
+    if (fields & FIELD_UTC) {
+        appendLogUtc(csv, e);
+        csv += ",";
+    }
+    if (e->type != LOG_FRAME) {
+        csv += String(e->timestamp) + (e->type == LOG_MARK ? ",MARK,0,0,0," : ",EVENT,0,0,0,");
+        csv += String(e->markText);
+        csv += "\n";
+        return;
+    }
+    const char* sep = "";
+    if (fields & FIELD_TIME) {
+        csv += String(e->timestamp);
+        sep = ",";
+    }
+    if (fields & FIELD_ID) {
+        csv += String(sep) + "0x" + String(e->id, HEX);
+        sep = ",";
+    }
+    if (fields & FIELD_EXT) {
+        csv += String(sep) + String(e->extended);
+        sep = ",";
+    }
+    if (fields & FIELD_FLAGS) {
+        csv += String(sep) + String(e->flags);
+        sep = ",";
+    }
+    if (fields & FIELD_DLC) {
+        csv += String(sep) + String(canLenToDlc(e->len));
+        sep = ",";
+    }
+    if (fields & FIELD_DATA) {
+        csv += sep;
+        for (int j = 0; j < e->len; j++) {
+            if (j > 0) csv += " ";
+            if (e->data[j] < 16) csv += "0";
+            csv += String(e->data[j], HEX);
+        }
+        sep = ",";
+    }
+    if (fields & FIELD_BUS) {
+        csv += String(sep) + String(e->bus);
+        sep = ",";
+    }
+    if (fields & FIELD_SEQ) csv += String(sep) + String(e->seq);
+    csv += "\n";
+}
+
+// GET /csv?burst=1 -- the last burst as CSV, timestamps in us since it
+// started, streamed with CAN polled in between. Takes the /log filters
+// except fields=, with from/to in ms since the burst started.
+void sendBurstCsv(const LogQuery* q) {
+    server.sendHeader("Content-Disposition", "attachment; filename=ets_burst.csv");
+    bodyBegin("text/csv");
+#if CAN_BUS_COUNT > 1
+    const char* header = "timestamp_us,id,extended,flags,dlc,data,bus\n";
+#else
+    const char* header = "timestamp_us,id,extended,flags,dlc,data\n";
+#endif
+    bodyWrite(header, strlen(header));
+
+    size_t offset = 0;
+    CanFrame frame;
+    char chunk[1024];
+    int used = 0;
+    while (burstNextRecord(&burst, &offset, &frame)) {
+        if (!queryMatchFrame(q, frame.id, frame.bus, frame.data, frame.len, frame.timestampUs / 1000)) continue;
+        if (used > (int)sizeof(chunk) - 240) {   // Room for an FD frame
+            bodyWrite(chunk, used);
+            used = 0;
+            pollCAN();
+        }
+        used += burstFormatRecord(&frame, chunk + used, sizeof(chunk) - used);
+    }
+    bodyWrite(chunk, used);
+    bodyEnd();
+}
+
+// GET /csv?delta=1 -- the whole log as a .cdl file, its blocks as they
+// are held (delta_codec.h), for can_merge.py. Streamed a block at a time
+// with CAN polled in between; filters don't apply.
+void sendLogDelta() {
+    server.sendHeader("Content-Disposition", "attachment; filename=ets_can_log.cdl");
+    bodyBegin("application/octet-stream");
+    uint32_t usPerTick = 1000;
+    bodyWrite(DELTA_FILE_MAGIC, 4);
+    bodyWrite((const char*)&usPerTick, sizeof(usPerTick));
+    LogReader* r = &logReader;
+    logReadBegin(r, 0, nextSeq);
+    while ((int32_t)(r->seq - r->end) < 0 && logLoadBlock(r)) {
+        bodyWrite((const char*)&r->block.header, sizeof(r->block.header));
+        bodyWrite((const char*)r->block.data, r->block.header.used);
+        r->seq = r->block.header.firstSeq + r->block.header.count;
+        pollCAN();
+    }
+    bodyEnd();
+}
+
+// GET /csv -- the whole log as CSV, with the filters in log_query.h.
+// Headers as /log. /csv?burst=1 gives the last burst instead, and
+// /csv?delta=1 the log delta coded.
 void handleCSV() {
-    String csv = "timestamp,id,extended,rtr,dlc,data\n";
-    int start = (logCount < LOG_BUFFER_SIZE) ? 0 : logHead;
+    LogQuery q;
+    if (!parseLogQuery(&q)) return;
+    if (server.hasArg("burst")) {
+        if (burst.state != BURST_DONE) {
+            server.send(404, "text/plain", "No burst captured");
+            return;
+        }
+        sendBurstCsv(&q);
+        return;
+    }
+    if (server.hasArg("delta")) {
+        sendLogDelta();
+        return;
+    }
+    uint16_t fields = q.fields;
+    if (fields == FIELD_ALL) fields = CSV_DEFAULT_FIELDS | (timeBase.synced ? FIELD_UTC : 0);
+    String csv = csvHeader(fields);
+
+    // A first pass for the headers, measuring filtered rows as it goes.
+    LogEntry e;
+    uint32_t end = nextSeq;
+    unsigned long full = strlen(CSV_HEADER);
+    unsigned long sent = csv.length();
+    int matched = 0;
+    String row;
+    logReadBegin(&logReader, 0, end);
+    while (logReadNext(&logReader, &e)) {
+        full += logCsvLen(&e);
+        if (!logEntryMatches(&q, &e)) continue;
+        matched++;
+        if (q.filtered) {
+            row = "";
+            appendLogCsv(row, &e, fields);
+            sent += row.length();
+        }
+    }
+    if (!q.filtered) full = sent = 0;
 
-    for (int i = 0; i < logCount; i++) {
-        int idx = (start + i) % LOG_BUFFER_SIZE;
-        LogEntry* e = &logBuffer[idx];
+    sendQueryHeaders(matched, full, sent);
+    server.sendHeader("Content-Disposition", "attachment; filename=ets_can_log.csv");
+    bodyBegin("text/csv");
+    logReadBegin(&logReader, 0, end);
+    while (logReadNext(&logReader, &e)) {
+        if (!logEntryMatches(&q, &e)) continue;
+        appendLogCsv(csv, &e, fields);
+        if (csv.length() >= STREAM_CHUNK_SIZE) {
+            bodyWrite(csv.c_str(), csv.length());
+            csv = "";
+            pollCAN();
+        }
+    }
+    bodyWrite(csv.c_str(), csv.length());
+    bodyEnd();
+}
 
-        if (e->isMark) {
-            csv += String(e->timestamp) + ",MARK,0,0,0,";
-            csv += String(e->markText);
-            csv += "\n";
-        } else {
-            csv += String(e->timestamp) + ",";
-            csv += "0x" + String(e->id, HEX) + ",";
-            csv += String(e->extended) + ",";
-            csv += String(e->rtr) + ",";
-            csv += String(e->dlc) + ",";
-            for (int j = 0; j < e->dlc; j++) {
-                if (j > 0) csv += " ";
-                if (e->data[j] < 16) csv += "0";
-                csv += String(e->data[j], HEX);
+// GET /flight?enable=0|1 -- turn the flash flight recorder off or on.
+// GET /flight -- download its contents as CSV, oldest first. Timestamps
+// are ms since each boot, and a BOOT row marks where each boot starts.
+// Streamed a block at a time with CAN polled in between. Takes the /log
+// filters except fields=, with from/to in ms since each boot; being
+// streamed, it has no X-Bytes-Saved header.
+void handleFlight() {
+    if (!flightAvailable(&flightRec)) {
+        server.send(404, "text/plain", "No flightrec partition");
+        return;
+    }
+    if (server.hasArg("enable")) {
+        flightSetEnabled(&flightRec, server.arg("enable").toInt() != 0);
+        server.send(200, "text/plain", flightRec.enabled ? "ON" : "OFF");
+        return;
+    }
+
+    LogQuery q;
+    if (!parseLogQuery(&q)) return;
+
+    server.sendHeader("Content-Disposition", "attachment; filename=ets_flight_log.csv");
+    bodyBegin("text/csv");
+    bodyWrite(CSV_HEADER, strlen(CSV_HEADER));
+
+    uint32_t lastBoot = 0;
+    char chunk[1024];
+    int used = 0;
+    if (flightBeginDump(&flightRec, &flightDump)) {
+        while (flightNextBlock(&flightRec, &flightDump, &flightDumpBlock)) {
+            uint16_t offset = 0;
+            FlightRecord rec;
+            while (flightNextRecord(&flightDumpBlock, &offset, &rec)) {
+                if (rec.isMark ? !queryMatchText(&q, rec.ms)
+                               : !queryMatchFrame(&q, rec.id, rec.bus, rec.data, rec.len, rec.ms)) continue;
+                if (used > (int)sizeof(chunk) - 320) {   // Room for a BOOT row and an FD frame
+                    bodyWrite(chunk, used);
+                    used = 0;
+                    pollCAN();
+                }
+                used += flightFormatRecord(&flightDumpBlock, &rec, &lastBoot, chunk + used, sizeof(chunk) - used);
             }
-            csv += "\n";
         }
     }
+    bodyWrite(chunk, used);
+    bodyEnd();
+}
 
-    server.sendHeader("Content-Disposition", "attachment; filename=ets_can_log.csv");
-    server.send(200, "text/csv", csv);
+// GET /perf -- heap, fragmentation, task stack headroom and per-route
+// request cost. Allocation counts are 0 unless built with
+// HEAP_ALLOC_TRACKING.
+void handlePerf() {
+    heapSample(&heapStats, millis());
+
+    String json = "{\"heap\":{";
+    json += "\"free\":" + String(heapStats.freeHeap);
+    json += ",\"minFree\":" + String(heapStats.minFreeHeap);
+    json += ",\"maxBlock\":" + String(heapStats.maxBlock);
+    json += ",\"minMaxBlock\":" + String(heapStats.minMaxBlock);
+    json += ",\"fragPct\":" + String(heapStats.fragmentation);
+    json += ",\"maxFragPct\":" + String(heapStats.maxFragmentation);
+    json += "},\"tasks\":[";
+    for (size_t i = 0; i < HEAP_WATCHED_TASK_COUNT; i++) {
+        if (i > 0) json += ",";
+        json += "{\"name\":\"" + String(heapWatchedTasks[i]) + "\"";
+        json += ",\"stackFree\":" + String(heapTaskStackFree(heapWatchedTasks[i])) + "}";
+    }
+    json += "],\"routes\":[";
+    for (int i = 0; i < routeCount; i++) {
+        RouteStats* r = &routeStats[i];
+        if (i > 0) json += ",";
+        json += "{\"path\":\"" + String(r->path) + "\"";
+        json += ",\"calls\":" + String(r->calls);
+        json += ",\"allocs\":" + String(r->allocs);
+        json += ",\"maxAllocs\":" + String(r->maxAllocs);
+        json += ",\"maxUs\":" + String(r->maxMicros);
+        json += ",\"heapDelta\":" + String(r->lastHeapDelta) + "}";
+    }
+    json += "],\"gzip\":{";
+    json += "\"responses\":" + String(gzipResponses);
+    json += ",\"inBytes\":" + String(gzipInBytes);
+    json += ",\"outBytes\":" + String(gzipOutBytes);
+    json += ",\"us\":" + String(gzipUs);
+    json += "}}";
+    server.send(200, "application/json", json);
 }
 
-// ============== MAIN ==============
+// Starts a chunked response whose body is written with streamPrintf(),
+// compressed as bodyBegin().
+void streamBegin(const char* contentType) {
+    bodyBegin(contentType);
+    streamUsed = 0;
+}
 
-void setup() {
-    Serial.begin(115200);
-    delay(2000);
+// Appends to the response chunk, sending it (and polling CAN) when it's
+// nearly full. Lines are always well under 160 bytes.
+void streamPrintf(const char* fmt, ...) {
+    if (streamUsed > STREAM_CHUNK_SIZE - 160) {
+        bodyWrite(streamChunk, streamUsed);
+        streamUsed = 0;
+        pollCAN();
+    }
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(streamChunk + streamUsed, STREAM_CHUNK_SIZE - streamUsed, fmt, args);
+    va_end(args);
+    if (len > 0) streamUsed += min(len, STREAM_CHUNK_SIZE - streamUsed - 1);
+}
 
-    pinMode(CAN_INT_PIN, INPUT);
+void streamEnd() {
+    bodyWrite(streamChunk, streamUsed);
+    bodyEnd();
+}
 
-    Serial.println("\n\nETS CAN Sniffer - WiFi Version (MCP2515)");
-    Serial.println("==========================================");
+void metricsHeader(const char* name, const char* type, const char* help) {
+    streamPrintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
 
-    WiFi.mode(WIFI_STA);
-    WiFi.config(staticIP, gateway, subnet, dns);
-    WiFi.begin(WIFI_SSID, WIFI_PASS);
-    Serial.printf("Connecting to WiFi \"%s\"", WIFI_SSID);
-    while (WiFi.status() != WL_CONNECTED) {
-        delay(500);
-        Serial.print(".");
-    }
-    Serial.println(" connected!");
-    Serial.print("IP: ");
-    Serial.println(WiFi.localIP());
-
-    server.on("/", handleRoot);
-    server.on("/status", handleStatus);
-    server.on("/ids", handleIds);
-    server.on("/log", handleLog);
-    server.on("/baud", handleBaud);
-    server.on("/mark", handleMark);
-    server.on("/scan", handleScan);
-    server.on("/clear", handleClear);
-    server.on("/csv", handleCSV);
-    server.begin();
-    Serial.println("Web server started on port 80");
+// GET /metrics -- Prometheus text exposition format. The body is built in
+// a fixed buffer and streamed in chunks, so a scrape allocates nothing
+// beyond the server's own response headers, and CAN is polled between
+// chunks so scrapes don't cost frames.
+void handleMetrics() {
+    unsigned long scrapeStart = micros();
+    unsigned long now = millis();
+    heapSample(&heapStats, now);
+    unsigned long overflows = 0, recoveries = 0;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        overflows += canHealth[b].overflows;
+        recoveries += canHealth[b].recoveries;
+    }
+
+    streamBegin("text/plain; version=0.0.4");
+
+    metricsHeader("ets_can_messages_total", "counter", "CAN frames received since the last clear");
+    streamPrintf("ets_can_messages_total %lu\n", messageCount);
+    metricsHeader("ets_can_errors_total", "counter", "Failed controller reads since the last clear");
+    streamPrintf("ets_can_errors_total %lu\n", errorCount);
+    metricsHeader("ets_can_overflows_total", "counter", "Controller RX overflows seen");
+    streamPrintf("ets_can_overflows_total %lu\n", overflows);
+    metricsHeader("ets_can_recoveries_total", "counter", "Controller re-initialisations by the health monitor");
+    streamPrintf("ets_can_recoveries_total %lu\n", recoveries);
+    metricsHeader("ets_rx_poll_mode", "gauge", "1 while the receive path is busy-polling, 0 while it sleeps on INT");
+    streamPrintf("ets_rx_poll_mode %d\n", rxAdapt.mode == RX_MODE_POLL ? 1 : 0);
+    metricsHeader("ets_rx_mode_switches_total", "counter", "Receive mode switches, by the mode switched to");
+    streamPrintf("ets_rx_mode_switches_total{to=\"poll\"} %lu\n", rxAdapt.toPoll);
+    streamPrintf("ets_rx_mode_switches_total{to=\"irq\"} %lu\n", rxAdapt.toIrq);
+    metricsHeader("ets_rx_sleep_seconds_total", "counter", "Time loop() spent asleep waiting for INT");
+    streamPrintf("ets_rx_sleep_seconds_total %.3f\n", rxAdapt.sleepUs / 1e6);
+    metricsHeader("ets_can_bus_load_ratio", "gauge", "Bus utilisation over the last second, without stuff bits");
+#if CAN_BUS_COUNT > 1
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        streamPrintf("ets_can_bus_load_ratio{bus=\"%d\"} %.4f\n", b, timingLoad(&busTiming.buses[b]));
+    }
+#else
+    streamPrintf("ets_can_bus_load_ratio %.4f\n", timingLoad(&busTiming.buses[0]));
+#endif
+    metricsHeader("ets_can_unique_ids", "gauge", "Distinct CAN IDs being tracked");
+    streamPrintf("ets_can_unique_ids %d\n", uniqueIdCount);
+    metricsHeader("ets_can_distinct_ids_estimate", "gauge", "Distinct CAN IDs seen, tracked or not (HyperLogLog)");
+    streamPrintf("ets_can_distinct_ids_estimate %lu\n", hllEstimate(&idDistinct));
+    metricsHeader("ets_can_untracked_frames_total", "counter", "Frames whose ID didn't fit in the ID table");
+    streamPrintf("ets_can_untracked_frames_total %lu\n", idOverflow.total);
+    metricsHeader("ets_anomaly_alerts_total", "counter", "Anomaly alerts raised, by type");
+    for (int t = 0; t < ALERT_TYPE_COUNT; t++) {
+        streamPrintf("ets_anomaly_alerts_total{type=\"%s\"} %lu\n", alertTypeToString(t), anomaly.raised[t]);
+    }
+    metricsHeader("ets_anomaly_alerts_suppressed_total", "counter", "Anomaly alerts dropped by rate limiting");
+    streamPrintf("ets_anomaly_alerts_suppressed_total %lu\n", anomaly.suppressed);
+
+    // Pick the busiest IDs by insertion into a small sorted list.
+    int top[METRICS_TOP_IDS];
+    int topCount = 0;
+    for (int i = 0; i < uniqueIdCount; i++) {
+        if (topCount == METRICS_TOP_IDS && idCounts[i] <= idCounts[top[topCount - 1]]) continue;
+        int pos = topCount < METRICS_TOP_IDS ? topCount++ : topCount - 1;
+        while (pos > 0 && idCounts[top[pos - 1]] < idCounts[i]) {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+        top[pos] = i;
+    }
+    unsigned long otherFrames = messageCount;
+
+    metricsHeader("ets_can_id_frames_total", "counter", "Frames per CAN ID, busiest IDs only");
+    for (int t = 0; t < topCount; t++) {
+        int i = top[t];
+        streamPrintf("ets_can_id_frames_total{id=\"0x%03X\"} %lu\n", seenIds[i], idCounts[i]);
+        otherFrames -= min(otherFrames, idCounts[i]);
+    }
+    metricsHeader("ets_can_other_id_frames_total", "counter", "Frames for IDs not listed individually");
+    streamPrintf("ets_can_other_id_frames_total %lu\n", otherFrames);
+    metricsHeader("ets_can_id_period_seconds", "gauge", "Smoothed interval between frames per CAN ID");
+    for (int t = 0; t < topCount; t++) {
+        int i = top[t];
+        if (idPeriodUs[i] == 0) continue;
+        streamPrintf("ets_can_id_period_seconds{id=\"0x%03X\"} %.6f\n", seenIds[i], idPeriodUs[i] / 1e6);
+    }
+
+    metricsHeader("ets_loop_gap_seconds", "histogram", "Time between loop() passes");
+    unsigned long cumulative = 0;
+    for (size_t b = 0; b < LOOP_GAP_BUCKETS - 1; b++) {
+        cumulative += loopGapCounts[b];
+        streamPrintf("ets_loop_gap_seconds_bucket{le=\"%g\"} %lu\n", loopGapBoundsUs[b] / 1e6, cumulative);
+    }
+    cumulative += loopGapCounts[LOOP_GAP_BUCKETS - 1];
+    streamPrintf("ets_loop_gap_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+    streamPrintf("ets_loop_gap_seconds_sum %.6f\n", loopGapSumUs / 1e6);
+    streamPrintf("ets_loop_gap_seconds_count %lu\n", cumulative);
+
+    metricsHeader("ets_heap_free_bytes", "gauge", "Free heap");
+    streamPrintf("ets_heap_free_bytes %u\n", heapStats.freeHeap);
+    metricsHeader("ets_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    streamPrintf("ets_heap_min_free_bytes %u\n", heapStats.minFreeHeap);
+    metricsHeader("ets_heap_max_block_bytes", "gauge", "Largest allocatable block");
+    streamPrintf("ets_heap_max_block_bytes %u\n", heapStats.maxBlock);
+    metricsHeader("ets_metrics_scrape_duration_seconds", "gauge", "Time taken by the previous scrape");
+    streamPrintf("ets_metrics_scrape_duration_seconds %.6f\n", lastScrapeUs / 1e6);
+
+    streamEnd();
+    lastScrapeUs = micros() - scrapeStart;
+}
+
+// GET /timing -- bus timing from bus_timing.h. Per bus: the idle gap
+// histogram in bit times (gapBounds are the bucket upper bounds), busy
+// clusters, and load per second in permille, oldest first. Per tracked
+// ID: interval range and jitter, back-to-back frames, lost arbitrations
+// and the longest estimated arbitration delay. Streamed like /metrics.
+void handleTiming() {
+    streamBegin("application/json");
+    streamPrintf("{\"hwTimestamps\":%s,\"b2bBits\":%d,\"bucketMs\":%d,\"gapBounds\":[",
+                 TIMING_STAMP_AT_SOF ? "true" : "false", TIMING_B2B_BITS, TIMING_BUCKET_MS);
+    for (size_t g = 0; g < TIMING_GAP_BUCKETS - 1; g++) {
+        streamPrintf(g ? ",%lu" : "%lu", (unsigned long)timingGapBoundsBits[g]);
+    }
+    streamPrintf("],\"buses\":[");
+    for (int bus = 0; bus < CAN_BUS_COUNT; bus++) {
+        const BusTiming* b = &busTiming.buses[bus];
+        streamPrintf("%s{\"bus\":%d,\"bitrate\":%lu,\"frames\":%lu,\"backToBack\":%lu,\"gaps\":[",
+                     bus ? "," : "", bus, baudToBitsPerSecond(currentBaud[bus]), b->frames, b->backToBack);
+        for (size_t g = 0; g < TIMING_GAP_BUCKETS; g++) streamPrintf(g ? ",%lu" : "%lu", b->gaps[g]);
+        streamPrintf("],\"clusters\":%lu,\"maxClusterFrames\":%u,\"maxClusterUs\":%lu,\"recent\":[",
+                     b->clusters, b->maxClusterFrames, (unsigned long)b->maxClusterUs);
+        for (int k = 0; k < b->recentCount; k++) {
+            const TimingCluster* c = &b->recent[(b->recentHead + TIMING_CLUSTER_KEEP - b->recentCount + k) % TIMING_CLUSTER_KEEP];
+            streamPrintf("%s{\"t\":%lu,\"frames\":%u,\"us\":%lu}", k ? "," : "",
+                         c->ms - startTime, c->frames, (unsigned long)c->durationUs);
+        }
+        streamPrintf("],\"load\":[");
+        for (int k = 0; k < b->seriesCount; k++) {
+            streamPrintf(k ? ",%u" : "%u",
+                         b->series[(b->seriesHead + TIMING_SERIES_LEN - b->seriesCount + k) % TIMING_SERIES_LEN]);
+        }
+        streamPrintf("]}");
+    }
+    streamPrintf("],\"ids\":[");
+    for (int i = 0; i < uniqueIdCount; i++) {
+        const IdTiming* d = &busTiming.ids[i];
+        streamPrintf("%s{\"id\":%lu,\"bus\":%d,\"intervals\":%lu,\"minUs\":%lu,\"maxUs\":%lu,",
+                     i ? "," : "", (unsigned long)seenIds[i], idBus[i], (unsigned long)d->intervals,
+                     (unsigned long)d->minIntervalUs, (unsigned long)d->maxIntervalUs);
+        streamPrintf("\"jitterUs\":%lu,\"backToBack\":%lu,\"lost\":%lu,\"maxDelayUs\":%lu}",
+                     (unsigned long)timingJitterUs(d), (unsigned long)d->backToBack,
+                     (unsigned long)d->lostArb, (unsigned long)d->maxDelayUs);
+    }
+    streamPrintf("]}");
+    streamEnd();
+}
+
+#ifdef TRACE_ENABLED
+// GET /trace?enable=0|1 or /trace?clear=1 -- control recording.
+// GET /trace -- download the event ring as Chrome trace_event JSON, for
+// ui.perfetto.dev or chrome://tracing. Recording pauses during the export.
+void handleTrace() {
+    if (server.hasArg("enable") || server.hasArg("clear")) {
+        if (server.hasArg("enable")) traceSetEnabled(server.arg("enable").toInt() != 0);
+        if (server.hasArg("clear")) traceClear();
+        server.send(200, "text/plain", traceRing.enabled ? "ON" : "OFF");
+        return;
+    }
+
+    TraceExport x;
+    traceExportBegin(&x);
+    server.sendHeader("Content-Disposition", "attachment; filename=ets_trace.json");
+    streamBegin("application/json");
+    streamPrintf("%s", TRACE_JSON_HEADER);
+    char line[160];
+    while (traceExportNext(&x, line, sizeof(line)) > 0) {
+        streamPrintf("%s", line);
+    }
+    streamPrintf("%s", TRACE_JSON_FOOTER);
+    streamEnd();
+    traceExportEnd(&x);
+}
+#endif
+
+// Wakes loop() when it is asleep in interrupt mode; reads still happen in
+// loop(). arg is the bus number.
+void IRAM_ATTR canIntIsr(void* arg) {
+    (void)arg;                   // Only read when tracing
+    TRACE_INSTANT(TRACE_ISR, TRACE_TID_ISR, (uint32_t)(uintptr_t)arg);
+    rxAdaptWake(&rxAdapt);
+}
+
+// Registers a handler and wraps it with the bookkeeping for /perf.
+void addRoute(const char* path, void (*handler)()) {
+    if (routeCount >= MAX_ROUTES) {
+        server.on(path, handler);
+        return;
+    }
+    int index = routeCount++;
+    routeStats[index].path = path;
+    server.on(path, [index, handler]() {
+        RouteStats* r = &routeStats[index];
+        uint32_t allocsBefore = heapAllocCount;
+        uint32_t heapBefore = ESP.getFreeHeap();
+        unsigned long start = micros();
+
+        TRACE_BEGIN(TRACE_HTTP, index);
+        handler();
+        TRACE_END(TRACE_HTTP, index);
+
+        uint32_t elapsed = micros() - start;
+        uint32_t allocs = heapAllocCount - allocsBefore;
+        r->calls++;
+        r->allocs += allocs;
+        if (allocs > r->maxAllocs) r->maxAllocs = allocs;
+        if (elapsed > r->maxMicros) r->maxMicros = elapsed;
+        r->lastHeapDelta = (int32_t)ESP.getFreeHeap() - (int32_t)heapBefore;
+    });
+}
 
+// ============== WIFI ==============
+
+// Runs on the WiFi event task: record state only, never block here.
+void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t) {
+    TRACE_INSTANT(TRACE_WIFI_EVENT, TRACE_TID_WIFI, event);
+    switch (event) {
+        case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+            wifiConnected = true;
+            break;
+        case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+            wifiAttemptFailed = true;
+            if (wifiConnected) {
+                wifiDownSince = millis();
+                wifiLost = true;
+            }
+            wifiConnected = false;
+            break;
+        case ARDUINO_EVENT_WIFI_AP_STACONNECTED:
+            apStations++;
+            break;
+        case ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
+            if (apStations > 0) apStations--;
+            break;
+        default:
+            break;
+    }
+}
+
+void startOTA() {
     ArduinoOTA.setHostname("ets-sniffer");
     ArduinoOTA.onStart([]() { Serial.println("OTA update starting..."); });
     ArduinoOTA.onEnd([]() { Serial.println("\nOTA update complete."); });
@@ -664,37 +2342,179 @@ void setup() {
         Serial.printf("OTA error [%u]\n", error);
     });
     ArduinoOTA.begin();
+    otaStarted = true;
     Serial.println("OTA enabled (hostname: ets-sniffer)");
+}
 
-    if (!initCAN(currentBaud)) {
-        Serial.println("FATAL: MCP2515 init failed!");
-        while(1) delay(1000);
+// Called every loop(). Handles connect/reconnect bookkeeping, the fallback
+// AP and retry backoff without ever waiting on the radio.
+void serviceWiFi() {
+    unsigned long now = millis();
+
+    if (wifiConnected) {
+        if (wifiConnectMs == 0) {
+            wifiConnectMs = now;
+            Serial.printf("WiFi connected after %lu ms, IP: %s\n",
+                          wifiConnectMs, WiFi.localIP().toString().c_str());
+        } else if (wifiDownSince != 0) {
+            lastReconnectGapMs = now - wifiDownSince;
+            if (lastReconnectGapMs > maxReconnectGapMs) maxReconnectGapMs = lastReconnectGapMs;
+            wifiReconnects++;
+            Serial.printf("WiFi reconnected after %lu ms outage\n", lastReconnectGapMs);
+        }
+        wifiDownSince = 0;
+        wifiRetryInterval = WIFI_RETRY_MIN_MS;
+
+        // Router is back, so the fallback network is no longer needed,
+        // but a phone that joined it while the router was down stays
+        // connected until it leaves. The AP keeps sharing the radio with
+        // the station link until then.
+        if (apActive && apStations == 0) {
+            WiFi.softAPdisconnect(true);
+            WiFi.mode(WIFI_STA);
+            apActive = false;
+            Serial.println("Fallback AP stopped");
+        }
+        if (!otaStarted) startOTA();
+        return;
     }
-    Serial.printf("CAN initialised at %s (MCP2515, 8 MHz crystal)\n", baudToString(currentBaud));
 
-    startTime = millis();
-    Serial.printf("Ready! Browse to http://%s\n", WiFi.localIP().toString().c_str());
-}
+    if (wifiLost) {
+        wifiLost = false;
+        Serial.println("WiFi connection lost, retrying in background");
+        nextWifiRetry = now + WIFI_RETRY_MIN_MS;
+    }
 
-void loop() {
-    ArduinoOTA.handle();
-    server.handleClient();
+    if (!apActive && wifiConnectMs == 0 && now > WIFI_CONNECT_TIMEOUT_MS) {
+        WiFi.mode(WIFI_AP_STA);
+        WiFi.softAP(AP_SSID, AP_PASS);
+        apActive = true;
+        Serial.printf("No router after %d ms, fallback AP \"%s\" at http://%s\n",
+                      WIFI_CONNECT_TIMEOUT_MS, AP_SSID, WiFi.softAPIP().toString().c_str());
+        if (!otaStarted) startOTA();
+    }
 
-    if (digitalRead(CAN_INT_PIN) == LOW) {
-        unsigned long rxId;
-        uint8_t dlc;
-        uint8_t data[8];
+    // WiFi.reconnect() returns immediately; the outcome arrives as an event.
+    // Retry only once the last attempt has failed: reconnecting while a
+    // slow association is still under way would abort it.
+    if (wifiAttemptFailed && (long)(now - nextWifiRetry) >= 0) {
+        wifiAttemptFailed = false;
+        WiFi.reconnect();
+        nextWifiRetry = now + wifiRetryInterval;
+        wifiRetryInterval = min(wifiRetryInterval * 2, (unsigned long)WIFI_RETRY_MAX_MS);
+    }
+}
 
-        byte result = CAN.readMsgBuf(&rxId, &dlc, data);
+// ============== MAIN ==============
 
-        if (result == CAN_OK) {
-            bool extended = (rxId & 0x80000000) != 0;
-            bool rtr = (rxId & 0x40000000) != 0;
-            uint32_t canId = rxId & 0x1FFFFFFF;
+void setup() {
+    Serial.begin(115200);
 
-            messageCount++;
-            findOrAddId(canId, data, dlc);
-            addToLog(canId, extended, rtr, dlc, data);
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        healthInit(&canHealth[b]);
+        currentBaud[b] = BAUD_250K;
+    }
+    heapInit(&heapStats);
+
+    // CAN comes up before anything else so the first frames after
+    // key-on are captured while WiFi is still associating.
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (!initCAN(b, currentBaud[b])) {
+            Serial.printf("FATAL: %s init failed on bus %d!\n", CanBackend::name(), b);
+            while(1) delay(1000);
         }
     }
+    startTime = millis();
+    timeBase.epochStartMs = startTime;
+
+    Serial.println("\n\nETS CAN Sniffer - WiFi Version");
+    Serial.println("==========================================");
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        Serial.printf("CAN%d initialised at %s (%s)\n", b, baudToString(currentBaud[b]), CanBackend::name());
+    }
+    if (flightInit(&flightRec)) {
+        Serial.printf("Flight recorder: %s (boot %lu)\n",
+                      flightRec.enabled ? "on" : "off", (unsigned long)flightRec.bootId);
+    }
+
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);   // Reconnects are scheduled by serviceWiFi()
+    WiFi.onEvent(onWiFiEvent);
+    WiFi.mode(WIFI_STA);
+    WiFi.config(staticIP, gateway, subnet, dns);
+    WiFi.begin(WIFI_SSID, WIFI_PASS);
+    nextWifiRetry = millis() + WIFI_CONNECT_TIMEOUT_MS / 3;
+    Serial.printf("Connecting to WiFi \"%s\" in background\n", WIFI_SSID);
+
+    addRoute("/", handleRoot);
+    addRoute("/status", handleStatus);
+    addRoute("/ids", handleIds);
+    addRoute("/ids/history", handleIdHistory);
+    addRoute("/log", handleLog);
+    addRoute("/baud", handleBaud);
+    addRoute("/mark", handleMark);
+    addRoute("/ping", handlePing);
+    addRoute("/time", handleTime);
+    addRoute("/alerts", handleAlerts);
+    addRoute("/buttons", handleButtons);
+    addRoute("/burst", handleBurst);
+    addRoute("/scan", handleScan);
+    addRoute("/clear", handleClear);
+    addRoute("/csv", handleCSV);
+    addRoute("/flight", handleFlight);
+    addRoute("/perf", handlePerf);
+    addRoute("/metrics", handleMetrics);
+    addRoute("/timing", handleTiming);
+#ifdef TRACE_ENABLED
+    addRoute("/trace", handleTrace);
+#endif
+    rxAdaptInit(&rxAdapt, canBus, canIntIsr);
+    markButtonsInit(&markButtons);
+    const char* headerKeys[] = {"Accept-Encoding"};
+    server.collectHeaders(headerKeys, 1);
+    server.begin();
+    Serial.println("Web server started on port 80");
+}
+
+// Feeds the loop gap histogram and closes bus load buckets.
+void updateLoopStats() {
+    unsigned long nowUs = micros();
+    if (lastLoopUs != 0) {
+        unsigned long gap = nowUs - lastLoopUs;
+        size_t b = 0;
+        while (b < LOOP_GAP_BUCKETS - 1 && gap > loopGapBoundsUs[b]) b++;
+        loopGapCounts[b]++;
+        loopGapSumUs += gap;
+    }
+    lastLoopUs = nowUs;
+    timingService(&busTiming, millis());
+}
+
+void loop() {
+    if (burst.state == BURST_RUNNING) {
+        serviceBurst();
+        return;
+    }
+
+    updateLoopStats();
+    pollCAN();
+    serviceAlerts();
+    serviceMarkButtons();
+
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        can_fault_t fault = healthPoll(&canHealth[b], canBus[b], millis());
+        if (fault != FAULT_NONE) recoverCAN(b, fault);
+    }
+    flightService(&flightRec, millis());
+    heapService(&heapStats, millis());
+
+    serviceWiFi();
+    if (otaStarted) {
+        TRACE_BEGIN(TRACE_OTA, 0);
+        ArduinoOTA.handle();
+        TRACE_END(TRACE_OTA, 0);
+    }
+    server.handleClient();
+
+    rxAdaptWait(&rxAdapt, canBus);
 }
@@ -0,0 +1,165 @@
+/*
+ * Hardware mark buttons, shared by the serial and WiFi builds.
+ *
+ * A mark typed on serial or tapped in the web UI lands 100-500 ms after
+ * the helm action it describes. A button wired from a GPIO to GND
+ * instead is timestamped in its edge ISR with micros(), the clock frames
+ * are stamped with, and the mark is logged at that time.
+ *
+ * The ISR only records the first falling edge of a press. Debouncing is
+ * done by a 1 ms esp_timer (a hardware timer, run on the esp_timer task):
+ * the press counts once the pin has read low for MARK_DEBOUNCE_MS ticks
+ * in a row, is dropped as a glitch if it reads high first, and the
+ * button re-arms after reading high for MARK_DEBOUNCE_MS. Confirmed
+ * presses wait in a small queue for markButtonsNext() in loop().
+ *
+ * Pins and their labels are set with MARK_BUTTON_PINS and
+ * MARK_BUTTON_LABELS; labels can be changed at runtime to any entry in
+ * markLabels[], the same set as the web UI's mark buttons. The pins use
+ * the internal pull-ups, so input-only GPIO34-39 need external ones.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#ifndef MARK_BUTTON_PINS
+#define MARK_BUTTON_PINS   { 13, 14, 25 }
+#define MARK_BUTTON_LABELS { "Shift FWD", "Shift NEU", "Shift REV" }
+#endif
+#define MARK_DEBOUNCE_MS   20
+#define MARK_QUEUE_LEN     8           // Power of two
+
+static const uint8_t markButtonPins[] = MARK_BUTTON_PINS;
+static const char* const markButtonLabels[] = MARK_BUTTON_LABELS;
+#define MARK_BUTTON_COUNT (sizeof(markButtonPins) / sizeof(markButtonPins[0]))
+
+static const char* const markLabels[] = {
+    "Shift FWD", "Shift NEU", "Shift REV",
+    "Throttle UP", "Throttle DOWN", "Throttle IDLE", "Throttle FULL",
+    "Key ON", "Key OFF", "Engine START", "Engine STOP",
+};
+#define MARK_LABEL_COUNT (sizeof(markLabels) / sizeof(markLabels[0]))
+
+typedef enum {
+    MARK_BUTTON_UP,          // Armed, waiting for an edge
+    MARK_BUTTON_SETTLING,    // Edge seen, pin being sampled
+    MARK_BUTTON_DOWN         // Press logged, waiting for release
+} mark_button_state_t;
+
+struct MarkButton {
+    uint8_t pin;
+    const char* label;
+    volatile uint8_t state;          // mark_button_state_t
+    volatile unsigned long edgeUs;   // micros() at the press's first edge
+    uint8_t stable;                  // Ticks the pin has held its new level
+};
+
+struct MarkPress {
+    uint8_t button;
+    unsigned long us;                // micros() at the press
+};
+
+struct MarkButtons {
+    MarkButton buttons[MARK_BUTTON_COUNT];
+    esp_timer_handle_t timer;
+    MarkPress queue[MARK_QUEUE_LEN];
+    volatile uint8_t head;           // Written by the timer
+    volatile uint8_t tail;           // Written by loop()
+    unsigned long presses;
+    unsigned long glitches;          // Edges that didn't hold for MARK_DEBOUNCE_MS
+    unsigned long dropped;           // Queue full
+};
+
+// arg is the MarkButton.
+inline void IRAM_ATTR markButtonIsr(void* arg) {
+    MarkButton* b = (MarkButton*)arg;
+    if (b->state != MARK_BUTTON_UP) return;
+    b->edgeUs = micros();
+    b->stable = 0;
+    b->state = MARK_BUTTON_SETTLING;
+}
+
+// Runs every millisecond on the esp_timer task; arg is the MarkButtons.
+inline void markButtonsTick(void* arg) {
+    MarkButtons* m = (MarkButtons*)arg;
+    for (size_t i = 0; i < MARK_BUTTON_COUNT; i++) {
+        MarkButton* b = &m->buttons[i];
+        bool low = digitalRead(b->pin) == LOW;
+        if (b->state == MARK_BUTTON_SETTLING) {
+            if (!low) {
+                m->glitches++;
+                b->state = MARK_BUTTON_UP;
+            } else if (++b->stable >= MARK_DEBOUNCE_MS) {
+                if ((uint8_t)(m->head - m->tail) < MARK_QUEUE_LEN) {
+                    MarkPress* p = &m->queue[m->head & (MARK_QUEUE_LEN - 1)];
+                    p->button = i;
+                    p->us = b->edgeUs;
+                    m->head++;
+                    m->presses++;
+                } else {
+                    m->dropped++;
+                }
+                b->stable = 0;
+                b->state = MARK_BUTTON_DOWN;
+            }
+        } else if (b->state == MARK_BUTTON_DOWN) {
+            b->stable = low ? 0 : b->stable + 1;
+            if (b->stable >= MARK_DEBOUNCE_MS) b->state = MARK_BUTTON_UP;
+        }
+    }
+}
+
+// Sets up the pins, their interrupts and the debounce timer. Returns
+// false if the timer couldn't be started.
+inline bool markButtonsInit(MarkButtons* m) {
+    for (size_t i = 0; i < MARK_BUTTON_COUNT; i++) {
+        MarkButton* b = &m->buttons[i];
+        b->pin = markButtonPins[i];
+        b->label = markButtonLabels[i];
+        b->state = MARK_BUTTON_UP;
+        pinMode(b->pin, INPUT_PULLUP);
+        attachInterruptArg(digitalPinToInterrupt(b->pin), markButtonIsr, b, FALLING);
+    }
+    esp_timer_create_args_t args = {};
+    args.callback = markButtonsTick;
+    args.arg = m;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "markbtn";
+    return esp_timer_create(&args, &m->timer) == ESP_OK &&
+           esp_timer_start_periodic(m->timer, 1000) == ESP_OK;
+}
+
+// Pops the oldest confirmed press. Returns false if there is none.
+inline bool markButtonsNext(MarkButtons* m, MarkPress* out) {
+    if (m->tail == m->head) return false;
+    *out = m->queue[m->tail & (MARK_QUEUE_LEN - 1)];
+    m->tail++;
+    return true;
+}
+
+// Converts a press time to millis(), by its age on the same clock.
+inline unsigned long markPressMs(const MarkPress* p) {
+    return millis() - (micros() - p->us) / 1000;
+}
+
+// The press's time in ms since start (a log's startTime). A press from
+// before a clear moved start is put at 0, so the mark is kept.
+inline unsigned long markPressSince(const MarkPress* p, unsigned long start) {
+    long ms = (long)(markPressMs(p) - start);
+    return ms > 0 ? ms : 0;
+}
+
+// Relabels button i with the markLabels[] entry matching label, ignoring
+// case. Returns false if either doesn't exist.
+inline bool markButtonsSetLabel(MarkButtons* m, size_t i, const char* label) {
+    if (i >= MARK_BUTTON_COUNT) return false;
+    for (size_t k = 0; k < MARK_LABEL_COUNT; k++) {
+        if (strcasecmp(markLabels[k], label) == 0) {
+            m->buttons[i].label = markLabels[k];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,71 @@
+/*
+ * Last payload per tracked ID, shared by the serial and WiFi builds.
+ *
+ * Every ID slot holds up to 8 bytes inline. CAN FD payloads longer than
+ * that keep bytes 8-63 in a pool of PAYLOAD_FD_SLOTS tails, taken the
+ * first time an ID sends more than 8 bytes, so an ID table sized for a
+ * classic bus doesn't carry 64 bytes per ID. If the pool runs out, later
+ * FD IDs keep only their first 8 bytes.
+ *
+ * All-zero is the empty state, so a global store needs no init.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "can_backend.h"
+
+#define PAYLOAD_FD_SLOTS 32
+#define PAYLOAD_TAIL_SIZE (CAN_MAX_DLEN - 8)
+
+template <int Ids>
+struct PayloadStore {
+    uint8_t head[Ids][8];
+    uint8_t len[Ids];
+    uint8_t tailSlot[Ids];                             // Pool index + 1, 0 = none
+    uint8_t tails[PAYLOAD_FD_SLOTS][PAYLOAD_TAIL_SIZE];
+    int tailsUsed;
+};
+
+template <int Ids>
+inline void payloadClear(PayloadStore<Ids>* p) {
+    memset(p->len, 0, sizeof(p->len));
+    memset(p->tailSlot, 0, sizeof(p->tailSlot));
+    p->tailsUsed = 0;
+}
+
+// Stores the payload of a frame for ID slot i. Returns true if it differs
+// from the previous one, or can't be compared because the pool is full.
+template <int Ids>
+inline bool payloadStore(PayloadStore<Ids>* p, int i, const CanFrame* frame) {
+    uint8_t headLen = frame->len < 8 ? frame->len : 8;
+    bool changed = p->len[i] != frame->len || memcmp(p->head[i], frame->data, headLen) != 0;
+    memcpy(p->head[i], frame->data, headLen);
+    p->len[i] = frame->len;
+    if (frame->len <= 8) return changed;
+
+    if (p->tailSlot[i] == 0) {
+        if (p->tailsUsed >= PAYLOAD_FD_SLOTS) return true;
+        p->tailSlot[i] = ++p->tailsUsed;
+    }
+    uint8_t* tail = p->tails[p->tailSlot[i] - 1];
+    changed = changed || memcmp(tail, frame->data + 8, frame->len - 8) != 0;
+    memcpy(tail, frame->data + 8, frame->len - 8);
+    return changed;
+}
+
+// Copies the payload for ID slot i into out (CAN_MAX_DLEN bytes) and
+// returns its length. Bytes past 8 read as 0 if the pool was full.
+template <int Ids>
+inline uint8_t payloadGet(const PayloadStore<Ids>* p, int i, uint8_t* out) {
+    uint8_t len = p->len[i];
+    memcpy(out, p->head[i], len < 8 ? len : 8);
+    if (len > 8) {
+        if (p->tailSlot[i] != 0) {
+            memcpy(out + 8, p->tails[p->tailSlot[i] - 1], len - 8);
+        } else {
+            memset(out + 8, 0, len - 8);
+        }
+    }
+    return len;
+}
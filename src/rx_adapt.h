@@ -0,0 +1,169 @@
+/*
+ * Adaptive receive, shared by the serial and WiFi builds: interrupt
+ * wake-ups when the bus is quiet, busy polling when it is busy, switched
+ * automatically in the style of Linux NAPI.
+ *
+ * In RX_MODE_IRQ, loop() sleeps for up to RX_IRQ_WAIT_MS whenever no
+ * controller has a frame waiting, and the INT falling edge wakes it.
+ * The CPU is left to the idle task, the WiFi stack and the flight
+ * recorder writer in between, at the price of one interrupt and one task
+ * switch per wake-up.
+ *
+ * Once frames arrive faster than RX_POLL_ENTER_FPS, or a pass leaves
+ * frames behind because the read budget ran out while the rate is past
+ * RX_POLL_EXIT_FPS, INT is masked and loop() reads up to RX_POLL_BUDGET
+ * frames per bus every pass without ever sleeping. It goes back to
+ * interrupts only after RX_POLL_EXIT_WINDOWS windows in a row below
+ * RX_POLL_EXIT_FPS, so a bursty bus doesn't flap between modes.
+ *
+ * Backends with no INT pin (TWAI, mock) always poll.
+ *
+ * The thresholds come from the sweep in test/test_rx_adapt. Polling
+ * loses no fewer frames than interrupts at any rate there; a stall
+ * loses the same frames either way, and the queued ones are caught up
+ * within a few passes. What it saves is an ISR and a task switch per
+ * frame, which is worth having only once loop() hardly sleeps anyway:
+ * with interrupts it takes about 70% of the CPU at 4000 frames/s and
+ * 90% at 5500.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "bus_merge.h"
+#include "can_backend.h"
+#include "trace.h"
+
+#define RX_RATE_WINDOW_US     10000   // Frame rate measured over 10 ms
+#define RX_POLL_ENTER_FPS     5500    // loop() asleep under 10% of the time in interrupt mode
+#define RX_POLL_EXIT_FPS      4000    // ...and 30% here
+#define RX_POLL_EXIT_WINDOWS  20      // 200 ms below the exit rate
+#define RX_POLL_BUDGET        64      // Frames per bus per pass while polling
+#define RX_IRQ_WAIT_MS        1       // Longest sleep, so the rest of loop() keeps running
+
+typedef enum {
+    RX_MODE_IRQ,
+    RX_MODE_POLL
+} rx_mode_t;
+
+struct RxAdapt {
+    rx_mode_t mode;
+    bool canSleep;                   // Every controller has an INT pin
+    int8_t pins[CAN_BUS_COUNT];
+    TaskHandle_t task;               // Task woken by rxAdaptWake(), i.e. loop()
+    unsigned long windowStart;       // micros()
+    unsigned long windowFrames;
+    unsigned long rate;              // Frames/s over the last full window
+    int quietWindows;
+    unsigned long toPoll;            // Mode switches, each way
+    unsigned long toIrq;
+    uint64_t sleepUs;                // Total time loop() spent asleep
+};
+
+inline const char* rxModeToString(rx_mode_t mode) {
+    return mode == RX_MODE_IRQ ? "irq" : "poll";
+}
+
+// Call from setup() (on the loop() task) after the controllers are up.
+// Attaches isr to each INT pin with the bus number as its argument; isr
+// must call rxAdaptWake().
+template <class Bus>
+inline void rxAdaptInit(RxAdapt* a, Bus* buses, void (*isr)(void*)) {
+    memset(a, 0, sizeof(*a));
+    a->task = xTaskGetCurrentTaskHandle();
+    a->canSleep = true;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        a->pins[b] = buses[b].intPin();
+        if (a->pins[b] < 0) {
+            a->canSleep = false;
+            continue;
+        }
+        attachInterruptArg(digitalPinToInterrupt(a->pins[b]), isr, (void*)(uintptr_t)b, FALLING);
+    }
+    a->mode = a->canSleep ? RX_MODE_IRQ : RX_MODE_POLL;
+    a->windowStart = micros();
+}
+
+inline void IRAM_ATTR rxAdaptWake(RxAdapt* a) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(a->task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+// Frames to read from each controller this pass.
+inline int rxAdaptBudget(const RxAdapt* a) {
+    return a->mode == RX_MODE_POLL ? RX_POLL_BUDGET : MERGE_READ_BUDGET;
+}
+
+// Masks INT while polling and unmasks it otherwise. Also call after a
+// controller is re-initialised, since its pinMode() unmasks INT again.
+inline void rxAdaptApplyMask(const RxAdapt* a) {
+    if (!a->canSleep) return;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (a->mode == RX_MODE_POLL) {
+            gpio_intr_disable((gpio_num_t)a->pins[b]);
+        } else {
+            gpio_intr_enable((gpio_num_t)a->pins[b]);
+        }
+    }
+}
+
+inline void rxAdaptSetMode(RxAdapt* a, rx_mode_t mode) {
+    a->mode = mode;
+    rxAdaptApplyMask(a);
+    if (mode == RX_MODE_POLL) {
+        a->toPoll++;
+    } else {
+        a->toIrq++;
+    }
+    TRACE_INSTANT(TRACE_RX_MODE, TRACE_TID_LOOP, mode);
+}
+
+// Call once per loop() pass after mergeFill() with the frames it read.
+inline void rxAdaptUpdate(RxAdapt* a, const BusMerge* m, int frames) {
+    a->windowFrames += frames;
+
+    if (a->mode == RX_MODE_IRQ && m->backlog && a->rate >= RX_POLL_EXIT_FPS) {
+        rxAdaptSetMode(a, RX_MODE_POLL);
+        a->quietWindows = 0;
+    }
+
+    unsigned long now = micros();
+    unsigned long elapsed = now - a->windowStart;
+    if (elapsed < RX_RATE_WINDOW_US) return;
+    a->rate = (unsigned long)((uint64_t)a->windowFrames * 1000000 / elapsed);
+    a->windowFrames = 0;
+    a->windowStart = now;
+
+    if (!a->canSleep) return;
+    if (a->mode == RX_MODE_IRQ) {
+        if (a->rate >= RX_POLL_ENTER_FPS) {
+            rxAdaptSetMode(a, RX_MODE_POLL);
+            a->quietWindows = 0;
+        }
+    } else if (a->rate < RX_POLL_EXIT_FPS && !m->backlog) {
+        if (++a->quietWindows >= RX_POLL_EXIT_WINDOWS) rxAdaptSetMode(a, RX_MODE_IRQ);
+    } else {
+        a->quietWindows = 0;
+    }
+}
+
+// Call at the end of loop(). In interrupt mode, sleeps until INT falls
+// or RX_IRQ_WAIT_MS passes, unless a controller already has a frame.
+// An edge between the pending() check and the sleep leaves the
+// notification set, so the sleep returns at once.
+template <class Bus>
+inline void rxAdaptWait(RxAdapt* a, Bus* buses) {
+    if (a->mode != RX_MODE_IRQ) return;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        if (buses[b].pending()) return;
+    }
+    unsigned long start = micros();
+    TRACE_BEGIN(TRACE_RX_SLEEP, 0);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RX_IRQ_WAIT_MS));
+    TRACE_END(TRACE_RX_SLEEP, 0);
+    a->sleepUs += micros() - start;
+}
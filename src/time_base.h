@@ -0,0 +1,95 @@
+/*
+ * Capture time base, shared by the serial and WiFi builds.
+ *
+ * Log timestamps are ms since startTime, which a clear (and on the serial
+ * build a baud change) moves to the current millis(). Each move starts a
+ * new epoch: it is numbered and logged as an EPOCH record carrying the
+ * new startTime in ms since boot, so a host can keep entries on one
+ * continuous clock instead of seeing time silently restart at zero.
+ *
+ * For absolute time a host measures the device clock NTP-style (/time on
+ * the WiFi build, "time" on the serial one), fits offset and drift on its
+ * side, and hands the result back as an anchor: the UTC time at one
+ * esp_timer_get_time() reading, the crystal's drift in ppm, and the
+ * uncertainty. Device times then map to UTC as
+ *
+ *   utc = anchorUtc + (device - anchorDevice) * (1 + ppm / 1e6)
+ *
+ * A host re-anchors every so often to follow temperature drift; an
+ * anchor older than TIME_ANCHOR_STALE_S is reported as stale. The error
+ * given is the host's at anchoring time and doesn't grow here.
+ *
+ * All times here are microseconds. All-zero is the unsynced state of
+ * epoch 0.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <time.h>
+
+#define TIME_ANCHOR_STALE_S  600
+#define TIME_MIN_UTC_US      1500000000000000LL   // 2017, rejects unset host clocks
+#define TIME_MAX_PPM         500.0f               // Far past any crystal's tolerance
+#define TIME_ISO_SIZE        25                   // timeFormatIso() and its NUL
+
+struct TimeBase {
+    uint32_t epoch;
+    unsigned long epochStartMs;  // startTime of the current epoch, ms since boot
+
+    bool synced;
+    int64_t anchorUtcUs;         // Unix time in us...
+    int64_t anchorDeviceUs;      // ...at this esp_timer_get_time()
+    float ppm;                   // Device clock rate error, positive = slow
+    uint32_t errUs;
+    uint32_t anchors;
+};
+
+// Starts a new epoch at startMs (ms since boot) and returns its number.
+inline uint32_t timeNewEpoch(TimeBase* t, unsigned long startMs) {
+    t->epochStartMs = startMs;
+    return ++t->epoch;
+}
+
+// Sets the UTC anchor. Returns false for a UTC time before
+// TIME_MIN_UTC_US or an implausible drift.
+inline bool timeSetAnchor(TimeBase* t, int64_t utcUs, int64_t deviceUs, float ppm, uint32_t errUs) {
+    if (utcUs < TIME_MIN_UTC_US || ppm > TIME_MAX_PPM || ppm < -TIME_MAX_PPM) return false;
+    t->synced = true;
+    t->anchorUtcUs = utcUs;
+    t->anchorDeviceUs = deviceUs;
+    t->ppm = ppm;
+    t->errUs = errUs;
+    t->anchors++;
+    return true;
+}
+
+inline bool timeAnchorStale(const TimeBase* t, int64_t nowUs) {
+    return !t->synced || nowUs - t->anchorDeviceUs > (int64_t)TIME_ANCHOR_STALE_S * 1000000;
+}
+
+// Maps a device time to Unix time in us. Returns false until anchored.
+inline bool timeToUtc(const TimeBase* t, int64_t deviceUs, int64_t* utcUs) {
+    if (!t->synced) return false;
+    int64_t since = deviceUs - t->anchorDeviceUs;
+    *utcUs = t->anchorUtcUs + since + (int64_t)(since * (double)t->ppm / 1e6);
+    return true;
+}
+
+// Device time of a log timestamp in the current epoch.
+inline int64_t timeLogToDevice(const TimeBase* t, unsigned long logMs) {
+    return ((int64_t)t->epochStartMs + logMs) * 1000;
+}
+
+// Formats Unix time in us as ISO 8601 UTC with milliseconds,
+// 2024-06-01T12:34:56.789Z, into a buffer of at least TIME_ISO_SIZE. The
+// year is clamped to four digits.
+inline int timeFormatIso(int64_t utcUs, char* out, int size) {
+    time_t secs = (time_t)(utcUs / 1000000);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    tm.tm_year = constrain(tm.tm_year, 0, 9999 - 1900);
+    int len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    return len + snprintf(out + len, size - len, ".%03uZ", (unsigned)((uint64_t)utcUs / 1000 % 1000));
+}
@@ -0,0 +1,147 @@
+/*
+ * Hierarchical timer wheel, for per-ID deadlines in the capture path.
+ *
+ * Timers are indexed 0..N-1 (one per ID table slot) and count in ticks
+ * of WHEEL_TICK_MS. Three levels of WHEEL_SLOTS slots each cover
+ * 0.64 s, 41 s and 44 min; a timer is filed in the lowest level whose
+ * span reaches its deadline, and each time a lower level wraps the next
+ * slot up is cascaded down a level. Arming, cancelling and expiring are
+ * O(1), cascading is O(1) amortised per timer, and idle ticks cost one
+ * empty-slot check, so deadlines for every periodic ID can be tracked
+ * without scanning the ID table. Deadlines past the top level's span
+ * are clamped to it.
+ *
+ * An all-zero wheel is empty. Its first wheelAdvance() walks every tick
+ * since boot, which is cheap while it holds nothing; wheelReset() starts
+ * it at a given time instead.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define WHEEL_TICK_MS   10
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    3
+#define WHEEL_MAX_TICKS ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct WheelTimer {
+    bool armed;
+    uint8_t level;
+    uint8_t slot;
+    uint16_t next;           // Neighbours as timer index plus one, 0 = none
+    uint16_t prev;
+    unsigned long expires;   // Tick
+};
+
+template <int N>
+struct TimerWheel {
+    WheelTimer timers[N];
+    uint16_t slots[WHEEL_LEVELS][WHEEL_SLOTS];   // First timer plus one, 0 = empty
+    unsigned long tick;                          // Next tick to process
+};
+
+template <int N>
+inline void wheelReset(TimerWheel<N>* w, unsigned long nowMs) {
+    memset(w, 0, sizeof(*w));
+    w->tick = nowMs / WHEEL_TICK_MS;
+}
+
+template <int N>
+inline bool wheelArmed(const TimerWheel<N>* w, int i) {
+    return w->timers[i].armed;
+}
+
+template <int N>
+inline void wheelCancel(TimerWheel<N>* w, int i) {
+    WheelTimer* t = &w->timers[i];
+    if (!t->armed) return;
+    if (t->prev) {
+        w->timers[t->prev - 1].next = t->next;
+    } else {
+        w->slots[t->level][t->slot] = t->next;
+    }
+    if (t->next) w->timers[t->next - 1].prev = t->prev;
+    t->armed = false;
+}
+
+// Files timer i by its expiry tick relative to the next tick to process.
+template <int N>
+inline void wheelInsert(TimerWheel<N>* w, int i, unsigned long expires) {
+    WheelTimer* t = &w->timers[i];
+    long delta = (long)(expires - w->tick);
+    if (delta < 0) {
+        delta = 0;
+        expires = w->tick;
+    } else if ((unsigned long)delta > WHEEL_MAX_TICKS) {
+        delta = WHEEL_MAX_TICKS;
+        expires = w->tick + WHEEL_MAX_TICKS;
+    }
+
+    uint8_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && (unsigned long)delta >= (1UL << (WHEEL_BITS * (level + 1)))) level++;
+
+    t->expires = expires;
+    t->level = level;
+    t->slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    uint16_t* head = &w->slots[level][t->slot];
+    t->prev = 0;
+    t->next = *head;
+    if (*head) w->timers[*head - 1].prev = i + 1;
+    *head = i + 1;
+    t->armed = true;
+}
+
+// (Re)arms timer i to expire at deadlineMs. A deadline already passed
+// expires on the next wheelAdvance().
+template <int N>
+inline void wheelArm(TimerWheel<N>* w, int i, unsigned long deadlineMs) {
+    wheelCancel(w, i);
+    wheelInsert(w, i, (deadlineMs + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS);
+}
+
+// Moves every timer in one slot of a higher level down to where it now
+// belongs.
+template <int N>
+inline void wheelCascade(TimerWheel<N>* w, int level, int slot) {
+    uint16_t e = w->slots[level][slot];
+    w->slots[level][slot] = 0;
+    while (e) {
+        WheelTimer* t = &w->timers[e - 1];
+        uint16_t next = t->next;
+        wheelInsert(w, e - 1, t->expires);
+        e = next;
+    }
+}
+
+// Processes every tick up to nowMs, calling onExpire(i) for each timer
+// that comes due. onExpire() may re-arm timer i, which then goes on a
+// later tick, but must not cancel or arm other timers.
+template <int N, class F>
+inline void wheelAdvance(TimerWheel<N>* w, unsigned long nowMs, F onExpire) {
+    unsigned long target = nowMs / WHEEL_TICK_MS;
+    while ((long)(target - w->tick) >= 0) {
+        unsigned long t = w->tick;
+        if ((t & WHEEL_MASK) == 0) {
+            // Cascade from the top so a timer can fall more than one level.
+            int top = 1;
+            while (top + 1 < WHEEL_LEVELS && ((t >> (WHEEL_BITS * top)) & WHEEL_MASK) == 0) top++;
+            for (int l = top; l >= 1; l--) {
+                wheelCascade(w, l, (t >> (WHEEL_BITS * l)) & WHEEL_MASK);
+            }
+        }
+
+        uint16_t e = w->slots[0][t & WHEEL_MASK];
+        w->slots[0][t & WHEEL_MASK] = 0;
+        w->tick = t + 1;
+        while (e) {
+            WheelTimer* timer = &w->timers[e - 1];
+            uint16_t next = timer->next;
+            timer->armed = false;
+            onExpire(e - 1);
+            e = next;
+        }
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * Internal event trace, shared by the serial and WiFi builds.
+ *
+ * A fixed ring of timestamped begin/end/instant events, exported as
+ * Chrome trace_event JSON that loads in Perfetto (ui.perfetto.dev) or
+ * chrome://tracing. Used to see where loop() time goes when frames are
+ * being dropped.
+ *
+ * Recording is lock-free: a writer claims a slot with an atomic
+ * increment and fills it in, so the INT pin ISR, loop() and the WiFi
+ * event task can all record without blocking each other. An export
+ * pauses recording while it reads the ring, so entries it reads are not
+ * being overwritten; a writer that claimed a slot just before the pause
+ * can still leave one event half-written.
+ *
+ * Compiled in with -DTRACE_ENABLED (set in platformio.ini) and off at
+ * runtime until enabled. When off each trace point costs one load and
+ * branch; without TRACE_ENABLED the macros compile to nothing.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define TRACE_RING_SIZE 1024     // Power of two
+
+typedef enum {
+    TRACE_ISR,           // INT pin went low
+    TRACE_SPI_READ,      // readMsgBuf()
+    TRACE_TRACK,         // ID table update
+    TRACE_LOG_APPEND,    // Ring buffer / output queue append
+    TRACE_HTTP,          // Web handler, arg = route index
+    TRACE_OTA,           // ArduinoOTA.handle()
+    TRACE_WIFI_EVENT,    // arg = arduino_event_id_t
+    TRACE_SERIAL_FLUSH,  // Output queue drained to the UART
+    TRACE_RX_SLEEP,      // loop() asleep waiting for INT
+    TRACE_RX_MODE,       // Receive mode switch, arg = rx_mode_t
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+// Track (thread) shown for each event in the trace viewer.
+typedef enum {
+    TRACE_TID_LOOP = 1,
+    TRACE_TID_ISR = 2,
+    TRACE_TID_WIFI = 3
+} trace_tid_t;
+
+struct TraceEntry {
+    uint32_t us;         // micros()
+    uint8_t event;       // trace_event_t
+    char phase;          // 'B', 'E' or 'i'
+    uint8_t tid;         // trace_tid_t
+    uint8_t arg;
+};
+
+struct TraceRing {
+    TraceEntry entries[TRACE_RING_SIZE];
+    volatile uint32_t head;          // Total events ever claimed
+    volatile bool enabled;
+};
+
+inline const char* traceEventName(uint8_t event) {
+    static const char* const names[TRACE_EVENT_COUNT] = {
+        "isr", "spi_read", "track", "log_append", "http", "ota", "wifi_event", "serial_flush",
+        "rx_sleep", "rx_mode"
+    };
+    return event < TRACE_EVENT_COUNT ? names[event] : "unknown";
+}
+
+#ifdef TRACE_ENABLED
+
+TraceRing traceRing;
+
+inline void IRAM_ATTR traceRecord(uint8_t event, char phase, uint8_t tid, uint8_t arg) {
+    if (!traceRing.enabled) return;
+    uint32_t slot = __atomic_fetch_add(&traceRing.head, 1, __ATOMIC_RELAXED) & (TRACE_RING_SIZE - 1);
+    TraceEntry* e = &traceRing.entries[slot];
+    e->us = micros();
+    e->event = event;
+    e->phase = phase;
+    e->tid = tid;
+    e->arg = arg;
+}
+
+#define TRACE_BEGIN(event, arg)        traceRecord((event), 'B', TRACE_TID_LOOP, (arg))
+#define TRACE_END(event, arg)          traceRecord((event), 'E', TRACE_TID_LOOP, (arg))
+#define TRACE_INSTANT(event, tid, arg) traceRecord((event), 'i', (tid), (arg))
+
+inline void traceSetEnabled(bool enabled) {
+    traceRing.enabled = enabled;
+}
+
+inline void traceClear() {
+    traceRing.head = 0;
+}
+
+// Export cursor. traceExportBegin() pauses recording and returns the
+// number of events to export; traceExportEnd() restores it.
+struct TraceExport {
+    uint32_t first;
+    uint32_t count;
+    uint32_t next;
+    bool wasEnabled;
+};
+
+inline uint32_t traceExportBegin(TraceExport* x) {
+    x->wasEnabled = traceRing.enabled;
+    traceRing.enabled = false;
+    uint32_t head = traceRing.head;
+    x->count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    x->first = head - x->count;
+    x->next = 0;
+    return x->count;
+}
+
+inline void traceExportEnd(TraceExport* x) {
+    traceRing.enabled = x->wasEnabled;
+}
+
+// Formats the next event as one trace_event JSON object, comma-prefixed
+// since TRACE_JSON_HEADER already holds the track names. Returns the
+// length, or 0 when done.
+inline int traceExportNext(TraceExport* x, char* out, int size) {
+    if (x->next >= x->count) return 0;
+    const TraceEntry* e = &traceRing.entries[(x->first + x->next) & (TRACE_RING_SIZE - 1)];
+    int len = snprintf(out, size,
+                       ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu,\"pid\":1,\"tid\":%u%s,\"args\":{\"arg\":%u}}\n",
+                       traceEventName(e->event), e->phase,
+                       (unsigned long)e->us, e->tid, e->phase == 'i' ? ",\"s\":\"t\"" : "", e->arg);
+    x->next++;
+    return len;
+}
+
+#define TRACE_JSON_HEADER \
+    "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" \
+    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"loop\"}}\n" \
+    ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"isr\"}}\n" \
+    ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"wifi\"}}\n"
+#define TRACE_JSON_FOOTER "]}\n"
+
+#else
+
+#define TRACE_BEGIN(event, arg)
+#define TRACE_END(event, arg)
+#define TRACE_INSTANT(event, tid, arg)
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Host stand-in for the parts of the Arduino core that the shared
+ * headers in src/ use, for the native test env.
+ *
+ * Time is a fake clock that only moves when a test moves it, with
+ * shimAdvanceUs() or delay(), or by shimTickUs on every reading for
+ * code that spins on the clock, so runs are repeatable and hours of
+ * simulated traffic take milliseconds. esp_random() is a seeded
+ * xorshift for the same reason; shimReset() puts both back to the start.
+ *
+ * The heap is a notional ESP_HEAP_SIZE bytes less what the host
+ * allocator has handed out, so leaks and growth show up in
+ * ESP.getFreeHeap(); fragmentation doesn't, and the largest block is
+ * whatever a test sets. glibc counts the chunks in its per-thread cache
+ * as handed out, so a test that compares readings over time runs with
+ * GLIBC_TUNABLES=glibc.malloc.tcache_count=0. Serial output is thrown
+ * away unless shimSerialOut is set. Pins read high and their interrupts
+ * never fire.
+ *
+ * unsigned long is 64 bits here against 32 on the ESP32. The clock
+ * starts at 0 and a soak runs it well past 2^32 us, but micros() and
+ * millis() never wrap, so code that relies on 32-bit wrap-around of
+ * unsigned long isn't exercised. And long is wider than uint32_t, so the
+ * difference of two uint32_t cast to long is never negative here; cast
+ * it to int32_t, which behaves the same on both.
+ */
+
+#pragma once
+
+#include <malloc.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "WString.h"
+
+using std::max;
+using std::min;
+
+#define IRAM_ATTR
+
+template <typename T, typename L, typename H>
+inline T constrain(T v, L lo, H hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+inline uint64_t shimNowUs = 0;
+inline uint32_t shimRandom = 1;
+inline uint32_t shimTickUs = 0;      // Added by every micros()/millis(), for busy-wait loops
+
+inline void shimReset(uint32_t seed = 1) {
+    shimNowUs = 0;
+    shimRandom = seed ? seed : 1;
+    shimTickUs = 0;
+}
+
+inline void shimAdvanceUs(uint64_t us) {
+    shimNowUs += us;
+}
+
+inline unsigned long micros() {
+    shimNowUs += shimTickUs;
+    return shimNowUs;
+}
+
+inline unsigned long millis() {
+    shimNowUs += shimTickUs;
+    return shimNowUs / 1000;
+}
+
+inline void delay(unsigned long ms) {
+    shimNowUs += (uint64_t)ms * 1000;
+}
+
+inline void delayMicroseconds(unsigned int us) {
+    shimNowUs += us;
+}
+
+inline void yield() {}
+
+// Heap for ESP.get*Heap(). There is no PSRAM.
+#define ESP_HEAP_SIZE 320000
+inline size_t shimHeapMaxAlloc = 110000;
+inline uint32_t shimHeapMinFree = ESP_HEAP_SIZE;
+
+struct ShimEsp {
+    uint32_t getFreeHeap() {
+        struct mallinfo2 m = mallinfo2();
+        size_t used = m.uordblks + m.hblkhd;
+        uint32_t free = used < ESP_HEAP_SIZE ? ESP_HEAP_SIZE - used : 0;
+        shimHeapMinFree = min(shimHeapMinFree, free);
+        return free;
+    }
+    uint32_t getMinFreeHeap() {
+        getFreeHeap();
+        return shimHeapMinFree;
+    }
+    uint32_t getMaxAllocHeap() { return min((uint32_t)shimHeapMaxAlloc, getFreeHeap()); }
+    uint32_t getMaxAllocPsram() { return 0; }
+};
+
+inline ShimEsp ESP;
+
+inline bool psramFound() {
+    return false;
+}
+
+inline void* ps_malloc(size_t size) {
+    return malloc(size);
+}
+
+#define LOW           0
+#define HIGH          1
+#define INPUT         0x01
+#define INPUT_PULLUP  0x05
+#define FALLING       0x02
+
+inline void pinMode(uint8_t, uint8_t) {}
+
+inline int digitalRead(uint8_t) {
+    return HIGH;
+}
+
+inline int digitalPinToInterrupt(uint8_t pin) {
+    return pin;
+}
+
+inline void attachInterruptArg(uint8_t, void (*)(void*), void*, int) {}
+
+inline FILE* shimSerialOut = NULL;
+
+struct ShimSerial {
+    void begin(unsigned long) {}
+    size_t write(const uint8_t* data, size_t len) {
+        if (shimSerialOut) fwrite(data, 1, len, shimSerialOut);
+        return len;
+    }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t print(const String& s) { return print(s.c_str()); }
+    template <typename T>
+    size_t print(T v) { return print(String(v)); }
+    template <typename T>
+    size_t println(T v) { return print(v) + print("\n"); }
+    size_t println() { return print("\n"); }
+    size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char line[512];
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        return write((const uint8_t*)line, min(len, (int)sizeof(line) - 1));
+    }
+    int available() { return 0; }
+    int read() { return -1; }
+    void flush() {}
+    int availableForWrite() { return 128; }
+};
+
+inline ShimSerial Serial;
+
+inline uint32_t esp_random() {
+    shimRandom ^= shimRandom << 13;
+    shimRandom ^= shimRandom >> 17;
+    shimRandom ^= shimRandom << 5;
+    return shimRandom;
+}
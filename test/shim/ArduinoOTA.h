@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for ArduinoOTA: starts, and never receives an update.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+typedef enum {
+    OTA_AUTH_ERROR,
+    OTA_BEGIN_ERROR,
+    OTA_CONNECT_ERROR,
+    OTA_RECEIVE_ERROR,
+    OTA_END_ERROR
+} ota_error_t;
+
+struct ShimArduinoOTA {
+    void setHostname(const char*) {}
+    void onStart(std::function<void()>) {}
+    void onEnd(std::function<void()>) {}
+    void onError(std::function<void(ota_error_t)>) {}
+    void begin() {}
+    void handle() {}
+};
+
+inline ShimArduinoOTA ArduinoOTA;
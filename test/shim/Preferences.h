@@ -0,0 +1,36 @@
+/*
+ * Host stand-in for the Arduino Preferences (NVS) class, kept in memory
+ * across instances like NVS is across reboots. shimPreferences.clear()
+ * wipes it.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <Arduino.h>
+
+inline std::map<std::string, std::string> shimPreferences;
+
+class Preferences {
+public:
+    bool begin(const char* name, bool = false) {
+        ns = name;
+        return true;
+    }
+
+    void end() {}
+
+    bool getBool(const char* key, bool defaultValue = false) {
+        auto it = shimPreferences.find(ns + "/" + key);
+        return it == shimPreferences.end() ? defaultValue : it->second == "1";
+    }
+
+    size_t putBool(const char* key, bool value) {
+        shimPreferences[ns + "/" + key] = value ? "1" : "0";
+        return 1;
+    }
+
+private:
+    std::string ns;
+};
@@ -0,0 +1,196 @@
+/*
+ * Host stand-in for the Arduino String class, enough of it for the web
+ * handlers in main_wifi.cpp. Like the real one it keeps its text in a
+ * malloc()ed buffer sized to fit, so what a handler builds shows up in
+ * the heap figures of the Arduino.h shim.
+ */
+
+#pragma once
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class String {
+public:
+    String(const char* s = "") { copy(s ? s : "", s ? strlen(s) : 0); }
+    String(const String& s) { copy(s.c_str(), s.len); }
+    String(String&& s) : buf(s.buf), len(s.len), cap(s.cap) { s.buf = NULL; s.len = s.cap = 0; }
+    explicit String(char c) { char s[2] = { c, 0 }; copy(s, 1); }
+    explicit String(unsigned char v, unsigned char base = 10) : String((unsigned long)v, base) {}
+    explicit String(int v, unsigned char base = 10) : String((long)v, base) {}
+    explicit String(unsigned int v, unsigned char base = 10) : String((unsigned long)v, base) {}
+    explicit String(long v, unsigned char base = 10) {
+        char s[72];
+        if (base == 10) snprintf(s, sizeof(s), "%ld", v);
+        else toBase(s, (unsigned long)v, base);
+        copy(s, strlen(s));
+    }
+    explicit String(unsigned long v, unsigned char base = 10) {
+        char s[72];
+        toBase(s, v, base);
+        copy(s, strlen(s));
+    }
+    explicit String(long long v, unsigned char base = 10) : String((long)v, base) {}
+    explicit String(unsigned long long v, unsigned char base = 10) : String((unsigned long)v, base) {}
+    explicit String(float v, unsigned int decimals = 2) : String((double)v, decimals) {}
+    explicit String(double v, unsigned int decimals = 2) {
+        char s[64];
+        snprintf(s, sizeof(s), "%.*f", (int)decimals, v);
+        copy(s, strlen(s));
+    }
+    ~String() { free(buf); }
+
+    String& operator=(const String& s) {
+        if (this != &s) copy(s.c_str(), s.len);
+        return *this;
+    }
+    String& operator=(String&& s) {
+        if (this != &s) {
+            free(buf);
+            buf = s.buf;
+            len = s.len;
+            cap = s.cap;
+            s.buf = NULL;
+            s.len = s.cap = 0;
+        }
+        return *this;
+    }
+    String& operator=(const char* s) {
+        copy(s ? s : "", s ? strlen(s) : 0);
+        return *this;
+    }
+
+    bool reserve(unsigned int size) {
+        if (size <= cap) return true;
+        char* p = (char*)realloc(buf, size + 1);
+        if (p == NULL) return false;
+        if (buf == NULL) p[0] = '\0';
+        buf = p;
+        cap = size;
+        return true;
+    }
+
+    bool concat(const char* s, unsigned int n) {
+        if (n == 0) return true;
+        if (!reserve(len + n)) return false;
+        memcpy(buf + len, s, n);
+        len += n;
+        buf[len] = '\0';
+        return true;
+    }
+    bool concat(const String& s) { return concat(s.c_str(), s.len); }
+    bool concat(const char* s) { return s ? concat(s, strlen(s)) : false; }
+    bool concat(char c) { return concat(&c, 1); }
+    template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    bool concat(T v) { return concat(String(v)); }
+
+    template <typename T>
+    String& operator+=(const T& v) {
+        concat(v);
+        return *this;
+    }
+    String& operator+=(const char* s) {
+        concat(s);
+        return *this;
+    }
+
+    const char* c_str() const { return buf ? buf : ""; }
+    unsigned int length() const { return len; }
+    bool isEmpty() const { return len == 0; }
+    char charAt(unsigned int i) const { return i < len ? buf[i] : 0; }
+    char operator[](unsigned int i) const { return charAt(i); }
+
+    bool equals(const char* s) const { return strcmp(c_str(), s ? s : "") == 0; }
+    bool operator==(const String& s) const { return len == s.len && equals(s.c_str()); }
+    bool operator==(const char* s) const { return equals(s); }
+    bool operator!=(const String& s) const { return !(*this == s); }
+    bool operator!=(const char* s) const { return !equals(s); }
+    bool startsWith(const char* s) const { return strncmp(c_str(), s, strlen(s)) == 0; }
+    bool startsWith(const String& s) const { return startsWith(s.c_str()); }
+    bool endsWith(const char* s) const {
+        size_t n = strlen(s);
+        return n <= len && strcmp(c_str() + len - n, s) == 0;
+    }
+
+    int indexOf(char c, unsigned int from = 0) const {
+        if (from >= len) return -1;
+        const char* p = strchr(c_str() + from, c);
+        return p ? (int)(p - c_str()) : -1;
+    }
+    int indexOf(const char* s, unsigned int from = 0) const {
+        if (from > len) return -1;
+        const char* p = strstr(c_str() + from, s);
+        return p ? (int)(p - c_str()) : -1;
+    }
+    int indexOf(const String& s, unsigned int from = 0) const { return indexOf(s.c_str(), from); }
+
+    String substring(unsigned int from, unsigned int to = (unsigned int)-1) const {
+        if (to > len) to = len;
+        if (from >= to) return String();
+        String out;
+        out.concat(c_str() + from, to - from);
+        return out;
+    }
+
+    void trim() {
+        if (len == 0) return;
+        unsigned int start = 0;
+        while (start < len && isspace((unsigned char)buf[start])) start++;
+        unsigned int end = len;
+        while (end > start && isspace((unsigned char)buf[end - 1])) end--;
+        memmove(buf, buf + start, end - start);
+        len = end - start;
+        buf[len] = '\0';
+    }
+
+    long toInt() const { return atol(c_str()); }
+    float toFloat() const { return atof(c_str()); }
+    double toDouble() const { return atof(c_str()); }
+
+private:
+    char* buf = NULL;
+    unsigned int len = 0;
+    unsigned int cap = 0;
+
+    void copy(const char* s, unsigned int n) {
+        len = 0;
+        if (buf) buf[0] = '\0';
+        if (n == 0 || !reserve(n)) return;
+        memcpy(buf, s, n);
+        len = n;
+        buf[len] = '\0';
+    }
+
+    static void toBase(char* out, unsigned long v, unsigned char base) {
+        char tmp[72];
+        int n = 0;
+        do {
+            int d = v % base;
+            tmp[n++] = d < 10 ? '0' + d : 'a' + d - 10;
+            v /= base;
+        } while (v);
+        for (int i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+        out[n] = '\0';
+    }
+};
+
+template <typename T>
+inline String operator+(const String& a, const T& b) {
+    String out(a);
+    out += b;
+    return out;
+}
+
+inline String operator+(const char* a, const String& b) {
+    String out(a);
+    out += b;
+    return out;
+}
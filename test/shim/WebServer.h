@@ -0,0 +1,150 @@
+/*
+ * Host stand-in for the Arduino WebServer. There is no socket: a test
+ * queues a request with shimRequest(), the next handleClient() runs its
+ * route as the real server would from loop(), and the reply is kept in
+ * shimResponse. Chunked replies (setContentLength(CONTENT_LENGTH_UNKNOWN))
+ * are put together as they would arrive. The first SHIM_BODY_KEEP bytes
+ * of a body are kept, in a static buffer so the shim itself doesn't
+ * move the heap figures.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#define CONTENT_LENGTH_UNKNOWN  ((size_t)-1)
+#define SHIM_MAX_HANDLERS       32
+#define SHIM_MAX_ARGS           8
+#define SHIM_ARG_LEN            128
+#define SHIM_BODY_KEEP          (256 * 1024)
+
+struct ShimResponse {
+    int code;
+    char contentType[64];
+    char headers[1024];          // "Name: value\n" for each sendHeader()
+    bool chunked;
+    bool done;
+    int chunks;                  // sendContent() calls
+    size_t bodyBytes;            // All of the body, kept or not
+    char body[SHIM_BODY_KEEP + 1];
+};
+
+inline ShimResponse shimResponse;
+
+// Called on each sendContent(), where the real server would block on
+// the socket, for a test to time the reply or move the clock.
+inline void (*shimOnContent)(size_t len) = NULL;
+
+class WebServer {
+public:
+    explicit WebServer(int) {}
+
+    void on(const char* path, std::function<void()> handler) {
+        if (handlerCount == SHIM_MAX_HANDLERS) return;
+        paths[handlerCount] = path;
+        handlers[handlerCount++] = handler;
+    }
+    void begin() {}
+    void collectHeaders(const char**, size_t) {}
+
+    // Queues a request for uri, with query as "a=1&b=2" (not URL
+    // encoded) and the client's Accept-Encoding. One at a time.
+    bool shimRequest(const char* uri, const char* query = "", const char* acceptEncoding = "") {
+        if (pending) return false;
+        snprintf(uriBuf, sizeof(uriBuf), "%s", uri);
+        snprintf(encodingBuf, sizeof(encodingBuf), "%s", acceptEncoding);
+        argCount = 0;
+        const char* p = query;
+        while (*p && argCount < SHIM_MAX_ARGS) {
+            const char* end = strchr(p, '&');
+            size_t n = end ? (size_t)(end - p) : strlen(p);
+            const char* eq = (const char*)memchr(p, '=', n);
+            size_t nameLen = eq ? (size_t)(eq - p) : n;
+            snprintf(argNames[argCount], SHIM_ARG_LEN, "%.*s", (int)nameLen, p);
+            snprintf(argValues[argCount], SHIM_ARG_LEN, "%.*s", eq ? (int)(n - nameLen - 1) : 0, eq ? eq + 1 : "");
+            argCount++;
+            p += n + (end ? 1 : 0);
+        }
+        pending = true;
+        return true;
+    }
+    bool shimPending() const { return pending; }
+
+    void handleClient() {
+        if (!pending) return;
+        pending = false;
+        memset(&shimResponse, 0, offsetof(ShimResponse, body));
+        shimResponse.body[0] = '\0';
+        contentLength = 0;
+        for (int i = 0; i < handlerCount; i++) {
+            if (strcmp(paths[i], uriBuf) == 0) {
+                handlers[i]();
+                shimResponse.done = true;
+                return;
+            }
+        }
+        send(404, "text/plain", "Not found");
+        shimResponse.done = true;
+    }
+
+    int args() { return argCount; }
+    String argName(int i) { return i < argCount ? String(argNames[i]) : String(); }
+    String arg(int i) { return i < argCount ? String(argValues[i]) : String(); }
+    String arg(const char* name) {
+        int i = find(name);
+        return i >= 0 ? String(argValues[i]) : String();
+    }
+    bool hasArg(const char* name) { return find(name) >= 0; }
+    String header(const char* name) {
+        return strcasecmp(name, "Accept-Encoding") == 0 ? String(encodingBuf) : String();
+    }
+
+    void setContentLength(size_t len) { contentLength = len; }
+    void sendHeader(const char* name, const String& value, bool = false) {
+        size_t used = strlen(shimResponse.headers);
+        snprintf(shimResponse.headers + used, sizeof(shimResponse.headers) - used, "%s: %s\n", name,
+                 value.c_str());
+    }
+    void send(int code, const char* contentType = "text/plain", const String& content = String()) {
+        shimResponse.code = code;
+        snprintf(shimResponse.contentType, sizeof(shimResponse.contentType), "%s", contentType);
+        shimResponse.chunked = contentLength == CONTENT_LENGTH_UNKNOWN;
+        keep(content.c_str(), content.length());
+    }
+    void sendContent(const char* data, size_t len) {
+        if (shimResponse.chunked && len == 0) shimResponse.done = true;
+        shimResponse.chunks++;
+        keep(data, len);
+        if (shimOnContent) shimOnContent(len);
+    }
+    void sendContent(const String& content) { sendContent(content.c_str(), content.length()); }
+
+private:
+    const char* paths[SHIM_MAX_HANDLERS];
+    std::function<void()> handlers[SHIM_MAX_HANDLERS];
+    int handlerCount = 0;
+    bool pending = false;
+    char uriBuf[64];
+    char encodingBuf[64];
+    char argNames[SHIM_MAX_ARGS][SHIM_ARG_LEN];
+    char argValues[SHIM_MAX_ARGS][SHIM_ARG_LEN];
+    int argCount = 0;
+    size_t contentLength = 0;
+
+    int find(const char* name) {
+        for (int i = 0; i < argCount; i++) {
+            if (strcmp(argNames[i], name) == 0) return i;
+        }
+        return -1;
+    }
+
+    void keep(const char* data, size_t len) {
+        if (shimResponse.bodyBytes < SHIM_BODY_KEEP) {
+            size_t n = min(len, SHIM_BODY_KEEP - shimResponse.bodyBytes);
+            memcpy(shimResponse.body + shimResponse.bodyBytes, data, n);
+            shimResponse.body[shimResponse.bodyBytes + n] = '\0';
+        }
+        shimResponse.bodyBytes += len;
+    }
+};
@@ -0,0 +1,72 @@
+/*
+ * Host stand-in for the WiFi station and access point calls in
+ * main_wifi.cpp. Nothing is ever associated; a test drives the link with
+ * shimWiFiEvent(), which calls the onEvent() handler as the WiFi event
+ * task would.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+class IPAddress {
+public:
+    IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : octets{ a, b, c, d } {}
+    String toString() const {
+        char s[16];
+        snprintf(s, sizeof(s), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+        return String(s);
+    }
+
+private:
+    uint8_t octets[4];
+};
+
+typedef enum {
+    ARDUINO_EVENT_WIFI_STA_START,
+    ARDUINO_EVENT_WIFI_STA_CONNECTED,
+    ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+    ARDUINO_EVENT_WIFI_STA_GOT_IP,
+    ARDUINO_EVENT_WIFI_AP_STACONNECTED,
+    ARDUINO_EVENT_WIFI_AP_STADISCONNECTED,
+} arduino_event_id_t;
+typedef arduino_event_id_t WiFiEvent_t;
+typedef struct {} WiFiEventInfo_t;
+
+typedef enum {
+    WIFI_OFF,
+    WIFI_STA,
+    WIFI_AP,
+    WIFI_AP_STA
+} wifi_mode_t;
+
+struct ShimWiFi {
+    void (*handler)(WiFiEvent_t, WiFiEventInfo_t) = NULL;
+    wifi_mode_t currentMode = WIFI_OFF;
+    uint32_t begins = 0;
+    uint32_t reconnects = 0;
+
+    void persistent(bool) {}
+    void setAutoReconnect(bool) {}
+    void onEvent(void (*h)(WiFiEvent_t, WiFiEventInfo_t)) { handler = h; }
+    bool mode(wifi_mode_t m) {
+        currentMode = m;
+        return true;
+    }
+    bool config(IPAddress, IPAddress, IPAddress, IPAddress) { return true; }
+    void begin(const char*, const char*) { begins++; }
+    bool reconnect() {
+        reconnects++;
+        return true;
+    }
+    bool softAP(const char*, const char*) { return true; }
+    bool softAPdisconnect(bool) { return true; }
+    IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+    IPAddress localIP() { return IPAddress(192, 168, 0, 200); }
+};
+
+inline ShimWiFi WiFi;
+
+inline void shimWiFiEvent(WiFiEvent_t event) {
+    if (WiFi.handler) WiFi.handler(event, WiFiEventInfo_t{});
+}
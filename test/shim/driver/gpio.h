@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the GPIO interrupt mask calls in rx_adapt.h.
+ */
+
+#pragma once
+
+typedef int gpio_num_t;
+
+inline int gpio_intr_enable(gpio_num_t) {
+    return 0;
+}
+
+inline int gpio_intr_disable(gpio_num_t) {
+    return 0;
+}
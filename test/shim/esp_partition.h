@@ -0,0 +1,93 @@
+/*
+ * Host stand-in for esp_partition.h: one RAM-backed data partition
+ * behaving like NOR flash. Erases set whole 4 KB sectors to 0xFF and
+ * writes can only clear bits, so code that programs without erasing
+ * first reads back wrong, as it would on the device.
+ *
+ * shimFlashTearAfter simulates power loss mid-write: once that many more
+ * bytes have been programmed, the rest of the write and every later
+ * erase and write are silently dropped, and the test then "reboots" by
+ * starting over on the same shimFlash. -1 turns it off.
+ */
+
+#pragma once
+
+#include <vector>
+#include <Arduino.h>
+
+typedef int esp_err_t;
+#define ESP_OK                 0
+#define ESP_FAIL               -1
+#define ESP_ERR_INVALID_ARG    0x102
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_ANY = 0xff
+} esp_partition_subtype_t;
+
+struct esp_partition_t {
+    esp_partition_type_t type;
+    uint32_t size;
+    char label[17];
+};
+
+#define SHIM_FLASH_SECTOR 4096
+
+inline esp_partition_t shimPartition;
+inline bool shimPartitionPresent = false;
+inline std::vector<uint8_t> shimFlash;
+inline std::vector<uint32_t> shimFlashErases;    // Per sector
+inline long shimFlashTearAfter = -1;
+
+// Creates the partition with the given label, erased.
+inline void shimPartitionCreate(const char* label, uint32_t sectors) {
+    shimPartition.type = ESP_PARTITION_TYPE_DATA;
+    shimPartition.size = sectors * SHIM_FLASH_SECTOR;
+    strncpy(shimPartition.label, label, sizeof(shimPartition.label) - 1);
+    shimPartitionPresent = true;
+    shimFlash.assign(shimPartition.size, 0xFF);
+    shimFlashErases.assign(sectors, 0);
+    shimFlashTearAfter = -1;
+}
+
+inline void shimPartitionRemove() {
+    shimPartitionPresent = false;
+}
+
+inline const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t,
+                                                       const char* label) {
+    if (!shimPartitionPresent || type != shimPartition.type) return NULL;
+    if (label && strcmp(label, shimPartition.label) != 0) return NULL;
+    return &shimPartition;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t* p, size_t offset, void* dst, size_t size) {
+    if (offset + size > p->size) return ESP_ERR_INVALID_ARG;
+    memcpy(dst, &shimFlash[offset], size);
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t* p, size_t offset, const void* src, size_t size) {
+    if (offset + size > p->size) return ESP_ERR_INVALID_ARG;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i = 0; i < size; i++) {
+        if (shimFlashTearAfter == 0) return ESP_OK;
+        if (shimFlashTearAfter > 0) shimFlashTearAfter--;
+        shimFlash[offset + i] &= s[i];
+    }
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t* p, size_t offset, size_t size) {
+    if (offset % SHIM_FLASH_SECTOR || size % SHIM_FLASH_SECTOR || offset + size > p->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (shimFlashTearAfter == 0) return ESP_OK;
+    memset(&shimFlash[offset], 0xFF, size);
+    for (size_t s = offset / SHIM_FLASH_SECTOR; s < (offset + size) / SHIM_FLASH_SECTOR; s++) shimFlashErases[s]++;
+    return ESP_OK;
+}
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for esp_rom_crc.h: the ROM's little-endian CRC32, which
+ * is the usual zlib one (inverted in and out, so calls chain).
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++) crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
@@ -0,0 +1,49 @@
+/*
+ * Host stand-in for esp_timer.h: the same fake clock as micros().
+ * Timers can be created and started but never fire; a test calls the
+ * callback itself if it needs one.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+
+typedef enum {
+    ESP_TIMER_TASK,
+    ESP_TIMER_ISR
+} esp_timer_dispatch_t;
+
+typedef struct {
+    void (*callback)(void* arg);
+    void* arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char* name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+struct ShimTimer {
+    esp_timer_create_args_t args;
+    uint64_t periodUs;
+};
+typedef ShimTimer* esp_timer_handle_t;
+
+inline int64_t esp_timer_get_time() {
+    return shimNowUs;
+}
+
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+    static ShimTimer timers[8];
+    static int count = 0;
+    if (count == 8) return -1;
+    timers[count].args = *args;
+    *handle = &timers[count++];
+    return ESP_OK;
+}
+
+inline esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t periodUs) {
+    timer->periodUs = periodUs;
+    return ESP_OK;
+}
@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for the FreeRTOS types and constants the shared headers
+ * use. Ticks are milliseconds.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE         0
+#define pdTRUE          1
+#define pdPASS          pdTRUE
+#define portMAX_DELAY   0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
@@ -0,0 +1,45 @@
+/*
+ * Host stand-in for FreeRTOS queues, for the thread-less tasks of
+ * task.h. A task receiving from an empty queue blocks, which unwinds it
+ * back to shimRunTasks(); the loop task never blocks.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <freertos/task.h>
+
+struct ShimQueue {
+    size_t length;
+    size_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+};
+typedef ShimQueue* QueueHandle_t;
+
+inline bool shimQueueReady(void* arg) {
+    return !((ShimQueue*)arg)->items.empty();
+}
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    return new ShimQueue{ length, itemSize, {} };
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t) {
+    if (q->items.size() >= q->length) return pdFALSE;
+    const uint8_t* p = (const uint8_t*)item;
+    q->items.emplace_back(p, p + q->itemSize);
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t) {
+    if (q->items.empty()) {
+        if (shimCurrentTask == NULL) return pdFALSE;
+        shimCurrentTask->ready = shimQueueReady;
+        shimCurrentTask->readyArg = q;
+        shimTaskBlock();
+    }
+    memcpy(item, q->items.front().data(), q->itemSize);
+    q->items.pop_front();
+    return pdTRUE;
+}
@@ -0,0 +1,108 @@
+/*
+ * Host stand-in for FreeRTOS tasks, without threads. A created task
+ * doesn't run until the test calls shimRunTasks(), which runs each task
+ * until it blocks on an empty queue (queue.h) and then unwinds it with
+ * longjmp, so everything happens on the test's thread in a repeatable
+ * order. The next shimRunTasks() starts the task function afresh, which
+ * suits the "loop forever on a queue" tasks in src/ as long as they keep
+ * no state in locals across items.
+ */
+
+#pragma once
+
+#include <setjmp.h>
+#include <freertos/FreeRTOS.h>
+
+typedef void (*TaskFunction_t)(void*);
+
+struct ShimTask {
+    TaskFunction_t fn;
+    void* arg;
+    const char* name;
+    bool (*ready)(void* arg);     // Set by the queue a task waits on
+    void* readyArg;
+};
+typedef ShimTask* TaskHandle_t;
+
+#define SHIM_MAX_TASKS 4
+
+inline ShimTask shimTasks[SHIM_MAX_TASKS];
+inline int shimTaskCount = 0;
+inline ShimTask* shimCurrentTask = NULL;     // NULL = the loop task
+inline jmp_buf shimTaskExit;
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t, void* arg,
+                                          UBaseType_t, TaskHandle_t* handle, BaseType_t) {
+    if (shimTaskCount == SHIM_MAX_TASKS) return pdFALSE;
+    ShimTask* t = &shimTasks[shimTaskCount++];
+    *t = ShimTask{ fn, arg, name, NULL, NULL };
+    if (handle) *handle = t;
+    return pdPASS;
+}
+
+// Forgets every task, as a reboot would.
+inline void shimResetTasks() {
+    shimTaskCount = 0;
+    shimCurrentTask = NULL;
+}
+
+// Called by a task that would block: back to shimRunTasks().
+inline void shimTaskBlock() {
+    longjmp(shimTaskExit, 1);
+}
+
+// Runs every task that has work until all of them are blocked. The
+// loop state is volatile as it lives across setjmp().
+inline void shimRunTasks() {
+    volatile bool ran = true;
+    while (ran) {
+        ran = false;
+        for (volatile int i = 0; i < shimTaskCount; i++) {
+            ShimTask* t = &shimTasks[i];
+            if (t->ready && !t->ready(t->readyArg)) continue;
+            shimCurrentTask = t;
+            if (setjmp(shimTaskExit) == 0) t->fn(t->arg);
+            shimCurrentTask = NULL;
+            ran |= t->ready == NULL || t->ready(t->readyArg);
+        }
+    }
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return shimCurrentTask;
+}
+
+inline TaskHandle_t xTaskGetHandle(const char* name) {
+    for (int i = 0; i < shimTaskCount; i++) {
+        if (strcmp(shimTasks[i].name, name) == 0) return &shimTasks[i];
+    }
+    return NULL;
+}
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) {
+    return 1024;
+}
+
+// Task notifications: shimNotifyUs is when an ISR next gives one, which
+// a test sets from its model of the INT pin; by default none ever comes
+// and a wait runs to its timeout. A notified wake also pays shimWakeUs
+// for the ISR and the switch back to the task.
+inline uint64_t shimNotifyUs = UINT64_MAX;
+inline uint32_t shimWakeUs = 0;
+
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t ticks) {
+    uint64_t timeout = shimNowUs + (uint64_t)ticks * 1000;
+    if (shimNotifyUs < timeout) {
+        shimNowUs = max(shimNowUs, shimNotifyUs) + shimWakeUs;
+        shimNotifyUs = UINT64_MAX;
+        return 1;
+    }
+    shimNowUs = timeout;
+    return 0;
+}
+
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t* woken) {
+    if (woken) *woken = pdFALSE;
+}
+
+#define portYIELD_FROM_ISR(woken) ((void)(woken))
@@ -0,0 +1,10 @@
+// Network settings for host builds of main_wifi.cpp, as in
+// wifi_config.example.h.
+
+#define WIFI_SSID "test"
+#define WIFI_PASS "test"
+
+#define STATIC_IP 192, 168, 0, 200
+#define GATEWAY_IP 192, 168, 0, 1
+#define SUBNET_MASK 255, 255, 255, 0
+#define DNS_IP 192, 168, 0, 1
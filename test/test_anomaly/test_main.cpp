@@ -0,0 +1,141 @@
+/*
+ * anomaly.h on mock ETS traffic: nothing is raised once the baselines
+ * are learned, and a stream that stops or changes is still caught.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include "anomaly.h"
+
+#define IDS      16
+#define STEP_US  100
+
+static AnomalyDetector<IDS> detector;
+static MockBackend bus(0);
+static CanFrame last[IDS];
+static int idCount;
+static bool stopped[IDS];
+
+void setUp() {
+    shimReset();
+    anomalyClear(&detector, millis());
+    bus.begin(BAUD_250K);
+    idCount = 0;
+    memset(stopped, 0, sizeof(stopped));
+}
+
+void tearDown() {}
+
+// The ID table slot for a frame, as seenIds is kept by the builds.
+static int slotFor(const CanFrame* f, bool* isNew) {
+    for (int i = 0; i < idCount; i++) {
+        if (last[i].id == f->id && last[i].extended == f->extended && last[i].bus == f->bus) {
+            *isNew = false;
+            return i;
+        }
+    }
+    *isNew = true;
+    return idCount < IDS ? idCount++ : -1;
+}
+
+// Runs loop() passes for us of mock traffic, as pollCAN() feeds the
+// detector. IDs marked stopped are dropped before the detector sees them.
+static void run(unsigned long us) {
+    unsigned long end = micros() + us;
+    CanFrame f;
+    while (micros() < end) {
+        shimAdvanceUs(STEP_US);
+        while (bus.read(&f)) {
+            bool isNew;
+            int i = slotFor(&f, &isNew);
+            if (i < 0 || stopped[i]) continue;
+            bool changed = isNew || f.len != last[i].len || memcmp(f.data, last[i].data, f.len) != 0;
+            anomalyOnFrame(&detector, i, &f, isNew, changed, millis());
+            last[i] = f;
+        }
+        anomalyService(&detector, millis());
+    }
+}
+
+static int slotOf(uint32_t id) {
+    for (int i = 0; i < idCount; i++) {
+        if (last[i].id == id) return i;
+    }
+    return -1;
+}
+
+void test_no_alerts_on_normal_traffic() {
+    run((ANOMALY_WARMUP_MS + 10 * 60000UL) * 1000);
+    TEST_ASSERT_EQUAL(MOCK_STREAM_COUNT, idCount);
+    TEST_ASSERT_EQUAL(0, anomalyAlertTotal(&detector));
+    TEST_ASSERT_EQUAL(0, detector.suppressed);
+    for (int i = 0; i < idCount; i++) {
+        TEST_ASSERT_EQUAL(0, detector.ids[i].missing);
+        TEST_ASSERT_TRUE(anomalyPeriodic(&detector.ids[i]));
+    }
+}
+
+void test_no_alerts_across_a_burst() {
+    run((ANOMALY_WARMUP_MS + 60000UL) * 1000);
+    // A burst capture takes the frames for 5 s, then hands back.
+    unsigned long end = micros() + 5000000;
+    CanFrame f;
+    while (micros() < end) {
+        shimAdvanceUs(STEP_US);
+        while (bus.read(&f)) {}
+    }
+    anomalyResume(&detector, millis());
+    run(5 * 60000000UL);
+    TEST_ASSERT_EQUAL(0, anomalyAlertTotal(&detector));
+    for (int i = 0; i < idCount; i++) TEST_ASSERT_EQUAL(0, detector.ids[i].missing);
+}
+
+void test_stopped_stream_is_missing() {
+    run((ANOMALY_WARMUP_MS + 60000UL) * 1000);
+    int i = slotOf(0x200);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, i);
+    stopped[i] = true;
+    run(1000000);
+    TEST_ASSERT_EQUAL(1, detector.ids[i].missing);
+    TEST_ASSERT_EQUAL(1, detector.raised[ALERT_MISSING]);
+    Alert a;
+    TEST_ASSERT_TRUE(anomalyNextAlert(&detector, &a));
+    TEST_ASSERT_EQUAL(ALERT_MISSING, a.type);
+    TEST_ASSERT_EQUAL(0x200, a.id);
+    TEST_ASSERT_FALSE(anomalyNextAlert(&detector, &a));
+
+    // Coming back is not a period alert.
+    stopped[i] = false;
+    run(10000000);
+    TEST_ASSERT_EQUAL(1, anomalyAlertTotal(&detector));
+}
+
+void test_new_id_and_dlc_after_warmup() {
+    run((ANOMALY_WARMUP_MS + 1000) * 1000);
+    CanFrame f = {};
+    f.id = 0x555;
+    f.len = 8;
+    f.timestampUs = micros();
+    bool isNew;
+    int i = slotFor(&f, &isNew);
+    anomalyOnFrame(&detector, i, &f, isNew, true, millis());
+    last[i] = f;
+    TEST_ASSERT_EQUAL(1, detector.raised[ALERT_NEW_ID]);
+
+    int h = slotOf(0x100);
+    f = last[h];
+    f.len = 4;
+    shimAdvanceUs(mockStreams[0].periodUs);
+    f.timestampUs = micros();
+    anomalyOnFrame(&detector, h, &f, false, true, millis());
+    TEST_ASSERT_EQUAL(1, detector.raised[ALERT_DLC]);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_no_alerts_on_normal_traffic);
+    RUN_TEST(test_no_alerts_across_a_burst);
+    RUN_TEST(test_stopped_stream_is_missing);
+    RUN_TEST(test_new_id_and_dlc_after_warmup);
+    return UNITY_END();
+}
@@ -0,0 +1,105 @@
+/*
+ * Mock backend on the host: the 250 kbps schedule, payload layout and
+ * the noise it makes at other bauds.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include "can_backend.h"
+
+#define RUN_US     10000000UL
+#define STEP_US    100
+
+void setUp() {
+    shimReset();
+}
+
+void tearDown() {}
+
+static int streamOf(const CanFrame* f) {
+    for (size_t s = 0; s < MOCK_STREAM_COUNT; s++) {
+        if (mockStreams[s].id == f->id && mockStreams[s].extended == f->extended) return s;
+    }
+    return -1;
+}
+
+void test_schedule_matches_periods() {
+    MockBackend bus(0);
+    TEST_ASSERT_TRUE(bus.begin(BAUD_250K));
+    unsigned long counts[MOCK_STREAM_COUNT] = {};
+    unsigned long lastUs = 0;
+    CanFrame f;
+    while (micros() < RUN_US) {
+        shimAdvanceUs(STEP_US);
+        while (bus.pending()) {
+            TEST_ASSERT_TRUE(bus.read(&f));
+            int s = streamOf(&f);
+            TEST_ASSERT_GREATER_OR_EQUAL(0, s);
+            TEST_ASSERT_GREATER_OR_EQUAL(lastUs, f.timestampUs);
+            TEST_ASSERT_EQUAL(0, f.bus);
+            lastUs = f.timestampUs;
+            counts[s]++;
+        }
+        TEST_ASSERT_FALSE(bus.read(&f));
+    }
+    for (size_t s = 0; s < MOCK_STREAM_COUNT; s++) {
+        TEST_ASSERT_EQUAL(RUN_US / mockStreams[s].periodUs, counts[s]);
+    }
+    TEST_ASSERT_EQUAL(0, bus.errorFlags());
+}
+
+void test_payload_layout() {
+    MockBackend bus(1);
+    bus.begin(BAUD_250K);
+    uint8_t expected[MOCK_STREAM_COUNT] = {};
+    CanFrame f;
+    while (micros() < RUN_US) {
+        shimAdvanceUs(STEP_US);
+        while (bus.read(&f)) {
+            int s = streamOf(&f);
+            const MockStream* m = &mockStreams[s];
+            TEST_ASSERT_EQUAL(1, f.bus);
+            TEST_ASSERT_EQUAL(m->flags, f.flags);
+            TEST_ASSERT_EQUAL(m->len, f.len);
+            TEST_ASSERT_EQUAL(expected[s], f.data[0]);
+            if (m->len > 2) TEST_ASSERT_EQUAL(s, f.data[2]);
+            for (int i = 8; i < m->len; i++) TEST_ASSERT_EQUAL((uint8_t)(i + expected[s]), f.data[i]);
+            expected[s]++;
+        }
+    }
+}
+
+void test_noise_at_other_bauds() {
+    MockBackend bus(0);
+    bus.begin(BAUD_500K);
+    unsigned long frames = 0;
+    unsigned long extended = 0;
+    CanFrame f;
+    while (micros() < RUN_US) {
+        shimAdvanceUs(STEP_US);
+        while (bus.read(&f)) {
+            frames++;
+            if (f.extended) extended++;
+            TEST_ASSERT_LESS_OR_EQUAL(f.extended ? 0x1FFFFFFF : 0x7FF, f.id);
+            TEST_ASSERT_LESS_OR_EQUAL(8, f.len);
+            TEST_ASSERT_EQUAL(0, f.flags);
+        }
+    }
+    TEST_ASSERT_EQUAL(RUN_US / MOCK_NOISE_PERIOD_US + 1, frames);
+    TEST_ASSERT_UINT32_WITHIN(frames / 10, frames / 2, extended);
+
+    // Back at 250 kbps it's the schedule again.
+    bus.begin(BAUD_250K);
+    TEST_ASSERT_FALSE(bus.pending());
+    shimAdvanceUs(mockStreams[0].periodUs);
+    TEST_ASSERT_TRUE(bus.read(&f));
+    TEST_ASSERT_EQUAL(mockStreams[0].id, f.id);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_schedule_matches_periods);
+    RUN_TEST(test_payload_layout);
+    RUN_TEST(test_noise_at_other_bauds);
+    return UNITY_END();
+}
@@ -0,0 +1,179 @@
+/*
+ * bus_merge.h with two mock controllers at full load: frames come out
+ * in timestamp order, neither bus waits on the other for long, and
+ * neither controller's FIFO overflows.
+ */
+
+#define CAN_BUS_COUNT 2
+
+#include <Arduino.h>
+#include <unity.h>
+#include "bus_merge.h"
+
+#define FIFO_DEPTH    32         // MCP2518FD RX FIFO as begin() sets it up
+#define SPI_READ_US   20         // One frame over 10 MHz SPI
+#define WORK_US       15         // Handling one frame in loop()
+#define LOOP_US       100        // The rest of a loop() pass
+#define STALL_EVERY_US 100000     // Now and then loop() is held up,
+#define STALL_US      3000       // by a flash write or a web request
+#define RUN_US        5000000
+#define MAX_LATENCY_US (STALL_US + 2000)   // Arrival to handed out
+
+// The default read budget and rx_adapt.h's while polling (RX_POLL_BUDGET,
+// a whole merge queue).
+static const int budgets[] = { MERGE_READ_BUDGET, MERGE_QUEUE_LEN };
+
+// A controller whose frames arrive every frameUs, back to back on a
+// saturated bus, stamped on arrival as the MCP2518FD does. They wait in
+// its FIFO until read; one that arrives to a full FIFO is lost. Frames
+// carry a sequence number, so a loss shows up as a gap.
+//
+// Each read also counts, for every other bus with frames waiting, how
+// many reads in a row it has been passed over.
+struct FullLoadMock {
+    uint8_t bus;
+    unsigned long frameUs;
+    unsigned long nextUs;
+    uint32_t sent;
+    uint32_t overflows;
+    uint32_t fifoSeq[FIFO_DEPTH];
+    unsigned long fifoUs[FIFO_DEPTH];
+    int head, count;
+    int passedOver;
+    int worstPassedOver;
+
+    void begin(uint8_t index, unsigned long period) {
+        bus = index;
+        frameUs = period;
+        nextUs = micros() + period;
+        sent = overflows = 0;
+        head = count = 0;
+        passedOver = worstPassedOver = 0;
+    }
+
+    void arrive() {
+        while ((long)(micros() - nextUs) >= 0) {
+            if (count == FIFO_DEPTH) {
+                overflows++;
+            } else {
+                int i = (head + count++) % FIFO_DEPTH;
+                fifoSeq[i] = sent;
+                fifoUs[i] = nextUs;
+            }
+            sent++;
+            nextUs += frameUs;
+        }
+    }
+
+    bool pending() {
+        arrive();
+        return count > 0;
+    }
+
+    bool read(CanFrame* frame);
+};
+
+static FullLoadMock buses[CAN_BUS_COUNT];
+
+bool FullLoadMock::read(CanFrame* frame) {
+    if (!pending()) return false;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        FullLoadMock* other = &buses[b];
+        other->passedOver = b != bus && other->pending() ? other->passedOver + 1 : 0;
+        other->worstPassedOver = max(other->worstPassedOver, other->passedOver);
+    }
+    shimAdvanceUs(SPI_READ_US);
+    memset(frame, 0, sizeof(*frame));
+    frame->id = 0x100 + bus;
+    frame->bus = bus;
+    frame->len = 8;
+    frame->timestampUs = fifoUs[head];
+    memcpy(frame->data, &fifoSeq[head], 4);
+    head = (head + 1) % FIFO_DEPTH;
+    count--;
+    return true;
+}
+static CanHealth health[CAN_BUS_COUNT];
+static unsigned long readErrors[CAN_BUS_COUNT];
+static BusMerge merge;
+
+struct RunStats {
+    uint32_t out[CAN_BUS_COUNT];
+    unsigned long worstLatencyUs[CAN_BUS_COUNT];
+};
+
+void setUp() {
+    shimReset();
+    memset(&merge, 0, sizeof(merge));
+    memset(readErrors, 0, sizeof(readErrors));
+    for (int b = 0; b < CAN_BUS_COUNT; b++) healthInit(&health[b]);
+}
+
+void tearDown() {}
+
+// Runs loop() passes as the builds do, checking every frame handed out.
+static RunStats run(int budget) {
+    RunStats s = {};
+    unsigned long lastUs = 0;
+    uint32_t expect[CAN_BUS_COUNT] = {};
+    unsigned long nextStallUs = STALL_EVERY_US;
+    while (micros() < RUN_US) {
+        TEST_ASSERT_EQUAL(0, mergeFill(&merge, buses, health, readErrors, budget));
+        CanFrame* f;
+        while ((f = mergeNext(&merge)) != NULL) {
+            TEST_ASSERT_LESS_OR_EQUAL(0, (long)(lastUs - f->timestampUs));
+            lastUs = f->timestampUs;
+
+            uint32_t seq;
+            memcpy(&seq, f->data, 4);
+            TEST_ASSERT_EQUAL(expect[f->bus]++, seq);
+            s.out[f->bus]++;
+            s.worstLatencyUs[f->bus] = max(s.worstLatencyUs[f->bus], micros() - f->timestampUs);
+            shimAdvanceUs(WORK_US);
+        }
+        shimAdvanceUs(LOOP_US);
+        if (micros() >= nextStallUs) {
+            shimAdvanceUs(STALL_US);
+            nextStallUs += STALL_EVERY_US;
+        }
+    }
+    for (int b = 0; b < CAN_BUS_COUNT; b++) {
+        TEST_ASSERT_EQUAL(0, buses[b].overflows);
+        // Drained in turn: a bus waits out at most a budget from each other.
+        TEST_ASSERT_LESS_OR_EQUAL(budget * (CAN_BUS_COUNT - 1), buses[b].worstPassedOver);
+        // Whatever is not out yet is at most one pass behind.
+        TEST_ASSERT_LESS_OR_EQUAL(FIFO_DEPTH + MERGE_QUEUE_LEN, buses[b].sent - s.out[b]);
+        TEST_ASSERT_LESS_OR_EQUAL(MAX_LATENCY_US, s.worstLatencyUs[b]);
+    }
+    return s;
+}
+
+void test_two_saturated_buses() {
+    for (int budget : budgets) {
+        setUp();
+        // 500 kbps: extended and standard 8-byte frames, back to back.
+        buses[0].begin(0, 270);
+        buses[1].begin(1, 230);
+        RunStats s = run(budget);
+        TEST_ASSERT_GREATER_THAN(RUN_US / 270 - FIFO_DEPTH - MERGE_QUEUE_LEN, s.out[0]);
+        TEST_ASSERT_GREATER_THAN(RUN_US / 230 - FIFO_DEPTH - MERGE_QUEUE_LEN, s.out[1]);
+    }
+}
+
+void test_quiet_bus_not_starved_by_busy_one() {
+    for (int budget : budgets) {
+        setUp();
+        // A saturated 1 Mbps bus beside one with a frame every 10 ms.
+        buses[0].begin(0, 115);
+        buses[1].begin(1, 10000);
+        RunStats s = run(budget);
+        TEST_ASSERT_GREATER_OR_EQUAL(RUN_US / 10000 - 1, s.out[1]);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_two_saturated_buses);
+    RUN_TEST(test_quiet_bus_not_starved_by_busy_one);
+    return UNITY_END();
+}
@@ -0,0 +1,203 @@
+/*
+ * CAN FD lengths end to end: DLC codes, the flight recorder's length
+ * byte, and the CSV and candump lines of 12- to 64-byte frames.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include "burst_capture.h"
+#include "flight_recorder.h"
+#include "frame_format.h"
+
+static const uint8_t fdLengths[] = { 12, 16, 20, 24, 32, 48, 64 };
+static FlightRecorder rec;
+
+void setUp() {
+    shimReset();
+    shimResetTasks();
+    shimPreferences.clear();
+}
+
+void tearDown() {}
+
+static CanFrame fdFrame(uint8_t len, uint8_t flags) {
+    CanFrame f = {};
+    f.id = 0x18DA00F1;
+    f.extended = true;
+    f.flags = CAN_FLAG_FD | flags;
+    f.len = len;
+    for (int i = 0; i < len; i++) f.data[i] = 0xA0 + i;
+    return f;
+}
+
+static std::string hexBytes(const CanFrame* f, const char* sep) {
+    std::string s;
+    char b[3];
+    for (int i = 0; i < f->len; i++) {
+        snprintf(b, sizeof(b), "%02X", f->data[i]);
+        if (i > 0) s += sep;
+        s += b;
+    }
+    return s;
+}
+
+// The ,BUS column, present only with more than one controller.
+static std::string busColumn(uint8_t bus) {
+    return CAN_BUS_COUNT > 1 ? "," + std::to_string(bus) : "";
+}
+
+void test_dlc_codes() {
+    for (uint8_t dlc = 0; dlc < 16; dlc++) {
+        uint8_t fd = canDlcToLen(dlc, true);
+        TEST_ASSERT_EQUAL(dlc <= 8 ? dlc : fdLengths[dlc - 9], fd);
+        TEST_ASSERT_EQUAL(dlc <= 8 ? dlc : 8, canDlcToLen(dlc, false));
+        TEST_ASSERT_EQUAL(dlc, canLenToDlc(fd));
+        // Only the low nibble is the code.
+        TEST_ASSERT_EQUAL(fd, canDlcToLen(dlc | 0xF0, true));
+    }
+    // Any other length rounds up to the next frame that holds it.
+    for (int len = 0; len <= CAN_MAX_DLEN; len++) {
+        uint8_t dlc = canLenToDlc(len);
+        TEST_ASSERT_GREATER_OR_EQUAL(len, canDlcToLen(dlc, true));
+        if (dlc > 0) TEST_ASSERT_LESS_THAN(len, canDlcToLen(dlc - 1, true));
+    }
+}
+
+void test_flight_length_byte() {
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, 4);
+    TEST_ASSERT_TRUE(flightInit(&rec));
+    flightSetEnabled(&rec, true);
+
+    static const uint8_t flagSets[] = { 0, CAN_FLAG_BRS, CAN_FLAG_ESI, CAN_FLAG_BRS | CAN_FLAG_ESI };
+    CanFrame frames[2 * 7 * 4];
+    int n = 0;
+    for (uint8_t bus = 0; bus < 2; bus++) {
+        for (uint8_t len : fdLengths) {
+            for (uint8_t flags : flagSets) {
+                CanFrame f = fdFrame(len, flags);
+                f.bus = bus;
+                f.id += n;
+                frames[n++] = f;
+            }
+        }
+    }
+    // Enough blocks to need the writer, then back through flash.
+    for (int i = 0; i < n; i++) {
+        flightRecordFrame(&rec, &frames[i]);
+        shimRunTasks();
+    }
+    flightFlush(&rec);
+    shimRunTasks();
+
+    static FlightDump dump;
+    static FlightBlock block;
+    TEST_ASSERT_TRUE(flightBeginDump(&rec, &dump));
+    int k = 0;
+    while (flightNextBlock(&rec, &dump, &block)) {
+        uint16_t offset = 0;
+        FlightRecord r;
+        while (flightNextRecord(&block, &offset, &r)) {
+            const CanFrame* f = &frames[k++];
+            const uint8_t* lenByte = block.payload + offset - r.len - (f->bus ? 1 : 0) - 1;
+            TEST_ASSERT_EQUAL(canLenToDlc(f->len), *lenByte & FLIGHT_LEN_DLC);
+            TEST_ASSERT_TRUE(*lenByte & FLIGHT_LEN_FD);
+            TEST_ASSERT_EQUAL(f->bus != 0, (*lenByte & FLIGHT_LEN_BUS) != 0);
+            TEST_ASSERT_EQUAL(f->id, r.id);
+            TEST_ASSERT_EQUAL(f->bus, r.bus);
+            TEST_ASSERT_EQUAL(f->flags, r.flags);
+            TEST_ASSERT_EQUAL(f->len, r.len);
+            TEST_ASSERT_EQUAL_MEMORY(f->data, r.data, f->len);
+        }
+    }
+    TEST_ASSERT_EQUAL(n, k);
+
+    // A classic record from before CAN FD reads as it always did.
+    FlightBlock old = {};
+    uint32_t ms = 5, idFlags = 0x123;
+    memcpy(old.payload, &ms, 4);
+    memcpy(old.payload + 4, &idFlags, 4);
+    old.payload[8] = 8;
+    old.header.used = 17;
+    uint16_t offset = 0;
+    FlightRecord r;
+    TEST_ASSERT_TRUE(flightNextRecord(&old, &offset, &r));
+    TEST_ASSERT_EQUAL(8, r.len);
+    TEST_ASSERT_EQUAL(0, r.flags);
+}
+
+void test_flight_csv_row() {
+    FlightBlock b = {};
+    b.header.bootId = 1;
+    FlightRecord r = {};
+    r.ms = 1234;
+    r.id = 0x400;
+    r.flags = CAN_FLAG_FD | CAN_FLAG_BRS;
+    r.len = 20;
+    for (int i = 0; i < r.len; i++) r.data[i] = i;
+    uint32_t lastBoot = 1;
+    char line[512];
+    int len = flightFormatRecord(&b, &r, &lastBoot, line, sizeof(line));
+    CanFrame f = {};
+    f.len = r.len;
+    memcpy(f.data, r.data, r.len);
+    std::string expected = "1234,0x400,0,6,11," + hexBytes(&f, " ") + busColumn(0) + "\n";
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), std::string(line, len).c_str());
+}
+
+void test_csv_lines() {
+    char line[512];
+    for (uint8_t len : fdLengths) {
+        CanFrame f = fdFrame(len, CAN_FLAG_BRS);
+        int n = formatFrameCsv(&f, 98765, line, sizeof(line));
+        std::string expected = "98765,0x18DA00F1,1,6," + std::to_string(canLenToDlc(len)) + "," +
+                               hexBytes(&f, " ") + busColumn(0) + "\n";
+        TEST_ASSERT_EQUAL_STRING(expected.c_str(), std::string(line, n).c_str());
+
+        // Burst rows are the same with the frame's own us timestamp.
+        f.timestampUs = 4000000123UL;
+        n = burstFormatRecord(&f, line, sizeof(line));
+        TEST_ASSERT_EQUAL_STRING(("4000000123" + expected.substr(5)).c_str(), std::string(line, n).c_str());
+    }
+
+    CanFrame classic = {};
+    classic.id = 0x100;
+    classic.len = 3;
+    classic.data[0] = 0x01;
+    classic.data[2] = 0xFF;
+    int n = formatFrameCsv(&classic, 7, line, sizeof(line));
+    TEST_ASSERT_EQUAL_STRING(("7,0x100,0,0,3,01 00 FF" + busColumn(0) + "\n").c_str(), std::string(line, n).c_str());
+}
+
+void test_candump_lines() {
+    char line[512];
+    static const struct { uint8_t flags; char nibble; } fd[] = {
+        { 0, '0' }, { CAN_FLAG_BRS, '1' }, { CAN_FLAG_ESI, '2' }, { CAN_FLAG_BRS | CAN_FLAG_ESI, '3' },
+    };
+    for (uint8_t len : fdLengths) {
+        for (const auto& x : fd) {
+            CanFrame f = fdFrame(len, x.flags);
+            f.bus = 1;
+            int n = formatFrameCandump(&f, 12345, line, sizeof(line));
+            std::string expected = std::string("(12.345) can1 18DA00F1##") + x.nibble + hexBytes(&f, "") + "\n";
+            TEST_ASSERT_EQUAL_STRING(expected.c_str(), std::string(line, n).c_str());
+        }
+    }
+
+    CanFrame rtr = {};
+    rtr.id = 0x7DF;
+    rtr.flags = CAN_FLAG_RTR;
+    rtr.len = 8;
+    int n = formatFrameCandump(&rtr, 5, line, sizeof(line));
+    TEST_ASSERT_EQUAL_STRING("(0.005) can0 7DF#R\n", std::string(line, n).c_str());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_dlc_codes);
+    RUN_TEST(test_flight_length_byte);
+    RUN_TEST(test_flight_csv_row);
+    RUN_TEST(test_csv_lines);
+    RUN_TEST(test_candump_lines);
+    return UNITY_END();
+}
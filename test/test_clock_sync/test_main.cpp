@@ -0,0 +1,125 @@
+/*
+ * clock_sync.h over a simulated jittery WiFi link: a mark mapped onto
+ * the device clock is never further from the truth than the errUs
+ * reported with it.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include "clock_sync.h"
+
+#define PINGS           2000
+#define PING_EVERY_US   1000000
+
+static ClockSync sync;
+
+void setUp() {
+    shimReset(777);
+    memset(&sync, 0, sizeof(sync));
+}
+
+void tearDown() {}
+
+static double uniform() {
+    return (esp_random() + 0.5) / 4294967296.0;
+}
+
+// One leg's delay: a 2 ms floor, exponential queueing averaging 8 ms,
+// and now and then a retransmit or a stall of up to 2 s.
+static int64_t legUs() {
+    int64_t us = 2000 - 8000 * log(uniform());
+    if (esp_random() % 50 == 0) us += esp_random() % 2000000;
+    return us;
+}
+
+// Runs a client whose clock reads deviceUs * (1 + ppm / 1e6) - offsetUs.
+// Returns the largest error beyond the reported bound, in us.
+static int64_t runLink(double ppm, int64_t offsetUs, int64_t slackUs) {
+    ClockClient* c = clockClient(&sync, 42, 0);
+    auto clientAt = [&](int64_t deviceUs) { return (int64_t)(deviceUs * (1 + ppm / 1e6)) - offsetUs; };
+    int64_t device = 10000000;
+    int64_t prevT0 = 0, prevT3 = 0;
+    bool hasPrev = false;
+    int64_t worst = INT64_MIN;
+    int checked = 0;
+
+    for (int i = 0; i < PINGS; i++) {
+        device += PING_EVERY_US;
+        int64_t t0 = clientAt(device);
+        int64_t seen = device + legUs();
+        int64_t back = seen + legUs();
+        clockPing(c, t0, hasPrev, prevT0, prevT3, seen);
+
+        // 2% of replies are lost: the next ping reports nothing.
+        hasPrev = esp_random() % 50 != 0;
+        prevT0 = t0;
+        prevT3 = clientAt(back);
+
+        // A mark stamped by the client some time in the last interval.
+        int64_t markDevice = back - esp_random() % PING_EVERY_US;
+        int64_t deviceUs;
+        uint32_t errUs;
+        if (!clockToDevice(c, clientAt(markDevice), &deviceUs, &errUs)) continue;
+        int64_t off = deviceUs - markDevice;
+        if (off < 0) off = -off;
+        worst = max(worst, off - (int64_t)errUs - slackUs);
+        checked++;
+    }
+    TEST_ASSERT_GREATER_THAN(PINGS * 9 / 10, checked);
+    return worst;
+}
+
+void test_error_within_reported_bound() {
+    TEST_ASSERT_LESS_OR_EQUAL(0, runLink(0, 123456789, 0));
+}
+
+void test_drift_stays_within_bound_plus_sample_age() {
+    // A sample is at most CLOCK_SAMPLES pings old, plus any that were
+    // lost or too slow, and the clocks drift apart meanwhile.
+    const double ppm = 50;
+    int64_t slack = (int64_t)(ppm * 1e-6 * 3 * CLOCK_SAMPLES * PING_EVERY_US);
+    TEST_ASSERT_LESS_OR_EQUAL(0, runLink(ppm, -5000000, slack));
+}
+
+void test_mismatched_and_slow_reports_are_ignored() {
+    ClockClient* c = clockClient(&sync, 7, 0);
+    clockPing(c, 1000, false, 0, 0, 50000);
+    // Reports a ping the device never saw.
+    clockPing(c, 2000, true, 999, 1500, 51000);
+    TEST_ASSERT_FALSE(clockSynced(c));
+    // Reports the last one, but with a round trip over CLOCK_MAX_RTT_US.
+    clockPing(c, 3000, true, 2000, 2000 + CLOCK_MAX_RTT_US + 1, 52000);
+    TEST_ASSERT_FALSE(clockSynced(c));
+    clockPing(c, 4000, true, 3000, 3400, 53000);
+    TEST_ASSERT_TRUE(clockSynced(c));
+    int64_t deviceUs;
+    uint32_t errUs;
+    TEST_ASSERT_TRUE(clockToDevice(c, 3200, &deviceUs, &errUs));
+    TEST_ASSERT_EQUAL(52000, deviceUs);
+    TEST_ASSERT_EQUAL(200, errUs);
+    TEST_ASSERT_EQUAL(4, c->pings);
+}
+
+void test_clients_take_least_recently_seen_slot() {
+    for (uint32_t id = 1; id <= CLOCK_MAX_CLIENTS; id++) clockClient(&sync, id, id * 1000);
+    clockClient(&sync, 1, 9000);
+    ClockClient* c = clockClient(&sync, 99, 10000);
+    TEST_ASSERT_EQUAL(99, c->id);
+    TEST_ASSERT_EQUAL(-1, c->best);
+    for (int i = 0; i < CLOCK_MAX_CLIENTS; i++) TEST_ASSERT_TRUE(sync.clients[i].id != 2);
+}
+
+void test_parse_ms() {
+    TEST_ASSERT_EQUAL_INT64(1234567, clockParseMs("1234.567"));
+    TEST_ASSERT_EQUAL_INT64(5000, clockParseMs("5"));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_error_within_reported_bound);
+    RUN_TEST(test_drift_stays_within_bound_plus_sample_age);
+    RUN_TEST(test_mismatched_and_slow_reports_are_ignored);
+    RUN_TEST(test_clients_take_least_recently_seen_slot);
+    RUN_TEST(test_parse_ms);
+    return UNITY_END();
+}
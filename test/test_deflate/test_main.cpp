@@ -0,0 +1,357 @@
+/*
+ * deflate_stream.h: round trips of random and repetitive input through
+ * inflateFixed(), which is itself checked against streams zlib wrote;
+ * the flight recorder's stored chunks for blocks that don't shrink; and
+ * the gzip framing and CRC of /csv and /flight against their plain
+ * bodies.
+ *
+ * It is also the measurement behind the ratios quoted in deflate_stream.h
+ * and flight_recorder.h: two minutes of the mock's ETS-like traffic,
+ * downloaded as /csv and kept by the flight recorder. The times printed
+ * are host times, for comparing one change with the next. Set
+ * DEFLATE_CAPTURE_DIR to also write the capture there as capture.csv and
+ * capture.csv.gz, e.g. to compare with zlib:
+ *
+ *   python3 -c "import zlib; d = open('capture.csv', 'rb').read(); print(len(d) / len(zlib.compress(d, 6)))"
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "main_wifi.cpp"
+
+#define FLIGHT_SECTORS  8
+#define CAPTURE_US      120000000UL
+#define LOOP_US         1000
+#define TIMING_PASSES   20
+
+using HostClock = std::chrono::steady_clock;
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes sunk;
+
+static void sink(void*, const uint8_t* data, size_t len) {
+    TEST_ASSERT_LESS_OR_EQUAL(DEFLATE_OUT_SIZE, len);
+    sunk.insert(sunk.end(), data, data + len);
+}
+
+// Deflates in in pieces of up to piece bytes, raw or gzip.
+static Bytes deflate(const Bytes& in, size_t piece, bool gzip = false) {
+    static DeflateStream d;
+    sunk.clear();
+    deflateBegin(&d, gzip, sink, NULL);
+    for (size_t i = 0; i < in.size(); i += piece) {
+        deflateWrite(&d, in.data() + i, min(piece, in.size() - i));
+    }
+    uint32_t outBytes = deflateEnd(&d);
+    TEST_ASSERT_EQUAL(sunk.size(), outBytes);
+    TEST_ASSERT_EQUAL(in.size(), d.inBytes);
+    return sunk;
+}
+
+static void checkRoundTrip(const Bytes& in, size_t piece) {
+    Bytes z = deflate(in, piece);
+    TEST_ASSERT_LESS_OR_EQUAL(DEFLATE_BOUND(in.size()), z.size());
+    Bytes out(in.size() + 1);
+    TEST_ASSERT_EQUAL(in.size(), inflateFixed(z.data(), z.size(), out.data(), out.size()));
+    TEST_ASSERT_EQUAL(0, memcmp(in.data(), out.data(), in.size()));
+}
+
+static Bytes randomBytes(size_t n) {
+    Bytes b(n);
+    for (size_t i = 0; i < n; i++) b[i] = esp_random();
+    return b;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// Lengths either side of the window and of the buffer it slides in.
+static const size_t lengths[] = { 0, 1, 2, 3, 100, DEFLATE_WINDOW - 1, DEFLATE_WINDOW, 2 * DEFLATE_WINDOW,
+                                  2 * DEFLATE_WINDOW + 1, 10000, 70000 };
+
+void test_round_trip_random() {
+    for (size_t n : lengths) {
+        checkRoundTrip(randomBytes(n), n + 1);
+        checkRoundTrip(randomBytes(n), 37);
+    }
+}
+
+void test_round_trip_repetitive() {
+    for (size_t n : lengths) {
+        // One byte over and over: matches at distance 1, up to the longest.
+        Bytes same(n, 'A');
+        checkRoundTrip(same, 37);
+        // A pattern whose repeats sit at the window's edge.
+        for (size_t period : { (size_t)DEFLATE_WINDOW - 1, (size_t)DEFLATE_WINDOW, (size_t)DEFLATE_WINDOW + 1 }) {
+            Bytes pattern = randomBytes(period);
+            Bytes in(n);
+            for (size_t i = 0; i < n; i++) in[i] = pattern[i % period];
+            checkRoundTrip(in, 501);
+        }
+    }
+    Bytes same(70000, 'A');
+    TEST_ASSERT_LESS_THAN(70000 / 100, deflate(same, 4096).size());
+}
+
+// zlib output, so the decoder isn't only checked against the encoder:
+// a fixed-Huffman stream (Z_FIXED) of three /csv rows and a stored one.
+static const char zlibText[] =
+    "100,0x100,0,0,8,00 80 00 00 00 00 00 00\n"
+    "110,0x100,0,0,8,01 80 00 00 00 00 00 00\n"
+    "120,0x101,0,0,8,02 81 01 00 00 00 00 00\n";
+static const uint8_t zlibFixed[] = {
+    0x33, 0x34, 0x30, 0xD0, 0x31, 0xA8, 0x30, 0x04, 0x91, 0x40, 0x68, 0xA1,
+    0x63, 0x60, 0xA0, 0x60, 0x61, 0xA0, 0x60, 0x80, 0x8E, 0xB8, 0x0C, 0x0D,
+    0xD1, 0xD4, 0x19, 0xE2, 0x50, 0x67, 0x04, 0x51, 0x67, 0x08, 0x53, 0x67,
+    0xA4, 0x60, 0x61, 0xA8, 0x00, 0x54, 0x8D, 0xA6, 0x0E, 0x00,
+};
+static const char zlibStoredText[] = "stored, not deflated";
+static const uint8_t zlibStored[] = {
+    0x01, 0x14, 0x00, 0xEB, 0xFF, 0x73, 0x74, 0x6F, 0x72, 0x65, 0x64, 0x2C,
+    0x20, 0x6E, 0x6F, 0x74, 0x20, 0x64, 0x65, 0x66, 0x6C, 0x61, 0x74, 0x65,
+    0x64,
+};
+
+void test_inflate_reads_zlib_output() {
+    uint8_t out[256];
+    int n = inflateFixed(zlibFixed, sizeof(zlibFixed), out, sizeof(out));
+    TEST_ASSERT_EQUAL(strlen(zlibText), n);
+    TEST_ASSERT_EQUAL(0, memcmp(zlibText, out, n));
+    n = inflateFixed(zlibStored, sizeof(zlibStored), out, sizeof(out));
+    TEST_ASSERT_EQUAL(strlen(zlibStoredText), n);
+    TEST_ASSERT_EQUAL(0, memcmp(zlibStoredText, out, n));
+
+    // Truncated, or too big for out: an error, never an overrun.
+    TEST_ASSERT_EQUAL(-1, inflateFixed(zlibFixed, sizeof(zlibFixed) - 2, out, sizeof(out)));
+    TEST_ASSERT_EQUAL(-1, inflateFixed(zlibFixed, sizeof(zlibFixed), out, strlen(zlibText) - 1));
+    TEST_ASSERT_EQUAL(-1, inflateFixed(zlibStored, sizeof(zlibStored), out, strlen(zlibStoredText) - 1));
+}
+
+// ============== FIRMWARE ==============
+
+static void run(unsigned long us) {
+    unsigned long end = micros() + us;
+    while (micros() < end) {
+        loop();
+        shimRunTasks();
+        shimAdvanceUs(LOOP_US);
+    }
+}
+
+static void request(const char* uri, const char* query = "", const char* encoding = "") {
+    TEST_ASSERT_TRUE(server.shimRequest(uri, query, encoding));
+    server.handleClient();
+    TEST_ASSERT_TRUE(shimResponse.done);
+    TEST_ASSERT_EQUAL(200, shimResponse.code);
+    TEST_ASSERT_LESS_THAN(SHIM_BODY_KEEP, shimResponse.bodyBytes);
+}
+
+static Bytes responseBody() {
+    return Bytes(shimResponse.body, shimResponse.body + shimResponse.bodyBytes);
+}
+
+// Runs the capture the downloads and ratios are taken from, once.
+static void capture() {
+    static bool done = false;
+    if (done) return;
+    done = true;
+    request("/flight", "enable=1");
+    run(CAPTURE_US);
+    loop();                      // Read what's due, so downloads agree
+    flightFlush(&flightRec);
+    shimRunTasks();
+}
+
+static uint32_t readLe32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Fetches uri plain and gzipped and checks the second is the first in
+// gzip framing (RFC 1952). Returns both.
+static void fetchBoth(const char* uri, Bytes* plain, Bytes* gz) {
+    request(uri);
+    TEST_ASSERT_NULL(strstr(shimResponse.headers, "Content-Encoding"));
+    *plain = responseBody();
+    request(uri, "", "gzip, deflate");
+    TEST_ASSERT_NOT_NULL(strstr(shimResponse.headers, "Content-Encoding: gzip\n"));
+    *gz = responseBody();
+
+    TEST_ASSERT_GREATER_THAN(DEFLATE_GZIP_OVERHEAD, gz->size());
+    const uint8_t* g = gz->data();
+    TEST_ASSERT_EQUAL_HEX8(0x1F, g[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x8B, g[1]);
+    TEST_ASSERT_EQUAL(8, g[2]);                     // Deflate
+    TEST_ASSERT_EQUAL(0, g[3]);                     // No name, comment or extra field
+
+    Bytes out(plain->size() + 1);
+    int n = inflateFixed(g + 10, gz->size() - DEFLATE_GZIP_OVERHEAD, out.data(), out.size());
+    TEST_ASSERT_EQUAL(plain->size(), n);
+    TEST_ASSERT_EQUAL(0, memcmp(plain->data(), out.data(), n));
+
+    const uint8_t* trailer = g + gz->size() - 8;
+    TEST_ASSERT_EQUAL_HEX32(esp_rom_crc32_le(0, plain->data(), plain->size()), readLe32(trailer));
+    TEST_ASSERT_EQUAL(plain->size(), readLe32(trailer + 4));
+}
+
+void test_gzip_csv() {
+    // The CRC the trailer uses is zlib's.
+    TEST_ASSERT_EQUAL_HEX32(0xCBF43926, esp_rom_crc32_le(0, (const uint8_t*)"123456789", 9));
+    capture();
+    Bytes plain, gz;
+    fetchBoth("/csv", &plain, &gz);
+    TEST_ASSERT_GREATER_THAN(10000, plain.size());
+}
+
+void test_gzip_flight() {
+    capture();
+    Bytes plain, gz;
+    fetchBoth("/flight", &plain, &gz);
+    TEST_ASSERT_GREATER_THAN(10000, plain.size());
+}
+
+static void writeFile(const char* dir, const char* name, const Bytes& data) {
+    std::string path = std::string(dir) + "/" + name;
+    FILE* f = fopen(path.c_str(), "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+// Host time to deflate data, per input byte.
+static double deflateNsPerByte(const Bytes& data, size_t piece) {
+    HostClock::time_point start = HostClock::now();
+    for (int i = 0; i < TIMING_PASSES; i++) deflate(data, piece);
+    double ns = std::chrono::duration<double, std::nano>(HostClock::now() - start).count();
+    return ns / TIMING_PASSES / data.size();
+}
+
+// The flight recorder's blocks, inflated, as its writer task had them.
+static std::vector<Bytes> flightBlocks() {
+    std::vector<Bytes> blocks;
+    TEST_ASSERT_TRUE(flightBeginDump(&flightRec, &flightDump));
+    while (flightNextBlock(&flightRec, &flightDump, &flightDumpBlock)) {
+        const uint8_t* p = flightDumpBlock.payload;
+        blocks.push_back(Bytes(p, p + flightDumpBlock.header.used));
+    }
+    return blocks;
+}
+
+void test_capture_ratios() {
+    capture();
+    Bytes plain, gz;
+    fetchBoth("/csv", &plain, &gz);
+    double csvRatio = (double)plain.size() / gz.size();
+    printf("%lu frames: /csv %zu -> %zu bytes gzipped, %.2f:1, host %.1f ns/byte\n", messageCount,
+           plain.size(), gz.size(), csvRatio, deflateNsPerByte(plain, STREAM_CHUNK_SIZE));
+
+    double flightRatio = (double)flightRec.rawBytes / flightRec.storedBytes;
+    std::vector<Bytes> blocks = flightBlocks();
+    double ns = 0;
+    size_t bytes = 0;
+    for (const Bytes& b : blocks) {
+        ns += deflateNsPerByte(b, b.size()) * b.size();
+        bytes += b.size();
+    }
+    printf("flight recorder: %lu record bytes -> %lu in flash, %.2f:1, host %.1f ns/byte\n",
+           (unsigned long)flightRec.rawBytes, (unsigned long)flightRec.storedBytes, flightRatio, ns / bytes);
+
+    const char* dir = getenv("DEFLATE_CAPTURE_DIR");
+    if (dir != NULL) {
+        writeFile(dir, "capture.csv", plain);
+        writeFile(dir, "capture.csv.gz", gz);
+    }
+    TEST_ASSERT_TRUE(csvRatio > 3.3);
+    TEST_ASSERT_TRUE(flightRatio > 2.2);
+}
+
+// The chunk the last flightFlush() wrote: the last one in the open sector.
+static FlightChunkHeader lastChunk() {
+    FlightChunkHeader c = {};
+    uint32_t offset = sizeof(FlightSectorHeader);
+    while (offset < flightRec.sectorUsed) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_read(flightRec.partition, flightRec.sectorOffset + offset, &c, sizeof(c)));
+        offset += sizeof(c) + c.size;
+    }
+    TEST_ASSERT_EQUAL(flightRec.sectorUsed, offset);
+    return c;
+}
+
+// Records FD frames, with IDs, gaps and payloads random or not, and
+// returns the block's chunk once written.
+static FlightChunkHeader recordBlock(int frames, bool random) {
+    flightFlush(&flightRec);
+    shimRunTasks();
+    CanFrame f = {};
+    f.extended = true;
+    f.flags = CAN_FLAG_FD;
+    f.len = 64;
+    for (int n = 0; n < frames; n++) {
+        f.id = random ? esp_random() & 0x1FFFFFFF : 0x18DA00F1;
+        for (int i = 0; i < f.len; i++) f.data[i] = random ? esp_random() : i;
+        flightRecordFrame(&flightRec, &f);
+        shimAdvanceUs(random ? esp_random() % 60000000 : 1000);
+    }
+    flightFlush(&flightRec);
+    shimRunTasks();
+    return lastChunk();
+}
+
+void test_incompressible_block_is_stored() {
+    capture();
+    const int frames = FLIGHT_RAW_LIMIT / 80;
+    uint32_t seed = shimRandom;
+    FlightChunkHeader c = recordBlock(frames, true);
+    TEST_ASSERT_EQUAL(frames, c.records);
+    TEST_ASSERT_EQUAL(FLIGHT_CHUNK_STORED, c.flags);
+    TEST_ASSERT_EQUAL(c.used, c.size);
+
+    c = recordBlock(frames, false);
+    TEST_ASSERT_EQUAL(frames, c.records);
+    TEST_ASSERT_EQUAL(0, c.flags);
+    TEST_ASSERT_LESS_THAN(c.used / 4, c.size);
+
+    // Both read back, the stored one as it went in.
+    uint8_t ramp[64];
+    for (int i = 0; i < 64; i++) ramp[i] = i;
+    int ramps = 0, randoms = 0;
+    shimRandom = seed;
+    TEST_ASSERT_TRUE(flightBeginDump(&flightRec, &flightDump));
+    while (flightNextBlock(&flightRec, &flightDump, &flightDumpBlock)) {
+        uint16_t offset = 0;
+        FlightRecord r;
+        while (flightNextRecord(&flightDumpBlock, &offset, &r)) {
+            if (r.isMark || r.len != 64) continue;
+            if (r.id == 0x18DA00F1) {
+                if (memcmp(r.data, ramp, 64) == 0) ramps++;
+                continue;
+            }
+            TEST_ASSERT_EQUAL_HEX32(esp_random() & 0x1FFFFFFF, r.id);
+            for (int i = 0; i < 64; i++) TEST_ASSERT_EQUAL_HEX8((uint8_t)esp_random(), r.data[i]);
+            esp_random();        // The gap after it
+            randoms++;
+        }
+    }
+    TEST_ASSERT_EQUAL(frames, ramps);
+    TEST_ASSERT_EQUAL(frames, randoms);
+}
+
+int main() {
+    shimReset();
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, FLIGHT_SECTORS);
+    setup();
+    shimWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip_random);
+    RUN_TEST(test_round_trip_repetitive);
+    RUN_TEST(test_inflate_reads_zlib_output);
+    RUN_TEST(test_gzip_csv);
+    RUN_TEST(test_gzip_flight);
+    RUN_TEST(test_capture_ratios);
+    RUN_TEST(test_incompressible_block_is_stored);
+    return UNITY_END();
+}
@@ -0,0 +1,248 @@
+/*
+ * delta_codec.h round trips: periodic traffic, FD frames changing shape,
+ * a dictionary that fills up mid-capture and marks stamped earlier than
+ * the record before them.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include "delta_codec.h"
+
+#define BLOCK_BYTES 2048
+
+struct Block {
+    DeltaBlockHeader header;
+    uint8_t data[BLOCK_BYTES];
+};
+
+// What went in, to compare the decoded records against.
+struct Expected {
+    uint8_t type;
+    uint32_t time;
+    CanFrame frame;
+    char text[DELTA_MAX_TEXT + 1];
+};
+
+static Block block;
+static DeltaState enc;
+static Expected expected[4096];
+static int expectedCount;
+
+void setUp() {
+    shimReset();
+    deltaBlockBegin(&enc, &block.header, 0, 0);
+    expectedCount = 0;
+}
+
+void tearDown() {}
+
+static bool addFrame(uint32_t time, const CanFrame* f) {
+    if (block.header.used + DELTA_MAX_RECORD > BLOCK_BYTES) return false;
+    int n = deltaEncodeFrame(&enc, time, f, block.data + block.header.used);
+    if (n < 0) return false;
+    TEST_ASSERT_LESS_OR_EQUAL(DELTA_MAX_RECORD, n);
+    block.header.used += n;
+    block.header.count++;
+    Expected* e = &expected[expectedCount++];
+    e->type = 0;
+    e->time = time;
+    e->frame = *f;
+    return true;
+}
+
+static void addText(uint32_t time, uint8_t type, const char* text) {
+    int n = deltaEncodeText(&enc, time, type, text, strlen(text), block.data + block.header.used);
+    TEST_ASSERT_LESS_OR_EQUAL(DELTA_MAX_RECORD, n);
+    block.header.used += n;
+    block.header.count++;
+    Expected* e = &expected[expectedCount++];
+    e->type = type;
+    e->time = time;
+    strncpy(e->text, text, DELTA_MAX_TEXT);
+    e->text[DELTA_MAX_TEXT] = '\0';
+}
+
+// Decodes the block and checks every record against expected[first..].
+static void checkBlock(const Block* b, int first) {
+    DeltaState dec;
+    DeltaRecord r;
+    deltaDecodeBegin(&dec, &b->header);
+    int pos = 0;
+    for (int k = 0; k < b->header.count; k++) {
+        const Expected* e = &expected[first + k];
+        TEST_ASSERT_TRUE(deltaDecode(&dec, b->data, b->header.used, &pos, &r));
+        TEST_ASSERT_EQUAL(e->type, r.type);
+        TEST_ASSERT_EQUAL_UINT32(e->time, r.time);
+        if (e->type != 0) {
+            TEST_ASSERT_EQUAL(strlen(e->text), r.textLen);
+            TEST_ASSERT_EQUAL_STRING_LEN(e->text, r.text, r.textLen);
+            continue;
+        }
+        TEST_ASSERT_EQUAL_HEX32(e->frame.id, r.id);
+        TEST_ASSERT_EQUAL(e->frame.extended, r.extended);
+        TEST_ASSERT_EQUAL(e->frame.bus, r.bus);
+        TEST_ASSERT_EQUAL(e->frame.flags, r.flags);
+        TEST_ASSERT_EQUAL(e->frame.len, r.len);
+        TEST_ASSERT_EQUAL_MEMORY(e->frame.data, r.data, r.len);
+    }
+    TEST_ASSERT_EQUAL(b->header.used, pos);
+    TEST_ASSERT_FALSE(deltaDecode(&dec, b->data, b->header.used, &pos, &r));
+}
+
+void test_varint_and_zigzag() {
+    static const int32_t values[] = { 0, 1, -1, 63, -64, 64, 1000000, -1000000, INT32_MAX, INT32_MIN };
+    for (int32_t v : values) {
+        uint8_t buf[8];
+        int n = deltaPutVarint(buf, deltaZigzag(v));
+        TEST_ASSERT_LESS_OR_EQUAL(5, n);
+        int pos = 0;
+        uint32_t got;
+        TEST_ASSERT_TRUE(deltaGetVarint(buf, n, &pos, &got));
+        TEST_ASSERT_EQUAL(n, pos);
+        TEST_ASSERT_EQUAL(v, deltaUnzigzag(got));
+        pos = 0;
+        if (n > 1) TEST_ASSERT_FALSE(deltaGetVarint(buf, n - 1, &pos, &got));
+    }
+}
+
+void test_mock_traffic_round_trip() {
+    MockBackend bus(0);
+    bus.begin(BAUD_250K);
+    CanFrame f;
+    bool full = false;
+    while (!full) {
+        shimAdvanceUs(100);
+        while (!full && bus.read(&f)) full = !addFrame(millis(), &f);
+    }
+    TEST_ASSERT_GREATER_THAN(100, block.header.count);
+    // Periodic frames with a counter and a slow sweep code small.
+    TEST_ASSERT_LESS_THAN(12 * block.header.count, block.header.used);
+    checkBlock(&block, 0);
+}
+
+void test_fd_reshapes() {
+    static const struct { uint8_t flags; uint8_t len; } shapes[] = {
+        { 0, 8 }, { CAN_FLAG_FD, 12 }, { CAN_FLAG_FD | CAN_FLAG_BRS, 64 }, { CAN_FLAG_FD, 20 },
+        { 0, 3 }, { 0, 0 }, { CAN_FLAG_FD | CAN_FLAG_BRS | CAN_FLAG_ESI, 48 }, { 0, 8 },
+    };
+    CanFrame f = {};
+    f.id = 0x18DA00F1;
+    f.extended = true;
+    f.bus = 2;
+    uint32_t time = 1000;
+    for (int round = 0; round < 3; round++) {
+        for (const auto& s : shapes) {
+            // Twice per shape: the second is a plain DELTA_FRAME.
+            for (int k = 0; k < 2; k++) {
+                f.flags = s.flags;
+                f.len = s.len;
+                for (int j = 0; j < CAN_MAX_DLEN; j++) f.data[j] = j < s.len ? esp_random() : 0;
+                if (k == 1 && s.len > 0) f.data[0] ^= 0x55;
+                time += 5 + esp_random() % 20;
+                TEST_ASSERT_TRUE(addFrame(time, &f));
+            }
+        }
+    }
+    checkBlock(&block, 0);
+}
+
+void test_dictionary_overflow() {
+    CanFrame f = {};
+    f.len = 8;
+    uint32_t time = 0;
+    for (int i = 0; i < DELTA_MAX_IDS; i++) {
+        f.id = 0x100 + i;
+        f.data[0] = i;
+        TEST_ASSERT_TRUE(addFrame(time += 3, &f));
+    }
+    // The same ID number on another bus is another dictionary entry.
+    f.id = 0x100;
+    f.bus = 1;
+    TEST_ASSERT_EQUAL(-1, deltaEncodeFrame(&enc, time + 3, &f, block.data + block.header.used));
+    f.bus = 0;
+    TEST_ASSERT_TRUE(addFrame(time += 3, &f));
+    checkBlock(&block, 0);
+
+    // A full dictionary ends the block; the next one starts empty and
+    // decodes on its own.
+    static Block next;
+    int first = expectedCount;
+    deltaBlockBegin(&enc, &next.header, block.header.count, time);
+    for (int i = 0; i < 2 * DELTA_MAX_IDS; i++) {
+        f.id = 0x7FF - i % (DELTA_MAX_IDS + 8);
+        f.bus = 1;
+        f.data[1] = i;
+        time += 2;
+        int n = deltaEncodeFrame(&enc, time, &f, next.data + next.header.used);
+        if (n < 0) {
+            TEST_ASSERT_EQUAL(DELTA_MAX_IDS, enc.idCount);
+            break;
+        }
+        next.header.used += n;
+        next.header.count++;
+        Expected* e = &expected[expectedCount++];
+        e->type = 0;
+        e->time = time;
+        e->frame = f;
+    }
+    TEST_ASSERT_EQUAL(DELTA_MAX_IDS, next.header.count);
+    checkBlock(&next, first);
+}
+
+void test_out_of_order_marks() {
+    CanFrame f = {};
+    f.id = 0x100;
+    f.len = 8;
+    uint32_t time = 50000;
+    for (int i = 0; i < 200; i++) {
+        f.data[0] = i;
+        time += 10;
+        TEST_ASSERT_TRUE(addFrame(time, &f));
+        // Marks stamped up to 500 ms before the frame they follow, as
+        // back-dated host marks and button presses are.
+        if (i % 17 == 5) addText(time - esp_random() % 500, 1, "lever sticks");
+        if (i % 31 == 7) addText(time - 20, 2, "BAUD,500000");
+    }
+    // One stamped before the block's base time.
+    addText(block.header.baseTime - 1000, 1, "before the block");
+    f.data[0] = 0xAA;
+    TEST_ASSERT_TRUE(addFrame(time + 10, &f));
+    // Text is cut to DELTA_MAX_TEXT.
+    char longText[DELTA_MAX_TEXT * 2];
+    memset(longText, 'x', sizeof(longText) - 1);
+    longText[sizeof(longText) - 1] = '\0';
+    addText(time + 10, 3, longText);
+    checkBlock(&block, 0);
+}
+
+void test_truncated_block_fails_cleanly() {
+    CanFrame f = {};
+    f.id = 0x123;
+    f.flags = CAN_FLAG_FD;
+    f.len = 64;
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 64; j++) f.data[j] = esp_random();
+        TEST_ASSERT_TRUE(addFrame(i * 7, &f));
+    }
+    for (int cut = 0; cut < block.header.used; cut++) {
+        DeltaState dec;
+        DeltaRecord r;
+        deltaDecodeBegin(&dec, &block.header);
+        int pos = 0;
+        int records = 0;
+        while (deltaDecode(&dec, block.data, cut, &pos, &r)) records++;
+        TEST_ASSERT_LESS_OR_EQUAL(cut, pos);
+        TEST_ASSERT_LESS_THAN(block.header.count, records);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_varint_and_zigzag);
+    RUN_TEST(test_mock_traffic_round_trip);
+    RUN_TEST(test_fd_reshapes);
+    RUN_TEST(test_dictionary_overflow);
+    RUN_TEST(test_out_of_order_marks);
+    RUN_TEST(test_truncated_block_fails_cleanly);
+    return UNITY_END();
+}
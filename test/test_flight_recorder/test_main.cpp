@@ -0,0 +1,204 @@
+/*
+ * flight_recorder.h on a RAM-backed flash partition: wraparound, a chunk
+ * torn by a reset mid-write and resuming after a reboot.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <vector>
+#include "flight_recorder.h"
+
+#define SECTORS       32
+#define WRAP_SECTORS  8
+
+static FlightRecorder rec;
+static FlightDump dump;
+static FlightBlock block;
+static uint32_t nextCounter;
+
+struct Dumped {
+    uint32_t bootId;
+    uint32_t counter;
+};
+
+void setUp() {
+    shimReset();
+    shimPreferences.clear();
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, SECTORS);
+    nextCounter = 1;
+}
+
+void tearDown() {}
+
+// Power on: the writer task and RAM blocks start over on the same flash.
+static void boot() {
+    shimResetTasks();
+    shimFlashTearAfter = -1;
+    TEST_ASSERT_TRUE(flightInit(&rec));
+    flightSetEnabled(&rec, true);
+}
+
+// Records count frames carrying consecutive counters, 1 ms apart, the
+// writer keeping up.
+static void record(int count) {
+    CanFrame f = {};
+    f.len = 8;
+    for (int i = 0; i < count; i++) {
+        uint32_t n = nextCounter++;
+        f.id = 0x100 + n % 12;
+        memcpy(f.data, &n, 4);
+        f.data[4] = n / 1000;
+        f.data[5] = f.id;
+        flightRecordFrame(&rec, &f);
+        shimAdvanceUs(1000);
+        shimRunTasks();
+    }
+}
+
+static void flush() {
+    flightFlush(&rec);
+    shimRunTasks();
+}
+
+static std::vector<Dumped> readAll() {
+    std::vector<Dumped> out;
+    TEST_ASSERT_TRUE(flightBeginDump(&rec, &dump));
+    while (flightNextBlock(&rec, &dump, &block)) {
+        uint16_t offset = 0;
+        FlightRecord r;
+        while (flightNextRecord(&block, &offset, &r)) {
+            TEST_ASSERT_FALSE(r.isMark);
+            uint32_t n;
+            memcpy(&n, r.data, 4);
+            TEST_ASSERT_EQUAL_HEX32(0x100 + n % 12, r.id);
+            out.push_back({ block.header.bootId, n });
+        }
+        TEST_ASSERT_EQUAL(block.header.used, offset);
+    }
+    return out;
+}
+
+// Counters must run from first to last with nothing missing.
+static void assertRun(const std::vector<Dumped>& d, size_t from, size_t to, uint32_t first, uint32_t last) {
+    TEST_ASSERT_EQUAL(last - first + 1, to - from);
+    for (size_t i = from; i < to; i++) TEST_ASSERT_EQUAL(first + (i - from), d[i].counter);
+}
+
+void test_no_partition() {
+    shimPartitionRemove();
+    TEST_ASSERT_FALSE(flightInit(&rec));
+    TEST_ASSERT_FALSE(flightAvailable(&rec));
+    CanFrame f = {};
+    flightRecordFrame(&rec, &f);
+    TEST_ASSERT_FALSE(flightBeginDump(&rec, &dump));
+}
+
+void test_wraparound_keeps_newest_in_order() {
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, WRAP_SECTORS);
+    boot();
+    record(100000);
+    flush();
+    TEST_ASSERT_EQUAL(0, rec.writeErrors);
+    TEST_ASSERT_EQUAL(0, rec.droppedRecords);
+    TEST_ASSERT_GREATER_THAN(WRAP_SECTORS * 3, rec.nextSeq);
+
+    std::vector<Dumped> d = readAll();
+    TEST_ASSERT_GREATER_THAN(0, d.size());
+    assertRun(d, 0, d.size(), d[0].counter, nextCounter - 1);
+    // Older data was overwritten, but at least WRAP_SECTORS - 1 sectors'
+    // worth of it is kept.
+    TEST_ASSERT_GREATER_THAN(1, d[0].counter);
+    TEST_ASSERT_GREATER_THAN((WRAP_SECTORS - 1) * FLIGHT_RAW_LIMIT / 17, d.size());
+
+    // Sectors are used in strict rotation.
+    uint32_t lo = UINT32_MAX, hi = 0;
+    for (uint32_t e : shimFlashErases) {
+        lo = min(lo, e);
+        hi = max(hi, e);
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(1, hi - lo);
+}
+
+void test_resume_after_reboot() {
+    boot();
+    record(3000);
+    flush();
+    uint32_t firstBoot = rec.bootId;
+    uint32_t seq = rec.nextSeq;
+    uint32_t lastOfFirst = nextCounter - 1;
+
+    boot();
+    TEST_ASSERT_EQUAL(firstBoot + 1, rec.bootId);
+    TEST_ASSERT_EQUAL(seq, rec.nextSeq);
+    TEST_ASSERT_TRUE(rec.enabled);
+    record(3000);
+    flush();
+
+    std::vector<Dumped> d = readAll();
+    assertRun(d, 0, d.size(), 1, nextCounter - 1);
+    for (const Dumped& x : d) TEST_ASSERT_EQUAL(x.counter <= lastOfFirst ? firstBoot : firstBoot + 1, x.bootId);
+}
+
+void test_torn_chunk_costs_only_that_chunk() {
+    static const long tears[] = { 0, 1, 8, 17, 100, 1000 };
+    for (long tear : tears) {
+        setUp();
+        boot();
+        record(1000);
+        flush();
+        uint32_t kept = nextCounter - 1;
+
+        // Reset partway through programming the next chunk.
+        shimFlashTearAfter = tear;
+        record(1000);
+        flush();
+        uint32_t lostUpTo = nextCounter - 1;
+
+        boot();
+        record(1000);
+        flush();
+
+        std::vector<Dumped> d = readAll();
+        TEST_ASSERT_EQUAL(kept + 1000, d.size());
+        assertRun(d, 0, kept, 1, kept);
+        assertRun(d, kept, d.size(), lostUpTo + 1, nextCounter - 1);
+    }
+}
+
+void test_torn_sector_header() {
+    boot();
+    // Chunks until two sectors are open, then a reset while the third
+    // one's header is programmed. The chunks meant for it are lost.
+    while (rec.nextSeq < 3) {
+        record(200);
+        flush();
+    }
+    uint32_t kept = nextCounter - 1;
+    shimFlashTearAfter = 5;
+    while (rec.nextSeq < 4) {
+        record(200);
+        flush();
+    }
+    uint32_t lostUpTo = nextCounter - 1;
+
+    // The torn sector has no valid header, so writing resumes in it.
+    boot();
+    TEST_ASSERT_EQUAL(2, rec.nextSector);
+    TEST_ASSERT_EQUAL(3, rec.nextSeq);
+    record(500);
+    flush();
+    std::vector<Dumped> d = readAll();
+    TEST_ASSERT_EQUAL(kept + 500, d.size());
+    assertRun(d, 0, kept, 1, kept);
+    assertRun(d, kept, d.size(), lostUpTo + 1, nextCounter - 1);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_no_partition);
+    RUN_TEST(test_wraparound_keeps_newest_in_order);
+    RUN_TEST(test_resume_after_reboot);
+    RUN_TEST(test_torn_chunk_costs_only_that_chunk);
+    RUN_TEST(test_torn_sector_header);
+    return UNITY_END();
+}
@@ -0,0 +1,149 @@
+/*
+ * id_sketch.h against exact counts of skewed synthetic traffic: the
+ * Space-Saving bounds and guarantee, and HyperLogLog within 3 standard
+ * errors.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <map>
+#include <vector>
+#include "id_sketch.h"
+
+#define IDS          5000
+#define FRAMES       200000
+#define ZIPF_S       1.1
+
+static std::vector<uint32_t> keys;    // Key of each popularity rank
+static std::vector<double> cdf;
+
+void setUp() {
+    shimReset(12345);
+}
+
+void tearDown() {}
+
+static uint32_t randomKey() {
+    CanFrame f = {};
+    f.extended = esp_random() & 1;
+    f.id = esp_random() & (f.extended ? 0x1FFFFFFF : 0x7FF);
+    f.bus = esp_random() % CAN_BUS_COUNT;
+    return sketchKey(&f);
+}
+
+// IDS distinct keys with Zipf-distributed popularity, like a backbone
+// where a few IDs carry most of the frames.
+static void makeTraffic() {
+    std::map<uint32_t, bool> used;
+    keys.clear();
+    while (keys.size() < IDS) {
+        uint32_t key = randomKey();
+        if (used[key]) continue;
+        used[key] = true;
+        keys.push_back(key);
+    }
+    cdf.resize(IDS);
+    double sum = 0;
+    for (int i = 0; i < IDS; i++) cdf[i] = sum += 1.0 / pow(i + 1, ZIPF_S);
+    for (double& c : cdf) c /= sum;
+}
+
+static uint32_t nextKey() {
+    double u = (esp_random() + 0.5) / 4294967296.0;
+    return keys[std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()];
+}
+
+void test_topk_bounds_and_heavy_hitters() {
+    makeTraffic();
+    static TopK topk;
+    topkClear(&topk);
+    std::map<uint32_t, unsigned long> truth;
+    for (int i = 0; i < FRAMES; i++) {
+        uint32_t key = nextKey();
+        topkAdd(&topk, key);
+        truth[key]++;
+    }
+    TEST_ASSERT_EQUAL(FRAMES, topk.total);
+    TEST_ASSERT_EQUAL(TOPK_SIZE, topk.used);
+
+    for (int i = 0; i < topk.used; i++) {
+        const TopKEntry* e = &topk.entries[i];
+        unsigned long count = truth[e->key];
+        TEST_ASSERT_LESS_OR_EQUAL(e->count, count);
+        TEST_ASSERT_GREATER_OR_EQUAL(e->count - e->err, count);
+    }
+
+    int heavy = 0;
+    for (const auto& kv : truth) {
+        if (kv.second <= FRAMES / TOPK_SIZE) continue;
+        heavy++;
+        bool found = false;
+        for (int i = 0; i < topk.used; i++) found |= topk.entries[i].key == kv.first;
+        TEST_ASSERT_TRUE_MESSAGE(found, "ID above N/K missing from the table");
+    }
+    // The skew is steep enough that the guarantee covers something.
+    TEST_ASSERT_GREATER_OR_EQUAL(3, heavy);
+}
+
+void test_topk_keys_split_bus_and_extended() {
+    static TopK topk;
+    topkClear(&topk);
+    CanFrame f = {};
+    f.id = 0x100;
+    topkAdd(&topk, sketchKey(&f));
+    f.extended = true;
+    topkAdd(&topk, sketchKey(&f));
+#if CAN_BUS_COUNT > 1
+    f.bus = 1;
+    topkAdd(&topk, sketchKey(&f));
+    TEST_ASSERT_EQUAL(1, sketchKeyBus(topk.entries[2].key));
+#endif
+    TEST_ASSERT_EQUAL(CAN_BUS_COUNT > 1 ? 3 : 2, topk.used);
+    TEST_ASSERT_EQUAL(0x100, sketchKeyId(topk.entries[1].key));
+}
+
+void test_hll_within_three_sigma() {
+    static const unsigned long cardinalities[] = { 10, 100, 1000, 3000, 10000, 50000, 200000 };
+    const double sigma = 1.04 / sqrt(HLL_REGISTERS);
+    static HyperLogLog hll;
+    for (unsigned long n : cardinalities) {
+        hllClear(&hll);
+        std::map<uint32_t, bool> seen;
+        while (seen.size() < n) {
+            uint32_t key = randomKey();
+            seen[key] = true;
+            // Repeats don't change the estimate.
+            hllAdd(&hll, key);
+            hllAdd(&hll, key);
+        }
+        double estimate = hllEstimate(&hll);
+        double allowed = 3 * sigma * n + 1;
+        char msg[80];
+        snprintf(msg, sizeof(msg), "n=%lu estimate=%.0f", n, estimate);
+        TEST_ASSERT_TRUE_MESSAGE(fabs(estimate - n) <= allowed, msg);
+    }
+}
+
+void test_hll_on_skewed_traffic() {
+    makeTraffic();
+    static HyperLogLog hll;
+    hllClear(&hll);
+    std::map<uint32_t, bool> seen;
+    for (int i = 0; i < FRAMES; i++) {
+        uint32_t key = nextKey();
+        hllAdd(&hll, key);
+        seen[key] = true;
+    }
+    double n = seen.size();
+    double sigma = 1.04 / sqrt(HLL_REGISTERS);
+    TEST_ASSERT_TRUE(fabs(hllEstimate(&hll) - n) <= 3 * sigma * n);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_topk_bounds_and_heavy_hitters);
+    RUN_TEST(test_topk_keys_split_bus_and_extended);
+    RUN_TEST(test_hll_within_three_sigma);
+    RUN_TEST(test_hll_on_skewed_traffic);
+    return UNITY_END();
+}
@@ -0,0 +1,158 @@
+/*
+ * /metrics with the ID table full: the mock's noise mode fills all
+ * MAX_UNIQUE_IDS slots, then Prometheus-style scrapes, plain and gzipped,
+ * are checked for a bounded reply sent a chunk at a time with CAN polled
+ * in between, and for no overflows or read errors.
+ *
+ * The timings printed are host wall-clock times, for comparing one
+ * change with the next. They are not what an ESP32 takes.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "main_wifi.cpp"
+
+#define SCRAPES        200
+#define LOOP_US        1000
+#define CHUNK_SEND_US  1000      // A chunk on the wire, clock moved by the hook
+
+using HostClock = std::chrono::steady_clock;
+
+struct ScrapeStats {
+    double meanUs, maxUs;        // Host time for the whole handler
+    double maxGapUs;             // Host time between two sends
+    size_t bytes;
+    size_t maxChunk;
+    int chunks;
+    unsigned long framesDuring;  // Polled while the scrape ran
+};
+
+static HostClock::time_point lastSend;
+static double maxGapUs;
+static size_t maxChunk;
+
+static double usSince(HostClock::time_point t) {
+    return std::chrono::duration<double, std::micro>(HostClock::now() - t).count();
+}
+
+static void onContent(size_t len) {
+    maxGapUs = max(maxGapUs, usSince(lastSend));
+    maxChunk = max(maxChunk, len);
+    shimAdvanceUs(CHUNK_SEND_US);
+    lastSend = HostClock::now();
+}
+
+static void run(unsigned long us) {
+    unsigned long end = micros() + us;
+    while (micros() < end) {
+        loop();
+        shimRunTasks();
+        shimAdvanceUs(LOOP_US);
+    }
+}
+
+static void request(const char* uri, const char* query) {
+    TEST_ASSERT_TRUE(server.shimRequest(uri, query));
+    server.handleClient();
+    TEST_ASSERT_EQUAL(200, shimResponse.code);
+}
+
+static int countLines(const char* body, const char* prefix) {
+    int n = 0;
+    for (const char* p = strstr(body, prefix); p != NULL; p = strstr(p + 1, prefix)) n++;
+    return n;
+}
+
+static ScrapeStats scrape(const char* encoding) {
+    ScrapeStats s = {};
+    double totalUs = 0;
+    shimOnContent = onContent;
+    for (int k = 0; k < SCRAPES; k++) {
+        run(100000);
+        unsigned long before = messageCount;
+        maxGapUs = 0;
+        maxChunk = 0;
+        TEST_ASSERT_TRUE(server.shimRequest("/metrics", "", encoding));
+        HostClock::time_point start = HostClock::now();
+        lastSend = start;
+        server.handleClient();
+        double us = usSince(start);
+
+        TEST_ASSERT_TRUE(shimResponse.done);
+        TEST_ASSERT_EQUAL(200, shimResponse.code);
+        TEST_ASSERT_TRUE(shimResponse.chunked);
+        TEST_ASSERT_LESS_THAN(SHIM_BODY_KEEP, shimResponse.bodyBytes);
+        totalUs += us;
+        s.maxUs = max(s.maxUs, us);
+        s.maxGapUs = max(s.maxGapUs, maxGapUs);
+        s.maxChunk = max(s.maxChunk, maxChunk);
+        s.bytes = shimResponse.bodyBytes;
+        s.chunks = shimResponse.chunks;
+        s.framesDuring = max(s.framesDuring, messageCount - before);
+    }
+    shimOnContent = NULL;
+    s.meanUs = totalUs / SCRAPES;
+    return s;
+}
+
+static void report(const char* what, const ScrapeStats& s) {
+    printf("%s: %d IDs, %zu bytes in %d chunks (largest %zu), host %.0f us mean %.0f us max, "
+           "%.0f us max between sends, %lu frames polled during the scrape\n",
+           what, uniqueIdCount, s.bytes, s.chunks, s.maxChunk, s.meanUs, s.maxUs, s.maxGapUs,
+           s.framesDuring);
+}
+
+static unsigned long overflows() {
+    unsigned long n = 0;
+    for (int b = 0; b < CAN_BUS_COUNT; b++) n += canHealth[b].overflows;
+    return n;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_scrape_with_mock_streams() {
+    ScrapeStats s = scrape("");
+    report("mock streams", s);
+    TEST_ASSERT_EQUAL(MOCK_STREAM_COUNT, uniqueIdCount);
+    TEST_ASSERT_EQUAL(MOCK_STREAM_COUNT, countLines(shimResponse.body, "ets_can_id_frames_total{"));
+}
+
+void test_scrape_with_full_id_table() {
+    request("/baud", "v=3");
+    run(2000000);
+    TEST_ASSERT_EQUAL(MAX_UNIQUE_IDS, uniqueIdCount);
+    TEST_ASSERT_GREATER_THAN(0, idOverflow.total);
+
+    ScrapeStats plain = scrape("");
+    report("full table", plain);
+    // Per-ID series stay at the busiest METRICS_TOP_IDS.
+    TEST_ASSERT_EQUAL(METRICS_TOP_IDS, countLines(shimResponse.body, "ets_can_id_frames_total{"));
+    TEST_ASSERT_NOT_NULL(strstr(shimResponse.body, "ets_can_unique_ids 256\n"));
+    // Sent a chunk at a time, with CAN read between them.
+    TEST_ASSERT_LESS_OR_EQUAL(STREAM_CHUNK_SIZE, plain.maxChunk);
+    TEST_ASSERT_GREATER_THAN(plain.bytes / STREAM_CHUNK_SIZE, plain.chunks);
+    TEST_ASSERT_GREATER_THAN(0, plain.framesDuring);
+
+    ScrapeStats gzip = scrape("gzip");
+    report("full table, gzip", gzip);
+    TEST_ASSERT_GREATER_THAN(0, gzip.framesDuring);
+
+    TEST_ASSERT_EQUAL(0, overflows());
+    TEST_ASSERT_EQUAL(0, errorCount);
+}
+
+int main() {
+    shimReset();
+    shimTickUs = 1;
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, 16);
+    setup();
+    shimWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_scrape_with_mock_streams);
+    RUN_TEST(test_scrape_with_full_id_table);
+    return UNITY_END();
+}
@@ -0,0 +1,257 @@
+/*
+ * rx_adapt.h over a sweep of frame rates: frames lost and CPU time taken
+ * by loop(), in interrupt mode only, polling only, and switching between
+ * them as the builds do. The table it prints is what RX_POLL_ENTER_FPS
+ * and RX_POLL_EXIT_FPS are set from.
+ *
+ * One controller with an INT pin and an RX FIFO of the MCP2515's depth,
+ * then the MCP2518FD's. Frames arrive at random, no closer together than
+ * back to back at 1 Mbps. While INT is unmasked, each frame that lands
+ * in an empty FIFO costs an ISR, and waking a sleeping loop() costs a
+ * task switch on top. loop() is modelled as in bus_merge's test.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include "rx_adapt.h"
+
+#define FRAME_MIN_US  114        // 8-byte standard frame and IFS at 1 Mbps
+#define SPI_READ_US   20         // One frame over 10 MHz SPI
+#define WORK_US       15         // Handling one frame in loop()
+#define LOOP_US       100        // The rest of a loop() pass
+#define ISR_US        5          // GPIO ISR giving the notification
+#define WAKE_US       10         // Switch back into a sleeping loop()
+#define STALL_EVERY_US 100000    // Now and then loop() is held up,
+#define STALL_US      3000       // by a flash write or a web request
+#define RUN_US        2000000
+
+static const uint32_t rates[] = { 100, 250, 500, 1000, 1500, 2000, 2500, 3000, 4000, 5000, 6000, 7000 };
+static const int depths[] = { 2, 26 };
+
+static RxAdapt rxAdapt;
+
+// A controller whose INT pin is modelled: frames queue in its FIFO until
+// read, and one that arrives to a full FIFO is lost.
+struct IntMock {
+    int depth;
+    unsigned long meanUs;
+    uint64_t nextUs;
+    int count;
+    uint32_t sent, lost, isrs;
+    bool notified;               // The ISR has given a notification not yet taken
+
+    void begin(int fifoDepth, uint32_t fps) {
+        depth = fifoDepth;
+        setRate(fps);
+        count = 0;
+        sent = lost = isrs = 0;
+        notified = false;
+        nextUs = gap();
+    }
+
+    void setRate(uint32_t fps) {
+        meanUs = 1000000 / fps;
+    }
+
+    // Time to the next frame: back to back plus an exponential wait.
+    uint64_t gap() {
+        double u = (esp_random() + 1.0) / 4294967296.0;
+        return FRAME_MIN_US + (uint64_t)(-log(u) * (meanUs - FRAME_MIN_US));
+    }
+
+    void arrive() {
+        while (shimNowUs >= nextUs) {
+            if (count == 0 && rxAdapt.mode == RX_MODE_IRQ) {
+                notified = true;
+                isrs++;
+                shimNowUs += ISR_US;
+            }
+            if (count == depth) {
+                lost++;
+            } else {
+                count++;
+            }
+            sent++;
+            nextUs += gap();
+        }
+    }
+
+    int intPin() const { return 4; }
+
+    bool pending() {
+        arrive();
+        return count > 0;
+    }
+
+    bool read(CanFrame* frame) {
+        if (!pending()) return false;
+        shimAdvanceUs(SPI_READ_US);
+        memset(frame, 0, sizeof(*frame));
+        frame->len = 8;
+        frame->timestampUs = micros();
+        count--;
+        return true;
+    }
+};
+
+static IntMock bus;
+static CanHealth health[CAN_BUS_COUNT];
+static unsigned long readErrors[CAN_BUS_COUNT];
+static BusMerge merge;
+
+typedef enum {
+    POLICY_IRQ,
+    POLICY_POLL,
+    POLICY_ADAPT
+} policy_t;
+
+static const char* policyNames[] = { "irq", "poll", "adapt" };
+
+struct RunResult {
+    float lossPct;
+    float cpuPct;                // Time loop() didn't leave to other tasks
+    unsigned long switches;
+    rx_mode_t mode;              // At the end
+};
+
+static void isr(void*) {
+    rxAdaptWake(&rxAdapt);
+}
+
+void setUp() {
+    shimReset();
+    shimWakeUs = WAKE_US;
+    memset(&merge, 0, sizeof(merge));
+    memset(readErrors, 0, sizeof(readErrors));
+    for (int b = 0; b < CAN_BUS_COUNT; b++) healthInit(&health[b]);
+}
+
+void tearDown() {
+    shimNotifyUs = UINT64_MAX;
+    shimWakeUs = 0;
+}
+
+// Runs loop() passes as the builds do for RUN_US, at fps and then, from
+// halfway, at laterFps.
+static RunResult run(policy_t policy, int depth, uint32_t fps, uint32_t laterFps = 0) {
+    setUp();
+    bus.begin(depth, fps);
+    rxAdaptInit(&rxAdapt, &bus, isr);
+    if (policy == POLICY_POLL) rxAdaptSetMode(&rxAdapt, RX_MODE_POLL);
+    uint32_t wakes = 0;
+    uint64_t nextStallUs = STALL_EVERY_US;
+
+    while (micros() < RUN_US) {
+        if (laterFps && micros() >= RUN_US / 2) bus.setRate(laterFps);
+        TEST_ASSERT_EQUAL(0, mergeFill(&merge, &bus, health, readErrors, rxAdaptBudget(&rxAdapt)));
+        int frames = 0;
+        while (mergeNext(&merge) != NULL) {
+            shimAdvanceUs(WORK_US);
+            frames++;
+        }
+        if (policy == POLICY_ADAPT) rxAdaptUpdate(&rxAdapt, &merge, frames);
+        shimAdvanceUs(LOOP_US);
+        if (shimNowUs >= nextStallUs) {
+            shimAdvanceUs(STALL_US);
+            nextStallUs += STALL_EVERY_US;
+        }
+
+        bus.arrive();
+        shimNotifyUs = bus.notified ? shimNowUs : bus.nextUs;
+        rxAdaptWait(&rxAdapt, &bus);
+        if (shimNotifyUs == UINT64_MAX) {
+            // Taken: the edge that woke loop() is handled, not a new one.
+            wakes++;
+            bus.arrive();
+            bus.notified = false;
+        }
+    }
+
+    RunResult r;
+    r.lossPct = 100.0f * bus.lost / bus.sent;
+    r.cpuPct = 100.0f - 100.0f * (rxAdapt.sleepUs - (uint64_t)wakes * WAKE_US) / micros();
+    r.switches = rxAdapt.toPoll + rxAdapt.toIrq;
+    r.mode = rxAdapt.mode;
+    return r;
+}
+
+static RunResult results[2][sizeof(rates) / sizeof(rates[0])][3];
+
+// Runs the sweep once and prints it; the tests below check it.
+static void sweep() {
+    static bool done = false;
+    if (done) return;
+    done = true;
+    for (int d = 0; d < 2; d++) {
+        printf("FIFO depth %d\n  fps    ", depths[d]);
+        for (int p = 0; p < 3; p++) printf("  %-5s loss   cpu ", policyNames[p]);
+        printf(" switches\n");
+        for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+            printf("  %-6lu ", (unsigned long)rates[i]);
+            for (int p = 0; p < 3; p++) {
+                RunResult* r = &results[d][i][p];
+                *r = run((policy_t)p, depths[d], rates[i]);
+                printf("      %5.2f%% %4.0f%%", r->lossPct, r->cpuPct);
+            }
+            printf("  %lu\n", results[d][i][POLICY_ADAPT].switches);
+        }
+    }
+}
+
+#define RATE_COUNT (sizeof(rates) / sizeof(rates[0]))
+
+// Switching never loses more than staying in either mode.
+void test_adapt_loses_no_more() {
+    sweep();
+    for (int d = 0; d < 2; d++) {
+        for (size_t i = 0; i < RATE_COUNT; i++) {
+            RunResult* r = results[d][i];
+            float worst = max(r[POLICY_IRQ].lossPct, r[POLICY_POLL].lossPct);
+            TEST_ASSERT_TRUE(r[POLICY_ADAPT].lossPct <= worst + 0.1f);
+        }
+    }
+}
+
+// Below the exit rate loop() keeps sleeping: stalls and random bunching
+// don't tip it into polling.
+void test_adapt_sleeps_below_exit_rate() {
+    sweep();
+    for (int d = 0; d < 2; d++) {
+        for (size_t i = 0; i < RATE_COUNT && rates[i] < RX_POLL_EXIT_FPS; i++) {
+            RunResult* r = results[d][i];
+            TEST_ASSERT_EQUAL(0, r[POLICY_ADAPT].switches);
+            TEST_ASSERT_FLOAT_WITHIN(1.0f, r[POLICY_IRQ].cpuPct, r[POLICY_ADAPT].cpuPct);
+        }
+    }
+}
+
+// Past the enter rate sleeping frees next to nothing, and it polls.
+void test_adapt_polls_above_enter_rate() {
+    sweep();
+    for (int d = 0; d < 2; d++) {
+        for (size_t i = 0; i < RATE_COUNT; i++) {
+            if (rates[i] <= RX_POLL_ENTER_FPS) continue;
+            RunResult* r = results[d][i];
+            TEST_ASSERT_EQUAL(RX_MODE_POLL, r[POLICY_ADAPT].mode);
+            TEST_ASSERT_EQUAL(1, r[POLICY_ADAPT].switches);
+            TEST_ASSERT_TRUE(r[POLICY_IRQ].cpuPct >= 90.0f);
+        }
+    }
+}
+
+void test_back_to_irq_when_bus_quietens() {
+    for (int d = 0; d < 2; d++) {
+        RunResult r = run(POLICY_ADAPT, depths[d], 7000, 1000);
+        TEST_ASSERT_EQUAL(RX_MODE_IRQ, r.mode);
+        TEST_ASSERT_EQUAL(2, r.switches);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_adapt_loses_no_more);
+    RUN_TEST(test_adapt_sleeps_below_exit_rate);
+    RUN_TEST(test_adapt_polls_above_enter_rate);
+    RUN_TEST(test_back_to_irq_when_bus_quietens);
+    return UNITY_END();
+}
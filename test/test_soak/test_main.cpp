@@ -0,0 +1,207 @@
+/*
+ * Soak test of the WiFi build: main_wifi.cpp on the mock backend for
+ * SOAK_HOURS of simulated time, with every route requested over and over
+ * (bursts, scans, clears, downloads gzipped and not) and the WiFi link
+ * dropping now and then. Free heap is read at the end of each cycle of
+ * requests, and the run fails if the lowest reading of a later hour has
+ * drifted below the first hour's: a leak of a few bytes a request adds
+ * up to kilobytes over the run.
+ *
+ * The host allocator doesn't fragment like the ESP32's, so this catches
+ * leaks and unbounded growth, not fragmentation. glibc's per-thread cache
+ * fills over the first hour and would read as about 2 KB of drift, so the
+ * test runs itself again with the cache off.
+ */
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED
+#endif
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <unity.h>
+#include "main_wifi.cpp"
+
+#ifndef SOAK_HOURS
+#define SOAK_HOURS        4
+#endif
+#define LOOP_US           1000       // One loop() pass
+#define REQUEST_GAP_US    2000000    // Between requests
+#define OUTAGE_EVERY      10         // Cycles between WiFi drops
+#define OUTAGE_US         30000000
+#define HEAP_DRIFT_BYTES  1024
+
+struct Request {
+    const char* uri;
+    const char* query;            // NULL: built by dynamicQuery()
+    const char* encoding;         // Accept-Encoding
+    int code;
+    int everyCycles;
+};
+
+// Every route, down its heavier paths. A cycle takes about a minute.
+static const Request requests[] = {
+    { "/", "", "", 200, 1 },
+    { "/status", "", "", 200, 1 },
+    { "/ids", "", "", 200, 1 },
+    { "/ids/history", "id=0x100", "", 200, 1 },
+    { "/log", "", "", 200, 1 },
+    { "/log", "limit=500", "gzip", 200, 1 },
+    { "/log", NULL, "", 200, 1 },
+    { "/log", "id=0x100,0x18FEF100&fields=t,id,data", "", 200, 1 },
+    { "/mark", "msg=soak", "", 200, 1 },
+    { "/ping", NULL, "", 200, 1 },
+    { "/mark", NULL, "", 200, 1 },
+    { "/time", "", "", 200, 1 },
+    { "/time", NULL, "", 200, 1 },
+    { "/alerts", "", "", 200, 1 },
+    { "/buttons", "n=0&label=Key ON", "", 200, 1 },
+    { "/burst", "start=1&ms=3000", "", 200, 1 },
+    { "/burst", "", "", 200, 1 },
+    { "/csv", "burst=1", "gzip", 200, 1 },
+    { "/burst", "free=1", "", 200, 1 },
+    { "/csv", "", "", 200, 1 },
+    { "/csv", "", "gzip", 200, 1 },
+    { "/csv", "delta=1", "", 200, 1 },
+    { "/csv", "bus=0&data=x?&text=0", "", 200, 1 },
+    { "/flight", "", "gzip", 200, 1 },
+    { "/flight", "enable=1", "", 200, 1 },
+    { "/perf", "", "", 200, 1 },
+    { "/metrics", "", "", 200, 1 },
+    { "/metrics", "", "gzip", 200, 1 },
+    { "/timing", "", "", 200, 1 },
+    { "/trace", "enable=1", "", 200, 1 },
+    { "/trace", "", "gzip", 200, 1 },
+    { "/baud", "v=2", "", 200, 5 },
+    { "/scan", "", "", 200, 20 },
+    { "/clear", "", "", 200, 20 },
+};
+#define REQUEST_COUNT (sizeof(requests) / sizeof(requests[0]))
+
+static int cycle;
+static uint32_t hourMinFree[SOAK_HOURS];
+
+// The queries that depend on the time or on earlier replies.
+static void dynamicQuery(const Request* r, char* query, size_t size) {
+    static unsigned long lastSeq = 0;
+    unsigned long nowMs = millis();
+    if (strcmp(r->uri, "/log") == 0) {
+        snprintf(query, size, "since=%lu", lastSeq);
+        lastSeq = nextSeq > 50 ? nextSeq - 50 : 0;
+    } else if (strcmp(r->uri, "/ping") == 0) {
+        // A browser whose clock runs 1 s behind, 5 ms each way.
+        snprintf(query, size, "c=7&t=%lu&p=%lu&r=%lu", nowMs - 1000, nowMs - 3005, nowMs - 2995);
+    } else if (strcmp(r->uri, "/mark") == 0) {
+        snprintf(query, size, "msg=Shift FWD&c=7&t=%lu", nowMs - 1100);
+    } else if (strcmp(r->uri, "/time") == 0) {
+        snprintf(query, size, "utc=%llu&at=%lld&ppm=1.5&err=800",
+                 1700000000000000ULL + (unsigned long long)esp_timer_get_time(),
+                 (long long)esp_timer_get_time());
+    }
+}
+
+static void step() {
+    loop();
+    shimRunTasks();
+    shimAdvanceUs(LOOP_US);
+}
+
+static void run(unsigned long us) {
+    unsigned long end = micros() + us;
+    while (micros() < end) step();
+}
+
+static void request(const Request* r) {
+    char query[160];
+    if (r->query == NULL) {
+        dynamicQuery(r, query, sizeof(query));
+    } else {
+        snprintf(query, sizeof(query), "%s", r->query);
+    }
+    TEST_ASSERT_TRUE(server.shimRequest(r->uri, query, r->encoding));
+    while (server.shimPending()) step();
+    TEST_ASSERT_TRUE(shimResponse.done);
+    TEST_ASSERT_EQUAL_MESSAGE(r->code, shimResponse.code, r->uri);
+}
+
+// One pass through the routes due this cycle, with traffic in between.
+static void runCycle() {
+    for (size_t i = 0; i < REQUEST_COUNT; i++) {
+        if (cycle % requests[i].everyCycles != 0) continue;
+        request(&requests[i]);
+        run(REQUEST_GAP_US);
+    }
+    if (cycle % OUTAGE_EVERY == OUTAGE_EVERY - 1) {
+        shimWiFiEvent(ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+        run(OUTAGE_US);
+        shimWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    }
+    cycle++;
+}
+
+// Runs cycles for hours of simulated time, keeping each hour's lowest
+// free heap.
+static void soak(int hours, uint32_t* minFree, size_t leakPerCycle) {
+    unsigned long start = micros();
+    for (int h = 0; h < hours; h++) minFree[h] = UINT32_MAX;
+    while (micros() - start < (unsigned long)hours * 3600000000UL) {
+        runCycle();
+        if (leakPerCycle) TEST_ASSERT_NOT_NULL(malloc(leakPerCycle));
+        int h = (micros() - start) / 3600000000UL;
+        if (h < hours) minFree[h] = min(minFree[h], (uint32_t)ESP.getFreeHeap());
+    }
+}
+
+// True if any hour's low point is more than HEAP_DRIFT_BYTES below the
+// first hour's.
+static bool heapDrifted(const uint32_t* minFree, int hours) {
+    for (int h = 1; h < hours; h++) {
+        if (minFree[h] + HEAP_DRIFT_BYTES < minFree[0]) return true;
+    }
+    return false;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_soak_every_route() {
+    soak(SOAK_HOURS, hourMinFree, 0);
+    for (int h = 0; h < SOAK_HOURS; h++) {
+        printf("hour %d: lowest free heap %lu\n", h, (unsigned long)hourMinFree[h]);
+    }
+    TEST_ASSERT_FALSE(heapDrifted(hourMinFree, SOAK_HOURS));
+
+    TEST_ASSERT_GREATER_THAN(SOAK_HOURS * 50, cycle);
+    TEST_ASSERT_EQUAL(MOCK_STREAM_COUNT, uniqueIdCount);
+    TEST_ASSERT_EQUAL(0, errorCount);
+    TEST_ASSERT_EQUAL(0, flightRec.writeErrors);
+    TEST_ASSERT_EQUAL(cycle / OUTAGE_EVERY, wifiReconnects);
+    for (int i = 0; i < routeCount; i++) {
+        TEST_ASSERT_GREATER_THAN_MESSAGE(0, routeStats[i].calls, routeStats[i].path);
+    }
+}
+
+// The same run with a handler that loses 16 bytes a cycle fails.
+void test_leak_is_caught() {
+    uint32_t minFree[2];
+    soak(2, minFree, 16);
+    TEST_ASSERT_TRUE(heapDrifted(minFree, 2));
+}
+
+int main(int, char** argv) {
+    if (getenv("GLIBC_TUNABLES") == NULL) {
+        setenv("GLIBC_TUNABLES", "glibc.malloc.tcache_count=0", 1);
+        execv("/proc/self/exe", argv);
+    }
+    shimReset();
+    shimTickUs = 1;
+    shimPartitionCreate(FLIGHT_PARTITION_LABEL, 16);
+    setup();
+    shimWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_soak_every_route);
+    RUN_TEST(test_leak_is_caught);
+    return UNITY_END();
+}